@@ -32,6 +32,7 @@
 #ifndef _MOOSHIKA_H
 #define _MOOSHIKA_H
 
+#include <errno.h>
 #include <rdma/rdma_cma.h>
 
 #define MOOSHIKA_API_VERSION 5
@@ -52,6 +53,9 @@ typedef struct msk_data {
 	enum ibv_wc_status status; /**< work completion status, set upon reception of work completion */
 } msk_data_t;
 
+/** status given to err_callback when a post's deadline passed, see op_timeout_ms */
+#define MSK_WC_DEADLINE 0x100
+
 typedef union sockaddr_union {
 	struct sockaddr sa;
 	struct sockaddr_in sa_in;
@@ -59,6 +63,32 @@ typedef union sockaddr_union {
 	struct sockaddr_storage sa_stor;
 } sockaddr_union_t;
 
+/**
+ * \enum msk_stats_op
+ * work request kinds counted separately in struct msk_stats
+ */
+enum msk_stats_op {
+	MSK_OP_SEND,
+	MSK_OP_RECV,
+	MSK_OP_READ,
+	MSK_OP_WRITE,
+	MSK_OP_OTHER,			/**< memory window binds and local invalidates */
+	MSK_OP_COUNT
+};
+
+/* work completion statuses counted in wc_err, bigger ones go in the last slot */
+#define MSK_WC_STATUS_COUNT 32
+
+enum msk_stats_format {
+	MSK_STATS_TEXT,
+	MSK_STATS_JSON,
+	MSK_STATS_PROMETHEUS
+};
+
+/**
+ * \struct msk_stats
+ * data path counters are kept per thread, use msk_get_stats to read them
+ */
 struct msk_stats {
 	uint64_t rx_bytes;
 	uint64_t rx_pkt;
@@ -66,9 +96,42 @@ struct msk_stats {
 	uint64_t tx_bytes;
 	uint64_t tx_pkt;
 	uint64_t tx_err;
-	/* times only set if debug has MSK_DEBUG_SPEED */
-	uint64_t nsec_callback;
-	uint64_t nsec_compevent;
+	/* times only counted if debug has MSK_DEBUG_SPEED */
+	uint64_t nsec_callback;		/**< total time spent in callbacks */
+	uint64_t nsec_compevent;	/**< total time spent handling completion events */
+	/* message layer flow control */
+	uint64_t credit_stall;		/**< messages that had to wait for credits */
+	uint64_t credit_update;		/**< explicit credit messages sent */
+	uint64_t nsec_credit_stall;	/**< time spent with messages waiting for credits */
+	/* listening trans only */
+	uint64_t conn_req_depth;	/**< connection requests waiting for accept */
+	uint64_t conn_req_peak;		/**< highest conn_req_depth seen */
+	uint64_t conn_req_drop;		/**< requests rejected because the queue (server backlog) was full */
+	uint64_t warm_hit;		/**< requests that got a cq and contexts from the warm pool */
+	uint64_t warm_miss;		/**< requests that had to make their own */
+	/* queue occupancy: current values are sampled when read, peaks since connect */
+	uint64_t wctx_pending;		/**< send contexts posted, waiting for completion */
+	uint64_t wctx_processing;	/**< send contexts completed, waiting for or in callback */
+	uint64_t wctx_peak;		/**< most send contexts in use at once, out of sq_depth */
+	uint64_t rctx_pending;		/**< same for receives, 0 on srq (see msk_srq_stats) */
+	uint64_t rctx_processing;
+	uint64_t rctx_peak;
+	uint64_t sq_wait;		/**< times a sender slept because all send contexts were used */
+	uint64_t nsec_sq_wait;		/**< time senders spent waiting for a send context */
+	uint64_t rq_wait;		/**< likewise for receive contexts */
+	uint64_t nsec_rq_wait;
+	uint64_t worker_block;		/**< completions that waited for room in the worker queue */
+	uint64_t nsec_worker_block;	/**< time the completion thread spent waiting for it */
+	uint64_t worker_queue_depth;	/**< process wide, 0 without worker threads */
+	uint64_t worker_queue_peak;
+	uint64_t worker_queue_size;
+	uint64_t stuck;			/**< send contexts found pending longer than stuck_ms */
+	uint64_t deadline_expired;	/**< posts whose err_callback got MSK_WC_DEADLINE */
+	/* per work request kind, see enum msk_stats_op */
+	uint64_t op_pkt[MSK_OP_COUNT];
+	uint64_t op_bytes[MSK_OP_COUNT];
+	uint64_t op_err[MSK_OP_COUNT];
+	uint64_t wc_err[MSK_WC_STATUS_COUNT];	/**< failed completions by enum ibv_wc_status */
 };
 
 struct msk_pd {
@@ -82,7 +145,18 @@ struct msk_pd {
 };
 #define PD_GUARD ((void*)-1)
 
+/**
+ * \struct msk_mr_set
+ * one memory region registered on every device, indexed by device
+ */
+struct msk_mr_set {
+	int count;
+	struct ibv_mr **mr;
+};
+
 typedef void (*disconnect_callback_t) (msk_trans_t *trans);
+typedef void (*connect_callback_t) (msk_trans_t *trans, int status, void *arg);
+typedef void (*stuck_callback_t) (msk_trans_t *trans, msk_data_t *data, int opcode, uint64_t age_nsec);
 
 #define MSK_CLIENT 0
 #define MSK_SERVER_CHILD -1
@@ -106,7 +180,7 @@ struct msk_trans {
 	struct rdma_cm_id *cm_id;	/**< The RDMA CM ID */
 	struct rdma_event_channel *event_channel;
 	struct ibv_comp_channel *comp_channel;
-	struct msk_pd *pd;		/**< Protection Domain pointer list */
+	struct msk_pd *pd;		/**< Protection Domain array, indexed by device */
 	struct ibv_qp *qp;		/**< Queue Pair pointer */
 	struct ibv_srq *srq;		/**< Shared Receive Queue pointer */
 	struct ibv_cq *cq;		/**< Completion Queue pointer */
@@ -125,15 +199,53 @@ struct msk_trans {
 	int privport;			/**< set to 1 if mooshika should use a reserved port for client side */
 	uint32_t debug;
 	struct rdma_cm_id **conn_requests; /**< temporary child cm_id, only used for server */
+	int conn_head;			/**< oldest entry of the conn_requests ring */
+	int conn_count;			/**< number of entries in the conn_requests ring */
 	struct msk_ctx *wctx;		/**< pointer to actual context data */
 	struct msk_ctx *rctx;		/**< pointer to actual context data */
 	pthread_mutex_t cm_lock;	/**< lock for connection events */
 	pthread_cond_t cm_cond;		/**< cond for connection events */
 	struct ibv_recv_wr *bad_recv_wr;
 	struct ibv_send_wr *bad_send_wr;
-	struct msk_stats stats;
+	struct msk_stats stats;		/**< connection side counters, data path ones are in stats_slots */
+	struct msk_stats_slot *stats_slots;	/**< per thread data path counters, see msk_get_stats */
 	char *stats_prefix;
 	int stats_sock;
+	int stats_format;		/**< what the stats socket serves, enum msk_stats_format */
+	int stats_shm;			/**< set to 1 if published in the stats_shm region */
+	int stats_shm_index;		/**< entry in the stats_shm region, -1 if none */
+	uint32_t msg_threshold;		/**< eager/rendezvous limit of the message layer, 0 if disabled */
+	int flow_control;		/**< set to 1 if the message layer uses credits */
+	struct msk_msg *msg;		/**< message layer state, see msk_post_msg */
+	uint32_t mw_count;		/**< size of the memory window pool */
+	struct msk_mw_pool *mw;		/**< memory windows, see msk_post_bind */
+	connect_callback_t connect_setup_cb;	/**< msk_connect_async callbacks */
+	connect_callback_t connect_done_cb;
+	void *connect_arg;
+	int connect_status;		/**< EINPROGRESS, 0 or errno, see msk_connect_poll */
+	uint64_t connect_deadline;	/**< CLOCK_MONOTONIC ns msk_connect_async gives up at */
+	struct msk_trans *connect_next;	/**< asynchronous connects in progress */
+	int route_cache_ttl;		/**< seconds resolved addresses/paths are reused, 0 to always resolve */
+	int resvport;			/**< reserved port bound with privport, 0 if none */
+	char *bind_node;		/**< client: local address to connect from */
+	int warm_count;			/**< listener: warm pool size per device */
+	struct msk_warm_pool *warm;	/**< listener: cqs and contexts made ahead of connection requests */
+	int flushing;			/**< set while teardown waits for contexts, workers signal cm_cond */
+	uint32_t srq_limit;		/**< listener: srq low watermark */
+	uint32_t srq_max_wr;		/**< listener: srq growth limit */
+	struct msk_ud *ud;		/**< datagram endpoint state, see msk_ud_bind */
+	uint32_t wctx_used;		/**< send contexts taken, see wctx_peak in msk_get_stats */
+	uint32_t wctx_peak;
+	uint32_t rctx_used;		/**< receive contexts taken, not counted on srq */
+	uint32_t rctx_peak;
+	uint32_t outstanding;		/**< contexts not given back yet, msk_flush_buffers waits for 0 */
+	uint32_t stuck_ms;		/**< send contexts pending longer are reported, 0 if not watched */
+	stuck_callback_t stuck_callback;
+	struct msk_trans *stuck_next;	/**< watched transports, see msk_stuck_scan */
+	uint32_t op_timeout_ms;		/**< deadline of sends, reads and writes, 0 if none */
+	struct msk_trans *record_next;	/**< connected transports, see msk_record_start */
+	struct msk_record_prev *record_prev;	/**< counters at the last sample, set while on that list */
+	void *owner;			/**< pool connection or stripe driving this transport, private_data stays the user's */
 };
 
 struct msk_trans_attr {
@@ -155,8 +267,285 @@ struct msk_trans_attr {
 	char *port;			/**< The service port (or name) */
 	struct msk_pd *pd;		/**< Protection Domain pointer */
 	char *stats_prefix;
+	int stats_format;		/**< Stats socket output: MSK_STATS_TEXT (default), MSK_STATS_JSON or MSK_STATS_PROMETHEUS */
+	char *stats_shm;		/**< POSIX shared memory name (e.g. "/mooshika.<pid>") where all transports' counters are published, the first one sets it for the process */
+	uint32_t stats_shm_entries;	/**< Transports the stats_shm region can hold, MSK_STATS_SHM_ENTRIES if 0 */
+	uint32_t msg_threshold;		/**< Enables the message layer: messages up to this size are sent eagerly, bigger ones through rendezvous */
+	int flow_control;		/**< Set to 1 for credit-based flow control in the message layer, must match on both sides, needs rq_depth >= 4 */
+	uint32_t mw_count;		/**< Number of type 2 memory windows to preallocate for msk_post_bind, 0 if unused */
+	int route_cache_ttl;		/**< Client: seconds to reuse the resolved address and path of node/port, 0 to disable */
+	char *bind_node;		/**< Client: local address to connect from, selects the device/port; NULL lets the route decide */
+	int warm_count;			/**< Server: completion queues and context arrays kept ready per device for new connections, 0 to disable */
+	int shared_cm;			/**< Set to 1 to use the process-wide connection manager event channel instead of one per transport */
+	uint32_t srq_limit;		/**< Server with use_srq: refill from msk_srq_add_buffers' pool when fewer receives are posted, below rq_depth, 0 to refill on every release */
+	uint32_t srq_max_wr;		/**< Server with use_srq: the srq and its contexts grow up to that many receives, 0 to keep rq_depth */
+	uint32_t stuck_ms;		/**< Report sends, reads, writes and binds not completed after that many ms (scanned by the stats thread), 0 to disable */
+	stuck_callback_t stuck_callback;	/**< Also called for each of them, from the stats thread; must not destroy the transport */
+	uint32_t op_timeout_ms;		/**< Deadline of every send, read and write, see msk_post_n_timed; 0 for none. Not applied to the message layer, pool and stripe internal posts. The err_callback getting MSK_WC_DEADLINE must not destroy the transport */
+};
+
+/**
+ * \struct msk_srq_stats
+ * shared receive queue occupancy, see msk_srq_stats
+ */
+struct msk_srq_stats {
+	uint32_t depth;			/**< receive contexts, grows up to srq_max_wr */
+	uint32_t posted;		/**< receives currently on the srq */
+	uint32_t pool;			/**< buffers waiting to be posted */
+	uint64_t limit_events;		/**< low watermark events */
+	uint64_t grow;			/**< times the srq was grown */
+	uint64_t starved;		/**< low watermark events with nothing left to post */
+	uint64_t wait;			/**< times a poster slept because the srq couldn't grow */
+	uint64_t nsec_wait;		/**< time posters spent waiting */
+};
+
+#define MSK_THREAD_NAME_LEN 16
+
+/**
+ * \struct msk_thread_stats
+ * time spent by one of the library's threads, see msk_get_thread_stats
+ */
+struct msk_thread_stats {
+	char name[MSK_THREAD_NAME_LEN];	/**< cm, cq, stats or workerN */
+	uint32_t tid;
+	int running;			/**< 0 once it exited, its times are kept */
+	uint64_t nsec_cpu;		/**< CLOCK_THREAD_CPUTIME_ID */
+	uint64_t nsec_idle;		/**< wall time waiting for events */
+	uint64_t nsec_poll;		/**< wall time handling events, outside of callbacks */
+	uint64_t nsec_callback;		/**< wall time in callbacks */
 };
 
+#define MSK_SYMBOL_LEN 64
+
+/**
+ * \struct msk_callback_stats
+ * calls of one callback function, see msk_profile_start
+ */
+struct msk_callback_stats {
+	void *callback;
+	char symbol[MSK_SYMBOL_LEN];	/**< from dladdr, function+offset, or object+offset when not exported */
+	uint64_t calls;
+	uint64_t nsec_total;
+	uint64_t nsec_max;		/**< longest single call */
+};
+
+#define MSK_STATS_SHM_MAGIC 0x534b534d	/**< "MSKS" */
+#define MSK_STATS_SHM_VERSION 4
+#define MSK_STATS_SHM_ENTRIES 16384	/**< default directory size */
+#define MSK_STATS_SHM_RETRIES 64
+
+/**
+ * \struct msk_stats_shm_hdr
+ * start of the stats_shm region, the directory of entries follows.
+ * Entries are hdr_size + i * entry_size from the start, up to used.
+ */
+struct msk_stats_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdr_size;
+	uint32_t entry_size;
+	uint32_t entries;		/**< size of the directory */
+	uint32_t used;			/**< entries past that were never handed out */
+	uint32_t pid;			/**< process publishing the region */
+	uint32_t period_ms;		/**< how often counters are refreshed */
+	uint64_t updated_nsec;		/**< CLOCK_MONOTONIC time of the last refresh */
+};
+
+/**
+ * \struct msk_stats_shm_entry
+ * one transport in the stats_shm region, see msk_stats_shm_read
+ */
+struct msk_stats_shm_entry {
+	uint32_t seq;			/**< odd while the publisher writes the entry */
+	int32_t state;			/**< enum msk_state */
+	uint64_t id;			/**< transport address, 0 if the entry is free */
+	char peer[64];			/**< remote address:port */
+	char local[64];			/**< local address:port */
+	struct msk_stats stats;
+};
+
+static inline struct msk_stats_shm_entry *msk_stats_shm_entry(struct msk_stats_shm_hdr *hdr, uint32_t i) {
+	return (struct msk_stats_shm_entry *)((char *)hdr + hdr->hdr_size + (size_t)i * hdr->entry_size);
+}
+
+/**
+ * msk_stats_shm_read: consistent copy of a stats_shm entry, without syscalls
+ *
+ * @return 0 on success, ENOENT if the entry is free, EAGAIN if it kept changing
+ */
+static inline int msk_stats_shm_read(struct msk_stats_shm_hdr *hdr, uint32_t i, struct msk_stats_shm_entry *out) {
+	volatile struct msk_stats_shm_entry *entry = msk_stats_shm_entry(hdr, i);
+	uint32_t seq;
+	int retry;
+
+	for (retry = 0; retry < MSK_STATS_SHM_RETRIES; retry++) {
+		seq = entry->seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+		*out = *(struct msk_stats_shm_entry *)entry;
+		__sync_synchronize();
+		if (entry->seq == seq)
+			return out->id ? 0 : ENOENT;
+	}
+
+	return EAGAIN;
+}
+
+/**
+ * \enum msk_trace_event
+ * what a trace record stands for, see msk_trace_start
+ */
+enum msk_trace_event {
+	MSK_TRACE_POST_SEND = 1,	/**< opcode is an ibv_wr_opcode, size the bytes posted */
+	MSK_TRACE_POST_RECV,		/**< size is the buffer size */
+	MSK_TRACE_COMPLETION,		/**< opcode and status of the work completion, size its byte_len */
+	MSK_TRACE_CALLBACK,		/**< the completion's callback returned, size is data->size */
+};
+
+/**
+ * \struct msk_trace_rec
+ * fixed size trace record
+ */
+struct msk_trace_rec {
+	uint64_t nsec;			/**< CLOCK_MONOTONIC */
+	uint64_t trans;			/**< transport address */
+	uint64_t ctx;			/**< context address, matches a post with its completion */
+	uint32_t size;
+	uint16_t event;			/**< enum msk_trace_event */
+	uint8_t opcode;
+	uint8_t status;			/**< enum ibv_wc_status */
+};
+
+#define MSK_TRACE_MAGIC 0x52544b4d	/**< "MKTR" */
+#define MSK_TRACE_VERSION 1
+#define MSK_TRACE_DEFAULT_RECORDS 65536
+#define MSK_TRACE_MAX_RECORDS (1U << 31)
+
+/* msk_trace_dump file: this header, then nrings times a ring header and its records, oldest first */
+struct msk_trace_file_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t nrings;
+};
+
+struct msk_trace_ring_hdr {
+	uint32_t tid;			/**< thread that wrote the ring */
+	uint32_t count;			/**< records following */
+	uint64_t lost;			/**< older records overwritten */
+};
+
+/**
+ * \struct msk_record_sample
+ * one transport over one msk_record_start period, rates are per second
+ */
+struct msk_record_sample {
+	uint64_t nsec;			/**< CLOCK_REALTIME at the end of the period */
+	uint64_t trans;			/**< transport address */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint32_t tx_pkt;
+	uint32_t rx_pkt;
+	uint32_t errors;		/**< tx and rx */
+	uint32_t period_us;		/**< what the rates were computed over */
+	uint32_t wctx_pending;		/**< occupancy at the end of the period */
+	uint32_t rctx_pending;
+	uint32_t worker_queue_depth;
+	uint32_t state;			/**< enum msk_state */
+};
+
+#define MSK_RECORD_MAGIC 0x524b534d	/**< "MSKR" */
+#define MSK_RECORD_VERSION 1
+#define MSK_RECORD_DEFAULT_PERIOD_MS 100
+#define MSK_RECORD_DEFAULT_SIZE (16 << 20)
+
+/* msk_record_start file: this header then a ring of capacity samples */
+struct msk_record_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdr_size;
+	uint32_t sample_size;
+	uint32_t capacity;
+	uint32_t period_ms;
+	uint32_t pid;
+	uint32_t pad;
+	uint64_t head;			/**< samples ever written, the next one goes to head % capacity */
+};
+
+/**
+ * \struct msk_pool_hdr
+ * sent by msk_chan_call in front of each request, the server
+ * sends it back as is in front of the reply
+ */
+struct msk_pool_hdr {
+	uint32_t xid;			/**< request id, network order */
+	uint32_t chan;			/**< logical channel, network order */
+};
+#define MSK_POOL_HDR_SIZE sizeof(struct msk_pool_hdr)
+
+typedef struct msk_pool msk_pool_t;
+typedef struct msk_chan msk_chan_t;
+
+typedef struct msk_pool_attr {
+	int min_conns;			/**< connections opened upfront and kept */
+	int max_conns;			/**< upper bound on connections to the server */
+	int chan_per_conn;		/**< channels on a connection before another one is opened */
+	uint32_t max_reply_size;	/**< size of receive buffers, bigger replies are truncated */
+	int idle_timeout;		/**< seconds a connection without channel is kept above min_conns */
+} msk_pool_attr_t;
+
+#define MSK_STRIPE_MAX_LANES 8
+#define MSK_STRIPE_DEFAULT_SIZE (256*1024)
+
+typedef struct msk_stripe msk_stripe_t;
+
+typedef struct msk_stripe_attr {
+	int lanes;			/**< number of connections, up to MSK_STRIPE_MAX_LANES */
+	char **nodes;			/**< optional per-lane destination, NULL entries use attr->node */
+	char **bind_nodes;		/**< optional per-lane local address, picks the device/port of each lane */
+	uint32_t stripe_size;		/**< segment size, MSK_STRIPE_DEFAULT_SIZE if 0 */
+} msk_stripe_attr_t;
+
+/**
+ * \struct msk_stripe_rloc
+ * remote memory for striped read/write, one rkey per lane
+ */
+typedef struct msk_stripe_rloc {
+	uint64_t raddr;
+	uint64_t size;
+	uint32_t rkey[MSK_STRIPE_MAX_LANES];
+} msk_stripe_rloc_t;
+
+struct msk_stripe_lane_stats {
+	uint64_t bytes;			/**< bytes read/written on the lane */
+	uint64_t segments;
+	uint64_t nsec_busy;		/**< time with segments in flight */
+	uint64_t nsec_up;		/**< time since the stripe was set up */
+	uint32_t outstanding;		/**< segments in flight now */
+};
+
+#define MSK_UD_GRH_SIZE 40		/**< global routing header in front of every datagram received */
+
+typedef struct msk_ud_dest msk_ud_dest_t;
+
+/**
+ * msk_ud_payload: strips the routing header from a received datagram
+ *
+ * @param data [IN]  buffer given to the receive callback
+ * @param size [OUT] message size
+ *
+ * @return the message, NULL if the buffer is too short to be a datagram
+ */
+static inline uint8_t *msk_ud_payload(msk_data_t *data, uint32_t *size) {
+	if (data->size < MSK_UD_GRH_SIZE) {
+		*size = 0;
+		return NULL;
+	}
+	*size = data->size - MSK_UD_GRH_SIZE;
+	return data->data + MSK_UD_GRH_SIZE;
+}
+
 #define MSK_DEBUG_EVENT 0x0001
 #define MSK_DEBUG_SETUP 0x0002
 #define MSK_DEBUG_SEND  0x0004
@@ -188,6 +577,7 @@ int msk_wait_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge);
 int msk_wait_n_send(msk_trans_t *trans, msk_data_t *data, int num_sge);
 int msk_post_n_read(msk_trans_t *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg);
 int msk_post_n_write(msk_trans_t *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg);
+int msk_post_n_timed(msk_trans_t *trans, enum ibv_wr_opcode opcode, msk_data_t *data, int num_sge, msk_rloc_t *rloc, uint32_t timeout_ms, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
 int msk_wait_n_read(msk_trans_t *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc);
 int msk_wait_n_write(msk_trans_t *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc);
 
@@ -222,6 +612,21 @@ static inline int msk_wait_write(msk_trans_t *trans, msk_data_t *data, msk_rloc_
 	return msk_wait_n_write(trans, data, 1, rloc);
 }
 
+/* message layer, requires msg_threshold to be set in attr */
+int msk_post_msg(msk_trans_t *trans, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_post_msg_recv(msk_trans_t *trans, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_wait_msg(msk_trans_t *trans, msk_data_t *data);
+int msk_wait_msg_recv(msk_trans_t *trans, msk_data_t *data);
+
+/* memory windows, requires mw_count in attr and mr registered with IBV_ACCESS_MW_BIND */
+msk_rloc_t *msk_post_bind(msk_trans_t *trans, msk_data_t *data, int access, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_post_invalidate(msk_trans_t *trans, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_post_n_send_inv(msk_trans_t *trans, msk_data_t *data, int num_sge, uint32_t rkey, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+
+static inline int msk_post_send_inv(msk_trans_t *trans, msk_data_t *data, uint32_t rkey, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	return msk_post_n_send_inv(trans, data, 1, rkey, callback, err_callback, callback_arg);
+}
+
 
 
 int msk_init(msk_trans_t **ptrans, msk_trans_attr_t *attr);
@@ -230,13 +635,30 @@ int msk_init(msk_trans_t **ptrans, msk_trans_attr_t *attr);
 int msk_bind_server(msk_trans_t *trans);
 msk_trans_t *msk_accept_one_wait(msk_trans_t *trans, int msleep);
 msk_trans_t *msk_accept_one_timedwait(msk_trans_t *trans, struct timespec *abstime);
+int msk_accept_many(msk_trans_t *trans, msk_trans_t **children, int max, struct timespec *abstime);
 static inline msk_trans_t *msk_accept_one(msk_trans_t *trans) {
 	return msk_accept_one_timedwait(trans, NULL);
 }
 int msk_finalize_accept(msk_trans_t *trans);
 void msk_destroy_trans(msk_trans_t **ptrans);
+void msk_destroy_many(msk_trans_t **trans, int count);
+int msk_srq_add_buffers(msk_trans_t *trans, msk_data_t *data, int count, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_srq_release(msk_trans_t *trans, msk_data_t *data);
+int msk_srq_stats(msk_trans_t *trans, struct msk_srq_stats *stats);
+void msk_get_stats(msk_trans_t *trans, struct msk_stats *stats);
+int msk_get_thread_stats(struct msk_thread_stats *stats, int max);
+int msk_profile_start(void);
+void msk_profile_stop(void);
+int msk_get_callback_stats(struct msk_callback_stats *stats, int max);
+int msk_trace_start(uint32_t records);
+void msk_trace_stop(void);
+int msk_trace_dump(const char *path);
+int msk_record_start(const char *path, uint32_t period_ms, size_t size);
+void msk_record_stop(void);
 
 int msk_connect(msk_trans_t *trans);
+int msk_connect_async(msk_trans_t *trans, connect_callback_t setup_cb, connect_callback_t done_cb, void *arg);
+int msk_connect_poll(msk_trans_t *trans);
 int msk_finalize_connect(msk_trans_t *trans);
 
 
@@ -245,6 +667,11 @@ int msk_finalize_connect(msk_trans_t *trans);
 struct ibv_mr *msk_reg_mr(msk_trans_t *trans, void *memaddr, size_t size, int access);
 int msk_dereg_mr(struct ibv_mr *mr);
 
+/* register once for all devices, then pick the mr matching a trans */
+struct msk_mr_set *msk_reg_mr_all(msk_trans_t *trans, void *memaddr, size_t size, int access);
+struct ibv_mr *msk_mr_set_get(struct msk_mr_set *set, msk_trans_t *trans);
+int msk_dereg_mr_all(struct msk_mr_set *set);
+
 msk_rloc_t *msk_make_rloc(struct ibv_mr *mr, uint64_t addr, uint32_t size);
 
 void msk_print_devinfo(msk_trans_t *trans);
@@ -258,4 +685,33 @@ struct msk_pd *msk_getpd(msk_trans_t *trans);
 
 const char *msk_wc_status_str(enum ibv_wc_status status);
 
+/* client connection pool, logical channels multiplexed over a bounded set of connections */
+int msk_pool_init(msk_pool_t **ppool, msk_trans_attr_t *attr, msk_pool_attr_t *pattr);
+void msk_pool_destroy(msk_pool_t **ppool);
+msk_chan_t *msk_chan_open(msk_pool_t *pool);
+void msk_chan_close(msk_chan_t **pchan);
+int msk_chan_call(msk_chan_t *chan, msk_data_t *request, msk_data_t *reply, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_chan_wait_call(msk_chan_t *chan, msk_data_t *request, msk_data_t *reply);
+msk_trans_t *msk_chan_trans(msk_chan_t *chan);
+
+/* striped transport, one logical connection over several queue pairs */
+int msk_stripe_connect(msk_stripe_t **pstripe, msk_trans_attr_t *attr, msk_stripe_attr_t *sattr);
+int msk_stripe_accept(msk_trans_t *listener, msk_stripe_t **pstripe);
+void msk_stripe_destroy(msk_stripe_t **pstripe);
+struct msk_mr_set *msk_stripe_reg_mr(msk_stripe_t *stripe, void *memaddr, size_t size, int access);
+void msk_stripe_make_rloc(msk_stripe_t *stripe, struct msk_mr_set *set, void *memaddr, uint64_t size, msk_stripe_rloc_t *rloc);
+int msk_stripe_send(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_stripe_recv(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_stripe_write(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, msk_stripe_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_stripe_read(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, msk_stripe_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_stripe_lanes(msk_stripe_t *stripe);
+msk_trans_t *msk_stripe_lane(msk_stripe_t *stripe, int lane);
+int msk_stripe_stats(msk_stripe_t *stripe, struct msk_stripe_lane_stats *stats, int max);
+
+/* datagram transport, one qp for all peers */
+int msk_ud_bind(msk_trans_t *trans);
+msk_ud_dest_t *msk_ud_resolve(msk_trans_t *trans, const char *node, const char *port);
+uint32_t msk_ud_max_msg(msk_trans_t *trans);
+int msk_ud_post_send(msk_trans_t *trans, msk_ud_dest_t *dest, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+
 #endif /* _MOOSHIKA_H */
@@ -33,6 +33,8 @@
 
 #ifdef GCC_ATOMIC_FUNCTIONS
 #define atomic_store(x, n) __atomic_store_n(x, n, __ATOMIC_RELEASE)
+#define atomic_load(x) __atomic_load_n(x, __ATOMIC_RELAXED)
 #elif defined(GCC_SYNC_FUNCTIONS)
 #define atomic_store(x, n) do { *(x) = n; __sync_synchronize(); } while (0)
+#define atomic_load(x) __sync_fetch_and_add(x, 0)
 #endif
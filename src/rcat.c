@@ -84,6 +84,15 @@ void callback_error(msk_trans_t *trans, msk_data_t *pdata, void *arg) {
 		&& trans->debug, "error callback on buffer %p", pdata);
 }
 
+void callback_recv(msk_trans_t *trans, msk_data_t *pdata, void *arg);
+
+// srq buffers go back to the srq's pool, it reposts them when it runs low
+int repost_recv(msk_trans_t *trans, msk_data_t *pdata) {
+	if (trans->srq)
+		return msk_srq_release(trans, pdata);
+	return msk_post_recv(trans, pdata, callback_recv, callback_error, NULL);
+}
+
 void callback_recv(msk_trans_t *trans, msk_data_t *pdata, void *arg) {
 	struct priv_data *priv_data = trans->private_data;
 	int n;
@@ -101,13 +110,13 @@ void callback_recv(msk_trans_t *trans, msk_data_t *pdata, void *arg) {
 		if (n != pdata->size)
 			ERROR_LOG("Wrote less than what was actually received");
 
-		if (msk_post_recv(trans, pdata, callback_recv, callback_error, priv_data))
+		if (repost_recv(trans, pdata))
 			ERROR_LOG("post_recv failed");
 	        if (msk_post_send(trans, priv_data->ackdata, NULL, NULL, NULL))
 			ERROR_LOG("post_send failed");
 	} else {
 	// or we get an ack and just send a signal to handle_trans thread
-		if(msk_post_recv(trans, pdata, callback_recv, callback_error, priv_data))
+		if (repost_recv(trans, pdata))
 			ERROR_LOG("post_recv failed");
 
 		pthread_mutex_lock(priv_data->lock);
@@ -129,6 +138,11 @@ void print_help(char **argv) {
 		"	-v, --verbose: enable verbose output (more v for more verbosity)\n"
 		"	-q, --quiet: don't display connection messages\n"
 		"	-D, --stats <prefix>: create a socket where to look stats up at given path\n"
+		"	-F, --stats-format {text|json|prometheus}: what the stats socket serves\n"
+		"	-M, --stats-shm <name>: publish stats in that shared memory region, see msktop\n"
+		"	-T, --trace <file>: record data path events, dumped to file on exit for msktrace\n"
+		"	-P, --profile: time callbacks, heaviest ones shown on exit and in the stats socket\n"
+		"	-R, --record <file>: sample rates every 100ms to file, see mskrecord\n"
 		"	-d: display stats summary on close\n"
 		"	-b, --block-size size: size of packets to send (default: %u)\n"
 		"	-r, --recv-num n: size of receive queue for server (default: %u)\n",
@@ -141,6 +155,7 @@ void* handle_trans(void *arg) {
 	struct ibv_mr *mr;
 	msk_data_t *ackdata;
 	msk_data_t *wdatas;
+	struct msk_stats stats;
 	int cur_data = 0;
 
 	pthread_mutex_t lock;
@@ -234,7 +249,8 @@ void* handle_trans(void *arg) {
 	}
 	pthread_mutex_unlock(&lock);
 
-	if (thread_arg->stats)
+	if (thread_arg->stats) {
+		msk_get_stats(trans, &stats);
 		fprintf(stderr,
 			"stats:\n"
 			"	tx_bytes\ttx_pkt\ttx_err\n"
@@ -243,11 +259,12 @@ void* handle_trans(void *arg) {
 			"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
 			"	callback time:   %"PRIu64".%09"PRIu64" s\n"
 			"	completion time: %"PRIu64".%09"PRIu64" s\n",
-			trans->stats.tx_bytes, trans->stats.tx_pkt,
-			trans->stats.tx_err, trans->stats.rx_bytes,
-			trans->stats.rx_pkt, trans->stats.rx_err,
-			trans->stats.nsec_callback / NSEC_IN_SEC, trans->stats.nsec_callback % NSEC_IN_SEC,
-			trans->stats.nsec_compevent / NSEC_IN_SEC, trans->stats.nsec_compevent % NSEC_IN_SEC);
+			stats.tx_bytes, stats.tx_pkt,
+			stats.tx_err, stats.rx_bytes,
+			stats.rx_pkt, stats.rx_err,
+			stats.nsec_callback / NSEC_IN_SEC, stats.nsec_callback % NSEC_IN_SEC,
+			stats.nsec_compevent / NSEC_IN_SEC, stats.nsec_compevent % NSEC_IN_SEC);
+	}
 
 
 	TEST_Z(msk_dereg_mr(wdatas->mr));
@@ -283,8 +300,11 @@ void post_recvs(msk_trans_t *trans, struct thread_arg *thread_arg) {
 		thread_arg->rdata[i].data=rdmabuf+i*thread_arg->block_size;
 		thread_arg->rdata[i].max_size=thread_arg->block_size;
 		thread_arg->rdata[i].mr = mr;
-		TEST_Z(msk_post_recv(trans, &thread_arg->rdata[i], callback_recv, callback_error, NULL));
+		if (!trans->srq)
+			TEST_Z(msk_post_recv(trans, &thread_arg->rdata[i], callback_recv, callback_error, NULL));
 	}
+	if (trans->srq)
+		TEST_Z(msk_srq_add_buffers(trans, thread_arg->rdata, thread_arg->recv_num, callback_recv, callback_error, NULL));
 }
 
 int setup_recv(msk_trans_t *trans, struct thread_arg *thread_arg) {
@@ -323,6 +343,11 @@ int main(int argc, char **argv) {
 		{ "verbose",	no_argument,		0,		'v' },
 		{ "quiet",	no_argument,		0,		'q' },
 		{ "stats",	required_argument,	0,		'D' },
+		{ "stats-format", required_argument,	0,		'F' },
+		{ "stats-shm",	required_argument,	0,		'M' },
+		{ "trace",	required_argument,	0,		'T' },
+		{ "profile",	no_argument,		0,		'P' },
+		{ "record",	required_argument,	0,		'R' },
 		{ "recv-num",	required_argument,	0,		'r' },
 		{ "block-size",	required_argument,	0,		'b' },
 		{ "srq",	no_argument,		0,		'x' },
@@ -332,6 +357,9 @@ int main(int argc, char **argv) {
 	int option_index = 0;
 	int op;
 	char *tmp_s;
+	char *trace_file = NULL;
+	int profile = 0;
+	char *record_file = NULL;
 
 	memset(&attr, 0, sizeof(msk_trans_attr_t));
 	memset(&thread_arg, 0, sizeof(struct thread_arg));
@@ -343,7 +371,7 @@ int main(int argc, char **argv) {
 	attr.disconnect_callback = callback_disconnect;
 	attr.port = "1235"; /* default port */
 
-	while ((op = getopt_long(argc, argv, "@hvqmsb:S:c:p:dD:r:x", long_options, &option_index)) != -1) {
+	while ((op = getopt_long(argc, argv, "@hvqmsb:S:c:p:dD:F:M:T:PR:r:x", long_options, &option_index)) != -1) {
 		switch(op) {
 			case '@':
 				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
@@ -384,6 +412,26 @@ int main(int argc, char **argv) {
 				attr.stats_prefix = optarg;
 				thread_arg.stats = 1;
 				break;
+			case 'M':
+				attr.stats_shm = optarg;
+				break;
+			case 'T':
+				trace_file = optarg;
+				break;
+			case 'P':
+				profile = 1;
+				break;
+			case 'R':
+				record_file = optarg;
+				break;
+			case 'F':
+				if (!strcmp(optarg, "json"))
+					attr.stats_format = MSK_STATS_JSON;
+				else if (!strcmp(optarg, "prometheus"))
+					attr.stats_format = MSK_STATS_PROMETHEUS;
+				else
+					attr.stats_format = MSK_STATS_TEXT;
+				break;
 			case 'q':
 				attr.debug = 0;
 				break;
@@ -429,10 +477,18 @@ int main(int argc, char **argv) {
 		thread_arg.recv_num = attr.use_srq ? DEFAULT_RECV_NUM : 2;
 
 	attr.rq_depth = thread_arg.recv_num+2;
+	attr.srq_limit = thread_arg.recv_num/4;
 
 	// writing to stdout is the limiting factor anyway
 	attr.worker_count = -1;
 
+	if (trace_file)
+		TEST_Z(msk_trace_start(0));
+	if (profile)
+		TEST_Z(msk_profile_start());
+	if (record_file)
+		TEST_Z(msk_record_start(record_file, 0, 0));
+
 	TEST_Z(msk_init(&trans, &attr));
 
 	if (!trans)
@@ -483,5 +539,22 @@ int main(int argc, char **argv) {
 	free(thread_arg.rdata[0].data);
 	free(thread_arg.rdata);
 
+	if (record_file)
+		msk_record_stop();
+
+	if (trace_file && (errno = msk_trace_dump(trace_file)))
+		ERROR_LOG("trace dump to %s failed: %s", trace_file, strerror(errno));
+
+	if (profile) {
+		struct msk_callback_stats callbacks[10];
+		int i, n;
+
+		n = msk_get_callback_stats(callbacks, 10);
+		printf("%10s %14s %14s  %s\n", "calls", "total usec", "max usec", "callback");
+		for (i = 0; i < n && i < 10; i++)
+			printf("%10"PRIu64" %14.3f %14.3f  %s\n", callbacks[i].calls,
+			       callbacks[i].nsec_total / 1000.0, callbacks[i].nsec_max / 1000.0, callbacks[i].symbol);
+	}
+
 	return 0;
 }
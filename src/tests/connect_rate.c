@@ -0,0 +1,253 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   connect_rate.c
+ * \brief  connections per second, msk_connect_async vs blocking connects
+ *
+ * Server accepts -n connections with msk_accept_many, client opens them
+ * all at once with msk_connect_async (or one by one with -b) and prints
+ * the rate once all are established.
+ * With -P the client binds reserved ports and, unless -n is given, opens
+ * the whole privileged range (needs root).
+ * -w gives the server a warm pool of cqs and context arrays, -C puts
+ * the client's transports on the shared cm event channel.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h> // PRIu64
+
+#include "utils.h"
+#include "mooshika.h"
+
+#define DEFAULT_COUNT 100
+#define ACCEPT_BATCH 32
+
+struct connect_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int failed;
+};
+
+void callback_connect(msk_trans_t *trans, int status, void *arg) {
+	struct connect_state *state = arg;
+
+	pthread_mutex_lock(&state->lock);
+	state->done++;
+	if (status)
+		state->failed++;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s [-n count] [-b] [-P] [-w warm] [-C] {-s|-c addr}\n", argv[0]);
+	printf("	-n: number of connections (default %d, or all reserved ports with -P)\n", DEFAULT_COUNT);
+	printf("	-b: client uses blocking msk_connect, one connection at a time\n");
+	printf("	-P: client binds reserved ports (privport)\n");
+	printf("	-C: client transports share one cm event channel\n");
+	printf("	-w: server keeps that many cqs/contexts ready per device (warm pool)\n");
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans;
+	msk_trans_t **conns;
+	msk_trans_attr_t attr;
+	struct connect_state state;
+	struct timespec ts_start, ts_end;
+	uint64_t nsec = 0;
+	int count = 0;
+	int blocking = 0;
+	int i, j, n;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+	memset(&state, 0, sizeof(state));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	// sane values for optional or non-configurable elements
+	attr.rq_depth = 1;
+	attr.sq_depth = 1;
+	attr.port = "1235";
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "server",	required_argument,	0,		's' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "count",	required_argument,	0,		'n' },
+		{ "blocking",	no_argument,		0,		'b' },
+		{ "privport",	no_argument,		0,		'P' },
+		{ "warm",	required_argument,	0,		'w' },
+		{ "shared-cm",	no_argument,		0,		'C' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvbPCsS:c:p:n:w:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 's':
+				attr.server = 10;
+				attr.node = "::";
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				attr.port = optarg;
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'b':
+				blocking = 1;
+				break;
+			case 'P':
+				attr.privport = 1;
+				break;
+			case 'w':
+				attr.warm_count = atoi(optarg);
+				break;
+			case 'C':
+				attr.shared_cm = 1;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (count == 0)
+		count = attr.privport ? MSK_MAX_RESVPORT - MSK_MIN_RESVPORT + 1 : DEFAULT_COUNT;
+
+	if (attr.server == -1 || count <= 0) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	TEST_NZ(conns = malloc(count * sizeof(msk_trans_t *)));
+	memset(conns, 0, count * sizeof(msk_trans_t *));
+
+	if (attr.server) {
+		attr.server = count; // let the whole storm queue up
+		TEST_Z(msk_init(&trans, &attr));
+		TEST_NZ(trans);
+		TEST_Z(msk_bind_server(trans));
+
+		for (i = 0; i < count; i += n) {
+			n = msk_accept_many(trans, conns + i, (count - i < ACCEPT_BATCH ? count - i : ACCEPT_BATCH), NULL);
+			for (j = i; j < i + n; j++)
+				TEST_Z(msk_finalize_accept(conns[j]));
+			if (i == 0 && n > 0)
+				clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		sub_timespec(&nsec, &ts_start, &ts_end);
+
+		printf("accepted %d connections in %"PRIu64".%09"PRIu64" s, peak queue depth %"PRIu64", %"PRIu64" dropped, warm pool %"PRIu64" hit/%"PRIu64" miss\n",
+		       count, nsec / NSEC_IN_SEC, nsec % NSEC_IN_SEC,
+		       trans->stats.conn_req_peak, trans->stats.conn_req_drop,
+		       trans->stats.warm_hit, trans->stats.warm_miss);
+
+		// client disconnects first
+		msk_destroy_many(conns, count);
+		msk_destroy_trans(&trans);
+	} else {
+		pthread_mutex_init(&state.lock, NULL);
+		pthread_cond_init(&state.cond, NULL);
+
+		for (i = 0; i < count; i++) {
+			TEST_Z(msk_init(&conns[i], &attr));
+			TEST_NZ(conns[i]);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		if (blocking) {
+			for (i = 0; i < count; i++) {
+				TEST_Z(msk_connect(conns[i]));
+				TEST_Z(msk_finalize_connect(conns[i]));
+			}
+		} else {
+			pthread_mutex_lock(&state.lock);
+			for (i = 0; i < count; i++)
+				TEST_Z(msk_connect_async(conns[i], NULL, callback_connect, &state));
+
+			while (state.done < count)
+				pthread_cond_wait(&state.cond, &state.lock);
+			pthread_mutex_unlock(&state.lock);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		sub_timespec(&nsec, &ts_start, &ts_end);
+
+		printf("%d connections (%d failed) in %"PRIu64".%09"PRIu64" s: %.1f conn/s (%s%s)\n",
+		       count, state.failed, nsec / NSEC_IN_SEC, nsec % NSEC_IN_SEC,
+		       nsec ? (double)count * NSEC_IN_SEC / nsec : 0.0,
+		       blocking ? "blocking" : "async", attr.privport ? ", reserved ports" : "");
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		msk_destroy_many(conns, count);
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		sub_timespec(&nsec, &ts_start, &ts_end);
+		printf("closed them in %"PRIu64".%09"PRIu64" s\n", nsec / NSEC_IN_SEC, nsec % NSEC_IN_SEC);
+
+		TEST_Z(state.failed);
+	}
+
+	free(conns);
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   mw_write.c
+ * \brief  checks memory window exposure and remote invalidation
+ *
+ * Server binds a window on a buffer and sends the rloc, client rdma-writes
+ * into it and replies with a send-with-invalidate. Server then checks the
+ * data and that the window went back to its pool.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h> // PRIu64
+#include <pthread.h>
+
+#include "utils.h"
+#include "mooshika.h"
+
+#define WIN_SIZE 64*1024
+
+struct waitlock {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+};
+
+void callback_signal(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct waitlock *wl = arg;
+
+	pthread_mutex_lock(&wl->lock);
+	wl->done = 1;
+	pthread_cond_signal(&wl->cond);
+	pthread_mutex_unlock(&wl->lock);
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s {-s|-c addr}\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans;
+	uint8_t *rdmabuf;
+	struct ibv_mr *mr;
+	msk_data_t win, sdata, rdata;
+	msk_rloc_t *rloc, peer;
+	struct waitlock wl;
+	msk_trans_attr_t attr;
+	uint32_t i;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	// sane values for optional or non-configurable elements
+	attr.rq_depth = 4;
+	attr.sq_depth = 4;
+	attr.mw_count = 2;
+	attr.port = "1235";
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "server",	required_argument,	0,		's' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvsS:c:p:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 's':
+				attr.server = 10;
+				attr.node = "::";
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				attr.port = optarg;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (attr.server == -1) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	TEST_Z(msk_init(&trans, &attr));
+
+	if (!trans)
+		exit(-1);
+
+	if (trans->server) {
+		TEST_Z(msk_bind_server(trans));
+		TEST_NZ(trans = msk_accept_one(trans));
+	} else { //client
+		TEST_Z(msk_connect(trans));
+	}
+
+	TEST_NZ(rdmabuf = malloc(WIN_SIZE + 2*sizeof(msk_rloc_t)));
+	memset(rdmabuf, 0, WIN_SIZE + 2*sizeof(msk_rloc_t));
+	TEST_NZ(mr = msk_reg_mr(trans, rdmabuf, WIN_SIZE + 2*sizeof(msk_rloc_t), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND));
+
+	win.data = rdmabuf;
+	win.max_size = WIN_SIZE;
+	win.size = 0;
+	win.mr = mr;
+	sdata.data = rdmabuf + WIN_SIZE;
+	sdata.max_size = sizeof(msk_rloc_t);
+	sdata.mr = mr;
+	rdata.data = rdmabuf + WIN_SIZE + sizeof(msk_rloc_t);
+	rdata.max_size = sizeof(msk_rloc_t);
+	rdata.mr = mr;
+
+	pthread_mutex_init(&wl.lock, NULL);
+	pthread_cond_init(&wl.cond, NULL);
+	wl.done = 0;
+
+	pthread_mutex_lock(&wl.lock);
+	TEST_Z(msk_post_recv(trans, &rdata, callback_signal, NULL, &wl));
+
+	if (trans->server) {
+		TEST_Z(msk_finalize_accept(trans));
+
+		TEST_NZ(rloc = msk_post_bind(trans, &win, IBV_ACCESS_REMOTE_WRITE, NULL, NULL, NULL));
+		printf("exposing %u bytes with rkey %x\n", rloc->size, rloc->rkey);
+
+		/* sent after the bind on the same queue */
+		memcpy(sdata.data, rloc, sizeof(msk_rloc_t));
+		sdata.size = sizeof(msk_rloc_t);
+		TEST_Z(msk_post_send(trans, &sdata, NULL, NULL, NULL));
+
+		printf("waiting for the client's send with invalidate\n");
+		while (!wl.done)
+			TEST_Z(pthread_cond_wait(&wl.cond, &wl.lock));
+		wl.done = 0;
+
+		for (i = 0; i < WIN_SIZE; i++)
+			TEST_Z(rdmabuf[i] != (uint8_t)i);
+		printf("window content ok\n");
+
+		/* already invalidated by the peer */
+		TEST_NZ(msk_post_invalidate(trans, rloc, NULL, NULL, NULL));
+
+		sdata.size = 1;
+		TEST_Z(msk_wait_send(trans, &sdata)); // ack - other can quit
+	} else {
+		TEST_Z(msk_finalize_connect(trans));
+
+		printf("waiting for rloc\n");
+		while (!wl.done)
+			TEST_Z(pthread_cond_wait(&wl.cond, &wl.lock));
+		wl.done = 0;
+		memcpy(&peer, rdata.data, sizeof(msk_rloc_t));
+
+		for (i = 0; i < WIN_SIZE; i++)
+			rdmabuf[i] = (uint8_t)i;
+		win.size = WIN_SIZE;
+		TEST_Z(msk_post_write(trans, &win, &peer, callback_signal, NULL, &wl));
+		while (!wl.done)
+			TEST_Z(pthread_cond_wait(&wl.cond, &wl.lock));
+		wl.done = 0;
+
+		TEST_Z(msk_post_recv(trans, &rdata, callback_signal, NULL, &wl));
+		sdata.size = 1;
+		TEST_Z(msk_post_send_inv(trans, &sdata, peer.rkey, NULL, NULL, NULL));
+
+		printf("wrote window, waiting for server ack\n");
+		while (!wl.done)
+			TEST_Z(pthread_cond_wait(&wl.cond, &wl.lock));
+		wl.done = 0;
+	}
+	pthread_mutex_unlock(&wl.lock);
+
+	msk_dereg_mr(mr);
+
+	msk_destroy_trans(&trans);
+
+	free(rdmabuf);
+
+	return 0;
+}
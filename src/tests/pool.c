@@ -0,0 +1,277 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   pool.c
+ * \brief  client connection pool: channels multiplexed over a few connections
+ *
+ * Client opens -C channels with two per connection (up to -n connections)
+ * and does -i echo requests on each; the server echoes every message back,
+ * pool header included, on each of the -n connections it accepts.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h> // PRIu64
+
+#include "utils.h"
+#include "mooshika.h"
+
+#define DEFAULT_CONNS 4
+#define DEFAULT_CHANS 8
+#define DEFAULT_ITER 1000
+#define CHUNK_SIZE 1024
+#define RECV_NUM 8
+
+static int disconnected = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+void callback_disconnect(msk_trans_t *trans) {
+	pthread_mutex_lock(&lock);
+	disconnected++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void callback_recv(msk_trans_t *trans, msk_data_t *data, void *arg);
+
+static void callback_send(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	data->size = data->max_size;
+	msk_post_recv(trans, data, callback_recv, NULL, NULL);
+}
+
+static void callback_recv(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	// echo, pool header and all
+	if (msk_post_send(trans, data, callback_send, NULL, NULL))
+		ERROR_LOG("echo failed");
+}
+
+static void serve(msk_trans_t *child) {
+	struct ibv_mr *mr;
+	msk_data_t *rdata;
+	uint8_t *buf;
+	int i;
+
+	TEST_NZ(buf = malloc(RECV_NUM * (CHUNK_SIZE + MSK_POOL_HDR_SIZE)));
+	TEST_NZ(rdata = malloc(RECV_NUM * sizeof(msk_data_t)));
+	TEST_NZ(mr = msk_reg_mr(child, buf, RECV_NUM * (CHUNK_SIZE + MSK_POOL_HDR_SIZE), IBV_ACCESS_LOCAL_WRITE));
+
+	for (i = 0; i < RECV_NUM; i++) {
+		rdata[i].data = buf + i * (CHUNK_SIZE + MSK_POOL_HDR_SIZE);
+		rdata[i].max_size = CHUNK_SIZE + MSK_POOL_HDR_SIZE;
+		rdata[i].size = rdata[i].max_size;
+		rdata[i].mr = mr;
+		rdata[i].next = NULL;
+		TEST_Z(msk_post_recv(child, &rdata[i], callback_recv, NULL, NULL));
+	}
+	TEST_Z(msk_finalize_accept(child));
+	// buffers live until the process exits
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s [-n conns] [-C chans] [-i iter] {-s|-c addr}\n", argv[0]);
+	printf("	-n: connections (server: accepted before exiting, client: pool maximum, default %d)\n", DEFAULT_CONNS);
+	printf("	-C: client channels, two per connection (default %d)\n", DEFAULT_CHANS);
+	printf("	-i: requests per channel (default %d)\n", DEFAULT_ITER);
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans;
+	msk_trans_t **children;
+	msk_trans_attr_t attr;
+	msk_pool_attr_t pattr;
+	msk_pool_t *pool;
+	msk_chan_t **chans;
+	msk_data_t req, reply;
+	struct ibv_mr *mr;
+	uint8_t *buf;
+	struct timespec ts_start, ts_end;
+	uint64_t nsec = 0;
+	int conns = DEFAULT_CONNS;
+	int nchans = DEFAULT_CHANS;
+	int iter = DEFAULT_ITER;
+	int i, j;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+	memset(&pattr, 0, sizeof(msk_pool_attr_t));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	// sane values for optional or non-configurable elements
+	attr.rq_depth = RECV_NUM;
+	attr.sq_depth = RECV_NUM;
+	attr.port = "1235";
+	attr.disconnect_callback = callback_disconnect;
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "server",	required_argument,	0,		's' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "conns",	required_argument,	0,		'n' },
+		{ "chans",	required_argument,	0,		'C' },
+		{ "iter",	required_argument,	0,		'i' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvsS:c:p:n:C:i:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 's':
+				attr.server = 10;
+				attr.node = "::";
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				attr.port = optarg;
+				break;
+			case 'n':
+				conns = atoi(optarg);
+				break;
+			case 'C':
+				nchans = atoi(optarg);
+				break;
+			case 'i':
+				iter = atoi(optarg);
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (attr.server == -1 || conns <= 0 || nchans <= 0) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	if (attr.server) {
+		TEST_NZ(children = malloc(conns * sizeof(msk_trans_t *)));
+		TEST_Z(msk_init(&trans, &attr));
+		TEST_NZ(trans);
+		TEST_Z(msk_bind_server(trans));
+
+		for (i = 0; i < conns; i++) {
+			TEST_NZ(children[i] = msk_accept_one(trans));
+			serve(children[i]);
+		}
+
+		pthread_mutex_lock(&lock);
+		while (disconnected < conns)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+
+		for (i = 0; i < conns; i++)
+			msk_destroy_trans(&children[i]);
+		msk_destroy_trans(&trans);
+		free(children);
+
+		return 0;
+	}
+
+	pattr.min_conns = 1;
+	pattr.max_conns = conns;
+	pattr.chan_per_conn = 2;
+	pattr.max_reply_size = CHUNK_SIZE;
+	pattr.idle_timeout = 1;
+	TEST_Z(msk_pool_init(&pool, &attr, &pattr));
+
+	TEST_NZ(chans = malloc(nchans * sizeof(msk_chan_t *)));
+	for (i = 0; i < nchans; i++)
+		TEST_NZ(chans[i] = msk_chan_open(pool));
+
+	TEST_NZ(buf = malloc(2 * CHUNK_SIZE));
+	// the pool's connections share the registry's protection domain
+	TEST_NZ(mr = msk_reg_mr(msk_chan_trans(chans[0]), buf, 2 * CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE));
+
+	req.data = buf;
+	req.max_size = CHUNK_SIZE;
+	req.mr = mr;
+	req.next = NULL;
+	reply.data = buf + CHUNK_SIZE;
+	reply.max_size = CHUNK_SIZE;
+	reply.mr = mr;
+	reply.next = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	for (j = 0; j < iter; j++) {
+		for (i = 0; i < nchans; i++) {
+			req.size = snprintf((char *)req.data, CHUNK_SIZE, "chan %d request %d", i, j) + 1;
+			TEST_Z(msk_chan_wait_call(chans[i], &req, &reply));
+			if (reply.size != req.size || memcmp(req.data, reply.data, req.size)) {
+				ERROR_LOG("bad reply on chan %d: %s", i, reply.data);
+				exit(EIO);
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	sub_timespec(&nsec, &ts_start, &ts_end);
+
+	printf("%d requests over %d channels: %"PRIu64" ns per request\n",
+	       iter * nchans, nchans, nsec / (uint64_t)(iter * nchans));
+
+	for (i = 0; i < nchans; i++)
+		msk_chan_close(&chans[i]);
+
+	msk_dereg_mr(mr);
+	msk_pool_destroy(&pool);
+	free(chans);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   rendezvous.c
+ * \brief  checks the message layer with eager and rendezvous messages
+ *
+ * Client sends a small and a big message, server checks both landed
+ * in its buffers and sends a small ack back.
+ * Only threshold-sized receive buffers are posted on the queue pair.
+ * -f turns on credit-based flow control (both sides need it).
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h> // PRIu64
+
+#include "utils.h"
+#include "mooshika.h"
+
+#define THRESHOLD 1024
+#define SMALL_SIZE 100
+#define BIG_SIZE 4*1024*1024
+
+static void fill(uint8_t *buf, uint32_t size, uint8_t seed) {
+	uint32_t i;
+	for (i = 0; i < size; i++)
+		buf[i] = (uint8_t)(i * 7 + seed);
+}
+
+static int check(uint8_t *buf, uint32_t size, uint8_t seed) {
+	uint32_t i;
+	for (i = 0; i < size; i++)
+		if (buf[i] != (uint8_t)(i * 7 + seed))
+			return 1;
+	return 0;
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s [-f] {-s|-c addr}\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans;
+	uint8_t *rdmabuf;
+	struct ibv_mr *mr;
+	msk_data_t small, big;
+	msk_trans_attr_t attr;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	// sane values for optional or non-configurable elements
+	attr.rq_depth = 4;
+	attr.sq_depth = 4;
+	attr.msg_threshold = THRESHOLD;
+	attr.port = "1235";
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "server",	required_argument,	0,		's' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "flow",	no_argument,		0,		'f' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvfsS:c:p:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 's':
+				attr.server = 10;
+				attr.node = "::";
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				attr.port = optarg;
+				break;
+			case 'f':
+				attr.flow_control = 1;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (attr.server == -1) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	TEST_Z(msk_init(&trans, &attr));
+
+	if (!trans)
+		exit(-1);
+
+	if (trans->server) {
+		TEST_Z(msk_bind_server(trans));
+		TEST_NZ(trans = msk_accept_one(trans));
+	} else { //client
+		TEST_Z(msk_connect(trans));
+	}
+
+	TEST_NZ(rdmabuf = malloc(SMALL_SIZE + BIG_SIZE));
+	memset(rdmabuf, 0, SMALL_SIZE + BIG_SIZE);
+	TEST_NZ(mr = msk_reg_mr(trans, rdmabuf, SMALL_SIZE + BIG_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+
+	small.data = rdmabuf;
+	small.max_size = SMALL_SIZE;
+	small.mr = mr;
+	big.data = rdmabuf + SMALL_SIZE;
+	big.max_size = BIG_SIZE;
+	big.mr = mr;
+
+	if (trans->server) {
+		TEST_Z(msk_finalize_accept(trans));
+
+		TEST_Z(msk_wait_msg_recv(trans, &small));
+		TEST_Z(msk_wait_msg_recv(trans, &big));
+
+		printf("got %u and %u bytes\n", small.size, big.size);
+		TEST_Z(small.size != SMALL_SIZE || check(small.data, small.size, 1));
+		TEST_Z(big.size != BIG_SIZE || check(big.data, big.size, 2));
+
+		small.size = 1;
+		TEST_Z(msk_wait_msg(trans, &small)); // ack - other can quit
+	} else {
+		TEST_Z(msk_finalize_connect(trans));
+
+		fill(small.data, SMALL_SIZE, 1);
+		small.size = SMALL_SIZE;
+		fill(big.data, BIG_SIZE, 2);
+		big.size = BIG_SIZE;
+
+		TEST_Z(msk_wait_msg(trans, &small));
+		TEST_Z(msk_wait_msg(trans, &big));
+
+		printf("sent both messages, waiting for server ack\n");
+		TEST_Z(msk_wait_msg_recv(trans, &small));
+	}
+
+	msk_dereg_mr(mr);
+
+	msk_destroy_trans(&trans);
+
+	free(rdmabuf);
+
+	return 0;
+}
@@ -9,7 +9,7 @@ runit() {
 
 IP="$1"
 
-for prog in ./bench_rdma ./multiple_sge ./read_write; do
+for prog in ./bench_rdma ./multiple_sge ./read_write ./rendezvous ./mw_write ./connect_rate ./pool ./stripe ./ud_fanout; do
 	echo "Starting server $prog -S \"$IP\""
 	runit "Server" $prog -S "$IP" &
 	sleep 0.2
@@ -17,3 +17,11 @@ for prog in ./bench_rdma ./multiple_sge ./read_write; do
 	echo "Starting client: $prog -c \"$IP\""
 	runit "Client" $prog -c "$IP"
 done
+
+# more messages than slots, so the stripe rings wrap around
+echo "Starting server ./stripe -n 64 -d 4 -S \"$IP\""
+runit "Server" ./stripe -n 64 -d 4 -S "$IP" &
+sleep 0.2
+
+echo "Starting client: ./stripe -n 64 -d 4 -c \"$IP\""
+runit "Client" ./stripe -n 64 -d 4 -c "$IP"
@@ -0,0 +1,269 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   stripe.c
+ * \brief  bulk messages over a striped transport
+ *
+ * Client sends -n messages of -m bytes over -l lanes (optionally bound to
+ * the comma separated local addresses of -B), the server checks them.
+ * Both sides print the throughput and how busy each lane was.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h> // PRIu64
+
+#include "utils.h"
+#include "mooshika.h"
+
+#define DEFAULT_LANES 2
+#define DEFAULT_SIZE (1024*1024)
+#define DEFAULT_COUNT 16
+#define DEFAULT_DEPTH 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int done = 0;
+static int failed = 0;
+
+static void callback_done(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	pthread_mutex_lock(&lock);
+	if (data->status)
+		failed++;
+	done++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void wait_done(int count) {
+	pthread_mutex_lock(&lock);
+	while (done < count)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+static void print_stats(msk_stripe_t *stripe, uint64_t bytes, uint64_t nsec) {
+	struct msk_stripe_lane_stats stats[MSK_STRIPE_MAX_LANES];
+	int i, n;
+
+	printf("%"PRIu64" bytes in %"PRIu64".%09"PRIu64" s: %.1f MB/s\n",
+	       bytes, nsec / NSEC_IN_SEC, nsec % NSEC_IN_SEC,
+	       nsec ? (double)bytes * 1000 / nsec : 0.0);
+
+	n = msk_stripe_stats(stripe, stats, MSK_STRIPE_MAX_LANES);
+	for (i = 0; i < n; i++)
+		printf("lane %d: %"PRIu64" bytes, %"PRIu64" segments, busy %.1f%%\n", i,
+		       stats[i].bytes, stats[i].segments,
+		       stats[i].nsec_up ? 100.0 * stats[i].nsec_busy / stats[i].nsec_up : 0.0);
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s [-l lanes] [-B addr,addr...] [-m size] [-n count] [-d depth] {-s|-c addr}\n", argv[0]);
+	printf("	-l: number of lanes (default %d)\n", DEFAULT_LANES);
+	printf("	-B: local addresses for the lanes, in order\n");
+	printf("	-m: message size (default %d)\n", DEFAULT_SIZE);
+	printf("	-n: number of messages (default %d)\n", DEFAULT_COUNT);
+	printf("	-d: messages in flight, slots are reused past that many (default %d)\n", DEFAULT_DEPTH);
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans = NULL;
+	msk_stripe_t *stripe;
+	msk_trans_attr_t attr;
+	msk_stripe_attr_t sattr;
+	struct msk_mr_set *set;
+	msk_data_t *data;
+	char *bind_nodes[MSK_STRIPE_MAX_LANES];
+	char *bind_arg = NULL, *tok;
+	struct timespec ts_start, ts_end;
+	uint64_t nsec = 0;
+	uint32_t size = DEFAULT_SIZE;
+	uint8_t *buf;
+	int count = DEFAULT_COUNT;
+	int i, j;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+	memset(&sattr, 0, sizeof(msk_stripe_attr_t));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	// sane values for optional or non-configurable elements
+	// stripes get rq_depth/2 message slots
+	attr.rq_depth = 2 * DEFAULT_DEPTH;
+	attr.sq_depth = 64;
+	attr.port = "1235";
+	// striped reads are posted from callbacks
+	attr.worker_count = 2;
+	sattr.lanes = DEFAULT_LANES;
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "server",	required_argument,	0,		's' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "lanes",	required_argument,	0,		'l' },
+		{ "bind",	required_argument,	0,		'B' },
+		{ "size",	required_argument,	0,		'm' },
+		{ "count",	required_argument,	0,		'n' },
+		{ "depth",	required_argument,	0,		'd' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvsS:c:p:l:B:m:n:d:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 's':
+				attr.server = 10;
+				attr.node = "::";
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				attr.port = optarg;
+				break;
+			case 'l':
+				sattr.lanes = atoi(optarg);
+				break;
+			case 'B':
+				bind_arg = optarg;
+				break;
+			case 'm':
+				size = strtoul(optarg, &tok, 0);
+				if (*tok != '\0')
+					set_size(size, tok);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'd':
+				attr.rq_depth = 2 * atoi(optarg);
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (attr.server == -1 || sattr.lanes <= 0 || sattr.lanes > MSK_STRIPE_MAX_LANES || size == 0 || attr.rq_depth <= 0) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	if (bind_arg) {
+		memset(bind_nodes, 0, sizeof(bind_nodes));
+		for (i = 0, tok = strtok(bind_arg, ","); tok && i < sattr.lanes; i++, tok = strtok(NULL, ","))
+			bind_nodes[i] = tok;
+		sattr.bind_nodes = bind_nodes;
+	}
+
+	if (attr.server) {
+		TEST_Z(msk_init(&trans, &attr));
+		TEST_NZ(trans);
+		TEST_Z(msk_bind_server(trans));
+		TEST_Z(msk_stripe_accept(trans, &stripe));
+	} else {
+		TEST_Z(msk_stripe_connect(&stripe, &attr, &sattr));
+	}
+
+	TEST_NZ(buf = malloc((size_t)size * count));
+	TEST_NZ(data = malloc(count * sizeof(msk_data_t)));
+	TEST_NZ(set = msk_stripe_reg_mr(stripe, buf, (size_t)size * count, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+
+	for (i = 0; i < count; i++) {
+		data[i].data = buf + (size_t)i * size;
+		data[i].max_size = size;
+		data[i].size = size;
+		data[i].mr = NULL;
+		data[i].next = NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	if (attr.server) {
+		for (i = 0; i < count; i++)
+			TEST_Z(msk_stripe_recv(stripe, &data[i], set, callback_done, callback_done, NULL));
+	} else {
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < size; j += 4096)
+				data[i].data[j] = (uint8_t)(i + j / 4096);
+			TEST_Z(msk_stripe_send(stripe, &data[i], set, callback_done, callback_done, NULL));
+		}
+	}
+	wait_done(count);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	sub_timespec(&nsec, &ts_start, &ts_end);
+
+	if (attr.server) {
+		for (i = 0; i < count; i++)
+			for (j = 0; j < size; j += 4096)
+				if (data[i].data[j] != (uint8_t)(i + j / 4096)) {
+					ERROR_LOG("message %d corrupted at %d", i, j);
+					failed++;
+					break;
+				}
+	}
+
+	print_stats(stripe, (uint64_t)size * count, nsec);
+
+	msk_dereg_mr_all(set);
+	msk_stripe_destroy(&stripe);
+	if (attr.server)
+		msk_destroy_trans(&trans);
+	free(data);
+	free(buf);
+
+	return failed;
+}
@@ -0,0 +1,320 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   ud_fanout.c
+ * \brief  small messages to many peers, one datagram qp vs one rc qp per peer
+ *
+ * Server stands for -n peers: -n datagram endpoints on consecutive ports,
+ * or a listener accepting -n connections with -r. Client sends -i rounds
+ * of a 64 bytes message to every peer and prints the message rate and how
+ * much its resident memory grew to reach them all. The server prints how
+ * many messages it got, datagrams can be dropped.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//read
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h> // PRIu64
+
+#include "utils.h"
+#include "atomics.h"
+#include "mooshika.h"
+
+#define DEFAULT_PEERS 16
+#define DEFAULT_ROUNDS 1000
+#define RECV_NUM 64
+#define MSG_SIZE 64
+
+static uint64_t received;
+static uint64_t completed;
+
+void callback_recv(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	uint32_t size = data->size;
+
+	if (trans->ud && !msk_ud_payload(data, &size))
+		ERROR_LOG("short datagram (%u bytes)", data->size);
+	else if (size != MSG_SIZE)
+		ERROR_LOG("unexpected message size %u", size);
+
+	atomic_inc(received);
+
+	if (msk_post_recv(trans, data, callback_recv, NULL, NULL))
+		ERROR_LOG("post_recv failed");
+}
+
+void callback_send(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	atomic_inc(completed);
+}
+
+void callback_error(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	INFO_LOG(trans->state != MSK_CLOSING && trans->state != MSK_CLOSED
+		&& trans->debug, "error callback on buffer %p", data);
+}
+
+static uint64_t rss_kb(void) {
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return (uint64_t)resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static void post_recvs(msk_trans_t *trans, uint32_t size) {
+	msk_data_t *rdata;
+	uint8_t *buf;
+	struct ibv_mr *mr;
+	int i;
+
+	TEST_NZ(buf = malloc(RECV_NUM * size));
+	TEST_NZ(mr = msk_reg_mr(trans, buf, RECV_NUM * size, IBV_ACCESS_LOCAL_WRITE));
+	TEST_NZ(rdata = malloc(RECV_NUM * sizeof(msk_data_t)));
+	for (i = 0; i < RECV_NUM; i++) {
+		rdata[i].data = buf + i * size;
+		rdata[i].max_size = size;
+		rdata[i].mr = mr;
+		TEST_Z(msk_post_recv(trans, &rdata[i], callback_recv, callback_error, NULL));
+	}
+}
+
+void print_help(char **argv) {
+	printf("Usage: %s [-r] [-n peers] [-i rounds] [-l addr] {-S addr|-c addr}\n", argv[0]);
+	printf("	-r: one rc connection per peer instead of a datagram endpoint\n");
+	printf("	-n: number of peers (default %d)\n", DEFAULT_PEERS);
+	printf("	-i: messages sent to each peer (default %d)\n", DEFAULT_ROUNDS);
+	printf("	-l: client datagram endpoint address (default: same as -c, for loopback)\n");
+	printf("	-p: server port, datagram peers take the following ones\n");
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans = NULL;
+	msk_trans_t **peers;
+	msk_ud_dest_t **dests = NULL;
+	msk_trans_attr_t attr;
+	msk_data_t data;
+	struct ibv_mr *mr;
+	struct timespec ts_start, ts_end;
+	uint64_t nsec = 0, rss_start, rss_end, last;
+	char port[16];
+	char *local = NULL;
+	int count = DEFAULT_PEERS;
+	int rounds = DEFAULT_ROUNDS;
+	int rc = 0;
+	int base_port = 1236;
+	int i, j, idle;
+
+	memset(&attr, 0, sizeof(msk_trans_attr_t));
+
+	attr.server = -1; // put an incorrect value to check if we're either client or server
+	attr.rq_depth = RECV_NUM;
+	attr.sq_depth = 64;
+	attr.worker_count = -1;
+
+	// argument handling
+	static struct option long_options[] = {
+		{ "client",	required_argument,	0,		'c' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "peers",	required_argument,	0,		'n' },
+		{ "rounds",	required_argument,	0,		'i' },
+		{ "local",	required_argument,	0,		'l' },
+		{ "rc",		no_argument,		0,		'r' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hvrS:c:p:n:i:l:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'v':
+				attr.debug = attr.debug * 2 + 1;
+				break;
+			case 'c':
+				attr.server = 0;
+				attr.node = optarg;
+				break;
+			case 'S':
+				attr.server = 10;
+				attr.node = optarg;
+				break;
+			case 'p':
+				base_port = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'i':
+				rounds = atoi(optarg);
+				break;
+			case 'l':
+				local = optarg;
+				break;
+			case 'r':
+				rc = 1;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (attr.server == -1 || count <= 0 || rounds <= 0) {
+		ERROR_LOG("must be either a client or a server!");
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	TEST_NZ(peers = malloc(count * sizeof(msk_trans_t *)));
+	memset(peers, 0, count * sizeof(msk_trans_t *));
+	attr.conn_type = rc ? RDMA_PS_TCP : RDMA_PS_UDP;
+
+	if (attr.server) {
+		if (rc) {
+			snprintf(port, sizeof(port), "%d", base_port);
+			attr.port = port;
+			attr.server = count;
+			TEST_Z(msk_init(&trans, &attr));
+			TEST_Z(msk_bind_server(trans));
+			for (i = 0; i < count; i++) {
+				TEST_NZ(peers[i] = msk_accept_one(trans));
+				post_recvs(peers[i], MSG_SIZE);
+				TEST_Z(msk_finalize_accept(peers[i]));
+			}
+		} else {
+			for (i = 0; i < count; i++) {
+				snprintf(port, sizeof(port), "%d", base_port + i);
+				attr.port = port;
+				TEST_Z(msk_init(&peers[i], &attr));
+				TEST_Z(msk_ud_bind(peers[i]));
+				post_recvs(peers[i], MSG_SIZE + MSK_UD_GRH_SIZE);
+			}
+		}
+
+		// until everything came or nothing did for two seconds
+		last = 0;
+		for (idle = 0; idle < 20 && received < (uint64_t)count * rounds; ) {
+			usleep(100000);
+			if (received == last && received > 0)
+				idle++;
+			last = received;
+		}
+
+		printf("received %"PRIu64" of %"PRIu64" messages on %d %s\n",
+		       received, (uint64_t)count * rounds, count, rc ? "connections" : "datagram endpoints");
+
+		for (i = 0; i < count; i++)
+			msk_destroy_trans(&peers[i]);
+		if (trans)
+			msk_destroy_trans(&trans);
+	} else {
+		rss_start = rss_kb();
+		snprintf(port, sizeof(port), "%d", base_port);
+		if (rc) {
+			attr.port = port;
+			for (i = 0; i < count; i++) {
+				TEST_Z(msk_init(&peers[i], &attr));
+				TEST_Z(msk_connect(peers[i]));
+				TEST_Z(msk_finalize_connect(peers[i]));
+			}
+			trans = peers[0];
+		} else {
+			char *server = attr.node;
+
+			TEST_NZ(dests = malloc(count * sizeof(msk_ud_dest_t *)));
+			attr.node = local ? local : server;
+			attr.port = "0";
+			TEST_Z(msk_init(&trans, &attr));
+			TEST_Z(msk_ud_bind(trans));
+			for (i = 0; i < count; i++) {
+				snprintf(port, sizeof(port), "%d", base_port + i);
+				TEST_NZ(dests[i] = msk_ud_resolve(trans, server, port));
+			}
+		}
+
+		// same read-only message for every send
+		TEST_NZ(data.data = malloc(MSG_SIZE));
+		memset(data.data, 'a', MSG_SIZE);
+		data.size = data.max_size = MSG_SIZE;
+		data.next = NULL;
+		TEST_NZ(mr = msk_reg_mr(trans, data.data, MSG_SIZE, IBV_ACCESS_LOCAL_WRITE));
+		data.mr = mr;
+		rss_end = rss_kb();
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		for (j = 0; j < rounds; j++) {
+			for (i = 0; i < count; i++) {
+				if (rc)
+					TEST_Z(msk_post_send(peers[i], &data, callback_send, callback_error, NULL));
+				else
+					TEST_Z(msk_ud_post_send(trans, dests[i], &data, callback_send, callback_error, NULL));
+			}
+		}
+		while (completed < (uint64_t)count * rounds)
+			usleep(100);
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		sub_timespec(&nsec, &ts_start, &ts_end);
+
+		printf("%s, %d peers: %.0f msg/s, %"PRIu64" kB more resident memory (%"PRIu64" kB per peer)\n",
+		       rc ? "rc" : "ud", count,
+		       nsec ? (double)count * rounds * NSEC_IN_SEC / nsec : 0.0,
+		       rss_end - rss_start, (rss_end - rss_start) / count);
+
+		msk_dereg_mr(mr);
+		free(data.data);
+		if (rc) {
+			msk_destroy_many(peers, count);
+		} else {
+			msk_destroy_trans(&trans);
+			free(dests);
+		}
+	}
+
+	free(peers);
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   mskrecord.c
+ * \brief  renders a msk_record_start file
+ *
+ * Prints each transport's samples oldest first, one line per period with
+ * its rates, queue occupancy and a bar of its throughput scaled to the
+ * transport's busiest period, or all samples as csv for plotting. The
+ * file can still be written to.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memset
+#include <unistd.h>	//close
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>	//localtime_r
+#include <fcntl.h>	//O_RDONLY
+#include <sys/mman.h>	//mmap
+#include <sys/stat.h>	//fstat
+#include <inttypes.h> // PRIu64
+
+#include "mooshika.h"
+#include "../utils.h"
+
+#define DEFAULT_WIDTH 40
+
+static const char *state_str[] = { "init", "listening", "addr_resolved", "route_resolved",
+	"connect_request", "connected", "closing", "closed", "error" };
+
+static void print_help(char **argv) {
+	printf("Usage: %s [-t trans] [-w width] [-c] file\n", argv[0]);
+	printf("	file: written by msk_record_start (e.g. rcat -R)\n"
+		"	-t, --trans addr: only that transport (hex)\n"
+		"	-w, --width n: throughput bar width (default %d)\n"
+		"	-c, --csv: one csv line per sample instead\n", DEFAULT_WIDTH);
+}
+
+static void print_time(uint64_t nsec) {
+	time_t sec = nsec / NSEC_IN_SEC;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&sec, &tm);
+	strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+	printf("%s.%03"PRIu64, buf, nsec % NSEC_IN_SEC / 1000000);
+}
+
+static void print_bar(uint64_t val, uint64_t max, int width) {
+	int i, n = max ? (int)((double)val * width / max + 0.5) : 0;
+
+	for (i = 0; i < n; i++)
+		putchar('#');
+	putchar('\n');
+}
+
+int main(int argc, char **argv) {
+	struct msk_record_hdr *hdr;
+	struct msk_record_sample *samples, *sample;
+	struct stat st;
+	uint64_t filter = 0, head, count, first, i, max;
+	uint64_t *done = NULL;
+	uint32_t ndone = 0, j;
+	int width = DEFAULT_WIDTH, csv = 0;
+	int fd, seen;
+
+	static struct option long_options[] = {
+		{ "trans",	required_argument,	0,		't' },
+		{ "width",	required_argument,	0,		'w' },
+		{ "csv",	no_argument,		0,		'c' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@ht:w:c", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 't':
+				filter = strtoull(optarg, NULL, 16);
+				break;
+			case 'w':
+				width = atoi(optarg);
+				break;
+			case 'c':
+				csv = 1;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (optind != argc - 1 || width < 0) {
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1) {
+		ERROR_LOG("Couldn't open %s: %s", argv[optind], strerror(errno));
+		exit(errno);
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct msk_record_hdr)) {
+		ERROR_LOG("%s is too small to be a record file", argv[optind]);
+		exit(EINVAL);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		ERROR_LOG("mmap failed: %s", strerror(errno));
+		exit(errno);
+	}
+
+	if (hdr->magic != MSK_RECORD_MAGIC || hdr->version != MSK_RECORD_VERSION
+	    || hdr->sample_size != sizeof(struct msk_record_sample) || !hdr->capacity
+	    || hdr->hdr_size + (uint64_t)hdr->capacity * hdr->sample_size > st.st_size) {
+		ERROR_LOG("%s: not a record file or version mismatch", argv[optind]);
+		exit(EINVAL);
+	}
+
+	// copy what's there now, the recorder may go on meanwhile
+	head = hdr->head;
+	count = head < hdr->capacity ? head : hdr->capacity;
+	first = head - count;
+	TEST_NZ(samples = malloc((count ? count : 1) * sizeof(struct msk_record_sample)));
+	for (i = 0; i < count; i++)
+		samples[i] = ((struct msk_record_sample *)((uint8_t *)hdr + hdr->hdr_size))[(first + i) % hdr->capacity];
+	// and drop the oldest ones it may have overwritten while we copied
+	if (hdr->head - head > hdr->capacity - count) {
+		i = hdr->head - head - (hdr->capacity - count);
+		if (i > count)
+			i = count;
+		memmove(samples, samples + i, (count - i) * sizeof(struct msk_record_sample));
+		count -= i;
+		first += i;
+	}
+
+	if (csv) {
+		printf("nsec,trans,tx_bytes_s,rx_bytes_s,tx_pkt_s,rx_pkt_s,errors_s,period_us,wctx_pending,rctx_pending,worker_queue_depth,state\n");
+		for (i = 0; i < count; i++) {
+			sample = &samples[i];
+			if (filter && sample->trans != filter)
+				continue;
+			printf("%"PRIu64",0x%"PRIx64",%"PRIu64",%"PRIu64",%u,%u,%u,%u,%u,%u,%u,%s\n",
+			       sample->nsec, sample->trans, sample->tx_bytes, sample->rx_bytes,
+			       sample->tx_pkt, sample->rx_pkt, sample->errors, sample->period_us,
+			       sample->wctx_pending, sample->rctx_pending, sample->worker_queue_depth,
+			       sample->state <= MSK_ERROR ? state_str[sample->state] : "?");
+		}
+		goto out;
+	}
+
+	printf("pid %u, %u ms period, %"PRIu64" samples (%"PRIu64" overwritten)\n",
+	       hdr->pid, hdr->period_ms, count, first);
+
+	TEST_NZ(done = malloc((count ? count : 1) * sizeof(uint64_t)));
+
+	// one block per transport, in the order they first show up
+	for (i = 0; i < count; i++) {
+		uint64_t trans = samples[i].trans;
+		uint64_t k;
+
+		if (filter && trans != filter)
+			continue;
+		for (j = 0, seen = 0; j < ndone && !seen; j++)
+			seen = done[j] == trans;
+		if (seen)
+			continue;
+		done[ndone++] = trans;
+
+		for (k = i, max = 0; k < count; k++)
+			if (samples[k].trans == trans && samples[k].tx_bytes + samples[k].rx_bytes > max)
+				max = samples[k].tx_bytes + samples[k].rx_bytes;
+
+		printf("\ntrans 0x%"PRIx64", peak %.3f MB/s\n", trans, max / 1000000.0);
+		printf("%-12s %10s %10s %10s %10s %8s %6s %6s %6s  %s\n", "time", "tx MB/s", "rx MB/s",
+		       "tx msg/s", "rx msg/s", "err/s", "wctx", "rctx", "workq", "throughput");
+		for (k = i; k < count; k++) {
+			sample = &samples[k];
+			if (sample->trans != trans)
+				continue;
+			print_time(sample->nsec);
+			printf(" %10.3f %10.3f %10u %10u %8u %6u %6u %6u  ",
+			       sample->tx_bytes / 1000000.0, sample->rx_bytes / 1000000.0,
+			       sample->tx_pkt, sample->rx_pkt, sample->errors,
+			       sample->wctx_pending, sample->rctx_pending, sample->worker_queue_depth);
+			print_bar(sample->tx_bytes + sample->rx_bytes, max, width);
+		}
+	}
+
+out:
+	free(done);
+	free(samples);
+	munmap(hdr, st.st_size);
+
+	return 0;
+}
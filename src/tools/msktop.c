@@ -0,0 +1,232 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   msktop.c
+ * \brief  busiest connections of a process publishing its stats_shm region
+ *
+ * Maps the region read-only, takes two snapshots -i seconds apart and
+ * prints the -n transports that moved the most bytes in between.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <unistd.h>	//sleep
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>	//O_RDONLY
+#include <sys/mman.h>	//shm_open
+#include <sys/stat.h>	//fstat
+#include <inttypes.h> // PRIu64
+
+#include "mooshika.h"
+#include "../utils.h"
+
+#define DEFAULT_TOP 10
+#define DEFAULT_INTERVAL 1
+
+struct sample {
+	uint64_t id;
+	struct msk_stats_shm_entry entry;
+	int active;		/**< was there for the whole interval */
+	/* over the last interval */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t tx_pkt;
+	uint64_t rx_pkt;
+};
+
+static const char *state_str[] = { "init", "listening", "addr_resolved", "route_resolved",
+	"connect_request", "connected", "closing", "closed", "error" };
+
+static void print_help(char **argv) {
+	printf("Usage: %s [-n top] [-i interval] [-c count] name\n", argv[0]);
+	printf("	name: stats_shm region, as given to the transports' attr\n"
+		"	-n, --top n: connections to show (default %d)\n"
+		"	-i, --interval s: seconds between snapshots (default %d)\n"
+		"	-c, --count n: refreshes before exiting, 0 for forever (default 1)\n",
+		DEFAULT_TOP, DEFAULT_INTERVAL);
+}
+
+static void snapshot(struct msk_stats_shm_hdr *hdr, struct sample *samples, uint32_t entries) {
+	uint32_t i, used = hdr->used;
+
+	memset(samples, 0, entries * sizeof(struct sample));
+	for (i = 0; i < used && i < entries; i++)
+		if (msk_stats_shm_read(hdr, i, &samples[i].entry) == 0)
+			samples[i].id = samples[i].entry.id;
+}
+
+static int cmp_bytes(const void *a, const void *b) {
+	const struct sample *sa = a, *sb = b;
+	uint64_t bytes_a = sa->tx_bytes + sa->rx_bytes;
+	uint64_t bytes_b = sb->tx_bytes + sb->rx_bytes;
+	uint64_t pkt_a = sa->tx_pkt + sa->rx_pkt;
+	uint64_t pkt_b = sb->tx_pkt + sb->rx_pkt;
+
+	if (sa->active != sb->active)
+		return sb->active - sa->active;
+	if (bytes_a != bytes_b)
+		return bytes_a < bytes_b ? 1 : -1;
+	if (pkt_a != pkt_b)
+		return pkt_a < pkt_b ? 1 : -1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct msk_stats_shm_hdr *hdr;
+	struct sample *prev, *cur, *top;
+	struct msk_stats *s, *p;
+	struct stat st;
+	uint32_t entries, i;
+	int count = 1, interval = DEFAULT_INTERVAL, ntop = DEFAULT_TOP;
+	int fd, n, loop, active;
+
+	static struct option long_options[] = {
+		{ "top",	required_argument,	0,		'n' },
+		{ "interval",	required_argument,	0,		'i' },
+		{ "count",	required_argument,	0,		'c' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@hn:i:c:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'n':
+				ntop = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'c':
+				count = atoi(optarg);
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (optind != argc - 1 || ntop <= 0 || interval <= 0) {
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	fd = shm_open(argv[optind], O_RDONLY, 0);
+	if (fd == -1) {
+		ERROR_LOG("shm_open %s failed: %s", argv[optind], strerror(errno));
+		exit(errno);
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct msk_stats_shm_hdr)) {
+		ERROR_LOG("%s is too small to be a stats region", argv[optind]);
+		exit(EINVAL);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		ERROR_LOG("mmap failed: %s", strerror(errno));
+		exit(errno);
+	}
+
+	if (hdr->magic != MSK_STATS_SHM_MAGIC || hdr->version != MSK_STATS_SHM_VERSION
+	    || hdr->entry_size < sizeof(struct msk_stats_shm_entry)) {
+		ERROR_LOG("%s: not a stats region or version mismatch (%u, expected %u)",
+			  argv[optind], hdr->version, MSK_STATS_SHM_VERSION);
+		exit(EINVAL);
+	}
+
+	// the region doesn't grow, but don't trust it to fit the file
+	entries = hdr->entries;
+	if (hdr->hdr_size + (uint64_t)entries * hdr->entry_size > st.st_size)
+		entries = (st.st_size - hdr->hdr_size) / hdr->entry_size;
+
+	TEST_NZ(prev = malloc(entries * sizeof(struct sample)));
+	TEST_NZ(cur = malloc(entries * sizeof(struct sample)));
+
+	snapshot(hdr, prev, entries);
+	for (loop = 0; count == 0 || loop < count; loop++) {
+		sleep(interval);
+		snapshot(hdr, cur, entries);
+
+		// only keep transports that were there for the whole interval
+		for (i = 0, active = 0; i < entries; i++) {
+			if (!cur[i].id || cur[i].id != prev[i].id)
+				continue;
+			s = &cur[i].entry.stats;
+			p = &prev[i].entry.stats;
+			cur[i].tx_bytes = s->tx_bytes - p->tx_bytes;
+			cur[i].rx_bytes = s->rx_bytes - p->rx_bytes;
+			cur[i].tx_pkt = s->tx_pkt - p->tx_pkt;
+			cur[i].rx_pkt = s->rx_pkt - p->rx_pkt;
+			cur[i].active = 1;
+			active++;
+		}
+
+		TEST_NZ(top = malloc(entries * sizeof(struct sample)));
+		memcpy(top, cur, entries * sizeof(struct sample));
+		qsort(top, entries, sizeof(struct sample), cmp_bytes);
+
+		printf("pid %u, %d transports, refreshed every %u ms\n", hdr->pid, active, hdr->period_ms);
+		printf("%-18s %-12s %-24s %12s %12s %10s %10s %8s\n",
+		       "trans", "state", "peer", "tx kB/s", "rx kB/s", "tx pkt/s", "rx pkt/s", "errors");
+		for (n = 0; n < ntop && n < active; n++) {
+			s = &top[n].entry.stats;
+			printf("0x%-16"PRIx64" %-12s %-24s %12"PRIu64" %12"PRIu64" %10"PRIu64" %10"PRIu64" %8"PRIu64"\n",
+			       top[n].id,
+			       top[n].entry.state >= 0 && top[n].entry.state <= MSK_ERROR ? state_str[top[n].entry.state] : "?",
+			       top[n].entry.peer[0] ? top[n].entry.peer : "-",
+			       top[n].tx_bytes / 1024 / interval,
+			       top[n].rx_bytes / 1024 / interval,
+			       top[n].tx_pkt / interval,
+			       top[n].rx_pkt / interval,
+			       s->tx_err + s->rx_err);
+		}
+		printf("\n");
+		free(top);
+
+		memcpy(prev, cur, entries * sizeof(struct sample));
+	}
+
+	free(prev);
+	free(cur);
+	munmap(hdr, st.st_size);
+
+	return 0;
+}
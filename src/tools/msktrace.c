@@ -0,0 +1,226 @@
+/*
+ *
+ * Copyright CEA/DAM/DIF (2012)
+ * contributor : Dominique Martinet  dominique.martinet@cea.fr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * ---------------------------------------
+ */
+
+/**
+ * \file   msktrace.c
+ * \brief  decodes a msk_trace_dump file
+ *
+ * Merges every thread's ring in time order and prints one line per
+ * record. Completions and callbacks get the time since the post of the
+ * same context, when that post is still in the trace.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memset
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h> // PRIu64
+
+#include "mooshika.h"
+#include "../utils.h"
+
+struct record {
+	uint32_t tid;
+	struct msk_trace_rec rec;
+};
+
+/* ctx -> time of its last post, open addressing */
+struct post {
+	uint64_t ctx;
+	uint64_t nsec;
+};
+
+static const char *event_str[] = { "?", "post_send", "post_recv", "completion", "callback" };
+
+static void print_help(char **argv) {
+	printf("Usage: %s [-t trans] file\n", argv[0]);
+	printf("	file: written by msk_trace_dump (e.g. rcat -T)\n"
+		"	-t, --trans addr: only records of that transport (hex)\n");
+}
+
+static const char *opcode_str(const struct msk_trace_rec *rec) {
+	static char buf[16];
+
+	if (rec->event == MSK_TRACE_POST_RECV)
+		return "-";
+
+	// posts have an ibv_wr_opcode, the rest an ibv_wc_opcode
+	if (rec->event == MSK_TRACE_POST_SEND) {
+		switch (rec->opcode) {
+			case IBV_WR_RDMA_WRITE: return "rdma_write";
+			case IBV_WR_RDMA_WRITE_WITH_IMM: return "rdma_write_imm";
+			case IBV_WR_SEND: return "send";
+			case IBV_WR_SEND_WITH_IMM: return "send_imm";
+			case IBV_WR_RDMA_READ: return "rdma_read";
+		}
+	} else {
+		switch (rec->opcode) {
+			case IBV_WC_SEND: return "send";
+			case IBV_WC_RDMA_WRITE: return "rdma_write";
+			case IBV_WC_RDMA_READ: return "rdma_read";
+			case IBV_WC_RECV: return "recv";
+			case IBV_WC_RECV_RDMA_WITH_IMM: return "recv_imm";
+		}
+	}
+	snprintf(buf, sizeof(buf), "%u", rec->opcode);
+	return buf;
+}
+
+static int cmp_nsec(const void *a, const void *b) {
+	const struct record *ra = a, *rb = b;
+
+	if (ra->rec.nsec != rb->rec.nsec)
+		return ra->rec.nsec < rb->rec.nsec ? -1 : 1;
+	return 0;
+}
+
+static struct post *post_find(struct post *posts, uint32_t mask, uint64_t ctx) {
+	uint32_t i = (ctx >> 4) * 2654435761U & mask;
+
+	while (posts[i].ctx && posts[i].ctx != ctx)
+		i = (i + 1) & mask;
+	return &posts[i];
+}
+
+int main(int argc, char **argv) {
+	struct msk_trace_file_hdr hdr;
+	struct msk_trace_ring_hdr rhdr;
+	struct record *records = NULL;
+	struct post *posts, *post;
+	uint64_t filter = 0, total = 0, lost = 0, first;
+	uint32_t i, j, mask;
+	FILE *f;
+
+	static struct option long_options[] = {
+		{ "trans",	required_argument,	0,		't' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+	while ((op = getopt_long(argc, argv, "@ht:", long_options, &option_index)) != -1) {
+		switch(op) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 't':
+				filter = strtoull(optarg, NULL, 16);
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		ERROR_LOG("Couldn't open %s: %s", argv[optind], strerror(errno));
+		exit(errno);
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != MSK_TRACE_MAGIC
+	    || hdr.version != MSK_TRACE_VERSION || hdr.rec_size != sizeof(struct msk_trace_rec)) {
+		ERROR_LOG("%s: not a trace file or version mismatch", argv[optind]);
+		exit(EINVAL);
+	}
+
+	for (i = 0; i < hdr.nrings; i++) {
+		if (fread(&rhdr, sizeof(rhdr), 1, f) != 1) {
+			ERROR_LOG("%s: truncated after %u rings", argv[optind], i);
+			break;
+		}
+		if (rhdr.count)
+			TEST_NZ(records = realloc(records, (total + rhdr.count) * sizeof(struct record)));
+		for (j = 0; j < rhdr.count; j++) {
+			if (fread(&records[total].rec, sizeof(struct msk_trace_rec), 1, f) != 1)
+				break;
+			records[total].tid = rhdr.tid;
+			if (!filter || records[total].rec.trans == filter)
+				total++;
+		}
+		lost += rhdr.lost;
+	}
+	fclose(f);
+
+	if (!total) {
+		printf("no records, %"PRIu64" lost\n", lost);
+		return 0;
+	}
+
+	qsort(records, total, sizeof(struct record), cmp_nsec);
+
+	for (mask = 1; mask < 2 * total; mask *= 2);
+	TEST_NZ(posts = calloc(mask, sizeof(struct post)));
+	mask--;
+
+	printf("%u rings, %"PRIu64" records, %"PRIu64" lost to ring wraps\n", hdr.nrings, total, lost);
+	printf("%14s %8s %-18s %-18s %-10s %-14s %-20s %10s %10s\n",
+	       "usec", "tid", "trans", "ctx", "event", "opcode", "status", "size", "lat usec");
+
+	first = records[0].rec.nsec;
+	for (i = 0; i < total; i++) {
+		struct msk_trace_rec *rec = &records[i].rec;
+
+		post = post_find(posts, mask, rec->ctx);
+		printf("%14.3f %8u 0x%-16"PRIx64" 0x%-16"PRIx64" %-10s %-14s %-20s %10u ",
+		       (rec->nsec - first) / 1000.0, records[i].tid, rec->trans, rec->ctx,
+		       rec->event < sizeof(event_str) / sizeof(*event_str) ? event_str[rec->event] : "?",
+		       opcode_str(rec),
+		       rec->event == MSK_TRACE_COMPLETION || rec->event == MSK_TRACE_CALLBACK
+				? ibv_wc_status_str(rec->status) : "-",
+		       rec->size);
+
+		if (rec->event == MSK_TRACE_POST_SEND || rec->event == MSK_TRACE_POST_RECV) {
+			post->ctx = rec->ctx;
+			post->nsec = rec->nsec;
+			printf("%10s\n", "-");
+		} else if (post->ctx) {
+			printf("%10.3f\n", (rec->nsec - post->nsec) / 1000.0);
+		} else {
+			printf("%10s\n", "-");
+		}
+	}
+
+	free(posts);
+	free(records);
+
+	return 0;
+}
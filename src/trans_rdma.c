@@ -35,6 +35,8 @@
 
 #include <stdio.h>	//printf
 #include <stdlib.h>	//malloc
+#include <stdarg.h>	//va_list
+#include <stddef.h>	//offsetof
 #include <string.h>	//memcpy
 #include <limits.h>	//INT_MAX
 #include <inttypes.h>	//uint*_t
@@ -50,9 +52,16 @@
 #include <fcntl.h>	//fcntl
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>	//shm_open
+#include <sys/stat.h>	//fstat
+#include <signal.h>	//kill
+#include <sys/syscall.h>	//SYS_gettid
+#include <dlfcn.h>	//dladdr
 
 #define EPOLL_MAX_EVENTS 16
+#define MSK_CM_DRAIN_MAX 64	/**< events taken from the shared cm channel per wakeup */
 #define NUM_WQ_PER_POLL 16
+#define MSK_STATS_SHM_PERIOD_MS 1000	/**< stats_shm region refresh period */
 
 #include <rdma/rdma_cma.h>
 #include <netdb.h> /* gai_strerror() */
@@ -70,6 +79,15 @@
 #  define VALGRIND_MAKE_MEM_DEFINED(addr, len)
 #endif
 
+/* static tracepoints for perf/bpftrace (provider mooshika), a nop each when not attached */
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define MSK_PROBE(name, args...) STAP_PROBEV(mooshika, name, ##args)
+#else
+static inline void msk_probe_nop(int unused, ...) { }
+#  define MSK_PROBE(name, args...) do { if (0) msk_probe_nop(0, ##args); } while (0)
+#endif
+
 /**
  * \struct msk_ctx
  * Context data we can use during recv/send callbacks
@@ -84,6 +102,12 @@ struct msk_ctx {
 	ctx_callback_t callback;
 	ctx_callback_t err_callback;
 	void *callback_arg;
+	uint64_t post_nsec;		/**< send contexts with stuck_ms: coarse time taken, 0 once reported */
+	int deadline_state;		/**< enum msk_deadline_state */
+	uint64_t deadline;		/**< wheel tick (ms) err_callback is due at */
+	struct msk_trans *trans;	/**< owner, for the wheel */
+	struct msk_ctx *timer_next;	/**< wheel slot list */
+	struct msk_ctx **timer_pprev;
 	union {
 		struct ibv_recv_wr rwr;
 		struct ibv_send_wr wwr;
@@ -91,6 +115,116 @@ struct msk_ctx {
 	struct ibv_sge sg_list[0]; 		/**< this is actually an array. note that when you malloc you have to add its size */
 };
 
+/**
+ * \struct msk_srq
+ * per-device shared receive queue state, the ibv_srq's srq_context
+ */
+struct msk_srq {
+	pthread_mutex_t lock;		/**< protects everything but posted and the counters */
+	struct msk_pd *pd;		/**< slot the srq belongs to, pd->rctx follows rctx */
+	struct ibv_srq *srq;
+	struct msk_ctx *rctx;		/**< current context array */
+	uint32_t depth;			/**< rctx entries, same as the srq max_wr */
+	uint32_t max_depth;		/**< how far depth can grow */
+	uint32_t limit;			/**< low watermark, 0 if the limit event isn't used */
+	uint32_t posted;		/**< receives on the srq */
+	int max_recv_sge;
+	int debug;
+	struct msk_ctx **old;		/**< arrays replaced when growing, receives may still be posted there */
+	int old_count;
+	msk_data_t **pool;		/**< buffers waiting to be posted, see msk_srq_add_buffers */
+	int pool_count;
+	int pool_size;
+	ctx_callback_t callback;	/**< callbacks of the pool's receives */
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	uint64_t limit_events;
+	uint64_t grow;
+	uint64_t starved;		/**< limit events with nothing left to post */
+	uint64_t wait;			/**< posters that had to sleep */
+	uint64_t nsec_wait;
+};
+
+#define MSK_STATS_SLOTS 8
+
+/**
+ * \struct msk_stats_slot
+ * data path counters, threads each stick to one slot of the transport's
+ * array so they don't share cache lines, msk_get_stats sums them up
+ */
+struct msk_stats_slot {
+	uint64_t op_pkt[MSK_OP_COUNT];
+	uint64_t op_bytes[MSK_OP_COUNT];
+	uint64_t op_err[MSK_OP_COUNT];
+	uint64_t wc_err[MSK_WC_STATUS_COUNT];
+	uint64_t nsec_callback;
+	uint64_t nsec_compevent;
+	uint64_t sq_wait;
+	uint64_t nsec_sq_wait;
+	uint64_t rq_wait;
+	uint64_t nsec_rq_wait;
+	uint64_t worker_block;
+	uint64_t nsec_worker_block;
+} __attribute__ ((aligned(64)));
+
+/**
+ * \struct msk_trace_ring
+ * trace records of one thread, only that thread writes it
+ */
+struct msk_trace_ring {
+	struct msk_trace_ring *next;	/**< all rings, under the global lock */
+	uint32_t tid;
+	uint32_t size;			/**< power of two */
+	uint64_t head;			/**< records ever written */
+	struct msk_trace_rec recs[0];
+};
+
+/** a transport's counters at the recorder's last sample */
+struct msk_record_prev {
+	uint64_t nsec;			/**< CLOCK_MONOTONIC, 0 until the first sample */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t tx_pkt;
+	uint64_t rx_pkt;
+	uint64_t errors;
+};
+
+#define MSK_PROFILE_SLOTS 256	/**< distinct callbacks the profiler tells apart */
+
+/** callback profiler entry, see msk_profile_start */
+struct msk_profile_slot {
+	void *callback;			/**< claimed with a compare and swap, never cleared while profiling */
+	uint64_t calls;
+	uint64_t nsec_total;
+	uint64_t nsec_max;
+};
+
+#define MSK_WHEEL_BITS 6
+#define MSK_WHEEL_SLOTS (1 << MSK_WHEEL_BITS)
+#define MSK_WHEEL_MASK (MSK_WHEEL_SLOTS - 1)
+#define MSK_WHEEL_LEVELS 4		/**< 1ms ticks, deadlines up to 2^24 ms away before they get another round */
+
+enum msk_deadline_state {
+	MSK_DEADLINE_NONE = 0,
+	MSK_DEADLINE_ARMED,		/**< in the wheel */
+	MSK_DEADLINE_FIRED,		/**< expired, cq thread is calling err_callback */
+	MSK_DEADLINE_DONE,		/**< err_callback returned, the completion only gives the context back */
+	MSK_DEADLINE_COMPLETED,		/**< completion came during err_callback, the cq thread gives it back */
+};
+
+/**
+ * \struct msk_wheel
+ * hierarchical timer wheel of post deadlines, advanced by the cq thread.
+ * Level l slot i holds contexts due in the 64^l ms ending with i.
+ */
+struct msk_wheel {
+	uint64_t tick;			/**< ms, everything due up to it has expired */
+	uint32_t count;			/**< armed contexts */
+	int efd;			/**< wakes the cq thread up when the first one is armed */
+	int epollfd;			/**< cq_epollfd efd was added to, -1 if none */
+	struct msk_ctx *slots[MSK_WHEEL_LEVELS][MSK_WHEEL_SLOTS];
+};
+
 struct msk_worker_data {
 	struct msk_trans *trans;
 	struct msk_ctx *ctx;
@@ -118,8 +252,59 @@ struct worker_pool {
 	int m_tail;
 	int m_count;
 	int m_efd;
+	uint32_t depth;			/**< entries queued and not picked up yet */
+	uint32_t peak;
+	int started;			/**< workers spawned, names them */
+};
+
+#define MSK_DEV_HASH_SIZE 16
+
+/** device registry entry, index is the device's slot in pd arrays */
+struct msk_dev {
+	struct msk_dev *next;		/**< hash chain */
+	struct ibv_context *context;
+	uint64_t guid;			/**< node guid, host order */
+	int index;
+	int async_epollfd;		/**< cm_epollfd the async fd was added to, -1 if none */
+};
+
+/** resolved addresses and path of a (node, port, port space), see msk_resolve_addr */
+struct msk_route_entry {
+	struct msk_route_entry *next;
+	char *node;
+	char *port;
+	enum rdma_port_space ps;
+	time_t expire;			/**< CLOCK_MONOTONIC seconds */
+	int has_src;
+	struct sockaddr_storage src;
+	struct sockaddr_storage dst;
+	int has_path;			/**< only for infiniband links */
+	struct ibv_path_data path;
+};
+
+enum msk_thread_state {
+	MSK_THREAD_IDLE,
+	MSK_THREAD_POLL,
+	MSK_THREAD_CALLBACK,
+	MSK_THREAD_STATES,
+};
+
+/** cpu and wall time of one of our threads, see msk_get_thread_stats */
+struct msk_thread_acct {
+	struct msk_thread_acct *next;
+	char name[MSK_THREAD_NAME_LEN];
+	uint32_t tid;
+	int running;			/**< cpu_clock is valid, under threads_lock */
+	clockid_t cpu_clock;		/**< pthread_getcpuclockid, readable from other threads */
+	uint64_t cpu_base;		/**< cpu time of previous threads of that name */
+	enum msk_thread_state state;
+	uint64_t mark;			/**< CLOCK_MONOTONIC when state was entered */
+	uint64_t nsec[MSK_THREAD_STATES];	/**< only written by the thread itself */
 };
 
+#define MSK_RESVPORT_COUNT (MSK_MAX_RESVPORT - MSK_MIN_RESVPORT + 1)
+#define MSK_RESVPORT_WORDS ((MSK_RESVPORT_COUNT + 63) / 64)
+
 struct msk_global_state {
 	pthread_mutex_t lock;
 	int debug;
@@ -131,6 +316,47 @@ struct msk_global_state {
 	int cq_epollfd;
 	int stats_epollfd;
 	struct worker_pool worker_pool;
+	struct ibv_context **dev_list;	/**< from rdma_get_devices, kept open for the process */
+	struct msk_dev *devs;		/**< registry, indexed by device index */
+	int dev_count;
+	struct msk_dev *dev_hash[MSK_DEV_HASH_SIZE];
+	pthread_mutex_t route_lock;
+	struct msk_route_entry *route_cache;
+	pthread_mutex_t wheel_lock;
+	struct msk_wheel wheel;		/**< post deadlines, under wheel_lock */
+	pthread_mutex_t stuck_lock;
+	struct msk_trans *stuck_trans;	/**< transports with stuck_ms, under stuck_lock */
+	uint32_t stuck_scan_ms;		/**< half the smallest stuck_ms seen */
+	uint64_t stuck_scan_nsec;	/**< last msk_stuck_scan */
+	uint64_t resvport_map[MSK_RESVPORT_WORDS];	/**< reserved ports bound by our transports, under lock */
+	int resvport_next;
+	struct msk_warm_pool *warm_pools;	/**< listeners' warm pools, under lock */
+	int warm_low;			/**< some warm pool needs refilling */
+	struct rdma_event_channel *cm_channel;	/**< shared by shared_cm transports, kept for the process */
+	int cm_channel_epollfd;		/**< cm_epollfd the shared channel was added to, -1 if none */
+	pthread_mutex_t stats_shm_lock;
+	struct msk_stats_shm_hdr *stats_shm;	/**< published counters, kept for the process */
+	size_t stats_shm_len;
+	char *stats_shm_name;
+	struct msk_trans **stats_shm_trans;	/**< transport of each entry, under stats_shm_lock */
+	uint32_t stats_shm_next;	/**< where to look for a free entry */
+	int trace_on;			/**< see msk_trace_start */
+	uint32_t trace_size;		/**< records per ring for new rings */
+	struct msk_trace_ring *trace_rings;	/**< every thread's ring, under lock, kept for the process */
+	pthread_mutex_t connect_lock;	/**< not lock, the cm thread takes it */
+	struct msk_trans *connecting;	/**< msk_connect_async in progress, under connect_lock */
+	pthread_mutex_t threads_lock;	/**< not lock, threads are joined under it */
+	struct msk_thread_acct *threads;	/**< under threads_lock, kept for the process */
+	pthread_mutex_t record_lock;	/**< not lock, the recorder is joined without it */
+	pthread_cond_t record_cond;	/**< CLOCK_MONOTONIC, wakes the recorder up to stop */
+	struct msk_trans *record_trans;	/**< transports that got connected, under record_lock */
+	struct msk_record_hdr *record;	/**< mapped msk_record_start file, under record_lock */
+	size_t record_len;
+	uint32_t record_period_ms;
+	int record_run;
+	pthread_t record_thread;
+	int profile_on;			/**< see msk_profile_start */
+	struct msk_profile_slot profile[MSK_PROFILE_SLOTS];
 };
 
 static int msk_cq_event_handler(struct msk_trans *trans);
@@ -139,7 +365,21 @@ static int msk_cq_event_handler(struct msk_trans *trans);
 
 static struct msk_global_state *msk_global_state = NULL;
 
+/* stats slot of the current thread, -1 until it first counts something */
+static __thread int msk_stats_tid = -1;
+static unsigned int msk_stats_next_tid = 0;
+
+/* trace ring of the current thread, allocated with its first record */
+static __thread struct msk_trace_ring *msk_trace_ring = NULL;
+
+/* time accounting of the current thread, only set in our own threads */
+static __thread struct msk_thread_acct *msk_thread_acct = NULL;
+/** the running callback is the library's, see msk_profile_skip */
+static __thread int msk_profile_lib = 0;
+
 void __attribute__ ((constructor)) msk_internals_init(void) {
+	pthread_condattr_t condattr;
+
 	msk_global_state = malloc(sizeof(*msk_global_state));
 	if (!msk_global_state)
 		ERROR_LOG("Out of memory");
@@ -147,13 +387,33 @@ void __attribute__ ((constructor)) msk_internals_init(void) {
 	memset(msk_global_state, 0, sizeof(*msk_global_state));
 
 	msk_global_state->run_threads = 0;
-	if (pthread_mutex_init(&msk_global_state->lock, NULL))
+	msk_global_state->cm_channel_epollfd = -1;
+	msk_global_state->wheel.efd = -1;
+	msk_global_state->wheel.epollfd = -1;
+	// don't have all processes start on the same port
+	msk_global_state->resvport_next = getpid() % MSK_RESVPORT_COUNT;
+	if (pthread_mutex_init(&msk_global_state->lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->route_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->stuck_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->wheel_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->stats_shm_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->connect_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->threads_lock, NULL)
+	    || pthread_mutex_init(&msk_global_state->record_lock, NULL))
 		ERROR_LOG("pthread_mutex_init failed?!");
+
+	if (pthread_condattr_init(&condattr)
+	    || pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC)
+	    || pthread_cond_init(&msk_global_state->record_cond, &condattr))
+		ERROR_LOG("pthread_cond_init failed?!");
+	pthread_condattr_destroy(&condattr);
 }
 
 void __attribute__ ((destructor)) msk_internals_fini(void) {
 
 	if (msk_global_state) {
+		msk_record_stop();
+
 		pthread_mutex_lock(&msk_global_state->lock);
 		msk_global_state->run_threads = 0;
 		pthread_mutex_unlock(&msk_global_state->lock);
@@ -171,6 +431,51 @@ void __attribute__ ((destructor)) msk_internals_fini(void) {
 			msk_global_state->stats_thread = 0;
 		}
 
+		if (msk_global_state->cm_channel)
+			rdma_destroy_event_channel(msk_global_state->cm_channel);
+
+		if (msk_global_state->dev_list)
+			rdma_free_devices(msk_global_state->dev_list);
+		free(msk_global_state->devs);
+
+		while (msk_global_state->route_cache) {
+			struct msk_route_entry *entry = msk_global_state->route_cache;
+			msk_global_state->route_cache = entry->next;
+			free(entry->node);
+			free(entry->port);
+			free(entry);
+		}
+		pthread_mutex_destroy(&msk_global_state->route_lock);
+		pthread_mutex_destroy(&msk_global_state->stuck_lock);
+
+		if (msk_global_state->wheel.efd != -1)
+			close(msk_global_state->wheel.efd);
+		pthread_mutex_destroy(&msk_global_state->wheel_lock);
+
+		if (msk_global_state->stats_shm) {
+			munmap(msk_global_state->stats_shm, msk_global_state->stats_shm_len);
+			shm_unlink(msk_global_state->stats_shm_name);
+			free(msk_global_state->stats_shm_name);
+			free(msk_global_state->stats_shm_trans);
+		}
+		pthread_mutex_destroy(&msk_global_state->stats_shm_lock);
+
+		while (msk_global_state->trace_rings) {
+			struct msk_trace_ring *ring = msk_global_state->trace_rings;
+			msk_global_state->trace_rings = ring->next;
+			free(ring);
+		}
+
+		while (msk_global_state->threads) {
+			struct msk_thread_acct *acct = msk_global_state->threads;
+			msk_global_state->threads = acct->next;
+			free(acct);
+		}
+		pthread_mutex_destroy(&msk_global_state->threads_lock);
+		pthread_mutex_destroy(&msk_global_state->connect_lock);
+		pthread_cond_destroy(&msk_global_state->record_cond);
+		pthread_mutex_destroy(&msk_global_state->record_lock);
+
 		pthread_mutex_destroy(&msk_global_state->lock);
 		free(msk_global_state);
 		msk_global_state = NULL;
@@ -180,6 +485,30 @@ void __attribute__ ((destructor)) msk_internals_fini(void) {
 /* forward declarations */
 
 static void *msk_cq_thread(void *arg);
+static int msk_msg_setup(struct msk_trans *trans);
+static void msk_msg_connected(struct msk_trans *trans);
+static void msk_msg_flush(struct msk_trans *trans);
+static void msk_msg_destroy(struct msk_trans *trans);
+static int msk_mw_setup(struct msk_trans *trans);
+static void msk_mw_destroy(struct msk_trans *trans);
+static void msk_mw_completion(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status);
+static void msk_mw_remote_inv(struct msk_trans *trans, uint32_t rkey);
+static struct rdma_cm_id *msk_pop_conn_request(struct msk_trans *trans);
+static void msk_connect_async_event(struct msk_trans *trans, struct rdma_cm_event *event);
+static void msk_connect_async_expire(void);
+static void msk_connect_async_del(struct msk_trans *trans);
+static void msk_route_cache_put_path(struct msk_trans *trans);
+static void msk_route_cache_invalidate(struct msk_trans *trans);
+static void msk_resvport_put(int port);
+static void msk_warm_refill_all(void);
+static void msk_warm_destroy(struct msk_trans *trans);
+static void msk_stripe_pending_drop(struct msk_trans *listener);
+static void msk_async_event(struct msk_dev *dev);
+static int msk_ud_sidr_reply(struct msk_trans *trans, struct rdma_cm_id *cm_id);
+static int msk_signal_worker(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status, enum ibv_wc_opcode opcode);
+static void msk_ud_destroy(struct msk_trans *trans);
+static void msk_srq_free(struct msk_srq *srq);
+static int msk_srq_post(struct msk_srq *srq, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg, int wait);
 
 
 /* UTILITY FUNCTIONS */
@@ -214,67 +543,193 @@ static inline int msk_cond_timedwait(int debug,
 }
 
 
+/* DEVICE REGISTRY */
+
+/**
+ * msk_dev_hash: bucket for a device guid
+ */
+static inline unsigned int msk_dev_hash(uint64_t guid) {
+	return (unsigned int)((guid ^ (guid >> 24) ^ (guid >> 48)) & (MSK_DEV_HASH_SIZE-1));
+}
+
+/**
+ * msk_dev_registry_init: builds the device registry from rdma_get_devices.
+ * Devices are given a fixed index in list order, which is the index used
+ * in every trans->pd array and msk_mr_set.
+ * Called once, lazily.
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_dev_registry_init(void) {
+	struct ibv_context **list;
+	struct msk_dev *devs;
+	int i, n, ret = 0;
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	do {
+		if (msk_global_state->dev_count)
+			break;
+
+		list = rdma_get_devices(&n);
+		if (!list) {
+			ret = errno ? errno : ENODEV;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "rdma_get_devices: %s (%d)", strerror(ret), ret);
+			break;
+		}
+		if (n <= 0) {
+			rdma_free_devices(list);
+			ret = ENODEV;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "no rdma device found");
+			break;
+		}
+
+		devs = malloc(n * sizeof(*devs));
+		if (!devs) {
+			rdma_free_devices(list);
+			ret = ENOMEM;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "couldn't malloc device registry (%d elems)", n);
+			break;
+		}
+		memset(msk_global_state->dev_hash, 0, sizeof(msk_global_state->dev_hash));
+		for (i = 0; i < n; i++) {
+			devs[i].context = list[i];
+			devs[i].guid = be64toh(ibv_get_device_guid(list[i]->device));
+			devs[i].index = i;
+			devs[i].async_epollfd = -1;
+			devs[i].next = msk_global_state->dev_hash[msk_dev_hash(devs[i].guid)];
+			msk_global_state->dev_hash[msk_dev_hash(devs[i].guid)] = &devs[i];
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_SETUP, "device %d: %s, guid %016"PRIx64,
+				 i, ibv_get_device_name(list[i]->device), devs[i].guid);
+		}
+		msk_global_state->dev_list = list;
+		msk_global_state->devs = devs;
+		/* dev_count is what lockless readers check, set it last */
+		atomic_store(&msk_global_state->dev_count, n);
+	} while (0);
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	return ret;
+}
+
+static inline int msk_dev_count(void) {
+	if (!msk_global_state->dev_count && msk_dev_registry_init())
+		return 0;
+
+	return msk_global_state->dev_count;
+}
+
+/**
+ * msk_dev_lookup: finds a device's registry entry from its guid
+ *
+ * @param guid [IN] node guid, host order
+ *
+ * @return the entry or NULL if unknown
+ */
+static struct msk_dev *msk_dev_lookup(uint64_t guid) {
+	struct msk_dev *dev;
+
+	if (!msk_dev_count())
+		return NULL;
+
+	for (dev = msk_global_state->dev_hash[msk_dev_hash(guid)]; dev; dev = dev->next) {
+		if (dev->guid == guid)
+			return dev;
+	}
+
+	return NULL;
+}
+
+/**
+ * msk_dev_index: registry index of a verbs context
+ *
+ * @param context [IN]
+ *
+ * @return the index or -1 if the device isn't known
+ */
+static int msk_dev_index(struct ibv_context *context) {
+	struct msk_dev *dev;
+
+	if (!context)
+		return -1;
+
+	dev = msk_dev_lookup(be64toh(ibv_get_device_guid(context->device)));
+	if (!dev) {
+		INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "device %s not in registry (hotplugged?)",
+			 ibv_get_device_name(context->device));
+		return -1;
+	}
+
+	return dev->index;
+}
+
 /**
  * msk_getpd: helper function to get the right pd for a given trans
  *
+ * The pd array is indexed by device registry index, so this is a hash lookup
+ * on the device guid instead of a scan.
+ *
  * @param trans [IN] the connection handle
  *
- * @return NULL if nothing is available, next free pd if none fit, correct one if any match
+ * @return NULL if nothing is available, the pd slot for the trans' device otherwise
  */
 struct msk_pd *msk_getpd(struct msk_trans *trans) {
-	int i = 0;
+	struct msk_pd *pd;
+	int i;
 
-	if (!trans->pd)
+	if (!trans->pd || !trans->cm_id)
 		return NULL;
 
-	while (trans->pd[i].context != PD_GUARD) {
-		if (trans->pd[i].context == trans->cm_id->verbs) {
-			/* Got a match, woo. */
-			return &trans->pd[i];
-		}
+	i = msk_dev_index(trans->cm_id->verbs);
+	if (i < 0)
+		return NULL;
 
-		if (!trans->pd[i].context) {
-			/* Not found, but we have room. */
-			if (atomic_postinc(trans->pd[i].used) != 0
-			    || trans->pd[i].context != NULL) {
-				/* We got raced, try again */
-				atomic_dec(trans->pd[i].used);
-				continue;
-			} else {
-				trans->pd[i].context = trans->cm_id->verbs;
-				return &trans->pd[i];
-			}
-		}
-		i++;
+	pd = &trans->pd[i];
+	if (!pd->context)
+		atomic_bool_compare_and_swap(&pd->context, NULL, msk_global_state->devs[i].context);
+
+	return pd;
+}
+
+/**
+ * msk_alloc_pd: allocates the ibv pd of a slot if it doesn't have one yet
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_alloc_pd(struct msk_trans *trans, struct msk_pd *pd) {
+	struct ibv_pd *ibv_pd;
+	int ret;
+
+	if (pd->pd)
+		return 0;
+
+	ibv_pd = ibv_alloc_pd(pd->context);
+	if (!ibv_pd) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_alloc_pd failed: %s (%d)", strerror(ret), ret);
+		return ret;
 	}
 
-	/* No space left, too bad. */
-	return NULL;
+	/* someone else allocated it in the meantime */
+	if (!atomic_bool_compare_and_swap(&pd->pd, NULL, ibv_pd))
+		ibv_dealloc_pd(ibv_pd);
+
+	return 0;
 }
 
 
 /* Prepare for first child to allocate pd
  * Cases:
  *  - pd already provided in attr,
- *  - context already set (bound to one uverb)
- *  - need to prepare for all of them
+ *  - need to prepare for all of them, one slot per registry device
  */
 static int msk_setup_pd(struct msk_trans *trans) {
 	int ret;
-	struct ibv_device **devlist;
 
 	if (!trans->pd) {
-		if (trans->cm_id->verbs) {
-			ret = 1;
-		} else {
-			devlist = ibv_get_device_list(&ret);
-			if (!devlist) {
-				ret = errno;
-				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_get_device_list: %s (%d)", strerror(ret), ret);
-				return ret;
-			}
-			/* We only care about the number of devices */
-			ibv_free_device_list(devlist);
+		ret = msk_dev_count();
+		if (!ret) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "empty device registry");
+			return ENODEV;
 		}
 
 		++ret; /* for guard */
@@ -307,13 +762,109 @@ struct ibv_mr *msk_reg_mr(struct msk_trans *trans, void *memaddr, size_t size, i
 	struct msk_pd *pd = msk_getpd(trans);
 	if (!pd)
 		return NULL;
-	if (!pd->pd) {
-		pd->used = 0;
+	if (msk_alloc_pd(trans, pd))
 		return NULL;
-	}
 	return ibv_reg_mr(pd->pd, memaddr, size, access);
 }
 
+/**
+ * msk_reg_mr_all: registers memory on every device of the registry
+ *
+ * PDs are taken from (or allocated in) the trans' pd array, so any trans
+ * sharing that array can use the result with msk_mr_set_get.
+ *
+ * @param trans   [IN]
+ * @param memaddr [IN] the address to register
+ * @param size    [IN] the size of the area to register
+ * @param access  [IN] the access to grants to the mr
+ *
+ * @return the mr set or NULL on failure, errno is set
+ */
+struct msk_mr_set *msk_reg_mr_all(struct msk_trans *trans, void *memaddr, size_t size, int access) {
+	struct msk_mr_set *set;
+	struct msk_pd *pd;
+	int i, n, ret = 0;
+
+	if (!trans->pd && (ret = msk_setup_pd(trans))) {
+		errno = ret;
+		return NULL;
+	}
+
+	n = msk_dev_count();
+	set = malloc(sizeof(*set) + n * sizeof(struct ibv_mr *));
+	if (!set) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc mr set");
+		errno = ENOMEM;
+		return NULL;
+	}
+	set->count = n;
+	set->mr = (struct ibv_mr **)(set + 1);
+	memset(set->mr, 0, n * sizeof(struct ibv_mr *));
+
+	for (i = 0; i < n; i++) {
+		pd = &trans->pd[i];
+		if (!pd->context)
+			atomic_bool_compare_and_swap(&pd->context, NULL, msk_global_state->devs[i].context);
+		if ((ret = msk_alloc_pd(trans, pd)))
+			break;
+		set->mr[i] = ibv_reg_mr(pd->pd, memaddr, size, access);
+		if (!set->mr[i]) {
+			ret = errno;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_reg_mr on device %d failed: %s (%d)", i, strerror(ret), ret);
+			break;
+		}
+	}
+
+	if (ret) {
+		msk_dereg_mr_all(set);
+		errno = ret;
+		return NULL;
+	}
+
+	return set;
+}
+
+/**
+ * msk_mr_set_get: mr to use with a given trans
+ *
+ * @param set   [IN] set returned by msk_reg_mr_all
+ * @param trans [IN] a connected trans
+ *
+ * @return the mr registered on the trans' device, NULL if none
+ */
+struct ibv_mr *msk_mr_set_get(struct msk_mr_set *set, struct msk_trans *trans) {
+	int i;
+
+	if (!set || !trans->cm_id)
+		return NULL;
+
+	i = msk_dev_index(trans->cm_id->verbs);
+	if (i < 0 || i >= set->count)
+		return NULL;
+
+	return set->mr[i];
+}
+
+/**
+ * msk_dereg_mr_all: deregisters and frees a set from msk_reg_mr_all
+ *
+ * @return 0 on success, last error otherwise
+ */
+int msk_dereg_mr_all(struct msk_mr_set *set) {
+	int i, rc, ret = 0;
+
+	if (!set)
+		return 0;
+
+	for (i = 0; i < set->count; i++) {
+		if (set->mr[i] && (rc = ibv_dereg_mr(set->mr[i])))
+			ret = rc;
+	}
+	free(set);
+
+	return ret;
+}
+
 /**
  * msk_reg_mr: deregisters memory for rdma use (exactly ibv_dereg_mr)
  *
@@ -422,102 +973,600 @@ static inline int msk_check_create_epoll_thread(pthread_t *thrid, void *(*start_
 }
 
 
-static inline void msk_worker_callback(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status, enum ibv_wc_opcode opcode) {
-	struct timespec ts_start, ts_end;
+static struct msk_stats_slot *msk_stats_slots_alloc(void) {
+	void *slots;
 
-	/* Set work completion status before calling callbacks */
-	ctx->data->status = status;
+	if (posix_memalign(&slots, 64, MSK_STATS_SLOTS * sizeof(struct msk_stats_slot)))
+		return NULL;
 
-	if (status) {
-		if (ctx->err_callback) {
-			if (trans->debug & MSK_DEBUG_SPEED)
-				clock_gettime(CLOCK_MONOTONIC, &ts_start);
-			ctx->err_callback(trans, ctx->data, ctx->callback_arg);
-			if (trans->debug & MSK_DEBUG_SPEED) {
-				clock_gettime(CLOCK_MONOTONIC, &ts_end);
-				sub_timespec(&trans->stats.nsec_callback, &ts_start, &ts_end);
-			}
-		}
-	} else switch (opcode) {
+	memset(slots, 0, MSK_STATS_SLOTS * sizeof(struct msk_stats_slot));
+	return slots;
+}
+
+static inline struct msk_stats_slot *msk_stats_slot(struct msk_trans *trans) {
+	if (msk_stats_tid == -1)
+		msk_stats_tid = atomic_postinc(msk_stats_next_tid) % MSK_STATS_SLOTS;
+
+	return &trans->stats_slots[msk_stats_tid];
+}
+
+static inline enum msk_stats_op msk_stats_op(enum ibv_wc_opcode opcode) {
+	switch (opcode) {
 		case IBV_WC_SEND:
+			return MSK_OP_SEND;
 		case IBV_WC_RDMA_WRITE:
+			return MSK_OP_WRITE;
 		case IBV_WC_RDMA_READ:
-			if (ctx->callback) {
-				if (trans->debug & MSK_DEBUG_SPEED)
-					clock_gettime(CLOCK_MONOTONIC, &ts_start);
-				ctx->callback(trans, ctx->data, ctx->callback_arg);
-				if (trans->debug & MSK_DEBUG_SPEED) {
-					clock_gettime(CLOCK_MONOTONIC, &ts_end);
-					sub_timespec(&trans->stats.nsec_callback, &ts_start, &ts_end);
-				}
-			}
-			break;
-
+			return MSK_OP_READ;
 		case IBV_WC_RECV:
 		case IBV_WC_RECV_RDMA_WITH_IMM:
-			if (ctx->callback) {
-				if (trans->debug & MSK_DEBUG_SPEED)
-					clock_gettime(CLOCK_MONOTONIC, &ts_start);
-				ctx->callback(trans, ctx->data, ctx->callback_arg);
-				if (trans->debug & MSK_DEBUG_SPEED) {
-					clock_gettime(CLOCK_MONOTONIC, &ts_end);
-					sub_timespec(&trans->stats.nsec_callback, &ts_start, &ts_end);
-				}
-			}
-			break;
-
+			return MSK_OP_RECV;
 		default:
-			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "worker thread got weird opcode: %d", opcode);
+			return MSK_OP_OTHER;
 	}
+}
 
-	atomic_store(&ctx->used, MSK_CTX_FREE);
+static inline void msk_stats_time(uint64_t *counter, struct timespec *start, struct timespec *end) {
+	uint64_t nsec;
 
-	return;
+	sub_timespec(&nsec, start, end);
+	atomic_add(*counter, nsec);
 }
 
-static void* msk_worker_thread(void *arg) {
-	struct worker_pool *pool = arg;
-	struct msk_worker_data wd;
-	uint64_t n;
-	int i;
+static struct msk_trace_ring *msk_trace_ring_new(void) {
+	struct msk_trace_ring *ring;
+	uint32_t size = msk_global_state->trace_size;
 
-	while (msk_global_state->run_threads > 0) {
-		if (pool->w_count > 0) {
-			i = atomic_dec(pool->w_count);
-			if (i < 0) {
-				atomic_inc(pool->w_count);
-				continue;
-			}
-			i = atomic_postinc(pool->w_head);
-			if (i >= pool->size) {
-				i = i & (pool->size-1);
-				atomic_mask(pool->w_head, pool->size-1);
-			}
-		} else {
-			if (eventfd_read(pool->w_efd, &n)) {
-				INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT,
-					 "eventfd_read failed: %d", errno);
-				continue;
-			}
-			// kill worker signal writes a large value
-			if (n > pool->size || msk_global_state->run_threads == 0)
-				break;
-			INFO_LOG(msk_global_state->debug & MSK_DEBUG_WORKERS, "worker: %d", (int)n);
-			atomic_add(pool->w_count, (int)n);
-			continue;
-		}
+	ring = malloc(sizeof(struct msk_trace_ring) + size * sizeof(struct msk_trace_rec));
+	if (!ring)
+		return NULL;
 
-		INFO_LOG(msk_global_state->debug & MSK_DEBUG_WORKERS, "thread %lx, depopping wd index %i, count %i, trans %p, ctx %p, used %i", pthread_self(), pool->w_head, pool->w_count, pool->wd_queue[i].trans, pool->wd_queue[i].ctx, pool->wd_queue[i].ctx->used);
+	ring->tid = syscall(SYS_gettid);
+	ring->size = size;
+	ring->head = 0;
 
-		memcpy(&wd, &pool->wd_queue[i], sizeof(struct msk_worker_data));
+	pthread_mutex_lock(&msk_global_state->lock);
+	ring->next = msk_global_state->trace_rings;
+	msk_global_state->trace_rings = ring;
+	pthread_mutex_unlock(&msk_global_state->lock);
 
-		if (eventfd_write(pool->m_efd, 1))
-			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "eventfd_write failed");
+	msk_trace_ring = ring;
+	return ring;
+}
 
-		msk_worker_callback(wd.trans, wd.ctx, wd.status, wd.opcode);
-	}
+/* data path trace point, a flag test when tracing is off */
+static inline void msk_trace(struct msk_trans *trans, struct msk_ctx *ctx, enum msk_trace_event event, int opcode, int status, uint32_t size) {
+	struct msk_trace_ring *ring = msk_trace_ring;
+	struct msk_trace_rec *rec;
+	struct timespec ts;
 
-	pthread_exit(NULL);
+	if (!msk_global_state->trace_on)
+		return;
+	if (!ring && !(ring = msk_trace_ring_new()))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec = &ring->recs[ring->head & (ring->size - 1)];
+	rec->nsec = ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+	rec->trans = (uintptr_t)trans;
+	rec->ctx = (uintptr_t)ctx;
+	rec->size = size;
+	rec->event = event;
+	rec->opcode = opcode;
+	rec->status = status;
+	atomic_store(&ring->head, ring->head + 1);
+}
+
+/* charge a call to its callback's profile slot, lock free */
+static void msk_profile_add(void *callback, uint64_t nsec) {
+	struct msk_profile_slot *slot;
+	uint64_t max;
+	int i, n;
+
+	i = ((uintptr_t)callback >> 4) * 2654435761U % MSK_PROFILE_SLOTS;
+	for (n = 0; n < MSK_PROFILE_SLOTS; n++, i = (i + 1) % MSK_PROFILE_SLOTS) {
+		slot = &msk_global_state->profile[i];
+		if (slot->callback == callback)
+			break;
+		// a racing thread may have claimed it for the same callback
+		if (!slot->callback && (atomic_bool_compare_and_swap(&slot->callback, NULL, callback)
+					|| slot->callback == callback))
+			break;
+	}
+	// table full, later callbacks go uncounted
+	if (n == MSK_PROFILE_SLOTS)
+		return;
+
+	atomic_inc(slot->calls);
+	atomic_add(slot->nsec_total, nsec);
+	while ((max = slot->nsec_max) < nsec && !atomic_bool_compare_and_swap(&slot->nsec_max, max, nsec))
+		;
+}
+
+/* calls a context's callback, timed if MSK_DEBUG_SPEED or the profiler want it,
+ * the profiler only counts it if it isn't one of the library's */
+static inline void msk_call_callback(struct msk_trans *trans, struct msk_ctx *ctx, ctx_callback_t callback) {
+	struct timespec ts_start, ts_end;
+	uint64_t nsec;
+	int outer, lib;
+
+	if (!(trans->debug & MSK_DEBUG_SPEED) && !msk_global_state->profile_on) {
+		callback(trans, ctx->data, ctx->callback_arg);
+		return;
+	}
+
+	// callbacks can nest when there are no workers
+	outer = msk_profile_lib;
+	msk_profile_lib = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	callback(trans, ctx->data, ctx->callback_arg);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	sub_timespec(&nsec, &ts_start, &ts_end);
+	lib = msk_profile_lib;
+	msk_profile_lib = outer;
+
+	if (trans->debug & MSK_DEBUG_SPEED)
+		atomic_add(msk_stats_slot(trans)->nsec_callback, nsec);
+	if (msk_global_state->profile_on && !lib)
+		msk_profile_add(callback, nsec);
+}
+
+/* library callbacks (pool, stripe, message layer) call this first, the profiler leaves them out */
+static inline void msk_profile_skip(void) {
+	msk_profile_lib = 1;
+}
+
+/* library callbacks call the user's through this, profiled under the user's function */
+static inline void msk_profile_call(ctx_callback_t callback, struct msk_trans *trans, msk_data_t *data, void *arg) {
+	struct timespec ts_start, ts_end;
+	uint64_t nsec;
+
+	if (!msk_global_state->profile_on) {
+		callback(trans, data, arg);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	callback(trans, data, arg);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	sub_timespec(&nsec, &ts_start, &ts_end);
+	msk_profile_add(callback, nsec);
+}
+
+/* a few ms resolution, but no more than a memory read */
+static inline uint64_t msk_coarse_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t msk_now_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+/**
+ * msk_thread_switch: charge the wall time since the last switch to the
+ * state the thread was in, a nop outside of our threads
+ *
+ * @return the previous state, to switch back to
+ */
+static inline enum msk_thread_state msk_thread_switch(enum msk_thread_state state) {
+	struct msk_thread_acct *acct = msk_thread_acct;
+	enum msk_thread_state prev;
+	uint64_t now;
+
+	if (!acct)
+		return state;
+
+	now = msk_now_nsec();
+	prev = acct->state;
+	atomic_store(&acct->nsec[prev], acct->nsec[prev] + now - acct->mark);
+	acct->mark = now;
+	acct->state = state;
+	return prev;
+}
+
+/**
+ * msk_thread_start: name the current thread msk-<name> and start
+ * accounting its time, in the record of a previous thread of the same
+ * name if there is one so restarts don't lose the totals
+ */
+static void msk_thread_start(const char *name) {
+	struct msk_thread_acct *acct;
+	char thread_name[MSK_THREAD_NAME_LEN];
+
+	snprintf(thread_name, sizeof(thread_name), "msk-%s", name);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	pthread_mutex_lock(&msk_global_state->threads_lock);
+	for (acct = msk_global_state->threads; acct; acct = acct->next)
+		if (!acct->running && !strncmp(acct->name, name, MSK_THREAD_NAME_LEN))
+			break;
+	if (!acct && (acct = malloc(sizeof(struct msk_thread_acct)))) {
+		memset(acct, 0, sizeof(struct msk_thread_acct));
+		strncpy(acct->name, name, MSK_THREAD_NAME_LEN - 1);
+		acct->next = msk_global_state->threads;
+		msk_global_state->threads = acct;
+	}
+	if (acct) {
+		acct->tid = syscall(SYS_gettid);
+		acct->running = !pthread_getcpuclockid(pthread_self(), &acct->cpu_clock);
+		acct->state = MSK_THREAD_POLL;
+		acct->mark = msk_now_nsec();
+	}
+	pthread_mutex_unlock(&msk_global_state->threads_lock);
+
+	msk_thread_acct = acct;
+}
+
+/* keep the cpu time of the exiting thread in its record */
+static void msk_thread_stop(void) {
+	struct msk_thread_acct *acct = msk_thread_acct;
+	struct timespec ts;
+
+	if (!acct)
+		return;
+
+	msk_thread_switch(MSK_THREAD_IDLE);
+	pthread_mutex_lock(&msk_global_state->threads_lock);
+	if (acct->running && !clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		acct->cpu_base += ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+	acct->running = 0;
+	pthread_mutex_unlock(&msk_global_state->threads_lock);
+
+	msk_thread_acct = NULL;
+}
+
+/* one more in use, and remember the highest value seen */
+static inline void msk_gauge_inc(uint32_t *cur, uint32_t *peak) {
+	uint32_t n = atomic_inc(*cur), p;
+
+	while ((p = *peak) < n && !atomic_bool_compare_and_swap(peak, p, n))
+		;
+}
+
+static inline int msk_ctx_is_wctx(struct msk_trans *trans, struct msk_ctx *ctx) {
+	return (uint8_t *)ctx >= (uint8_t *)trans->wctx
+		&& (uint8_t *)ctx < (uint8_t *)trans->wctx + trans->sq_depth * (sizeof(struct msk_ctx) + trans->max_send_sge * sizeof(struct ibv_sge));
+}
+
+/* the opcode of an error completion isn't valid, the context tells what was posted */
+static inline enum msk_stats_op msk_stats_ctx_op(struct msk_trans *trans, struct msk_ctx *ctx) {
+	if (!msk_ctx_is_wctx(trans, ctx))
+		return MSK_OP_RECV;
+
+	switch (ctx->wr.wwr.opcode) {
+		case IBV_WR_SEND:
+		case IBV_WR_SEND_WITH_IMM:
+			return MSK_OP_SEND;
+		case IBV_WR_RDMA_WRITE:
+		case IBV_WR_RDMA_WRITE_WITH_IMM:
+			return MSK_OP_WRITE;
+		case IBV_WR_RDMA_READ:
+			return MSK_OP_READ;
+		default:
+			return MSK_OP_OTHER;
+	}
+}
+
+/* the put functions return how many contexts msk_flush_buffers still waits for */
+static inline uint32_t msk_put_wctx(struct msk_trans *trans, struct msk_ctx *wctx) {
+	atomic_dec(trans->wctx_used);
+	wctx->post_nsec = 0;
+	atomic_store(&wctx->used, MSK_CTX_FREE);
+	return atomic_dec(trans->outstanding);
+}
+
+static inline uint32_t msk_put_rctx(struct msk_trans *trans, struct msk_ctx *rctx) {
+	atomic_dec(trans->rctx_used);
+	atomic_store(&rctx->used, MSK_CTX_FREE);
+	/* receives of server children are not waited for */
+	if (trans->server < 0)
+		return 1;
+	return atomic_dec(trans->outstanding);
+}
+
+/* gives a completed context back, and tells a flush waiting for the last one */
+static inline void msk_release_ctx(struct msk_trans *trans, struct msk_ctx *ctx) {
+	uint32_t left;
+
+	// srq receive contexts belong to the device
+	if (msk_ctx_is_wctx(trans, ctx)) {
+		if (trans->msg) {
+			// queued messages may have been waiting for any send context,
+			// our extra count keeps a flush from freeing trans->msg meanwhile
+			atomic_inc(trans->outstanding);
+			msk_put_wctx(trans, ctx);
+			msk_msg_flush(trans);
+			left = atomic_dec(trans->outstanding);
+		} else {
+			left = msk_put_wctx(trans, ctx);
+		}
+	} else if (!trans->srq) {
+		left = msk_put_rctx(trans, ctx);
+	} else {
+		atomic_store(&ctx->used, MSK_CTX_FREE);
+		return;
+	}
+
+	if (left == 0 && trans->flushing) {
+		// no workers means we were called under cm_lock
+		if (msk_global_state->worker_pool.worker_count == -1) {
+			pthread_cond_broadcast(&trans->cm_cond);
+		} else {
+			msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+			pthread_cond_broadcast(&trans->cm_cond);
+			msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+		}
+	}
+}
+
+/* needs wheel_lock */
+static void msk_wheel_insert(struct msk_wheel *wheel, struct msk_ctx *ctx) {
+	struct msk_ctx **slot;
+	uint64_t delta;
+	int level = 0;
+
+	if (ctx->deadline <= wheel->tick)
+		ctx->deadline = wheel->tick + 1;
+	delta = ctx->deadline - wheel->tick;
+	while (level < MSK_WHEEL_LEVELS - 1 && delta >= 1ULL << (MSK_WHEEL_BITS * (level + 1)))
+		level++;
+
+	slot = &wheel->slots[level][(ctx->deadline >> (MSK_WHEEL_BITS * level)) & MSK_WHEEL_MASK];
+	ctx->timer_next = *slot;
+	if (*slot)
+		(*slot)->timer_pprev = &ctx->timer_next;
+	ctx->timer_pprev = slot;
+	*slot = ctx;
+}
+
+/**
+ * msk_deadline_arm: puts a send context in the wheel, before it is posted
+ * so its completion can't come first.
+ */
+static int msk_deadline_arm(struct msk_trans *trans, struct msk_ctx *ctx, uint32_t timeout_ms) {
+	struct msk_wheel *wheel = &msk_global_state->wheel;
+	struct epoll_event ev;
+	int ret = 0;
+
+	pthread_mutex_lock(&msk_global_state->wheel_lock);
+	// the cq thread gets a new epollfd when it is restarted
+	if (wheel->epollfd != msk_global_state->cq_epollfd) {
+		if (wheel->efd == -1)
+			wheel->efd = eventfd(0, EFD_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = wheel;
+		if (wheel->efd == -1 || (epoll_ctl(msk_global_state->cq_epollfd, EPOLL_CTL_ADD, wheel->efd, &ev) == -1 && errno != EEXIST)) {
+			ret = errno;
+			pthread_mutex_unlock(&msk_global_state->wheel_lock);
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Failed to add deadline wheel eventfd to epoll: %s (%d)", strerror(ret), ret);
+			return ret;
+		}
+		wheel->epollfd = msk_global_state->cq_epollfd;
+	}
+
+	if (!wheel->count) {
+		wheel->tick = msk_coarse_nsec() / 1000000;
+		// the cq thread is waiting with its long timeout
+		if (eventfd_write(wheel->efd, 1))
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "eventfd_write failed");
+	}
+	ctx->trans = trans;
+	ctx->deadline = wheel->tick + timeout_ms;
+	ctx->deadline_state = MSK_DEADLINE_ARMED;
+	msk_wheel_insert(wheel, ctx);
+	wheel->count++;
+	pthread_mutex_unlock(&msk_global_state->wheel_lock);
+
+	return 0;
+}
+
+/**
+ * msk_deadline_complete: the post of an armed context completed or failed
+ *
+ * @return 0 if the deadline was cancelled in time and callbacks can run,
+ *         1 if err_callback got the deadline and the context must be left alone
+ */
+static int msk_deadline_complete(struct msk_trans *trans, struct msk_ctx *ctx) {
+	struct msk_ctx *next;
+	int state;
+
+	pthread_mutex_lock(&msk_global_state->wheel_lock);
+	state = ctx->deadline_state;
+	if (state == MSK_DEADLINE_ARMED) {
+		next = ctx->timer_next;
+		*ctx->timer_pprev = next;
+		if (next)
+			next->timer_pprev = ctx->timer_pprev;
+		msk_global_state->wheel.count--;
+		ctx->deadline_state = state = MSK_DEADLINE_NONE;
+	}
+	pthread_mutex_unlock(&msk_global_state->wheel_lock);
+
+	if (state == MSK_DEADLINE_NONE)
+		return 0;
+
+	// err_callback still running, whoever is last gives the context back
+	if (atomic_bool_compare_and_swap(&ctx->deadline_state, MSK_DEADLINE_FIRED, MSK_DEADLINE_COMPLETED))
+		return 1;
+
+	ctx->deadline_state = MSK_DEADLINE_NONE;
+	msk_release_ctx(trans, ctx);
+	return 1;
+}
+
+/**
+ * msk_deadline_expired: err_callback of a context msk_wheel_run found
+ * expired, on a worker like the completions
+ */
+static void msk_deadline_expired(struct msk_trans *trans, struct msk_ctx *ctx) {
+	atomic_inc(trans->stats.deadline_expired);
+	DATA_LOG(trans->debug & MSK_DEBUG_SEND, "deadline passed for context %p (data %p)", ctx, ctx->data);
+	ctx->data->status = MSK_WC_DEADLINE;
+	if (ctx->err_callback)
+		msk_call_callback(trans, ctx, ctx->err_callback);
+
+	// the completion came in the meantime and left the context to us
+	if (!atomic_bool_compare_and_swap(&ctx->deadline_state, MSK_DEADLINE_FIRED, MSK_DEADLINE_DONE)) {
+		ctx->deadline_state = MSK_DEADLINE_NONE;
+		msk_release_ctx(trans, ctx);
+	}
+}
+
+static inline void msk_worker_callback(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status, enum ibv_wc_opcode opcode) {
+	if (status == MSK_WC_DEADLINE) {
+		msk_deadline_expired(trans, ctx);
+		return;
+	}
+
+	if (ctx->deadline_state && msk_deadline_complete(trans, ctx))
+		return;
+
+	/* Set work completion status before calling callbacks */
+	ctx->data->status = status;
+	MSK_PROBE(callback_start, trans, ctx->data, opcode, status);
+
+	if (status) {
+		if (ctx->err_callback)
+			msk_call_callback(trans, ctx, ctx->err_callback);
+	} else switch (opcode) {
+		case IBV_WC_SEND:
+		case IBV_WC_RDMA_WRITE:
+		case IBV_WC_RDMA_READ:
+		case IBV_WC_BIND_MW:
+		case IBV_WC_LOCAL_INV:
+			if (ctx->callback)
+				msk_call_callback(trans, ctx, ctx->callback);
+			break;
+
+		case IBV_WC_RECV:
+		case IBV_WC_RECV_RDMA_WITH_IMM:
+			if (ctx->callback)
+				msk_call_callback(trans, ctx, ctx->callback);
+			break;
+
+		default:
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "worker thread got weird opcode: %d", opcode);
+	}
+	msk_trace(trans, ctx, MSK_TRACE_CALLBACK, opcode, status, ctx->data->size);
+	MSK_PROBE(callback_end, trans, ctx->data, opcode, status);
+
+	msk_release_ctx(trans, ctx);
+}
+
+/* needs wheel_lock: re-files a higher level slot whose time has come */
+static void msk_wheel_cascade(struct msk_wheel *wheel, int level) {
+	struct msk_ctx **slot = &wheel->slots[level][(wheel->tick >> (MSK_WHEEL_BITS * level)) & MSK_WHEEL_MASK];
+	struct msk_ctx *ctx = *slot, *next;
+
+	*slot = NULL;
+	for (; ctx; ctx = next) {
+		next = ctx->timer_next;
+		msk_wheel_insert(wheel, ctx);
+	}
+}
+
+/**
+ * msk_wheel_run: advances the wheel to now and hands every context that
+ * expired to the workers, which call its err_callback with MSK_WC_DEADLINE.
+ * Called by the cq thread.
+ */
+static void msk_wheel_run(void) {
+	struct msk_wheel *wheel = &msk_global_state->wheel;
+	struct msk_ctx *expired = NULL, *ctx, *next;
+	struct msk_trans *trans;
+	uint64_t now = msk_coarse_nsec() / 1000000;
+	int level;
+
+	pthread_mutex_lock(&msk_global_state->wheel_lock);
+	while (wheel->count && wheel->tick < now) {
+		wheel->tick++;
+		for (level = MSK_WHEEL_LEVELS - 1; level > 0; level--)
+			if (!(wheel->tick & ((1ULL << (MSK_WHEEL_BITS * level)) - 1)))
+				msk_wheel_cascade(wheel, level);
+
+		ctx = wheel->slots[0][wheel->tick & MSK_WHEEL_MASK];
+		wheel->slots[0][wheel->tick & MSK_WHEEL_MASK] = NULL;
+		for (; ctx; ctx = next) {
+			next = ctx->timer_next;
+			wheel->count--;
+			ctx->deadline_state = MSK_DEADLINE_FIRED;
+			ctx->timer_next = expired;
+			expired = ctx;
+		}
+	}
+	pthread_mutex_unlock(&msk_global_state->wheel_lock);
+
+	// the context stays pending until its completion, it keeps trans around
+	for (ctx = expired; ctx; ctx = next) {
+		next = ctx->timer_next;
+		trans = ctx->trans;
+
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+		msk_signal_worker(trans, ctx, MSK_WC_DEADLINE, IBV_WC_SEND);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+	}
+}
+
+static void* msk_worker_thread(void *arg) {
+	struct worker_pool *pool = arg;
+	struct msk_worker_data wd;
+	char name[MSK_THREAD_NAME_LEN];
+	uint64_t n;
+	int i;
+
+	snprintf(name, sizeof(name), "worker%d", atomic_postinc(pool->started));
+	msk_thread_start(name);
+
+	while (msk_global_state->run_threads > 0) {
+		if (pool->w_count > 0) {
+			i = atomic_dec(pool->w_count);
+			if (i < 0) {
+				atomic_inc(pool->w_count);
+				continue;
+			}
+			i = atomic_postinc(pool->w_head);
+			if (i >= pool->size) {
+				i = i & (pool->size-1);
+				atomic_mask(pool->w_head, pool->size-1);
+			}
+		} else {
+			msk_thread_switch(MSK_THREAD_IDLE);
+			i = eventfd_read(pool->w_efd, &n);
+			msk_thread_switch(MSK_THREAD_POLL);
+			if (i) {
+				INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT,
+					 "eventfd_read failed: %d", errno);
+				continue;
+			}
+			// kill worker signal writes a large value
+			if (n > pool->size || msk_global_state->run_threads == 0)
+				break;
+			DATA_LOG(msk_global_state->debug & MSK_DEBUG_WORKERS, "worker: %d", (int)n);
+			atomic_add(pool->w_count, (int)n);
+			continue;
+		}
+
+		DATA_LOG(msk_global_state->debug & MSK_DEBUG_WORKERS, "thread %lx, depopping wd index %i, count %i, trans %p, ctx %p, used %i", pthread_self(), pool->w_head, pool->w_count, pool->wd_queue[i].trans, pool->wd_queue[i].ctx, pool->wd_queue[i].ctx->used);
+
+		memcpy(&wd, &pool->wd_queue[i], sizeof(struct msk_worker_data));
+		atomic_dec(pool->depth);
+
+		if (eventfd_write(pool->m_efd, 1))
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "eventfd_write failed");
+
+		msk_thread_switch(MSK_THREAD_CALLBACK);
+		msk_worker_callback(wd.trans, wd.ctx, wd.status, wd.opcode);
+		msk_thread_switch(MSK_THREAD_POLL);
+	}
+
+	msk_thread_stop();
+	pthread_exit(NULL);
 }
 
 static int msk_spawn_worker_threads() {
@@ -545,6 +1594,7 @@ static int msk_spawn_worker_threads() {
 		msk_global_state->worker_pool.w_count = 0;
 		msk_global_state->worker_pool.m_tail = 0;
 		msk_global_state->worker_pool.m_count = 0;
+		msk_global_state->worker_pool.started = 0;
 		msk_global_state->worker_pool.w_efd = eventfd(0, 0);
 		msk_global_state->worker_pool.m_efd = eventfd(0, 0);
 
@@ -605,13 +1655,16 @@ static int msk_kill_worker_threads() {
 /* called under trans cm lock */
 static int msk_signal_worker(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status, enum ibv_wc_opcode opcode) {
 	struct msk_worker_data *wd;
-	int i;
+	struct timespec ts_start, ts_end;
+	int i, blocked = 0;
 
-	INFO_LOG(trans->debug & MSK_DEBUG_WORKERS, "signaling trans %p, ctx %p, status %d", trans, ctx, status);
+	DATA_LOG(trans->debug & MSK_DEBUG_WORKERS, "signaling trans %p, ctx %p, status %d", trans, ctx, status);
 
 	// Don't signal and do it directly if no worker
 	if (msk_global_state->worker_pool.worker_count == -1) {
+		enum msk_thread_state prev = msk_thread_switch(MSK_THREAD_CALLBACK);
 		msk_worker_callback(trans, ctx, status, opcode);
+		msk_thread_switch(prev);
 		return 0;
 	}
 
@@ -619,27 +1672,37 @@ static int msk_signal_worker(struct msk_trans *trans, struct msk_ctx *ctx, enum
 	 * Only need this done in async mode because we don't leave trans cm lock otherwise.
 	 * Likewise, doesn't need an atomic_bool_compare_and_swap because it only matters where this lock is held
 	 * e.g. if (!atomic_bool_compare_and_swap(&ctx->used, MSK_CTX_PENDING, MSK_CTX_PROCESSING))
+	 * An expired deadline leaves the context pending for its completion.
 	 */
-	if (ctx->used != MSK_CTX_PENDING) {
-		// nothing to do
-		return 0;
+	if (status != MSK_WC_DEADLINE) {
+		if (ctx->used != MSK_CTX_PENDING) {
+			// nothing to do
+			return 0;
+		}
+		ctx->used = MSK_CTX_PROCESSING;
 	}
-	ctx->used = MSK_CTX_PROCESSING;
 
 	while (atomic_inc(msk_global_state->worker_pool.m_count) > msk_global_state->worker_pool.size
 	    && msk_global_state->run_threads > 0) {
 		uint64_t n;
+		if (!blocked++)
+			clock_gettime(CLOCK_MONOTONIC, &ts_start);
 		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 
 		if (eventfd_read(msk_global_state->worker_pool.m_efd, &n)) {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT,
 				 "eventfd_read failed: %d", errno);
 		} else {
-			INFO_LOG(trans->debug & MSK_DEBUG_WORKERS, "master: %d\n", (int)n);
+			DATA_LOG(trans->debug & MSK_DEBUG_WORKERS, "master: %d\n", (int)n);
 			atomic_sub(msk_global_state->worker_pool.m_count, (int)n+1 /* we're doing inc again */);
 		}
 		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 	}
+	if (blocked) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		atomic_inc(msk_stats_slot(trans)->worker_block);
+		msk_stats_time(&msk_stats_slot(trans)->nsec_worker_block, &ts_start, &ts_end);
+	}
 
 	do {
 		if (msk_global_state->run_threads == 0) {
@@ -659,6 +1722,7 @@ static int msk_signal_worker(struct msk_trans *trans, struct msk_ctx *ctx, enum
 		wd->ctx = ctx;
 		wd->status = status;
 		wd->opcode = opcode;
+		msk_gauge_inc(&msk_global_state->worker_pool.depth, &msk_global_state->worker_pool.peak);
 
 		if (eventfd_write(msk_global_state->worker_pool.w_efd, 1))
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "eventfd_write failed");
@@ -721,52 +1785,442 @@ static inline int msk_cq_delfd(struct msk_trans *trans) {
 	return msk_delfd(trans->comp_channel->fd, msk_global_state->cq_epollfd);
 }
 
-static inline int msk_cm_addfd(struct msk_trans *trans) {
-	return msk_addfd(trans, trans->event_channel->fd, msk_global_state->cm_epollfd);
-}
+/**
+ * msk_cm_channel_get: returns the process-wide event channel, creating it on first use
+ */
+static struct rdma_event_channel *msk_cm_channel_get(void) {
+	struct rdma_event_channel *channel;
+	int flags;
 
-static inline int msk_cm_delfd(struct msk_trans *trans) {
-	return msk_delfd(trans->event_channel->fd, msk_global_state->cm_epollfd);
+	pthread_mutex_lock(&msk_global_state->lock);
+	if (!msk_global_state->cm_channel) do {
+		channel = rdma_create_event_channel();
+		if (!channel)
+			break;
+
+		// drained until EAGAIN by the cm thread
+		flags = fcntl(channel->fd, F_GETFL);
+		if (fcntl(channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			flags = errno;
+			rdma_destroy_event_channel(channel);
+			errno = flags;
+			break;
+		}
+		msk_global_state->cm_channel = channel;
+	} while (0);
+	channel = msk_global_state->cm_channel;
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	return channel;
 }
 
-static inline int msk_stats_add(struct msk_trans *trans) {
-	int rc;
-	struct sockaddr_un sockaddr;
+/**
+ * msk_cm_addfd: adds trans' event channel to the cm thread's epoll.
+ * The shared channel is added once, tagged with msk_global_state instead of a trans.
+ */
+static inline int msk_cm_addfd(struct msk_trans *trans) {
+	struct epoll_event ev;
+	int ret = 0;
 
-	/* no stats if no prefix */
-	if (!trans->stats_prefix)
-		return 0;
+	if (trans->event_channel != msk_global_state->cm_channel)
+		return msk_addfd(trans, trans->event_channel->fd, msk_global_state->cm_epollfd);
 
-	/* setup trans->stats_sock here */
-	if ( (trans->stats_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		rc = errno;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "socket on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
-		return rc;
+	pthread_mutex_lock(&msk_global_state->lock);
+	// the cm thread gets a new epollfd when it is restarted
+	if (msk_global_state->cm_channel_epollfd != msk_global_state->cm_epollfd) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = msk_global_state;
+		if (epoll_ctl(msk_global_state->cm_epollfd, EPOLL_CTL_ADD, msk_global_state->cm_channel->fd, &ev) == -1 && errno != EEXIST) {
+			ret = errno;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Failed to add shared cm channel to epoll: %s (%d)", strerror(ret), ret);
+		} else {
+			msk_global_state->cm_channel_epollfd = msk_global_state->cm_epollfd;
+		}
 	}
+	pthread_mutex_unlock(&msk_global_state->lock);
 
-	memset(&sockaddr, 0, sizeof(sockaddr));
-	sockaddr.sun_family = AF_UNIX;
-	snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path)-1, "%s%p", trans->stats_prefix, trans);
+	return ret;
+}
 
-	unlink(sockaddr.sun_path);
+static inline int msk_cm_delfd(struct msk_trans *trans) {
+	// other transports still use the shared channel
+	if (trans->event_channel == msk_global_state->cm_channel)
+		return 0;
+	return msk_delfd(trans->event_channel->fd, msk_global_state->cm_epollfd);
+}
 
-	if (bind(trans->stats_sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == -1) {
-		rc = errno;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "bind on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
-		return rc;
+/**
+ * msk_stats_shm_reclaim: unlinks an existing stats_shm region if the process
+ * that published it is gone
+ *
+ * @return 0 if the name is free again, EEXIST if it is still in use
+ */
+static int msk_stats_shm_reclaim(const char *name) {
+	struct msk_stats_shm_hdr *hdr;
+	struct stat st;
+	pid_t pid = 0;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : errno;
+
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*hdr)) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+		if (hdr != MAP_FAILED) {
+			if (atomic_load(&hdr->magic) == MSK_STATS_SHM_MAGIC)
+				pid = hdr->pid;
+			munmap(hdr, sizeof(*hdr));
+		}
 	}
+	close(fd);
 
-	if (listen(trans->stats_sock, 5) == -1) {
-		rc = errno;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "listen on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
-		return rc;
+	// no magic yet could be another process setting it up, leave it be
+	if (!pid || kill(pid, 0) == 0 || errno == EPERM) {
+		INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "stats_shm %s is in use (pid %d)", name, pid);
+		return EEXIST;
 	}
 
-
-	return msk_addfd(trans, trans->stats_sock, msk_global_state->stats_epollfd);
+	INFO_LOG(msk_global_state->debug & MSK_DEBUG_SETUP, "removing stats_shm %s left by pid %d", name, pid);
+	if (shm_unlink(name) && errno != ENOENT)
+		return errno;
+	return 0;
 }
 
-static inline int msk_stats_del(struct msk_trans *trans) {
+/**
+ * msk_stats_shm_open: create the process' stats_shm region if it isn't yet
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_stats_shm_open(const char *name, uint32_t entries) {
+	struct msk_stats_shm_hdr *hdr;
+	size_t len;
+	int fd, ret = 0;
+
+	pthread_mutex_lock(&msk_global_state->stats_shm_lock);
+	do {
+		if (msk_global_state->stats_shm) {
+			if (strcmp(name, msk_global_state->stats_shm_name))
+				INFO_LOG(msk_global_state->debug & MSK_DEBUG_SETUP, "stats already published in %s, not %s", msk_global_state->stats_shm_name, name);
+			break;
+		}
+
+		len = sizeof(struct msk_stats_shm_hdr) + (size_t)entries * sizeof(struct msk_stats_shm_entry);
+		msk_global_state->stats_shm_trans = calloc(entries, sizeof(struct msk_trans *));
+		msk_global_state->stats_shm_name = strdup(name);
+		if (!msk_global_state->stats_shm_trans || !msk_global_state->stats_shm_name) {
+			ret = ENOMEM;
+			break;
+		}
+
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd == -1 && errno == EEXIST) {
+			ret = msk_stats_shm_reclaim(name);
+			if (ret)
+				break;
+			fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+		}
+		if (fd == -1) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "shm_open %s failed: %s (%d)", name, strerror(ret), ret);
+			break;
+		}
+		if (ftruncate(fd, len)) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "ftruncate %s failed: %s (%d)", name, strerror(ret), ret);
+			close(fd);
+			shm_unlink(name);
+			break;
+		}
+		hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (hdr == MAP_FAILED) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "mmap %s failed: %s (%d)", name, strerror(ret), ret);
+			shm_unlink(name);
+			break;
+		}
+
+		hdr->version = MSK_STATS_SHM_VERSION;
+		hdr->hdr_size = sizeof(struct msk_stats_shm_hdr);
+		hdr->entry_size = sizeof(struct msk_stats_shm_entry);
+		hdr->entries = entries;
+		hdr->pid = getpid();
+		hdr->period_ms = MSK_STATS_SHM_PERIOD_MS;
+		// readers check magic last
+		atomic_store(&hdr->magic, MSK_STATS_SHM_MAGIC);
+
+		msk_global_state->stats_shm = hdr;
+		msk_global_state->stats_shm_len = len;
+	} while (0);
+
+	if (ret) {
+		free(msk_global_state->stats_shm_trans);
+		free(msk_global_state->stats_shm_name);
+		msk_global_state->stats_shm_trans = NULL;
+		msk_global_state->stats_shm_name = NULL;
+	}
+	pthread_mutex_unlock(&msk_global_state->stats_shm_lock);
+
+	return ret;
+}
+
+static void msk_sockaddr_str(struct sockaddr *sa, char *buf, size_t len) {
+	char addr[INET6_ADDRSTRLEN];
+
+	buf[0] = '\0';
+	if (!sa)
+		return;
+
+	if (sa->sa_family == AF_INET && inet_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr, addr, sizeof(addr)))
+		snprintf(buf, len, "%s:%u", addr, ntohs(((struct sockaddr_in *)sa)->sin_port));
+	else if (sa->sa_family == AF_INET6 && inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr, addr, sizeof(addr)))
+		snprintf(buf, len, "[%s]:%u", addr, ntohs(((struct sockaddr_in6 *)sa)->sin6_port));
+}
+
+/* seqlock, entries are only written under stats_shm_lock */
+static inline void msk_stats_shm_write_begin(struct msk_stats_shm_entry *entry) {
+	atomic_store(&entry->seq, entry->seq + 1);
+	__sync_synchronize();
+}
+
+static inline void msk_stats_shm_write_end(struct msk_stats_shm_entry *entry) {
+	atomic_store(&entry->seq, entry->seq + 1);
+}
+
+/* give the transport an entry, its directory part is filled once here */
+static void msk_stats_shm_add(struct msk_trans *trans) {
+	struct msk_stats_shm_hdr *hdr = msk_global_state->stats_shm;
+	struct msk_stats_shm_entry *entry;
+	uint32_t i, n;
+
+	if (!hdr || trans->stats_shm_index >= 0)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->stats_shm_lock);
+	for (n = 0, i = msk_global_state->stats_shm_next; n < hdr->entries; n++, i = (i + 1) % hdr->entries)
+		if (!msk_global_state->stats_shm_trans[i])
+			break;
+	if (n == hdr->entries) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "stats_shm region full (%u entries), %p not published", hdr->entries, trans);
+		pthread_mutex_unlock(&msk_global_state->stats_shm_lock);
+		return;
+	}
+
+	msk_global_state->stats_shm_trans[i] = trans;
+	msk_global_state->stats_shm_next = (i + 1) % hdr->entries;
+	trans->stats_shm_index = i;
+
+	entry = msk_stats_shm_entry(hdr, i);
+	msk_stats_shm_write_begin(entry);
+	entry->id = (uintptr_t)trans;
+	entry->state = trans->state;
+	msk_sockaddr_str(trans->cm_id ? rdma_get_peer_addr(trans->cm_id) : NULL, entry->peer, sizeof(entry->peer));
+	msk_sockaddr_str(trans->cm_id ? rdma_get_local_addr(trans->cm_id) : NULL, entry->local, sizeof(entry->local));
+	memset(&entry->stats, 0, sizeof(entry->stats));
+	msk_stats_shm_write_end(entry);
+
+	if (i >= hdr->used)
+		atomic_store(&hdr->used, i + 1);
+	pthread_mutex_unlock(&msk_global_state->stats_shm_lock);
+}
+
+static void msk_stats_shm_del(struct msk_trans *trans) {
+	struct msk_stats_shm_entry *entry;
+
+	if (!trans->stats_shm || trans->stats_shm_index < 0)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->stats_shm_lock);
+	entry = msk_stats_shm_entry(msk_global_state->stats_shm, trans->stats_shm_index);
+	msk_stats_shm_write_begin(entry);
+	entry->id = 0;
+	entry->state = MSK_CLOSED;
+	msk_stats_shm_write_end(entry);
+	msk_global_state->stats_shm_trans[trans->stats_shm_index] = NULL;
+	trans->stats_shm_index = -1;
+	pthread_mutex_unlock(&msk_global_state->stats_shm_lock);
+}
+
+/* refresh every entry's counters, at most once per period */
+static void msk_stats_shm_publish(void) {
+	struct msk_stats_shm_hdr *hdr = msk_global_state->stats_shm;
+	struct msk_stats_shm_entry *entry;
+	struct msk_trans *trans;
+	struct msk_stats stats;
+	struct timespec ts;
+	uint64_t now;
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+	if (now - hdr->updated_nsec < MSK_STATS_SHM_PERIOD_MS * 1000000ULL)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->stats_shm_lock);
+	for (i = 0; i < hdr->used; i++) {
+		trans = msk_global_state->stats_shm_trans[i];
+		if (!trans)
+			continue;
+
+		msk_get_stats(trans, &stats);
+		entry = msk_stats_shm_entry(hdr, i);
+		msk_stats_shm_write_begin(entry);
+		entry->state = trans->state;
+		entry->stats = stats;
+		msk_stats_shm_write_end(entry);
+	}
+	atomic_store(&hdr->updated_nsec, now);
+	pthread_mutex_unlock(&msk_global_state->stats_shm_lock);
+}
+
+/**
+ * msk_stuck_scan: reports send contexts pending for more than their
+ * transport's stuck_ms, once per post. Called from the stats thread.
+ */
+static void msk_stuck_scan(void) {
+	struct msk_trans *trans;
+	struct msk_ctx *wctx;
+	uint64_t now = msk_coarse_nsec();
+	uint64_t posted;
+	int i;
+
+	if (now - msk_global_state->stuck_scan_nsec < msk_global_state->stuck_scan_ms * 1000000ULL)
+		return;
+	msk_global_state->stuck_scan_nsec = now;
+
+	pthread_mutex_lock(&msk_global_state->stuck_lock);
+	for (trans = msk_global_state->stuck_trans; trans; trans = trans->stuck_next) {
+		if (trans->state != MSK_CONNECTED || !trans->wctx)
+			continue;
+
+		for (i = 0, wctx = trans->wctx;
+		     i < trans->sq_depth;
+		     i++, wctx = msk_next_ctx(wctx, trans->max_send_sge)) {
+			posted = atomic_load(&wctx->post_nsec);
+			if (!posted || wctx->used != MSK_CTX_PENDING
+			    || now < posted + trans->stuck_ms * 1000000ULL)
+				continue;
+			// lost to the context being released or reused in between
+			if (!atomic_bool_compare_and_swap(&wctx->post_nsec, posted, 0))
+				continue;
+
+			atomic_inc(trans->stats.stuck);
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "trans %p: opcode %d on context %p (data %p) pending for %"PRIu64" ms",
+				 trans, wctx->wr.wwr.opcode, wctx, wctx->data, (now - posted) / 1000000);
+			if (trans->stuck_callback)
+				trans->stuck_callback(trans, wctx->data, wctx->wr.wwr.opcode, now - posted);
+		}
+	}
+	pthread_mutex_unlock(&msk_global_state->stuck_lock);
+}
+
+static void msk_stuck_add(struct msk_trans *trans) {
+	uint32_t scan_ms = trans->stuck_ms / 2 ? trans->stuck_ms / 2 : 1;
+
+	pthread_mutex_lock(&msk_global_state->stuck_lock);
+	trans->stuck_next = msk_global_state->stuck_trans;
+	msk_global_state->stuck_trans = trans;
+	if (!msk_global_state->stuck_scan_ms || scan_ms < msk_global_state->stuck_scan_ms)
+		msk_global_state->stuck_scan_ms = scan_ms;
+	pthread_mutex_unlock(&msk_global_state->stuck_lock);
+}
+
+static void msk_stuck_del(struct msk_trans *trans) {
+	struct msk_trans **prev;
+
+	if (!trans->stuck_ms)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->stuck_lock);
+	for (prev = &msk_global_state->stuck_trans; *prev; prev = &(*prev)->stuck_next) {
+		if (*prev == trans) {
+			*prev = trans->stuck_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&msk_global_state->stuck_lock);
+}
+
+/* every connected transport is on the recorder's list, running or not */
+static void msk_record_add(struct msk_trans *trans) {
+	if (trans->record_prev)
+		return;
+
+	trans->record_prev = malloc(sizeof(struct msk_record_prev));
+	if (!trans->record_prev)
+		return;
+	memset(trans->record_prev, 0, sizeof(struct msk_record_prev));
+
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	trans->record_next = msk_global_state->record_trans;
+	msk_global_state->record_trans = trans;
+	pthread_mutex_unlock(&msk_global_state->record_lock);
+}
+
+static void msk_record_del(struct msk_trans *trans) {
+	struct msk_trans **prev;
+
+	if (!trans->record_prev)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	for (prev = &msk_global_state->record_trans; *prev; prev = &(*prev)->record_next) {
+		if (*prev == trans) {
+			*prev = trans->record_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&msk_global_state->record_lock);
+
+	free(trans->record_prev);
+	trans->record_prev = NULL;
+}
+
+static inline int msk_stats_add(struct msk_trans *trans) {
+	int rc;
+	struct sockaddr_un sockaddr;
+
+	if (trans->stats_shm)
+		msk_stats_shm_add(trans);
+	if (trans->stuck_ms)
+		msk_stuck_add(trans);
+	msk_record_add(trans);
+
+	/* no stats if no prefix */
+	if (!trans->stats_prefix)
+		return 0;
+
+	/* setup trans->stats_sock here */
+	if ( (trans->stats_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		rc = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "socket on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
+		return rc;
+	}
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.sun_family = AF_UNIX;
+	snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path)-1, "%s%p", trans->stats_prefix, trans);
+
+	unlink(sockaddr.sun_path);
+
+	if (bind(trans->stats_sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == -1) {
+		rc = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "bind on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
+		return rc;
+	}
+
+	if (listen(trans->stats_sock, 5) == -1) {
+		rc = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "listen on stats socket failed, quitting thread: %d (%s)", rc, strerror(rc));
+		return rc;
+	}
+
+
+	return msk_addfd(trans, trans->stats_sock, msk_global_state->stats_epollfd);
+}
+
+static inline int msk_stats_del(struct msk_trans *trans) {
 	/* msk_delfd is called in stats thread when a close event comes in */
 	char sun_path[108];
 	snprintf(sun_path, sizeof(sun_path)-1, "%s%p", trans->stats_prefix, trans);
@@ -775,6 +2229,335 @@ static inline int msk_stats_del(struct msk_trans *trans) {
 	return close(trans->stats_sock);
 }
 
+static const char *msk_stats_op_name[MSK_OP_COUNT] = { "send", "recv", "read", "write", "other" };
+
+enum msk_stats_field_type {
+	MSK_FIELD_COUNTER,
+	MSK_FIELD_GAUGE,
+	MSK_FIELD_NSEC,			/**< counter in nanoseconds, exported in seconds */
+};
+
+/** struct msk_stats scalars, in the order they're exported */
+static const struct msk_stats_field {
+	const char *name;		/**< json key */
+	const char *metric;		/**< prometheus metric name */
+	enum msk_stats_field_type type;
+	size_t offset;
+} msk_stats_fields[] = {
+	{ "tx_bytes", "msk_tx_bytes_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, tx_bytes) },
+	{ "tx_pkt", "msk_tx_packets_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, tx_pkt) },
+	{ "tx_err", "msk_tx_errors_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, tx_err) },
+	{ "rx_bytes", "msk_rx_bytes_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, rx_bytes) },
+	{ "rx_pkt", "msk_rx_packets_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, rx_pkt) },
+	{ "rx_err", "msk_rx_errors_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, rx_err) },
+	{ "nsec_callback", "msk_callback_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_callback) },
+	{ "nsec_compevent", "msk_compevent_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_compevent) },
+	{ "credit_stall", "msk_credit_stall_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, credit_stall) },
+	{ "credit_update", "msk_credit_update_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, credit_update) },
+	{ "nsec_credit_stall", "msk_credit_stall_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_credit_stall) },
+	{ "conn_req_depth", "msk_conn_req_depth", MSK_FIELD_GAUGE, offsetof(struct msk_stats, conn_req_depth) },
+	{ "conn_req_peak", "msk_conn_req_peak", MSK_FIELD_GAUGE, offsetof(struct msk_stats, conn_req_peak) },
+	{ "conn_req_drop", "msk_conn_req_drop_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, conn_req_drop) },
+	{ "warm_hit", "msk_warm_hit_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, warm_hit) },
+	{ "warm_miss", "msk_warm_miss_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, warm_miss) },
+	{ "wctx_pending", "msk_wctx_pending", MSK_FIELD_GAUGE, offsetof(struct msk_stats, wctx_pending) },
+	{ "wctx_processing", "msk_wctx_processing", MSK_FIELD_GAUGE, offsetof(struct msk_stats, wctx_processing) },
+	{ "wctx_peak", "msk_wctx_peak", MSK_FIELD_GAUGE, offsetof(struct msk_stats, wctx_peak) },
+	{ "rctx_pending", "msk_rctx_pending", MSK_FIELD_GAUGE, offsetof(struct msk_stats, rctx_pending) },
+	{ "rctx_processing", "msk_rctx_processing", MSK_FIELD_GAUGE, offsetof(struct msk_stats, rctx_processing) },
+	{ "rctx_peak", "msk_rctx_peak", MSK_FIELD_GAUGE, offsetof(struct msk_stats, rctx_peak) },
+	{ "sq_wait", "msk_sq_wait_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, sq_wait) },
+	{ "nsec_sq_wait", "msk_sq_wait_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_sq_wait) },
+	{ "rq_wait", "msk_rq_wait_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, rq_wait) },
+	{ "nsec_rq_wait", "msk_rq_wait_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_rq_wait) },
+	{ "worker_block", "msk_worker_block_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, worker_block) },
+	{ "nsec_worker_block", "msk_worker_block_seconds_total", MSK_FIELD_NSEC, offsetof(struct msk_stats, nsec_worker_block) },
+	{ "worker_queue_depth", "msk_worker_queue_depth", MSK_FIELD_GAUGE, offsetof(struct msk_stats, worker_queue_depth) },
+	{ "worker_queue_peak", "msk_worker_queue_peak", MSK_FIELD_GAUGE, offsetof(struct msk_stats, worker_queue_peak) },
+	{ "worker_queue_size", "msk_worker_queue_size", MSK_FIELD_GAUGE, offsetof(struct msk_stats, worker_queue_size) },
+	{ "stuck", "msk_stuck_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, stuck) },
+	{ "deadline_expired", "msk_deadline_expired_total", MSK_FIELD_COUNTER, offsetof(struct msk_stats, deadline_expired) },
+};
+
+#define MSK_STATS_FIELD(stats, i) (*(uint64_t *)((char *)(stats) + msk_stats_fields[i].offset))
+
+/* snprintf at the end of buf, returns the new length even if it didn't fit */
+static int msk_stats_append(char *buf, int size, int len, const char *fmt, ...) {
+	va_list ap;
+	int ret;
+
+	if (len >= size)
+		return len;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+
+	return ret < 0 ? len : len + ret;
+}
+
+#define MSK_STATS_THREADS 64	/**< threads listed by the stats socket */
+#define MSK_STATS_CALLBACKS 32	/**< heaviest profiled callbacks listed by the stats socket */
+
+static int msk_stats_text(struct msk_stats *stats, struct msk_srq_stats *srq_stats,
+			  struct msk_thread_stats *threads, int nthreads,
+			  struct msk_callback_stats *callbacks, int ncallbacks, char *buf, int size) {
+	int len, i;
+
+	len = snprintf(buf, size, "stats:\n"
+		"	tx_bytes\ttx_pkt\ttx_err\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
+		"	rx_bytes\trx_pkt\trx_err\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
+		"	callback time:   %"PRIu64".%09"PRIu64" s\n"
+		"	completion time: %"PRIu64".%09"PRIu64" s\n"
+		"	credit_stall\tcredit_update\tstall time\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64".%09"PRIu64" s\n"
+		"	conn_req_depth\tconn_req_peak\tconn_req_drop\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
+		"	warm_hit\twarm_miss\n"
+		"	%10"PRIu64"\t%"PRIu64"\n"
+		"	srq_depth\tsrq_posted\tsrq_pool\tsrq_limit\tsrq_grow\tsrq_starved\tsrq_wait\twait time\n"
+		"	%10u\t%u\t%u\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64".%09"PRIu64" s\n"
+		"	wctx_pending\twctx_processing\twctx_peak\tsq_wait\twait time\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64".%09"PRIu64" s\n"
+		"	rctx_pending\trctx_processing\trctx_peak\trq_wait\twait time\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64".%09"PRIu64" s\n"
+		"	worker_depth\tworker_peak\tworker_size\tworker_block\tblock time\n"
+		"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64".%09"PRIu64" s\n"
+		"	stuck\tdeadline_expired\n"
+		"	%10"PRIu64"\t%"PRIu64"\n"
+		"	op\tpkt\tbytes\terr\n",
+		stats->tx_bytes, stats->tx_pkt, stats->tx_err,
+		stats->rx_bytes, stats->rx_pkt, stats->rx_err,
+		stats->nsec_callback / NSEC_IN_SEC, stats->nsec_callback % NSEC_IN_SEC,
+		stats->nsec_compevent / NSEC_IN_SEC, stats->nsec_compevent % NSEC_IN_SEC,
+		stats->credit_stall, stats->credit_update,
+		stats->nsec_credit_stall / NSEC_IN_SEC, stats->nsec_credit_stall % NSEC_IN_SEC,
+		stats->conn_req_depth, stats->conn_req_peak, stats->conn_req_drop,
+		stats->warm_hit, stats->warm_miss,
+		srq_stats->depth, srq_stats->posted, srq_stats->pool,
+		srq_stats->limit_events, srq_stats->grow, srq_stats->starved,
+		srq_stats->wait, srq_stats->nsec_wait / NSEC_IN_SEC, srq_stats->nsec_wait % NSEC_IN_SEC,
+		stats->wctx_pending, stats->wctx_processing, stats->wctx_peak,
+		stats->sq_wait, stats->nsec_sq_wait / NSEC_IN_SEC, stats->nsec_sq_wait % NSEC_IN_SEC,
+		stats->rctx_pending, stats->rctx_processing, stats->rctx_peak,
+		stats->rq_wait, stats->nsec_rq_wait / NSEC_IN_SEC, stats->nsec_rq_wait % NSEC_IN_SEC,
+		stats->worker_queue_depth, stats->worker_queue_peak, stats->worker_queue_size,
+		stats->worker_block, stats->nsec_worker_block / NSEC_IN_SEC, stats->nsec_worker_block % NSEC_IN_SEC,
+		stats->stuck, stats->deadline_expired);
+	if (len < 0)
+		return 0;
+
+	for (i = 0; i < MSK_OP_COUNT; i++)
+		len = msk_stats_append(buf, size, len, "	%-10s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+			msk_stats_op_name[i], stats->op_pkt[i], stats->op_bytes[i], stats->op_err[i]);
+
+	for (i = 0; i < MSK_WC_STATUS_COUNT; i++)
+		if (stats->wc_err[i])
+			len = msk_stats_append(buf, size, len, "	wc error %s (%d): %"PRIu64"\n",
+				ibv_wc_status_str(i), i, stats->wc_err[i]);
+
+	if (nthreads)
+		len = msk_stats_append(buf, size, len, "threads:\n	name\ttid\tcpu\tidle\tpoll\tcallback\n");
+	for (i = 0; i < nthreads; i++)
+		len = msk_stats_append(buf, size, len, "	%-10s\t%u%s\t%"PRIu64".%09"PRIu64" s\t%"PRIu64".%09"PRIu64" s\t"
+			"%"PRIu64".%09"PRIu64" s\t%"PRIu64".%09"PRIu64" s\n",
+			threads[i].name, threads[i].tid, threads[i].running ? "" : " (exited)",
+			threads[i].nsec_cpu / NSEC_IN_SEC, threads[i].nsec_cpu % NSEC_IN_SEC,
+			threads[i].nsec_idle / NSEC_IN_SEC, threads[i].nsec_idle % NSEC_IN_SEC,
+			threads[i].nsec_poll / NSEC_IN_SEC, threads[i].nsec_poll % NSEC_IN_SEC,
+			threads[i].nsec_callback / NSEC_IN_SEC, threads[i].nsec_callback % NSEC_IN_SEC);
+
+	if (ncallbacks)
+		len = msk_stats_append(buf, size, len, "callbacks:\n	calls\ttotal\tmax\tcallback\n");
+	for (i = 0; i < ncallbacks; i++)
+		len = msk_stats_append(buf, size, len, "	%10"PRIu64"\t%"PRIu64".%09"PRIu64" s\t%"PRIu64".%09"PRIu64" s\t%s\n",
+			callbacks[i].calls,
+			callbacks[i].nsec_total / NSEC_IN_SEC, callbacks[i].nsec_total % NSEC_IN_SEC,
+			callbacks[i].nsec_max / NSEC_IN_SEC, callbacks[i].nsec_max % NSEC_IN_SEC,
+			callbacks[i].symbol);
+
+	return len;
+}
+
+static int msk_stats_json(struct msk_trans *trans, struct msk_stats *stats, struct msk_srq_stats *srq_stats,
+			  struct msk_thread_stats *threads, int nthreads,
+			  struct msk_callback_stats *callbacks, int ncallbacks, char *buf, int size) {
+	int len, i, first;
+
+	len = snprintf(buf, size, "{\"trans\":\"%p\"", trans);
+	if (len < 0)
+		return 0;
+
+	for (i = 0; i < sizeof(msk_stats_fields) / sizeof(msk_stats_fields[0]); i++)
+		len = msk_stats_append(buf, size, len, ",\"%s\":%"PRIu64,
+			msk_stats_fields[i].name, MSK_STATS_FIELD(stats, i));
+
+	len = msk_stats_append(buf, size, len, ",\"op\":{");
+	for (i = 0; i < MSK_OP_COUNT; i++)
+		len = msk_stats_append(buf, size, len, "%s\"%s\":{\"pkt\":%"PRIu64",\"bytes\":%"PRIu64",\"err\":%"PRIu64"}",
+			i ? "," : "", msk_stats_op_name[i], stats->op_pkt[i], stats->op_bytes[i], stats->op_err[i]);
+
+	len = msk_stats_append(buf, size, len, "},\"wc_err\":{");
+	for (i = 0, first = 1; i < MSK_WC_STATUS_COUNT; i++) {
+		if (!stats->wc_err[i])
+			continue;
+		len = msk_stats_append(buf, size, len, "%s\"%s\":%"PRIu64,
+			first ? "" : ",", ibv_wc_status_str(i), stats->wc_err[i]);
+		first = 0;
+	}
+	len = msk_stats_append(buf, size, len, "}");
+
+	if (trans->srq)
+		len = msk_stats_append(buf, size, len, ",\"srq\":{\"depth\":%u,\"posted\":%u,\"pool\":%u,"
+			"\"limit_events\":%"PRIu64",\"grow\":%"PRIu64",\"starved\":%"PRIu64","
+			"\"wait\":%"PRIu64",\"nsec_wait\":%"PRIu64"}",
+			srq_stats->depth, srq_stats->posted, srq_stats->pool,
+			srq_stats->limit_events, srq_stats->grow, srq_stats->starved,
+			srq_stats->wait, srq_stats->nsec_wait);
+
+	len = msk_stats_append(buf, size, len, ",\"threads\":[");
+	for (i = 0; i < nthreads; i++)
+		len = msk_stats_append(buf, size, len, "%s{\"name\":\"%s\",\"tid\":%u,\"running\":%d,"
+			"\"nsec_cpu\":%"PRIu64",\"nsec_idle\":%"PRIu64",\"nsec_poll\":%"PRIu64",\"nsec_callback\":%"PRIu64"}",
+			i ? "," : "", threads[i].name, threads[i].tid, threads[i].running,
+			threads[i].nsec_cpu, threads[i].nsec_idle, threads[i].nsec_poll, threads[i].nsec_callback);
+
+	len = msk_stats_append(buf, size, len, "],\"callbacks\":[");
+	for (i = 0; i < ncallbacks; i++)
+		len = msk_stats_append(buf, size, len, "%s{\"callback\":\"%s\",\"calls\":%"PRIu64","
+			"\"nsec_total\":%"PRIu64",\"nsec_max\":%"PRIu64"}",
+			i ? "," : "", callbacks[i].symbol, callbacks[i].calls,
+			callbacks[i].nsec_total, callbacks[i].nsec_max);
+
+	return msk_stats_append(buf, size, len, "]}\n");
+}
+
+static int msk_stats_prometheus(struct msk_trans *trans, struct msk_stats *stats, struct msk_srq_stats *srq_stats,
+				struct msk_thread_stats *threads, int nthreads,
+				struct msk_callback_stats *callbacks, int ncallbacks, char *buf, int size) {
+	int len = 0, i;
+	uint64_t val;
+
+	for (i = 0; i < sizeof(msk_stats_fields) / sizeof(msk_stats_fields[0]); i++) {
+		val = MSK_STATS_FIELD(stats, i);
+		len = msk_stats_append(buf, size, len, "# TYPE %s %s\n",
+			msk_stats_fields[i].metric, msk_stats_fields[i].type == MSK_FIELD_GAUGE ? "gauge" : "counter");
+		if (msk_stats_fields[i].type == MSK_FIELD_NSEC)
+			len = msk_stats_append(buf, size, len, "%s{trans=\"%p\"} %"PRIu64".%09"PRIu64"\n",
+				msk_stats_fields[i].metric, trans, val / NSEC_IN_SEC, val % NSEC_IN_SEC);
+		else
+			len = msk_stats_append(buf, size, len, "%s{trans=\"%p\"} %"PRIu64"\n",
+				msk_stats_fields[i].metric, trans, val);
+	}
+
+	len = msk_stats_append(buf, size, len, "# TYPE msk_op_packets_total counter\n");
+	for (i = 0; i < MSK_OP_COUNT; i++)
+		len = msk_stats_append(buf, size, len, "msk_op_packets_total{trans=\"%p\",op=\"%s\"} %"PRIu64"\n",
+			trans, msk_stats_op_name[i], stats->op_pkt[i]);
+	len = msk_stats_append(buf, size, len, "# TYPE msk_op_bytes_total counter\n");
+	for (i = 0; i < MSK_OP_COUNT; i++)
+		len = msk_stats_append(buf, size, len, "msk_op_bytes_total{trans=\"%p\",op=\"%s\"} %"PRIu64"\n",
+			trans, msk_stats_op_name[i], stats->op_bytes[i]);
+	len = msk_stats_append(buf, size, len, "# TYPE msk_op_errors_total counter\n");
+	for (i = 0; i < MSK_OP_COUNT; i++)
+		len = msk_stats_append(buf, size, len, "msk_op_errors_total{trans=\"%p\",op=\"%s\"} %"PRIu64"\n",
+			trans, msk_stats_op_name[i], stats->op_err[i]);
+
+	len = msk_stats_append(buf, size, len, "# TYPE msk_wc_errors_total counter\n");
+	for (i = 0; i < MSK_WC_STATUS_COUNT; i++)
+		if (stats->wc_err[i])
+			len = msk_stats_append(buf, size, len, "msk_wc_errors_total{trans=\"%p\",status=\"%s\"} %"PRIu64"\n",
+				trans, ibv_wc_status_str(i), stats->wc_err[i]);
+
+	if (trans->srq)
+		len = msk_stats_append(buf, size, len,
+			"# TYPE msk_srq_depth gauge\nmsk_srq_depth{trans=\"%p\"} %u\n"
+			"# TYPE msk_srq_posted gauge\nmsk_srq_posted{trans=\"%p\"} %u\n"
+			"# TYPE msk_srq_pool gauge\nmsk_srq_pool{trans=\"%p\"} %u\n"
+			"# TYPE msk_srq_limit_events_total counter\nmsk_srq_limit_events_total{trans=\"%p\"} %"PRIu64"\n"
+			"# TYPE msk_srq_grow_total counter\nmsk_srq_grow_total{trans=\"%p\"} %"PRIu64"\n"
+			"# TYPE msk_srq_starved_total counter\nmsk_srq_starved_total{trans=\"%p\"} %"PRIu64"\n"
+			"# TYPE msk_srq_wait_total counter\nmsk_srq_wait_total{trans=\"%p\"} %"PRIu64"\n"
+			"# TYPE msk_srq_wait_seconds_total counter\nmsk_srq_wait_seconds_total{trans=\"%p\"} %"PRIu64".%09"PRIu64"\n",
+			trans, srq_stats->depth, trans, srq_stats->posted, trans, srq_stats->pool,
+			trans, srq_stats->limit_events, trans, srq_stats->grow, trans, srq_stats->starved,
+			trans, srq_stats->wait, trans, srq_stats->nsec_wait / NSEC_IN_SEC, srq_stats->nsec_wait % NSEC_IN_SEC);
+
+	// process wide, no trans label
+	if (nthreads)
+		len = msk_stats_append(buf, size, len, "# TYPE msk_thread_cpu_seconds_total counter\n");
+	for (i = 0; i < nthreads; i++)
+		len = msk_stats_append(buf, size, len, "msk_thread_cpu_seconds_total{thread=\"%s\"} %"PRIu64".%09"PRIu64"\n",
+			threads[i].name, threads[i].nsec_cpu / NSEC_IN_SEC, threads[i].nsec_cpu % NSEC_IN_SEC);
+	if (nthreads)
+		len = msk_stats_append(buf, size, len, "# TYPE msk_thread_wall_seconds_total counter\n");
+	for (i = 0; i < nthreads; i++)
+		len = msk_stats_append(buf, size, len,
+			"msk_thread_wall_seconds_total{thread=\"%s\",state=\"idle\"} %"PRIu64".%09"PRIu64"\n"
+			"msk_thread_wall_seconds_total{thread=\"%s\",state=\"poll\"} %"PRIu64".%09"PRIu64"\n"
+			"msk_thread_wall_seconds_total{thread=\"%s\",state=\"callback\"} %"PRIu64".%09"PRIu64"\n",
+			threads[i].name, threads[i].nsec_idle / NSEC_IN_SEC, threads[i].nsec_idle % NSEC_IN_SEC,
+			threads[i].name, threads[i].nsec_poll / NSEC_IN_SEC, threads[i].nsec_poll % NSEC_IN_SEC,
+			threads[i].name, threads[i].nsec_callback / NSEC_IN_SEC, threads[i].nsec_callback % NSEC_IN_SEC);
+
+	if (ncallbacks)
+		len = msk_stats_append(buf, size, len, "# TYPE msk_profile_calls_total counter\n");
+	for (i = 0; i < ncallbacks; i++)
+		len = msk_stats_append(buf, size, len, "msk_profile_calls_total{callback=\"%s\"} %"PRIu64"\n",
+			callbacks[i].symbol, callbacks[i].calls);
+	if (ncallbacks)
+		len = msk_stats_append(buf, size, len, "# TYPE msk_profile_seconds_total counter\n");
+	for (i = 0; i < ncallbacks; i++)
+		len = msk_stats_append(buf, size, len, "msk_profile_seconds_total{callback=\"%s\"} %"PRIu64".%09"PRIu64"\n",
+			callbacks[i].symbol, callbacks[i].nsec_total / NSEC_IN_SEC, callbacks[i].nsec_total % NSEC_IN_SEC);
+	if (ncallbacks)
+		len = msk_stats_append(buf, size, len, "# TYPE msk_profile_max_seconds gauge\n");
+	for (i = 0; i < ncallbacks; i++)
+		len = msk_stats_append(buf, size, len, "msk_profile_max_seconds{callback=\"%s\"} %"PRIu64".%09"PRIu64"\n",
+			callbacks[i].symbol, callbacks[i].nsec_max / NSEC_IN_SEC, callbacks[i].nsec_max % NSEC_IN_SEC);
+
+	return len;
+}
+
+/**
+ * msk_stats_format: what the stats socket sends, in the transport's stats_format
+ *
+ * @return length written in buf, truncated to size - 1
+ */
+static int msk_stats_format(struct msk_trans *trans, char *buf, int size) {
+	struct msk_stats stats;
+	struct msk_srq_stats srq_stats;
+	struct msk_thread_stats threads[MSK_STATS_THREADS];
+	struct msk_callback_stats callbacks[MSK_STATS_CALLBACKS];
+	int len, nthreads, ncallbacks;
+
+	msk_get_stats(trans, &stats);
+	if (msk_srq_stats(trans, &srq_stats))
+		memset(&srq_stats, 0, sizeof(srq_stats));
+	nthreads = msk_get_thread_stats(threads, MSK_STATS_THREADS);
+	if (nthreads > MSK_STATS_THREADS)
+		nthreads = MSK_STATS_THREADS;
+	ncallbacks = msk_get_callback_stats(callbacks, MSK_STATS_CALLBACKS);
+	if (ncallbacks > MSK_STATS_CALLBACKS)
+		ncallbacks = MSK_STATS_CALLBACKS;
+
+	switch (trans->stats_format) {
+		case MSK_STATS_JSON:
+			len = msk_stats_json(trans, &stats, &srq_stats, threads, nthreads, callbacks, ncallbacks, buf, size);
+			break;
+		case MSK_STATS_PROMETHEUS:
+			len = msk_stats_prometheus(trans, &stats, &srq_stats, threads, nthreads, callbacks, ncallbacks, buf, size);
+			break;
+		default:
+			len = msk_stats_text(&stats, &srq_stats, threads, nthreads, callbacks, ncallbacks, buf, size);
+			break;
+	}
+
+	return len < size ? len : size - 1;
+}
+
 /**
  * msk_stats_thread: unix socket thread
  *
@@ -783,12 +2566,21 @@ static inline int msk_stats_del(struct msk_trans *trans) {
 void *msk_stats_thread(void *arg) {
 	struct msk_trans *trans;
 	struct epoll_event epoll_events[EPOLL_MAX_EVENTS];
-	char stats_str[256];
+	char stats_str[65536];
 	int nfds, n, childfd;
 	int ret;
 
+	msk_thread_start("stats");
+
 	while (msk_global_state->run_threads > 0) {
-		nfds = epoll_wait(msk_global_state->stats_epollfd, epoll_events, EPOLL_MAX_EVENTS, 100);
+		msk_thread_switch(MSK_THREAD_IDLE);
+		nfds = epoll_wait(msk_global_state->stats_epollfd, epoll_events, EPOLL_MAX_EVENTS,
+				  msk_global_state->stuck_scan_ms && msk_global_state->stuck_scan_ms < 100 ? msk_global_state->stuck_scan_ms : 100);
+		msk_thread_switch(MSK_THREAD_POLL);
+		if (msk_global_state->stats_shm)
+			msk_stats_shm_publish();
+		if (msk_global_state->stuck_trans)
+			msk_stuck_scan();
 		if (nfds == 0 || (nfds == -1 && errno == EINTR))
 			continue;
 
@@ -819,23 +2611,13 @@ void *msk_stats_thread(void *arg) {
 				}
 			}
 
-			ret = snprintf(stats_str, sizeof(stats_str), "stats:\n"
-				"	tx_bytes\ttx_pkt\ttx_err\n"
-				"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
-				"	rx_bytes\trx_pkt\trx_err\n"
-				"	%10"PRIu64"\t%"PRIu64"\t%"PRIu64"\n"
-				"	callback time:   %"PRIu64".%09"PRIu64" s\n"
-				"	completion time: %"PRIu64".%09"PRIu64" s\n",
-				trans->stats.tx_bytes, trans->stats.tx_pkt,
-				trans->stats.tx_err, trans->stats.rx_bytes,
-				trans->stats.rx_pkt, trans->stats.rx_err,
-				trans->stats.nsec_callback / NSEC_IN_SEC, trans->stats.nsec_callback % NSEC_IN_SEC,
-				trans->stats.nsec_compevent / NSEC_IN_SEC, trans->stats.nsec_compevent % NSEC_IN_SEC);
+			ret = msk_stats_format(trans, stats_str, sizeof(stats_str));
 			ret = write(childfd, stats_str, ret);
 			ret = close(childfd);
 		}
 	}
 
+	msk_thread_stop();
 	pthread_exit(NULL);
 }
 
@@ -844,9 +2626,9 @@ void *msk_stats_thread(void *arg) {
  *
  */
 static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *event) {
-	int i;
 	int ret = 0;
 	struct msk_trans *trans = cm_id->context;
+	enum msk_state old_state = trans->state;
 
 	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "cma_event type %s", rdma_event_str(event->event));
 
@@ -868,6 +2650,8 @@ static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event
 
 	case RDMA_CM_EVENT_ROUTE_RESOLVED:
 		INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "ROUTE_RESOLVED");
+		if (trans->route_cache_ttl)
+			msk_route_cache_put_path(trans);
 		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 		trans->state = MSK_ROUTE_RESOLVED;
 		pthread_cond_broadcast(&trans->cm_cond);
@@ -880,7 +2664,7 @@ static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event
 		if ((ret = msk_check_create_epoll_thread(&msk_global_state->cq_thread, msk_cq_thread, trans, &msk_global_state->cq_epollfd))) {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread for cq failed: %s (%d)", strerror(ret), ret);
 			trans->state = MSK_ERROR;
-		} else if (trans->stats_prefix != NULL && (ret = msk_check_create_epoll_thread(&msk_global_state->stats_thread, msk_stats_thread, trans, &msk_global_state->stats_epollfd))) {
+		} else if ((trans->stats_prefix || trans->stats_shm || trans->stuck_ms) && (ret = msk_check_create_epoll_thread(&msk_global_state->stats_thread, msk_stats_thread, trans, &msk_global_state->stats_epollfd))) {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread for stats failed: %s (%d)", strerror(ret), ret);
 			trans->state = MSK_ERROR;
 		} else {
@@ -893,24 +2677,30 @@ static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event
 
 	case RDMA_CM_EVENT_CONNECT_REQUEST:
 		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "CONNECT_REQUEST");
+		// datagram endpoint: a peer wants our qp number, nothing to queue
+		if (trans->ud) {
+			ret = msk_ud_sidr_reply(trans, cm_id);
+			break;
+		}
 		//even if the cm_id is new, trans is the good parent's trans.
 		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 
-		//FIXME don't run through this stupidely and remember last index written to and last index read, i.e. use as a queue
-		/* Find an empty connection request slot */
-		for (i = 0; i < trans->server; i++)
-			if (!trans->conn_requests[i])
-				break;
-
-		if (i == trans->server) {
+		if (trans->conn_count == trans->server) {
+			trans->stats.conn_req_drop++;
 			msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not pile up new connection requests' cm_id!");
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "connection request queue full (%d), rejecting", trans->server);
+			/* the cm thread destroys the id once the event is acked */
+			rdma_reject(cm_id, NULL, 0);
 			ret = ENOBUFS;
 			break;
 		}
 
-		// write down new cm_id and signal accept handler there's stuff to do
-		trans->conn_requests[i] = cm_id;
+		// queue new cm_id and signal accept handler there's stuff to do
+		trans->conn_requests[(trans->conn_head + trans->conn_count) % trans->server] = cm_id;
+		trans->conn_count++;
+		trans->stats.conn_req_depth = trans->conn_count;
+		if (trans->conn_count > trans->stats.conn_req_peak)
+			trans->stats.conn_req_peak = trans->conn_count;
 		pthread_cond_broadcast(&trans->cm_cond);
 		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 
@@ -923,6 +2713,9 @@ static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event
 	case RDMA_CM_EVENT_REJECTED:
 		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "cma event %s, error %d",
 			rdma_event_str(event->event), event->status);
+		/* a rejection means the peer is there, keep what we know about the route */
+		if (trans->route_cache_ttl && event->event != RDMA_CM_EVENT_REJECTED)
+			msk_route_cache_invalidate(trans);
 		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 		trans->state = MSK_ERROR;
 		pthread_cond_broadcast(&trans->cm_cond);
@@ -966,9 +2759,42 @@ static int msk_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event
 		break;
 	}
 
+	MSK_PROBE(cm_event, trans, event->event, event->status, old_state, trans->state);
+
+	/* non-blocking connect: move on to the next step from here */
+	if (trans->server == MSK_CLIENT && trans->connect_done_cb && trans->connect_status == EINPROGRESS)
+		msk_connect_async_event(trans, event);
+
 	return ret;
 }
 
+/**
+ * msk_cm_event: hands one event to the handler, acks it, then does what can only be done after the ack
+ */
+static void msk_cm_event(struct rdma_cm_event *event) {
+	struct msk_trans *trans;
+	struct rdma_cm_id *cm_id;
+	enum rdma_cm_event_type event_type;
+	int ret;
+
+	ret = msk_cma_event_handler(event->id, event);
+
+	trans = event->id->context;
+	if (ret && (trans->state != MSK_LISTENING || trans == event->id->context)) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "something happened in cma_event_handler: %d", ret);
+	}
+	cm_id = event->id;
+	event_type = event->event;
+	rdma_ack_cm_event(event);
+
+	/* rejected connection request or answered datagram lookup, can only be destroyed after ack */
+	if (event_type == RDMA_CM_EVENT_CONNECT_REQUEST && (ret == ENOBUFS || trans->ud))
+		rdma_destroy_id(cm_id);
+
+	if (trans->state == MSK_CLOSED && trans->destroy_on_disconnect)
+		msk_destroy_trans(&trans);
+}
+
 /**
  * msk_cm_thread: thread function which waits for new connection events and gives them to handler (then ack the event)
  *
@@ -977,11 +2803,20 @@ static void *msk_cm_thread(void *arg) {
 	struct msk_trans *trans;
 	struct rdma_cm_event *event;
 	struct epoll_event epoll_events[EPOLL_MAX_EVENTS];
-	int nfds, n;
+	int nfds, n, i;
 	int ret;
 
+	msk_thread_start("cm");
+
 	while (msk_global_state->run_threads > 0) {
+		// in between events, so connection requests aren't kept waiting long
+		msk_warm_refill_all();
+		if (msk_global_state->connecting)
+			msk_connect_async_expire();
+
+		msk_thread_switch(MSK_THREAD_IDLE);
 		nfds = epoll_wait(msk_global_state->cm_epollfd, epoll_events, EPOLL_MAX_EVENTS, 100);
+		msk_thread_switch(MSK_THREAD_POLL);
 
 		if (nfds == 0 || (nfds == -1 && errno == EINTR))
 			continue;
@@ -993,6 +2828,28 @@ static void *msk_cm_thread(void *arg) {
 		}
 
 		for (n = 0; n < nfds; ++n) {
+			if (epoll_events[n].data.ptr == msk_global_state) {
+				/* shared channel: events carry their trans in cm_id->context.
+				 * Drain a batch, epoll will wake us again if there is more */
+				for (i = 0; i < MSK_CM_DRAIN_MAX; i++) {
+					if (rdma_get_cm_event(msk_global_state->cm_channel, &event)) {
+						ret = errno;
+						if (ret != EAGAIN && ret != EWOULDBLOCK)
+							INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "rdma_get_cm_event failed: %d.", ret);
+						break;
+					}
+					msk_cm_event(event);
+				}
+				INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "%d events on the shared cm channel", i);
+				continue;
+			}
+			// device async fds are tagged with their registry entry
+			if ((struct msk_dev *)epoll_events[n].data.ptr >= msk_global_state->devs
+			    && (struct msk_dev *)epoll_events[n].data.ptr < msk_global_state->devs + msk_global_state->dev_count) {
+				msk_async_event(epoll_events[n].data.ptr);
+				continue;
+			}
+
 			trans = (struct msk_trans*)epoll_events[n].data.ptr;
 			if (!trans) {
 				INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "got an event on a fd that should have been removed! (no trans)");
@@ -1020,19 +2877,11 @@ static void *msk_cm_thread(void *arg) {
 				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_get_cm_event failed: %d.", ret);
 				continue;
 			}
-			ret = msk_cma_event_handler(event->id, event);
-
-			trans = event->id->context;
-			if (ret && (trans->state != MSK_LISTENING || trans == event->id->context)) {
-				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "something happened in cma_event_handler: %d", ret);
-			}
-			rdma_ack_cm_event(event);
-
-			if (trans->state == MSK_CLOSED && trans->destroy_on_disconnect)
-				msk_destroy_trans(&trans);
+			msk_cm_event(event);
 		}
 	}
 
+	msk_thread_stop();
 	pthread_exit(NULL);
 }
 
@@ -1049,6 +2898,7 @@ static int msk_cq_event_handler(struct msk_trans *trans) {
 	struct ibv_cq *ev_cq;
 	void *ev_ctx;
 	struct msk_ctx *ctx;
+	struct msk_stats_slot *slot = msk_stats_slot(trans);
 	msk_data_t *data;
 	int ret, i;
 	int npoll = 0;
@@ -1075,25 +2925,21 @@ static int msk_cq_event_handler(struct msk_trans *trans) {
 	while (ret == 0 && (npoll = ibv_poll_cq(trans->cq, NUM_WQ_PER_POLL, wc)) > 0) {
 		for (i=0; i < npoll; i++) {
 			if (trans->bad_recv_wr) {
-				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Something was bad on that recv");
+				DATA_LOG(trans->debug & MSK_DEBUG_EVENT, "Something was bad on that recv");
 			}
 			if (trans->bad_send_wr) {
-				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Something was bad on that send");
+				DATA_LOG(trans->debug & MSK_DEBUG_EVENT, "Something was bad on that send");
 			}
+			msk_trace(trans, (struct msk_ctx *)(uintptr_t)wc[i].wr_id, MSK_TRACE_COMPLETION, wc[i].opcode, wc[i].status, wc[i].byte_len);
+			MSK_PROBE(completion, trans, ((struct msk_ctx *)(uintptr_t)wc[i].wr_id)->data, wc[i].opcode, wc[i].status, wc[i].byte_len);
 			if (wc[i].status) {
-				switch (wc[i].opcode) {
-					case IBV_WC_SEND:
-					case IBV_WC_RDMA_WRITE:
-					case IBV_WC_RDMA_READ:
-						trans->stats.tx_err++;
-						break;
-					case IBV_WC_RECV:
-					case IBV_WC_RECV_RDMA_WITH_IMM:
-						trans->stats.rx_err++;
-						break;
-					default:
-						break;
-				}
+				atomic_inc(slot->op_err[msk_stats_ctx_op(trans, (struct msk_ctx *)(uintptr_t)wc[i].wr_id)]);
+				atomic_inc(slot->wc_err[wc[i].status < MSK_WC_STATUS_COUNT ? wc[i].status : MSK_WC_STATUS_COUNT - 1]);
+				// flushed srq receives are not posted anymore either
+				if (trans->srq && !msk_ctx_is_wctx(trans, (struct msk_ctx *)(uintptr_t)wc[i].wr_id))
+					atomic_dec(((struct msk_srq *)trans->srq->srq_context)->posted);
+				/* opcode isn't valid on error, the window can be told from the ctx */
+				msk_mw_completion(trans, (struct msk_ctx *)(uintptr_t)wc[i].wr_id, wc[i].status);
 				msk_signal_worker(trans, (struct msk_ctx *)(uintptr_t)wc[i].wr_id, wc[i].status, wc[i].opcode);
 
 				if (trans->state != MSK_CLOSED && trans->state != MSK_CLOSING && trans->state != MSK_ERROR) {
@@ -1108,32 +2954,46 @@ static int msk_cq_event_handler(struct msk_trans *trans) {
 			case IBV_WC_SEND:
 			case IBV_WC_RDMA_WRITE:
 			case IBV_WC_RDMA_READ:
-				INFO_LOG(trans->debug & MSK_DEBUG_SEND, "WC_SEND/RDMA_WRITE/RDMA_READ: %d", wc[i].opcode);
+				DATA_LOG(trans->debug & MSK_DEBUG_SEND, "WC_SEND/RDMA_WRITE/RDMA_READ: %d", wc[i].opcode);
 				ctx = (struct msk_ctx *)(uintptr_t)wc[i].wr_id;
-				trans->stats.tx_pkt++;
+				atomic_inc(slot->op_pkt[msk_stats_op(wc[i].opcode)]);
 				// wc[i].byte_len isn't filled on send, apparently
-				trans->stats.tx_bytes += ctx->data->size;
+				atomic_add(slot->op_bytes[msk_stats_op(wc[i].opcode)], ctx->data->size);
 
 				if (wc[i].wc_flags & IBV_WC_WITH_IMM) {
 					//FIXME ctx->data->imm_data = ntohl(wc.imm_data);
-					INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "imm_data: %d", ntohl(wc[i].imm_data));
+					DATA_LOG(trans->debug & MSK_DEBUG_EVENT, "imm_data: %d", ntohl(wc[i].imm_data));
 				}
 
 				msk_signal_worker(trans, ctx, wc[i].status, wc[i].opcode);
 				break;
 
+			case IBV_WC_BIND_MW:
+			case IBV_WC_LOCAL_INV:
+				DATA_LOG(trans->debug & MSK_DEBUG_SEND, "WC_BIND_MW/LOCAL_INV: %d", wc[i].opcode);
+				ctx = (struct msk_ctx *)(uintptr_t)wc[i].wr_id;
+				atomic_inc(slot->op_pkt[MSK_OP_OTHER]);
+				msk_mw_completion(trans, ctx, wc[i].status);
+				msk_signal_worker(trans, ctx, wc[i].status, wc[i].opcode);
+				break;
+
 			case IBV_WC_RECV:
 			case IBV_WC_RECV_RDMA_WITH_IMM:
-				INFO_LOG(trans->debug & MSK_DEBUG_RECV, "WC_RECV");
-				trans->stats.rx_pkt++;
-				trans->stats.rx_bytes += wc[i].byte_len;
+				DATA_LOG(trans->debug & MSK_DEBUG_RECV, "WC_RECV");
+				atomic_inc(slot->op_pkt[MSK_OP_RECV]);
+				atomic_add(slot->op_bytes[MSK_OP_RECV], wc[i].byte_len);
+
+				if (wc[i].wc_flags & IBV_WC_WITH_INV)
+					msk_mw_remote_inv(trans, wc[i].invalidated_rkey);
 
 				if (wc[i].wc_flags & IBV_WC_WITH_IMM) {
 					//FIXME ctx->data->imm_data = ntohl(wc.imm_data);
-					INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "imm_data: %d", ntohl(wc[i].imm_data));
+					DATA_LOG(trans->debug & MSK_DEBUG_EVENT, "imm_data: %d", ntohl(wc[i].imm_data));
 				}
 
 				ctx = (struct msk_ctx *)(uintptr_t)wc[i].wr_id;
+				if (trans->srq)
+					atomic_dec(((struct msk_srq *)trans->srq->srq_context)->posted);
 			
 				// fill all the sizes in case of multiple sge
 				len = wc[i].byte_len;
@@ -1182,8 +3042,16 @@ static void *msk_cq_thread(void *arg) {
 	int nfds, n;
 	int ret;
 
+	msk_thread_start("cq");
+
 	while (msk_global_state->run_threads > 0) {
-		nfds = epoll_wait(msk_global_state->cq_epollfd, epoll_events, EPOLL_MAX_EVENTS, 100);
+		// one tick while deadlines are armed
+		msk_thread_switch(MSK_THREAD_IDLE);
+		nfds = epoll_wait(msk_global_state->cq_epollfd, epoll_events, EPOLL_MAX_EVENTS,
+				  msk_global_state->wheel.count ? 1 : 100);
+		msk_thread_switch(MSK_THREAD_POLL);
+		if (msk_global_state->wheel.count)
+			msk_wheel_run();
 		if (nfds == 0 || (nfds == -1 && errno == EINTR))
 			continue;
 
@@ -1201,6 +3069,14 @@ static void *msk_cq_thread(void *arg) {
 				continue;
 			}
 
+			// just a wakeup, the wheel runs every loop
+			if (epoll_events[n].data.ptr == &msk_global_state->wheel) {
+				uint64_t val;
+				if (eventfd_read(msk_global_state->wheel.efd, &val))
+					INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "eventfd_read failed: %d", errno);
+				continue;
+			}
+
 			if (epoll_events[n].events == EPOLLERR || epoll_events[n].events == EPOLLHUP) {
 				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "epoll error or hup (%d)", epoll_events[n].events);
 				continue;
@@ -1228,11 +3104,12 @@ static void *msk_cq_thread(void *arg) {
 
 			if (trans->debug & MSK_DEBUG_SPEED) {
 				clock_gettime(CLOCK_MONOTONIC, &ts_end);
-				sub_timespec(&trans->stats.nsec_compevent, &ts_start, &ts_end);
+				msk_stats_time(&msk_stats_slot(trans)->nsec_compevent, &ts_start, &ts_end);
 			}
 		}
 	}
 
+	msk_thread_stop();
 	pthread_exit(NULL);
 }
 
@@ -1245,7 +3122,7 @@ static void *msk_cq_thread(void *arg) {
  */
 static void msk_flush_buffers(struct msk_trans *trans) {
 	struct msk_ctx *ctx;
-	int i, wait, ret;
+	int i, ret;
 
 	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "flushing %p", trans);
 
@@ -1274,29 +3151,48 @@ static void msk_flush_buffers(struct msk_trans *trans) {
 		if (ctx->used == MSK_CTX_PENDING)
 			msk_signal_worker(trans, ctx, IBV_WC_FATAL_ERR, IBV_WC_SEND);
 
-	/* only flush rx if client or accepting server */
-	if (trans->server >= 0) do {
-		wait = 0;
-			for (i = 0, ctx = trans->rctx;
-			     i < trans->rq_depth;
-			     i++, ctx = msk_next_ctx(ctx, trans->max_recv_sge))
-				if (ctx->used != MSK_CTX_FREE)
-					wait++;
-
-	} while (wait && usleep(100000));
-	do {
-		wait = 0;
-		for (i = 0, ctx = (struct msk_ctx *)trans->wctx;
-		     i < trans->sq_depth;
-		     i++, ctx = msk_next_ctx(ctx, trans->max_recv_sge))
-			if (ctx->used != MSK_CTX_FREE)
-				wait++;
-
-	} while (wait && usleep(100000));
+	/* the rest is with the workers, whoever gives the last context back wakes us up.
+	 * Contexts a failed post gives back don't, but that is only the poster's
+	 * own: a callback reposting still holds the one it runs for */
+	trans->flushing = 1;
+	while (atomic_load(&trans->outstanding) > 0) {
+		INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "waiting for %u contexts", trans->outstanding);
+		msk_cond_wait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock);
+	}
+	trans->flushing = 0;
 
 	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 }
 
+/**
+ * msk_put_pd: drops a reference to a pd array, freeing it with the last one
+ */
+static void msk_put_pd(struct msk_pd *pd) {
+	int i = 0;
+
+	if (atomic_dec(pd->refcnt) != 0)
+		return;
+
+	/* slots are indexed by device, so there can be holes */
+	while (pd[i].context != PD_GUARD) {
+		// the srq holds a reference on the pd
+		if (pd[i].srq) {
+			struct msk_srq *srq = pd[i].srq->srq_context;
+			ibv_destroy_srq(pd[i].srq);
+			msk_srq_free(srq);
+		}
+		pd[i].srq = NULL;
+		if (pd[i].pd)
+			ibv_dealloc_pd(pd[i].pd);
+		pd[i].pd = NULL;
+		if (pd[i].rctx)
+			free(pd[i].rctx);
+		pd[i].rctx = NULL;
+		i++;
+	}
+	free(pd);
+}
+
 /**
  * msk_destroy_qp: destroys all qp-related stuff for us
  *
@@ -1308,10 +3204,15 @@ static void msk_destroy_qp(struct msk_trans *trans) {
 	if (trans->qp) {
 		// flush all pending receive/send buffers to error callback
 		msk_flush_buffers(trans);
+		msk_msg_destroy(trans);
+		msk_mw_destroy(trans);
 
 		ibv_destroy_qp(trans->qp);
 		trans->qp = NULL;
 	}
+	// address handles go before their pd
+	if (trans->ud)
+		msk_ud_destroy(trans);
 	if (trans->cq) {
 		ibv_destroy_cq(trans->cq);
 		trans->cq = NULL;
@@ -1322,23 +3223,8 @@ static void msk_destroy_qp(struct msk_trans *trans) {
 	}
 	/* only dealloc PDs if client or accepting server */
 	if (trans->server >= 0 && trans->pd) {
-		if (atomic_dec(trans->pd->refcnt) == 0) {
-			int i = 0;
-			while (trans->pd[i].context != PD_GUARD && trans->pd[i].context != NULL) {
-				if (trans->pd[i].pd)
-					ibv_dealloc_pd(trans->pd[i].pd);
-				trans->pd[i].pd = NULL;
-				if (trans->pd[i].srq)
-					ibv_destroy_srq(trans->pd[i].srq);
-				trans->pd[i].srq = NULL;
-				if (trans->pd[i].rctx)
-					free(trans->pd[i].rctx);
-				trans->pd[i].rctx = NULL;
-				i++;
-			}
-			free(trans->pd);
-			trans->pd = NULL;
-		}
+		msk_put_pd(trans->pd);
+		trans->pd = NULL;
 	}
 	if (!trans->srq) {
 		free(trans->rctx);
@@ -1361,13 +3247,26 @@ void msk_destroy_trans(struct msk_trans **ptrans) {
 
 	if (trans) {
 		trans->destroy_on_disconnect = 0;
-		if (trans->state == MSK_CONNECTED || trans->state == MSK_CLOSED) {
+		msk_stats_shm_del(trans);
+		msk_stuck_del(trans);
+		msk_record_del(trans);
+		if (trans->connect_done_cb)
+			msk_connect_async_del(trans);
+		// no connection, so no disconnect event to wait for
+		if (trans->ud && trans->state == MSK_CONNECTED) {
+			msk_cq_delfd(trans);
+			trans->state = MSK_CLOSED;
+		}
+		// CLOSING if msk_destroy_many already disconnected it
+		if (trans->state == MSK_CONNECTED || trans->state == MSK_CLOSING || trans->state == MSK_CLOSED) {
 			msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
-			if (trans->state != MSK_CLOSED && trans->state != MSK_LISTENING && trans->state != MSK_ERROR)
-				trans->state = MSK_CLOSING;
+			if (trans->state != MSK_CLOSING) {
+				if (trans->state != MSK_CLOSED && trans->state != MSK_LISTENING && trans->state != MSK_ERROR)
+					trans->state = MSK_CLOSING;
 
-			if (trans->cm_id && trans->cm_id->verbs)
-				rdma_disconnect(trans->cm_id);
+				if (trans->cm_id && trans->cm_id->verbs)
+					rdma_disconnect(trans->cm_id);
+			}
 
 			while (trans->state != MSK_CLOSED && trans->state != MSK_LISTENING && trans->state != MSK_ERROR) {
 				INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "we're not closed yet, waiting for disconnect_event");
@@ -1377,18 +3276,46 @@ void msk_destroy_trans(struct msk_trans **ptrans) {
 			msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 		}
 
+		// children got a copy of the pointer, only the listener owns the ring
+		if (trans->server > 0 && trans->conn_requests) {
+			// reject whatever was never accepted
+			msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+			while (trans->conn_count > 0) {
+				struct rdma_cm_id *cm_id = msk_pop_conn_request(trans);
+				rdma_reject(cm_id, NULL, 0);
+				rdma_destroy_id(cm_id);
+			}
+			msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+			free(trans->conn_requests);
+			trans->conn_requests = NULL;
+		}
+
+		if (trans->server > 0 && trans->warm)
+			msk_warm_destroy(trans);
+
+		if (trans->server > 0)
+			msk_stripe_pending_drop(trans);
+
 		if (trans->cm_id) {
 			rdma_destroy_id(trans->cm_id);
 			trans->cm_id = NULL;
 		}
 
+		if (trans->resvport) {
+			msk_resvport_put(trans->resvport);
+			trans->resvport = 0;
+		}
+
 		if (trans->stats_sock)
 			msk_stats_del(trans);
 
 		// event channel is shared between all children, so don't close it unless it's its own.
+		// The process-wide one stays for the next shared_cm transport.
 		if ((trans->server != MSK_SERVER_CHILD) && trans->event_channel) {
-			msk_cm_delfd(trans);
-			rdma_destroy_event_channel(trans->event_channel);
+			if (trans->event_channel != msk_global_state->cm_channel) {
+				msk_cm_delfd(trans);
+				rdma_destroy_event_channel(trans->event_channel);
+			}
 			trans->event_channel = NULL;
 
 			// likewise for stats prefix
@@ -1399,6 +3326,8 @@ void msk_destroy_trans(struct msk_trans **ptrans) {
 				free(trans->node);
 			if (trans->port)
 				free(trans->port);
+			if (trans->bind_node)
+				free(trans->bind_node);
 
 		}
 
@@ -1430,11 +3359,41 @@ void msk_destroy_trans(struct msk_trans **ptrans) {
 		pthread_mutex_destroy(&trans->cm_lock);
 		pthread_cond_destroy(&trans->cm_cond);
 
+		free(trans->stats_slots);
 		free(trans);
 		*ptrans = NULL;
 	}
 }
 
+/**
+ * msk_destroy_many: destroys a set of transports. All of them are
+ * disconnected first so the disconnect events come in together instead
+ * of one round trip per transport.
+ *
+ * @param trans [INOUT] array of transports, entries are set to NULL
+ * @param count [IN]    number of entries, NULL ones are skipped
+ */
+void msk_destroy_many(struct msk_trans **trans, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!trans[i])
+			continue;
+
+		trans[i]->destroy_on_disconnect = 0;
+		msk_mutex_lock(trans[i]->debug & MSK_DEBUG_CM_LOCKS, &trans[i]->cm_lock);
+		if (trans[i]->state == MSK_CONNECTED) {
+			trans[i]->state = MSK_CLOSING;
+			if (trans[i]->cm_id && trans[i]->cm_id->verbs)
+				rdma_disconnect(trans[i]->cm_id);
+		}
+		msk_mutex_unlock(trans[i]->debug & MSK_DEBUG_CM_LOCKS, &trans[i]->cm_lock);
+	}
+
+	for (i = 0; i < count; i++)
+		msk_destroy_trans(&trans[i]);
+}
+
 /**
  * msk_init: part of the init that's the same for client and server
  *
@@ -1462,7 +3421,10 @@ int msk_init(struct msk_trans **ptrans, struct msk_trans_attr *attr) {
 	do {
 		memset(trans, 0, sizeof(struct msk_trans));
 
-		trans->event_channel = rdma_create_event_channel();
+		if (attr->shared_cm)
+			trans->event_channel = msk_cm_channel_get();
+		else
+			trans->event_channel = rdma_create_event_channel();
 		if (!trans->event_channel) {
 			ret = errno;
 			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "create_event_channel failed: %s (%d)", strerror(ret), ret);
@@ -1497,6 +3459,14 @@ int msk_init(struct msk_trans **ptrans, struct msk_trans_attr *attr) {
 				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc trans->port");
 				break;
 		}
+		if (attr->bind_node && !attr->server) {
+			trans->bind_node = strdup(attr->bind_node);
+			if (!trans->bind_node) {
+				ret = ENOMEM;
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc trans->bind_node");
+				break;
+			}
+		}
 		/*memcpy(trans->qp_attr, attr->qp_attr, sizeof(struct ibv_qp_init_attr));*/
 
 		/* fill in default values */
@@ -1515,6 +3485,37 @@ int msk_init(struct msk_trans **ptrans, struct msk_trans_attr *attr) {
 		trans->disconnect_callback = attr->disconnect_callback;
 		trans->destroy_on_disconnect = attr->destroy_on_disconnect;
 		trans->privport = attr->privport;
+		trans->msg_threshold = attr->msg_threshold;
+		trans->flow_control = attr->flow_control;
+		trans->mw_count = attr->mw_count;
+		trans->route_cache_ttl = attr->route_cache_ttl;
+		trans->warm_count = attr->warm_count;
+		if (attr->srq_limit && attr->srq_limit >= trans->rq_depth) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "srq_limit (%u) must be below rq_depth (%u)", attr->srq_limit, trans->rq_depth);
+			ret = EINVAL;
+			break;
+		}
+		trans->srq_limit = attr->srq_limit;
+		trans->srq_max_wr = attr->srq_max_wr;
+		trans->stats_format = attr->stats_format;
+		trans->stuck_ms = attr->stuck_ms;
+		trans->stuck_callback = attr->stuck_callback;
+		trans->op_timeout_ms = attr->op_timeout_ms;
+		trans->stats_shm_index = -1;
+		if (attr->stats_shm) {
+			ret = msk_stats_shm_open(attr->stats_shm, attr->stats_shm_entries ? attr->stats_shm_entries : MSK_STATS_SHM_ENTRIES);
+			if (ret) {
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't set up stats_shm region: %s (%d)", strerror(ret), ret);
+				break;
+			}
+			trans->stats_shm = 1;
+		}
+		trans->stats_slots = msk_stats_slots_alloc();
+		if (!trans->stats_slots) {
+			ret = ENOMEM;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc trans->stats_slots");
+			break;
+		}
 		if (attr->stats_prefix) {
 			ret = strlen(attr->stats_prefix)+1;
 			trans->stats_prefix = malloc(ret);
@@ -1599,7 +3600,7 @@ static int msk_create_qp(struct msk_trans *trans, struct rdma_cm_id *cm_id) {
 	pd = msk_getpd(trans);
 	if (!pd) {
 		ret = ENOSPC;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No space left in msk pd, multiple contexts per device?");
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No pd slot for this device");
 		return ret;
 	}
 
@@ -1613,6 +3614,222 @@ static int msk_create_qp(struct msk_trans *trans, struct rdma_cm_id *cm_id) {
 	return 0;
 }
 
+/* WARM POOL */
+
+#define MSK_WARM_REFILL_BATCH 4	/**< entries made per cm thread loop */
+
+/**
+ * \struct msk_warm_entry
+ * completion channel, cq and context arrays made before the connection request
+ */
+struct msk_warm_entry {
+	struct msk_warm_entry *next;
+	struct ibv_comp_channel *comp_channel;
+	struct ibv_cq *cq;
+	struct msk_ctx *wctx;
+	struct msk_ctx *rctx;		/**< NULL with srq, the pd has them */
+};
+
+struct msk_warm_dev {
+	struct ibv_context *context;	/**< NULL if the listener can't get connections there */
+	struct msk_warm_entry *head;
+	int count;
+};
+
+struct msk_warm_pool {
+	struct msk_warm_pool *next;	/**< msk_global_state->warm_pools */
+	struct msk_trans *trans;	/**< the listener, children get its sizes */
+	pthread_mutex_t lock;
+	int ndev;
+	struct msk_warm_dev devs[0];	/**< indexed by device */
+};
+
+static void msk_warm_free_entry(struct msk_warm_entry *entry) {
+	if (entry->cq)
+		ibv_destroy_cq(entry->cq);
+	if (entry->comp_channel)
+		ibv_destroy_comp_channel(entry->comp_channel);
+	free(entry->wctx);
+	free(entry->rctx);
+	free(entry);
+}
+
+static struct msk_warm_entry *msk_warm_create(struct msk_trans *trans, struct ibv_context *context) {
+	struct msk_warm_entry *entry;
+	size_t wsize = trans->sq_depth * (sizeof(struct msk_ctx) + trans->max_send_sge * sizeof(struct ibv_sge));
+	size_t rsize = trans->rq_depth * (sizeof(struct msk_ctx) + trans->max_recv_sge * sizeof(struct ibv_sge));
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+	memset(entry, 0, sizeof(*entry));
+
+	do {
+		entry->comp_channel = ibv_create_comp_channel(context);
+		if (!entry->comp_channel)
+			break;
+		// the cq thread finds the trans from the epoll data, not the cq context
+		entry->cq = ibv_create_cq(context, trans->sq_depth + trans->rq_depth, NULL, entry->comp_channel, 0);
+		if (!entry->cq)
+			break;
+		entry->wctx = malloc(wsize);
+		if (!entry->wctx)
+			break;
+		memset(entry->wctx, 0, wsize);
+		if (!trans->srq) {
+			entry->rctx = malloc(rsize);
+			if (!entry->rctx)
+				break;
+			memset(entry->rctx, 0, rsize);
+		}
+		return entry;
+	} while (0);
+
+	INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't make a warm entry: %s (%d)", strerror(errno), errno);
+	msk_warm_free_entry(entry);
+	return NULL;
+}
+
+/**
+ * msk_warm_fill: tops every device up to warm_count, making at most max entries
+ *
+ * @return number of entries made, -1 if one failed
+ */
+static int msk_warm_fill(struct msk_warm_pool *pool, int max) {
+	struct msk_warm_entry *entry;
+	int i, n = 0;
+
+	for (i = 0; i < pool->ndev && n < max; i++) {
+		if (!pool->devs[i].context)
+			continue;
+		while (pool->devs[i].count < pool->trans->warm_count && n < max) {
+			// the lock is only for the list, don't hold it while talking to the device
+			entry = msk_warm_create(pool->trans, pool->devs[i].context);
+			if (!entry)
+				return -1;
+			pthread_mutex_lock(&pool->lock);
+			entry->next = pool->devs[i].head;
+			pool->devs[i].head = entry;
+			pool->devs[i].count++;
+			pthread_mutex_unlock(&pool->lock);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * msk_warm_refill_all: called from the cm thread loop, a few entries at a time
+ */
+static void msk_warm_refill_all(void) {
+	struct msk_warm_pool *pool;
+	int more = 0;
+
+	if (!msk_global_state->warm_low)
+		return;
+	atomic_store(&msk_global_state->warm_low, 0);
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	for (pool = msk_global_state->warm_pools; pool; pool = pool->next)
+		if (msk_warm_fill(pool, MSK_WARM_REFILL_BATCH) == MSK_WARM_REFILL_BATCH)
+			more = 1;
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	if (more)
+		atomic_store(&msk_global_state->warm_low, 1);
+}
+
+/**
+ * msk_warm_take: pops an entry for a connection request on that device
+ *
+ * @return the entry, NULL if the pool is empty
+ */
+static struct msk_warm_entry *msk_warm_take(struct msk_trans *trans, struct ibv_context *context) {
+	struct msk_warm_pool *pool = trans->warm;
+	struct msk_warm_entry *entry = NULL;
+	int i = msk_dev_index(context);
+
+	if (i >= 0 && i < pool->ndev && pool->devs[i].context == context) {
+		pthread_mutex_lock(&pool->lock);
+		entry = pool->devs[i].head;
+		if (entry) {
+			pool->devs[i].head = entry->next;
+			pool->devs[i].count--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (entry)
+		trans->stats.warm_hit++;
+	else
+		trans->stats.warm_miss++;
+	atomic_store(&msk_global_state->warm_low, 1);
+
+	return entry;
+}
+
+/**
+ * msk_warm_setup: listener's pool, filled for every device it can get
+ * connection requests on before it starts listening
+ */
+static int msk_warm_setup(struct msk_trans *trans) {
+	struct msk_warm_pool *pool;
+	int i, ndev = msk_dev_count();
+
+	pool = malloc(sizeof(*pool) + ndev * sizeof(struct msk_warm_dev));
+	if (!pool)
+		return ENOMEM;
+	memset(pool, 0, sizeof(*pool) + ndev * sizeof(struct msk_warm_dev));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->trans = trans;
+	pool->ndev = ndev;
+	trans->warm = pool;
+
+	// bound to an address: cm_id is on that device only
+	for (i = 0; i < ndev; i++)
+		if (!trans->cm_id->verbs || trans->cm_id->verbs == msk_global_state->devs[i].context)
+			pool->devs[i].context = msk_global_state->devs[i].context;
+
+	if (msk_warm_fill(pool, INT_MAX) < 0) {
+		msk_warm_destroy(trans);
+		return ENOMEM;
+	}
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	pool->next = msk_global_state->warm_pools;
+	msk_global_state->warm_pools = pool;
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	return 0;
+}
+
+static void msk_warm_destroy(struct msk_trans *trans) {
+	struct msk_warm_pool *pool = trans->warm, **pprev;
+	struct msk_warm_entry *entry;
+	int i;
+
+	// the cm thread refills under the global lock
+	pthread_mutex_lock(&msk_global_state->lock);
+	for (pprev = &msk_global_state->warm_pools; *pprev; pprev = &(*pprev)->next) {
+		if (*pprev == pool) {
+			*pprev = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	for (i = 0; i < pool->ndev; i++) {
+		while ((entry = pool->devs[i].head)) {
+			pool->devs[i].head = entry->next;
+			msk_warm_free_entry(entry);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	trans->warm = NULL;
+}
+
 /**
  * msk_setup_qp: setups pd, qp an' stuff
  *
@@ -1625,7 +3842,9 @@ static int msk_setup_qp(struct msk_trans *trans) {
 
 	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "trans: %p", trans);
 
-	trans->comp_channel = ibv_create_comp_channel(trans->cm_id->verbs);
+	// both already there if they came from the listener's warm pool
+	if (!trans->comp_channel)
+		trans->comp_channel = ibv_create_comp_channel(trans->cm_id->verbs);
 	if (!trans->comp_channel) {
 		ret = errno;
 		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_create_comp_channel failed: %s (%d)", strerror(ret), ret);
@@ -1633,8 +3852,9 @@ static int msk_setup_qp(struct msk_trans *trans) {
 		return ret;
 	}
 
-	trans->cq = ibv_create_cq(trans->cm_id->verbs, trans->sq_depth + trans->rq_depth,
-				  trans, trans->comp_channel, 0);
+	if (!trans->cq)
+		trans->cq = ibv_create_cq(trans->cm_id->verbs, trans->sq_depth + trans->rq_depth,
+					  trans, trans->comp_channel, 0);
 	if (!trans->cq) {
 		ret = errno;
 		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_create_cq failed: %s (%d)", strerror(ret), ret);
@@ -1675,6 +3895,9 @@ static int msk_setup_rctx(struct msk_trans *trans) {
 }
 
 static int msk_setup_wctx(struct msk_trans *trans) {
+	if (trans->wctx) // warm pool
+		return 0;
+
 	trans->wctx = malloc(trans->sq_depth * (sizeof(struct msk_ctx) + trans->max_send_sge * sizeof(struct ibv_sge)));
 	if (!trans->wctx) {
 		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc trans->wctx");
@@ -1685,160 +3908,740 @@ static int msk_setup_wctx(struct msk_trans *trans) {
 	return 0;
 }
 
+/* SHARED RECEIVE QUEUE */
+
 /**
- * msk_bind_server
- *
- * @param trans [INOUT]
- *
- * @return 0 on success, errno value on failure
+ * msk_async_addfd: makes the cm thread read a device's async events
  */
-int msk_bind_server(struct msk_trans *trans) {
-	struct rdma_addrinfo hints, *res;
+static int msk_async_addfd(struct msk_dev *dev) {
+	struct epoll_event ev;
+	int flags, ret = 0;
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	if (dev->async_epollfd != msk_global_state->cm_epollfd) do {
+		flags = fcntl(dev->context->async_fd, F_GETFL);
+		if (fcntl(dev->context->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			ret = errno;
+			break;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = dev;
+		if (epoll_ctl(msk_global_state->cm_epollfd, EPOLL_CTL_ADD, dev->context->async_fd, &ev) == -1 && errno != EEXIST) {
+			ret = errno;
+			break;
+		}
+		dev->async_epollfd = msk_global_state->cm_epollfd;
+	} while (0);
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	if (ret)
+		INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "Failed to add async fd to epoll: %s (%d)", strerror(ret), ret);
+
+	return ret;
+}
+
+/**
+ * msk_srq_arm: (re)arms the srq limit event, it only fires once
+ */
+static void msk_srq_arm(struct msk_srq *srq) {
+	struct ibv_srq_attr attr;
 	int ret;
 
-	if (!trans || trans->state != MSK_INIT) {
-		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans must be initialized first!");
-		return EINVAL;
-	}
+	if (!srq->limit)
+		return;
 
-	if (trans->server <= 0) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Must be on server side to call this function");
-		return EINVAL;
-	}
+	memset(&attr, 0, sizeof(attr));
+	attr.srq_limit = srq->limit;
+	ret = ibv_modify_srq(srq->srq, &attr, IBV_SRQ_LIMIT);
+	if (ret)
+		INFO_LOG(srq->debug & MSK_DEBUG_EVENT, "ibv_modify_srq (limit %u) failed: %s (%d)", srq->limit, strerror(ret), ret);
+}
 
+/**
+ * msk_srq_grow: doubles the srq and its context array, up to max_depth.
+ * Contexts of the old array stay valid until they complete, they just aren't reused.
+ * Needs srq->lock.
+ *
+ * @return 0 on success, ENOSPC at max_depth, errno value on failure
+ */
+static int msk_srq_grow(struct msk_srq *srq) {
+	struct ibv_srq_attr attr;
+	struct msk_ctx *rctx, **old;
+	size_t ctx_size = sizeof(struct msk_ctx) + srq->max_recv_sge * sizeof(struct ibv_sge);
+	uint32_t depth;
+	int ret;
 
-	trans->conn_requests = malloc(trans->server * sizeof(struct rdma_cm_id*));
-	if (!trans->conn_requests) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not allocate conn_requests buffer");
-		return ENOMEM;
-	}
+	if (srq->depth >= srq->max_depth)
+		return ENOSPC;
 
-	memset(trans->conn_requests, 0, trans->server * sizeof(struct rdma_cm_id*));
+	depth = srq->depth * 2 > srq->max_depth ? srq->max_depth : srq->depth * 2;
 
-	memset(&hints, 0, sizeof(struct rdma_addrinfo));
-	hints.ai_flags = RAI_PASSIVE;
-	hints.ai_port_space = trans->conn_type;
+	rctx = malloc(depth * ctx_size);
+	if (!rctx)
+		return ENOMEM;
+	memset(rctx, 0, depth * ctx_size);
 
-	ret = rdma_getaddrinfo(trans->node, trans->port, &hints, &res);
-	if (ret) {
-		if (errno) {
-			ret = errno;
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo: %s (%d)", strerror(ret), ret);
-		} else {
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo failed: %s (%d)", gai_strerror(ret), ret);
-		}
-		return ret;
-	}
-	ret = rdma_bind_addr(trans->cm_id, res->ai_src_addr);
-	if (ret) {
-		ret = errno;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_bind_addr: %s (%d)", strerror(ret), ret);
-		return ret;
+	old = realloc(srq->old, (srq->old_count + 1) * sizeof(*old));
+	if (!old) {
+		free(rctx);
+		return ENOMEM;
 	}
-	rdma_freeaddrinfo(res);
+	srq->old = old;
 
-	ret = msk_setup_pd(trans);
+	memset(&attr, 0, sizeof(attr));
+	attr.max_wr = depth;
+	ret = ibv_modify_srq(srq->srq, &attr, IBV_SRQ_MAX_WR);
 	if (ret) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "setup pd failed: %s (%d)", strerror(ret), ret);
+		INFO_LOG(srq->debug & MSK_DEBUG_EVENT, "ibv_modify_srq (max_wr %u) failed: %s (%d), not growing anymore", depth, strerror(ret), ret);
+		srq->max_depth = srq->depth;
+		free(rctx);
 		return ret;
 	}
 
-	ret = rdma_listen(trans->cm_id, trans->server);
-	if (ret) {
-		ret = errno;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_listen failed: %s (%d)", strerror(ret), ret);
-		return ret;
+	srq->old[srq->old_count++] = srq->rctx;
+	srq->rctx = rctx;
+	srq->pd->rctx = rctx;
+	INFO_LOG(srq->debug & MSK_DEBUG_SETUP, "srq grown from %u to %u", srq->depth, depth);
+	srq->depth = depth;
+	srq->grow++;
+
+	return 0;
+}
+
+/**
+ * msk_srq_post_locked: posts a receive on a free context of the srq
+ * Needs srq->lock.
+ *
+ * @return 0 on success, EAGAIN if there is no free context, errno value on failure
+ */
+static int msk_srq_post_locked(struct msk_srq *srq, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct ibv_recv_wr *bad_wr;
+	struct msk_ctx *rctx;
+	uint32_t n;
+	int i, ret;
+
+	for (n = 0, rctx = srq->rctx; n < srq->depth; n++, rctx = msk_next_ctx(rctx, srq->max_recv_sge))
+		if (rctx->used == MSK_CTX_FREE
+		    && atomic_bool_compare_and_swap(&rctx->used, MSK_CTX_FREE, MSK_CTX_PENDING))
+			break;
+	if (n == srq->depth)
+		return EAGAIN;
+
+	rctx->callback = callback;
+	rctx->err_callback = err_callback;
+	rctx->callback_arg = callback_arg;
+	rctx->data = data;
+
+	for (i = 0; i < num_sge; i++) {
+		if (!data || !data->mr) {
+			INFO_LOG(srq->debug & MSK_DEBUG_EVENT, "You said to recv %d elements (num_sge), but we only found %d! Not requesting.", num_sge, i);
+			atomic_store(&rctx->used, MSK_CTX_FREE);
+			return EINVAL;
+		}
+		rctx->sg_list[i].addr = (uintptr_t) data->data;
+		rctx->sg_list[i].length = data->max_size;
+		rctx->sg_list[i].lkey = data->mr->lkey;
+		if (i != num_sge-1)
+			data = data->next;
 	}
 
-	trans->state = MSK_LISTENING;
+	rctx->wr.rwr.next = NULL;
+	rctx->wr.rwr.wr_id = (uintptr_t)rctx;
+	rctx->wr.rwr.sg_list = rctx->sg_list;
+	rctx->wr.rwr.num_sge = num_sge;
 
-	if ((ret = msk_check_create_epoll_thread(&msk_global_state->cm_thread, msk_cm_thread, trans, &msk_global_state->cm_epollfd))) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread failed: %s (%d)", strerror(ret), ret);
+	ret = ibv_post_srq_recv(srq->srq, &rctx->wr.rwr, &bad_wr);
+	if (ret) {
+		INFO_LOG(srq->debug & MSK_DEBUG_EVENT, "ibv_post_srq_recv failed: %s (%d)", strerror(ret), ret);
+		atomic_store(&rctx->used, MSK_CTX_FREE);
 		return ret;
 	}
-	msk_cm_addfd(trans);
+	atomic_inc(srq->posted);
 
 	return 0;
 }
 
+/**
+ * msk_srq_post: msk_post_n_recv for transports on a srq, grows the srq
+ * instead of waiting for a context when it still can
+ *
+ * @param wait [IN] wait for a context if the srq is full, EAGAIN otherwise
+ */
+static int msk_srq_post(struct msk_srq *srq, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg, int wait) {
+	struct timespec ts_start, ts_end;
+	uint64_t nsec;
+	int ret, waited = 0;
 
-static struct msk_trans *clone_trans(struct msk_trans *listening_trans, struct rdma_cm_id *cm_id) {
-	struct msk_trans *trans = malloc(sizeof(struct msk_trans));
-	struct msk_pd *pd;
-	int ret;
-
-	if (!trans) {
-		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "malloc failed");
-		return NULL;
+	pthread_mutex_lock(&srq->lock);
+	while ((ret = msk_srq_post_locked(srq, data, num_sge, callback, err_callback, callback_arg)) == EAGAIN) {
+		if (msk_srq_grow(srq) == 0)
+			continue;
+		if (!wait)
+			break;
+		pthread_mutex_unlock(&srq->lock);
+		DATA_LOG(srq->debug & MSK_DEBUG_CTX, "Waiting for rctx");
+		if (!waited++)
+			clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		usleep(250);
+		pthread_mutex_lock(&srq->lock);
 	}
+	if (waited) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		sub_timespec(&nsec, &ts_start, &ts_end);
+		srq->wait += waited;
+		srq->nsec_wait += nsec;
+	}
+	pthread_mutex_unlock(&srq->lock);
 
-	memcpy(trans, listening_trans, sizeof(struct msk_trans));
+	return ret;
+}
 
-	trans->cm_id = cm_id;
-	trans->cm_id->context = trans;
-	trans->state = MSK_CONNECT_REQUEST;
-	trans->server = MSK_SERVER_CHILD;
+/**
+ * msk_srq_refill: posts buffers from the pool, growing the srq if they don't fit.
+ * Needs srq->lock.
+ */
+static void msk_srq_refill(struct msk_srq *srq) {
+	int ret;
 
-	pd = msk_getpd(trans);
-	if (!pd) {
-		ret = ENOSPC;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No space left in msk pd, multiple contexts per device?");
-		return NULL;
-	}
-	if (!pd->pd) {
-		pd->pd = ibv_alloc_pd(trans->cm_id->verbs);
-		if (!pd->pd) {
-			ret = errno;
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_alloc_pd failed: %s (%d)", strerror(ret), ret);
-			return NULL;
-		}
+	while (srq->pool_count > 0) {
+		ret = msk_srq_post_locked(srq, srq->pool[srq->pool_count-1], 1, srq->callback, srq->err_callback, srq->callback_arg);
+		if (ret == EAGAIN && msk_srq_grow(srq) == 0)
+			continue;
+		if (ret)
+			break;
+		srq->pool_count--;
 	}
-	if (listening_trans->srq) {
-		if (!pd->srq) {
-			struct ibv_srq_init_attr srq_attr = {
-				.attr.max_wr = trans->rq_depth,
-				.attr.max_sge = trans->max_recv_sge,
-			};
-			pd->srq = ibv_create_srq(pd->pd, &srq_attr);
-			if (!pd->srq) {
-				ret = errno;
-				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_create_srq failed: %s (%d)", strerror(ret), ret);
-				return NULL;
-			}
+}
+
+/**
+ * msk_async_event: reads a device's async events, called by the cm thread
+ */
+static void msk_async_event(struct msk_dev *dev) {
+	struct ibv_async_event event;
+	struct msk_srq *srq;
+
+	while (ibv_get_async_event(dev->context, &event) == 0) {
+		switch (event.event_type) {
+		case IBV_EVENT_SRQ_LIMIT_REACHED:
+			srq = event.element.srq->srq_context;
+			pthread_mutex_lock(&srq->lock);
+			srq->limit_events++;
+			if (srq->pool_count == 0)
+				srq->starved++;
+			DATA_LOG(srq->debug & MSK_DEBUG_RECV, "srq limit reached, %u posted, %d to refill", srq->posted, srq->pool_count);
+			msk_srq_refill(srq);
+			msk_srq_arm(srq);
+			pthread_mutex_unlock(&srq->lock);
+			break;
+		default:
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "async event %s on %s",
+				 ibv_event_type_str(event.event_type), ibv_get_device_name(dev->context->device));
 		}
+		ibv_ack_async_event(&event);
+	}
+}
 
-		if (!pd->rctx) {
-			msk_setup_rctx(trans);
-			pd->rctx = trans->rctx;
-		} else {
-			trans->rctx = pd->rctx;
+/**
+ * msk_srq_create: creates the srq and context array of a pd slot, for the listener's children
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_srq_create(struct msk_trans *trans, struct msk_pd *pd) {
+	struct ibv_srq_init_attr srq_attr;
+	struct msk_srq *srq;
+	int i, ret;
+
+	srq = malloc(sizeof(*srq));
+	if (!srq)
+		return ENOMEM;
+	memset(srq, 0, sizeof(*srq));
+
+	srq->pd = pd;
+	srq->depth = trans->rq_depth;
+	srq->max_depth = trans->srq_max_wr > trans->rq_depth ? trans->srq_max_wr : trans->rq_depth;
+	srq->limit = trans->srq_limit;
+	srq->max_recv_sge = trans->max_recv_sge;
+	srq->debug = trans->debug;
+
+	do {
+		if ((ret = pthread_mutex_init(&srq->lock, NULL)))
+			break;
+
+		if ((ret = msk_setup_rctx(trans)))
+			break;
+		srq->rctx = trans->rctx;
+
+		memset(&srq_attr, 0, sizeof(srq_attr));
+		srq_attr.srq_context = srq;
+		srq_attr.attr.max_wr = srq->depth;
+		srq_attr.attr.max_sge = srq->max_recv_sge;
+		srq->srq = ibv_create_srq(pd->pd, &srq_attr);
+		if (!srq->srq) {
+			ret = errno;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_create_srq failed: %s (%d)", strerror(ret), ret);
+			break;
+		}
+
+		i = msk_dev_index(pd->context);
+		if (srq->limit && i >= 0 && (ret = msk_async_addfd(&msk_global_state->devs[i]))) {
+			ibv_destroy_srq(srq->srq);
+			break;
+		}
+		msk_srq_arm(srq);
+	} while (0);
+
+	if (ret) {
+		free(srq->rctx);
+		trans->rctx = NULL;
+		free(srq);
+		return ret;
+	}
+
+	pd->rctx = srq->rctx;
+	pd->srq = srq->srq;
+
+	return 0;
+}
+
+/**
+ * msk_srq_free: what's left of a srq once the ibv_srq is destroyed, pd->rctx is freed by the caller
+ */
+static void msk_srq_free(struct msk_srq *srq) {
+	int i;
+
+	for (i = 0; i < srq->old_count; i++)
+		free(srq->old[i]);
+	free(srq->old);
+	free(srq->pool);
+	pthread_mutex_destroy(&srq->lock);
+	free(srq);
+}
+
+/**
+ * msk_srq_add_buffers: gives buffers to the srq of a transport's device.
+ * They are posted right away, growing the srq up to srq_max_wr if needed,
+ * and whatever is given back with msk_srq_release is posted again when the
+ * srq runs low (srq_limit) or immediately without a limit.
+ * The callbacks are the same for all buffers of a srq.
+ *
+ * @param trans        [IN] a connection accepted by a listener with use_srq
+ * @param data         [IN] array of count buffers, one sge each
+ * @param count        [IN]
+ * @param callback     [IN] function that'll be called on receive
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callbacks
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_srq_add_buffers(struct msk_trans *trans, msk_data_t *data, int count, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_srq *srq;
+	msk_data_t **pool;
+	int i;
+
+	if (!trans || trans->server != MSK_SERVER_CHILD || !trans->srq || !data || count <= 0)
+		return EINVAL;
+
+	srq = trans->srq->srq_context;
+	pthread_mutex_lock(&srq->lock);
+	pool = realloc(srq->pool, (srq->pool_size + count) * sizeof(*pool));
+	if (!pool) {
+		pthread_mutex_unlock(&srq->lock);
+		return ENOMEM;
+	}
+	srq->pool = pool;
+	srq->pool_size += count;
+	for (i = 0; i < count; i++)
+		srq->pool[srq->pool_count++] = &data[i];
+	srq->callback = callback;
+	srq->err_callback = err_callback;
+	srq->callback_arg = callback_arg;
+
+	msk_srq_refill(srq);
+	pthread_mutex_unlock(&srq->lock);
+
+	return 0;
+}
+
+/**
+ * msk_srq_release: gives a buffer from msk_srq_add_buffers back once its receive callback is done with it
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_srq_release(struct msk_trans *trans, msk_data_t *data) {
+	struct msk_srq *srq;
+
+	if (!trans || !trans->srq || trans->server != MSK_SERVER_CHILD || !data)
+		return EINVAL;
+
+	srq = trans->srq->srq_context;
+	pthread_mutex_lock(&srq->lock);
+	if (srq->pool_count == srq->pool_size) {
+		pthread_mutex_unlock(&srq->lock);
+		return EINVAL;
+	}
+	srq->pool[srq->pool_count++] = data;
+
+	// without a watermark, or if the limit event already came, don't wait for one
+	if (!srq->limit || srq->posted < srq->limit)
+		msk_srq_refill(srq);
+	pthread_mutex_unlock(&srq->lock);
+
+	return 0;
+}
+
+/**
+ * msk_srq_stats: srq occupancy summed over the devices of a listener or one of its connections
+ *
+ * @return 0 on success, EINVAL if the transport doesn't use a srq
+ */
+int msk_srq_stats(struct msk_trans *trans, struct msk_srq_stats *stats) {
+	struct msk_srq *srq;
+	int i;
+
+	if (!trans || !trans->srq || !trans->pd || !stats)
+		return EINVAL;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; trans->pd[i].context != PD_GUARD; i++) {
+		if (!trans->pd[i].srq)
+			continue;
+		srq = trans->pd[i].srq->srq_context;
+		pthread_mutex_lock(&srq->lock);
+		stats->depth += srq->depth;
+		stats->posted += srq->posted;
+		stats->pool += srq->pool_count;
+		stats->limit_events += srq->limit_events;
+		stats->grow += srq->grow;
+		stats->starved += srq->starved;
+		stats->wait += srq->wait;
+		stats->nsec_wait += srq->nsec_wait;
+		pthread_mutex_unlock(&srq->lock);
+	}
+
+	return 0;
+}
+
+/* contexts of an array by state, at the time they're looked at */
+static void msk_ctx_occupancy(struct msk_ctx *ctx, int count, int n_sge, uint64_t *pending, uint64_t *processing) {
+	int i;
+
+	*pending = *processing = 0;
+	if (!ctx)
+		return;
+
+	for (i = 0; i < count; i++, ctx = msk_next_ctx(ctx, n_sge)) {
+		if (ctx->used == MSK_CTX_PENDING)
+			(*pending)++;
+		else if (ctx->used == MSK_CTX_PROCESSING)
+			(*processing)++;
+	}
+}
+
+/**
+ * msk_get_stats: snapshot of a transport's counters
+ *
+ * Sums up the per thread data path counters, the tx and rx totals are
+ * derived from the per operation ones. Can be called from any thread.
+ *
+ * @param trans [IN]
+ * @param stats [OUT]
+ */
+void msk_get_stats(struct msk_trans *trans, struct msk_stats *stats) {
+	struct msk_stats_slot *slot;
+	int i, j;
+
+	if (!trans || !stats)
+		return;
+
+	memcpy(stats, &trans->stats, sizeof(struct msk_stats));
+	memset(stats->op_pkt, 0, sizeof(stats->op_pkt));
+	memset(stats->op_bytes, 0, sizeof(stats->op_bytes));
+	memset(stats->op_err, 0, sizeof(stats->op_err));
+	memset(stats->wc_err, 0, sizeof(stats->wc_err));
+	stats->nsec_callback = 0;
+	stats->nsec_compevent = 0;
+	stats->sq_wait = stats->nsec_sq_wait = 0;
+	stats->rq_wait = stats->nsec_rq_wait = 0;
+	stats->worker_block = stats->nsec_worker_block = 0;
+
+	for (i = 0; i < MSK_STATS_SLOTS; i++) {
+		slot = &trans->stats_slots[i];
+		for (j = 0; j < MSK_OP_COUNT; j++) {
+			stats->op_pkt[j] += atomic_load(&slot->op_pkt[j]);
+			stats->op_bytes[j] += atomic_load(&slot->op_bytes[j]);
+			stats->op_err[j] += atomic_load(&slot->op_err[j]);
 		}
+		for (j = 0; j < MSK_WC_STATUS_COUNT; j++)
+			stats->wc_err[j] += atomic_load(&slot->wc_err[j]);
+		stats->nsec_callback += atomic_load(&slot->nsec_callback);
+		stats->nsec_compevent += atomic_load(&slot->nsec_compevent);
+		stats->sq_wait += atomic_load(&slot->sq_wait);
+		stats->nsec_sq_wait += atomic_load(&slot->nsec_sq_wait);
+		stats->rq_wait += atomic_load(&slot->rq_wait);
+		stats->nsec_rq_wait += atomic_load(&slot->nsec_rq_wait);
+		stats->worker_block += atomic_load(&slot->worker_block);
+		stats->nsec_worker_block += atomic_load(&slot->nsec_worker_block);
+	}
+
+	msk_ctx_occupancy(trans->wctx, trans->sq_depth, trans->max_send_sge, &stats->wctx_pending, &stats->wctx_processing);
+	stats->wctx_peak = trans->wctx_peak;
+	if (trans->srq) {
+		stats->rctx_pending = stats->rctx_processing = stats->rctx_peak = 0;
 	} else {
-		msk_setup_rctx(trans);
+		msk_ctx_occupancy(trans->rctx, trans->rq_depth, trans->max_recv_sge, &stats->rctx_pending, &stats->rctx_processing);
+		stats->rctx_peak = trans->rctx_peak;
 	}
 
-	trans->srq = pd->srq;
+	if (msk_global_state->worker_pool.worker_count > 0) {
+		stats->worker_queue_depth = msk_global_state->worker_pool.depth;
+		stats->worker_queue_peak = msk_global_state->worker_pool.peak;
+		stats->worker_queue_size = msk_global_state->worker_pool.size;
+	} else {
+		stats->worker_queue_depth = stats->worker_queue_peak = stats->worker_queue_size = 0;
+	}
 
-	memset(&trans->cm_lock, 0, sizeof(pthread_mutex_t));
-	memset(&trans->cm_cond, 0, sizeof(pthread_cond_t));
+	stats->tx_pkt = stats->op_pkt[MSK_OP_SEND] + stats->op_pkt[MSK_OP_READ] + stats->op_pkt[MSK_OP_WRITE];
+	stats->tx_bytes = stats->op_bytes[MSK_OP_SEND] + stats->op_bytes[MSK_OP_READ] + stats->op_bytes[MSK_OP_WRITE];
+	stats->tx_err = stats->op_err[MSK_OP_SEND] + stats->op_err[MSK_OP_READ] + stats->op_err[MSK_OP_WRITE];
+	stats->rx_pkt = stats->op_pkt[MSK_OP_RECV];
+	stats->rx_bytes = stats->op_bytes[MSK_OP_RECV];
+	stats->rx_err = stats->op_err[MSK_OP_RECV];
+}
 
-	ret = pthread_mutex_init(&trans->cm_lock, NULL);
+/**
+ * msk_get_thread_stats: cpu and wall time of the library's threads
+ *
+ * Threads that exited are still listed, with running = 0. Wall time of
+ * the state a thread is currently in is counted up to now.
+ *
+ * @param stats [OUT] array of max entries
+ * @param max [IN]
+ *
+ * @return the number of threads, can be more than max
+ */
+int msk_get_thread_stats(struct msk_thread_stats *stats, int max) {
+	struct msk_thread_acct *acct;
+	struct timespec ts;
+	uint64_t now, mark;
+	int n = 0, state;
+
+	now = msk_now_nsec();
+
+	pthread_mutex_lock(&msk_global_state->threads_lock);
+	for (acct = msk_global_state->threads; acct; acct = acct->next, n++) {
+		if (n >= max)
+			continue;
+		memset(&stats[n], 0, sizeof(struct msk_thread_stats));
+		memcpy(stats[n].name, acct->name, MSK_THREAD_NAME_LEN);
+		stats[n].tid = acct->tid;
+		stats[n].running = acct->running;
+		stats[n].nsec_cpu = acct->cpu_base;
+		if (acct->running && !clock_gettime(acct->cpu_clock, &ts))
+			stats[n].nsec_cpu += ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+		stats[n].nsec_idle = atomic_load(&acct->nsec[MSK_THREAD_IDLE]);
+		stats[n].nsec_poll = atomic_load(&acct->nsec[MSK_THREAD_POLL]);
+		stats[n].nsec_callback = atomic_load(&acct->nsec[MSK_THREAD_CALLBACK]);
+		if (!acct->running)
+			continue;
+		// racy with the thread's next switch, good enough for a snapshot
+		state = acct->state;
+		mark = acct->mark;
+		if (now <= mark)
+			continue;
+		if (state == MSK_THREAD_IDLE)
+			stats[n].nsec_idle += now - mark;
+		else if (state == MSK_THREAD_POLL)
+			stats[n].nsec_poll += now - mark;
+		else
+			stats[n].nsec_callback += now - mark;
+	}
+	pthread_mutex_unlock(&msk_global_state->threads_lock);
+
+	return n;
+}
+
+/**
+ * msk_bind_server
+ *
+ * @param trans [INOUT]
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_bind_server(struct msk_trans *trans) {
+	struct rdma_addrinfo hints, *res;
+	int ret;
+
+	if (!trans || trans->state != MSK_INIT) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans must be initialized first!");
+		return EINVAL;
+	}
+
+	if (trans->server <= 0) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Must be on server side to call this function");
+		return EINVAL;
+	}
+
+
+	trans->conn_requests = malloc(trans->server * sizeof(struct rdma_cm_id*));
+	if (!trans->conn_requests) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not allocate conn_requests buffer");
+		return ENOMEM;
+	}
+
+	memset(trans->conn_requests, 0, trans->server * sizeof(struct rdma_cm_id*));
+	trans->conn_head = 0;
+	trans->conn_count = 0;
+
+	memset(&hints, 0, sizeof(struct rdma_addrinfo));
+	hints.ai_flags = RAI_PASSIVE;
+	hints.ai_port_space = trans->conn_type;
+
+	ret = rdma_getaddrinfo(trans->node, trans->port, &hints, &res);
 	if (ret) {
-		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "pthread_mutex_init failed: %s (%d)", strerror(ret), ret);
-		msk_destroy_trans(&trans);
+		if (errno) {
+			ret = errno;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo: %s (%d)", strerror(ret), ret);
+		} else {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo failed: %s (%d)", gai_strerror(ret), ret);
+		}
+		return ret;
+	}
+	ret = rdma_bind_addr(trans->cm_id, res->ai_src_addr);
+	if (ret) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_bind_addr: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+	rdma_freeaddrinfo(res);
+
+	ret = msk_setup_pd(trans);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "setup pd failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	ret = rdma_listen(trans->cm_id, trans->server);
+	if (ret) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_listen failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	trans->state = MSK_LISTENING;
+
+	if (trans->warm_count && (ret = msk_warm_setup(trans))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "warm pool setup failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	if ((ret = msk_check_create_epoll_thread(&msk_global_state->cm_thread, msk_cm_thread, trans, &msk_global_state->cm_epollfd))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+	msk_cm_addfd(trans);
+
+	return 0;
+}
+
+
+static struct msk_trans *clone_trans(struct msk_trans *listening_trans, struct rdma_cm_id *cm_id) {
+	struct msk_trans *trans = malloc(sizeof(struct msk_trans));
+	struct msk_warm_entry *warm = NULL;
+	struct msk_pd *pd;
+	int ret;
+
+	if (!trans) {
+		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "malloc failed");
+		return NULL;
+	}
+
+	memcpy(trans, listening_trans, sizeof(struct msk_trans));
+
+	memset(&trans->stats, 0, sizeof(struct msk_stats));
+	trans->wctx_used = trans->wctx_peak = 0;
+	trans->rctx_used = trans->rctx_peak = 0;
+	trans->outstanding = 0;
+	trans->stats_shm_index = -1;
+	trans->stats_sock = 0;
+	trans->stuck_next = NULL;
+	trans->record_next = NULL;
+	trans->record_prev = NULL;
+	trans->owner = NULL;
+	trans->stats_slots = msk_stats_slots_alloc();
+	if (!trans->stats_slots) {
+		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "malloc failed");
+		free(trans);
 		return NULL;
 	}
-	ret = pthread_cond_init(&trans->cm_cond, NULL);
+
+	trans->cm_id = cm_id;
+	trans->cm_id->context = trans;
+	trans->state = MSK_CONNECT_REQUEST;
+	trans->server = MSK_SERVER_CHILD;
+	/* the listener's is only a bool, the pd's comes below */
+	trans->srq = NULL;
+
+	memset(&trans->cm_lock, 0, sizeof(pthread_mutex_t));
+	memset(&trans->cm_cond, 0, sizeof(pthread_cond_t));
+
+	ret = pthread_mutex_init(&trans->cm_lock, NULL);
+	if (!ret && (ret = pthread_cond_init(&trans->cm_cond, NULL)))
+		pthread_mutex_destroy(&trans->cm_lock);
 	if (ret) {
-		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "pthread_cond_init failed: %s (%d)", strerror(ret), ret);
-		msk_destroy_trans(&trans);
+		INFO_LOG(listening_trans->debug & MSK_DEBUG_EVENT, "pthread_mutex/cond_init failed: %s (%d)", strerror(ret), ret);
+		rdma_reject(cm_id, NULL, 0);
+		rdma_destroy_id(cm_id);
+		free(trans->stats_slots);
+		free(trans);
 		return NULL;
 	}
 
+	/* msk_destroy_trans takes it back from here on */
 	pthread_mutex_lock(&msk_global_state->lock);
 	msk_global_state->run_threads++;
 	pthread_mutex_unlock(&msk_global_state->lock);
 
+	do {
+		trans->warm = NULL;
+		if (listening_trans->warm)
+			warm = msk_warm_take(listening_trans, cm_id->verbs);
+		if (warm) {
+			trans->comp_channel = warm->comp_channel;
+			trans->cq = warm->cq;
+			trans->wctx = warm->wctx;
+			trans->rctx = warm->rctx;
+			free(warm);
+		}
+
+		pd = msk_getpd(trans);
+		if (!pd) {
+			ret = ENOSPC;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No pd slot for this device");
+			break;
+		}
+		if ((ret = msk_alloc_pd(trans, pd)))
+			break;
+		if (listening_trans->srq) {
+			if (!pd->srq && (ret = msk_srq_create(trans, pd))) {
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "srq setup failed: %s (%d)", strerror(ret), ret);
+				break;
+			}
+
+			trans->rctx = pd->rctx;
+		} else if (!warm && (ret = msk_setup_rctx(trans))) {
+			break;
+		}
+
+		trans->srq = pd->srq;
+	} while (0);
+
+	if (ret) {
+		// the client would otherwise wait for its timeout
+		rdma_reject(cm_id, NULL, 0);
+		msk_destroy_trans(&trans);
+		return NULL;
+	}
+
 	return trans;
 }
 
@@ -1881,6 +4684,7 @@ int msk_finalize_accept(struct msk_trans *trans) {
 		if (trans->state == MSK_CONNECTED) {
 			msk_cq_addfd(trans);
 			msk_stats_add(trans);
+			msk_msg_connected(trans);
 		} else {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Accept failed");
 			ret = ECONNRESET;
@@ -1894,19 +4698,81 @@ int msk_finalize_accept(struct msk_trans *trans) {
 }
 
 /**
- * msk_accept_one: given a listening trans, waits till one connection is requested and accepts it
- *
- * @param trans [IN] the parent trans
+ * msk_wait_conn_request: waits for the connection request queue not to be empty
+ * Needs trans->cm_lock.
  *
- * @return a new trans for the child on success, NULL on failure
+ * @return 0 when there is a request, the cond wait error otherwise
  */
-struct msk_trans *msk_accept_one_timedwait(struct msk_trans *trans, struct timespec *abstime) { //TODO make it return an int an' use trans as argument
+static int msk_wait_conn_request(struct msk_trans *trans, struct timespec *abstime) {
+	int ret = 0;
 
-	//TODO: timeout?
+	while (trans->conn_count == 0 && ret == 0) {
+		INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "Waiting for a connection to come in");
+		if (abstime)
+			ret = msk_cond_timedwait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock, abstime);
+		else
+			ret = msk_cond_wait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock);
+	}
 
-	struct rdma_cm_id *cm_id = NULL;
+	return ret;
+}
+
+/**
+ * msk_pop_conn_request: oldest queued request. Needs trans->cm_lock and conn_count > 0.
+ */
+static struct rdma_cm_id *msk_pop_conn_request(struct msk_trans *trans) {
+	struct rdma_cm_id *cm_id;
+
+	cm_id = trans->conn_requests[trans->conn_head];
+	trans->conn_requests[trans->conn_head] = NULL;
+	trans->conn_head = (trans->conn_head + 1) % trans->server;
+	trans->conn_count--;
+	trans->stats.conn_req_depth = trans->conn_count;
+
+	return cm_id;
+}
+
+/**
+ * msk_setup_child: qp, buffers and optional layers of a cloned child
+ *
+ * @return the child, or NULL if it had to be destroyed
+ */
+static struct msk_trans *msk_setup_child(struct msk_trans *trans, struct msk_trans *child_trans) {
+	int ret;
+
+	if ((ret = msk_setup_qp(child_trans))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's qp: %s (%d)", strerror(ret), ret);
+		msk_destroy_trans(&child_trans);
+		return NULL;
+	}
+	if ((ret = msk_setup_wctx(child_trans))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's buffer: %s (%d)", strerror(ret), ret);
+		msk_destroy_trans(&child_trans);
+		return NULL;
+	}
+	if ((ret = msk_msg_setup(child_trans))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's message layer: %s (%d)", strerror(ret), ret);
+		msk_destroy_trans(&child_trans);
+		return NULL;
+	}
+	if ((ret = msk_mw_setup(child_trans))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's memory windows: %s (%d)", strerror(ret), ret);
+		msk_destroy_trans(&child_trans);
+		return NULL;
+	}
+
+	return child_trans;
+}
+
+/**
+ * msk_accept_one: given a listening trans, waits till one connection is requested and accepts it
+ *
+ * @param trans [IN] the parent trans
+ *
+ * @return a new trans for the child on success, NULL on failure
+ */
+struct msk_trans *msk_accept_one_timedwait(struct msk_trans *trans, struct timespec *abstime) { //TODO make it return an int an' use trans as argument
 	struct msk_trans *child_trans = NULL;
-	int i, ret;
 
 	if (!trans || trans->state != MSK_LISTENING) {
 		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans isn't listening (after bind_server)?");
@@ -1914,48 +4780,63 @@ struct msk_trans *msk_accept_one_timedwait(struct msk_trans *trans, struct times
 	}
 
 	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
-	ret = 0;
-	while (!cm_id && ret == 0) {
-		/* See if one of the slots has been taken */
-		for (i = 0; i < trans->server; i++)
-			if (trans->conn_requests[i])
-				break;
+	if (msk_wait_conn_request(trans, abstime)) {
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+		return NULL;
+	}
 
-		if (i == trans->server) {
-			INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "Waiting for a connection to come in");
-			if (abstime)
-				ret = msk_cond_timedwait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock, abstime);
-			else
-				ret = msk_cond_wait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock);
-		} else {
-			cm_id = trans->conn_requests[i];
-			trans->conn_requests[i] = NULL;
-		}
+	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "Got a connection request - creating child");
+	child_trans = clone_trans(trans, msk_pop_conn_request(trans));
+
+	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+
+	if (child_trans)
+		child_trans = msk_setup_child(trans, child_trans);
+
+	return child_trans;
+}
+
+/**
+ * msk_accept_many: same as msk_accept_one, but takes up to max queued requests
+ * at once. Only waits if none is pending.
+ * Every returned child still needs msk_finalize_accept.
+ *
+ * @param trans    [IN]  the parent trans
+ * @param children [OUT] array of at least max elements
+ * @param max      [IN]
+ * @param abstime  [IN]  wait limit, NULL to wait forever
+ *
+ * @return the number of children filled in, 0 on timeout or failure
+ */
+int msk_accept_many(struct msk_trans *trans, struct msk_trans **children, int max, struct timespec *abstime) {
+	int i, n = 0, accepted = 0;
+
+	if (!trans || trans->state != MSK_LISTENING || !children || max <= 0) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans isn't listening (after bind_server)?");
+		return 0;
 	}
 
-	if (ret) {
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+	if (msk_wait_conn_request(trans, abstime)) {
 		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
-		return NULL;
+		return 0;
 	}
 
-	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "Got a connection request - creating child");
-	child_trans = clone_trans(trans, cm_id);
+	while (n < max && trans->conn_count > 0) {
+		children[n] = clone_trans(trans, msk_pop_conn_request(trans));
+		if (children[n])
+			n++;
+	}
+	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "Got %d connection requests - creating children", n);
 
 	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 
-	if (child_trans) {
-		if ((ret = msk_setup_qp(child_trans))) {
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's qp: %s (%d)", strerror(ret), ret);
-			msk_destroy_trans(&child_trans);
-			return NULL;
-		}
-		if ((ret = msk_setup_wctx(child_trans))) {
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Could not setup child trans's buffer: %s (%d)", strerror(ret), ret);
-			msk_destroy_trans(&child_trans);
-			return NULL;
-		}
+	for (i = 0; i < n; i++) {
+		if ((children[accepted] = msk_setup_child(trans, children[i])))
+			accepted++;
 	}
-	return child_trans;
+
+	return accepted;
 }
 
 struct msk_trans *msk_accept_one_wait(struct msk_trans *trans, int msleep) {
@@ -1975,20 +4856,273 @@ struct msk_trans *msk_accept_one_wait(struct msk_trans *trans, int msleep) {
 	return msk_accept_one_timedwait(trans, &ts);
 }
 
+/* RESERVED PORTS */
+
 /**
- * msk_bind_client: resolve addr and route for the client and waits till it's done
- * (the route and pthread_cond_signal is done in the cm thread)
+ * msk_resvport_get: takes the next port not bound by one of our transports,
+ * going down from MSK_MAX_RESVPORT starting where the last one was found
  *
+ * @return the port, 0 if all are in use
  */
-static int msk_bind_client(struct msk_trans *trans) {
-	struct rdma_addrinfo hints, *res;
-	int ret;
+static int msk_resvport_get(void) {
+	uint64_t *word;
+	int i, idx;
+	int port = 0;
 
-	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+	pthread_mutex_lock(&msk_global_state->lock);
+	idx = msk_global_state->resvport_next;
+	for (i = 0; i < MSK_RESVPORT_COUNT; i++, idx = (idx + 1) % MSK_RESVPORT_COUNT) {
+		word = &msk_global_state->resvport_map[idx / 64];
+		if (*word == ~0ULL && idx % 64 == 0 && idx + 64 <= MSK_RESVPORT_COUNT) {
+			// whole word in use
+			i += 63;
+			idx += 63;
+			continue;
+		}
+		if (*word & (1ULL << (idx % 64)))
+			continue;
 
-	do {
+		*word |= 1ULL << (idx % 64);
+		msk_global_state->resvport_next = (idx + 1) % MSK_RESVPORT_COUNT;
+		port = MSK_MAX_RESVPORT - idx;
+		break;
+	}
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	return port;
+}
+
+static void msk_resvport_put(int port) {
+	int idx = MSK_MAX_RESVPORT - port;
+
+	if (idx < 0 || idx >= MSK_RESVPORT_COUNT)
+		return;
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	msk_global_state->resvport_map[idx / 64] &= ~(1ULL << (idx % 64));
+	pthread_mutex_unlock(&msk_global_state->lock);
+}
+
+/* ROUTE CACHE */
+
+static inline int msk_strcmp_null(const char *a, const char *b) {
+	if (!a || !b)
+		return a != b;
+	return strcmp(a, b);
+}
+
+static inline time_t msk_now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * msk_route_cache_find: entry for the trans' destination, expired ones are dropped on the way.
+ * Needs route_lock.
+ */
+static struct msk_route_entry *msk_route_cache_find(struct msk_trans *trans) {
+	struct msk_route_entry **pentry, *entry;
+	time_t now = msk_now_sec();
+
+	pentry = &msk_global_state->route_cache;
+	while ((entry = *pentry)) {
+		if (entry->expire <= now) {
+			*pentry = entry->next;
+			free(entry->node);
+			free(entry->port);
+			free(entry);
+			continue;
+		}
+		if (entry->ps == trans->conn_type
+		    && !msk_strcmp_null(entry->node, trans->node)
+		    && !msk_strcmp_null(entry->port, trans->port))
+			return entry;
+		pentry = &entry->next;
+	}
+
+	return NULL;
+}
+
+static int msk_route_cache_get_addr(struct msk_trans *trans, struct sockaddr_storage *src, struct sockaddr_storage *dst, int *has_src) {
+	struct msk_route_entry *entry;
+	int ret = ENOENT;
+
+	pthread_mutex_lock(&msk_global_state->route_lock);
+	entry = msk_route_cache_find(trans);
+	if (entry) {
+		*has_src = entry->has_src;
+		memcpy(src, &entry->src, sizeof(*src));
+		memcpy(dst, &entry->dst, sizeof(*dst));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&msk_global_state->route_lock);
+
+	return ret;
+}
+
+/**
+ * msk_route_cache_put_addr: (re)starts an entry from a fresh getaddrinfo result
+ */
+static void msk_route_cache_put_addr(struct msk_trans *trans, struct rdma_addrinfo *res) {
+	struct msk_route_entry *entry;
+
+	if (res->ai_dst_len > sizeof(entry->dst) || res->ai_src_len > sizeof(entry->src))
+		return;
+
+	pthread_mutex_lock(&msk_global_state->route_lock);
+	entry = msk_route_cache_find(trans);
+	if (!entry) {
+		entry = malloc(sizeof(*entry));
+		if (!entry) {
+			pthread_mutex_unlock(&msk_global_state->route_lock);
+			return;
+		}
+		memset(entry, 0, sizeof(*entry));
+		entry->node = trans->node ? strdup(trans->node) : NULL;
+		entry->port = trans->port ? strdup(trans->port) : NULL;
+		entry->ps = trans->conn_type;
+		entry->next = msk_global_state->route_cache;
+		msk_global_state->route_cache = entry;
+	}
+	entry->expire = msk_now_sec() + trans->route_cache_ttl;
+	entry->has_src = (res->ai_src_addr != NULL);
+	if (res->ai_src_addr)
+		memcpy(&entry->src, res->ai_src_addr, res->ai_src_len);
+	memcpy(&entry->dst, res->ai_dst_addr, res->ai_dst_len);
+	entry->has_path = 0;
+	pthread_mutex_unlock(&msk_global_state->route_lock);
+}
+
+/**
+ * msk_route_cache_put_path: keeps the primary path record once the route is resolved.
+ * Only for infiniband links, others do not query the SA anyway.
+ */
+static void msk_route_cache_put_path(struct msk_trans *trans) {
+	struct msk_route_entry *entry;
+	struct ibv_sa_path_rec *rec;
+	struct ibv_port_attr port_attr;
+	struct ibv_path_record *path;
+
+	if (!trans->cm_id->route.num_paths || !trans->cm_id->route.path_rec
+	    || ibv_query_port(trans->cm_id->verbs, trans->cm_id->port_num, &port_attr)
+	    || port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND)
+		return;
+
+	rec = &trans->cm_id->route.path_rec[0];
+
+	pthread_mutex_lock(&msk_global_state->route_lock);
+	entry = msk_route_cache_find(trans);
+	if (entry && !entry->has_path) {
+		/* ibv_sa_path_rec is unpacked, the kernel wants the wire format */
+		memset(&entry->path, 0, sizeof(entry->path));
+		entry->path.flags = IBV_PATH_FLAG_GMP | IBV_PATH_FLAG_PRIMARY | IBV_PATH_FLAG_BIDIRECTIONAL;
+		path = &entry->path.path;
+		path->dgid = rec->dgid;
+		path->sgid = rec->sgid;
+		path->dlid = rec->dlid;
+		path->slid = rec->slid;
+		path->flowlabel_hoplimit = htobe32((be32toh(rec->flow_label) << 8) | rec->hop_limit);
+		path->tclass = rec->traffic_class;
+		path->reversible_numpath = (rec->reversible ? IBV_PATH_RECORD_REVERSIBLE : 0) | (rec->numb_path & 0x7f);
+		path->pkey = rec->pkey;
+		path->qosclass_sl = htobe16(rec->sl & 0xf);
+		path->mtu = (rec->mtu_selector << 6) | (rec->mtu & 0x3f);
+		path->rate = (rec->rate_selector << 6) | (rec->rate & 0x3f);
+		path->packetlifetime = (rec->packet_life_time_selector << 6) | (rec->packet_life_time & 0x3f);
+		path->preference = rec->preference;
+		entry->has_path = 1;
+	}
+	pthread_mutex_unlock(&msk_global_state->route_lock);
+}
+
+/**
+ * msk_route_cache_invalidate: forget the trans' destination, on connection errors
+ */
+static void msk_route_cache_invalidate(struct msk_trans *trans) {
+	struct msk_route_entry *entry;
+
+	pthread_mutex_lock(&msk_global_state->route_lock);
+	entry = msk_route_cache_find(trans);
+	if (entry) {
+		INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "invalidating cached route to %s:%s", trans->node, trans->port);
+		entry->expire = 0; /* dropped on next lookup */
+	}
+	pthread_mutex_unlock(&msk_global_state->route_lock);
+}
+
+/**
+ * msk_resolve_route: rdma_resolve_route, or sets a cached path record which
+ * gets us the ROUTE_RESOLVED event without asking the SA
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_resolve_route(struct msk_trans *trans) {
+	struct msk_route_entry *entry;
+	struct ibv_path_data path;
+	int has_path = 0;
+
+	if (trans->route_cache_ttl) {
+		pthread_mutex_lock(&msk_global_state->route_lock);
+		entry = msk_route_cache_find(trans);
+		if (entry && entry->has_path) {
+			memcpy(&path, &entry->path, sizeof(path));
+			has_path = 1;
+		}
+		pthread_mutex_unlock(&msk_global_state->route_lock);
+
+		if (has_path) {
+			if (!rdma_set_option(trans->cm_id, RDMA_OPTION_IB, RDMA_OPTION_IB_PATH, &path, sizeof(path))) {
+				INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "using cached path record");
+				return 0;
+			}
+			INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "setting cached path failed (%d), resolving", errno);
+		}
+	}
+
+	if (rdma_resolve_route(trans->cm_id, trans->timeout))
+		return errno;
+
+	return 0;
+}
+
+/**
+ * msk_resolve_addr: getaddrinfo (or cached result), optional reserved port bind
+ * and rdma_resolve_addr, the ADDR_RESOLVED event comes later on the cm thread
+ */
+static int msk_resolve_addr(struct msk_trans *trans) {
+	struct rdma_addrinfo hints, *res = NULL, *bind_res = NULL;
+	struct sockaddr_storage cached_src, cached_dst;
+	struct sockaddr *src_addr, *dst_addr;
+	int has_src;
+	int ret = 0;
+
+	if (trans->bind_node) {
+		// local address picks the device and port we go out from
+		memset(&hints, 0, sizeof(struct rdma_addrinfo));
+		hints.ai_flags = RAI_PASSIVE;
+		hints.ai_port_space = trans->conn_type;
+
+		ret = rdma_getaddrinfo(trans->bind_node, NULL, &hints, &bind_res);
+		if (ret) {
+			ret = errno ? errno : EADDRNOTAVAIL;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo on bind address %s failed: %s (%d)", trans->bind_node, strerror(ret), ret);
+			return ret;
+		}
+	}
+
+	if (trans->route_cache_ttl && !bind_res && !msk_route_cache_get_addr(trans, &cached_src, &cached_dst, &has_src)) {
+		INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "using cached address for %s:%s", trans->node, trans->port);
+		ret = 0;
+		src_addr = has_src ? (struct sockaddr*)&cached_src : NULL;
+		dst_addr = (struct sockaddr*)&cached_dst;
+	} else {
 		memset(&hints, 0, sizeof(struct rdma_addrinfo));
 		hints.ai_port_space = trans->conn_type;
+		if (bind_res) {
+			hints.ai_src_addr = bind_res->ai_src_addr;
+			hints.ai_src_len = bind_res->ai_src_len;
+		}
 
 		ret = rdma_getaddrinfo(trans->node, trans->port, &hints, &res);
 		if (ret) {
@@ -2001,11 +5135,22 @@ static int msk_bind_client(struct msk_trans *trans) {
 			} else {
 				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo failed: %s (%d)", gai_strerror(ret), ret);
 			}
-			break;
+			if (bind_res)
+				rdma_freeaddrinfo(bind_res);
+			return ret;
 		}
+		if (trans->route_cache_ttl && !bind_res)
+			msk_route_cache_put_addr(trans, res);
+
+		src_addr = res->ai_src_addr;
+		dst_addr = res->ai_dst_addr;
+		if (bind_res && !src_addr)
+			src_addr = bind_res->ai_src_addr;
+	}
 
+	do {
 		if (trans->privport) {
-			int port;
+			int i, port;
 			struct sockaddr_in sin = {
 				.sin_family      = AF_INET,
 				.sin_addr.s_addr = htonl(INADDR_ANY),
@@ -2016,29 +5161,16 @@ static int msk_bind_client(struct msk_trans *trans) {
 			};
 
 			struct sockaddr *sa;
+			in_port_t *sa_port;
 
-			switch (res->ai_dst_addr->sa_family) {
+			switch (dst_addr->sa_family) {
 				case PF_INET:
 					sa = (struct sockaddr*)&sin;
-					for (port = MSK_MAX_RESVPORT; port > MSK_MIN_RESVPORT; port--) {
-						sin.sin_port = htons(port);
-						ret = rdma_bind_addr(trans->cm_id, sa);
-						if (ret)
-							ret = errno;
-						if (ret != EADDRNOTAVAIL)
-							break;
-					}
+					sa_port = &sin.sin_port;
 					break;
 				case PF_INET6:
 					sa = (struct sockaddr*)&sin6;
-					for (port = MSK_MAX_RESVPORT; port > MSK_MIN_RESVPORT; port--) {
-						sin6.sin6_port = htons(port);
-						ret = rdma_bind_addr(trans->cm_id, sa);
-						if (ret)
-							ret = errno;
-						if (ret != EADDRNOTAVAIL)
-							break;
-					}
+					sa_port = &sin6.sin6_port;
 					break;
 				default:
 					ERROR_LOG("res->ai_src_addr not valid?");
@@ -2047,16 +5179,59 @@ static int msk_bind_client(struct msk_trans *trans) {
 			if (ret)
 				break;
 
+			/* ports held by our transports are skipped without a syscall,
+			 * ones taken by someone else are given back and rotated past */
+			ret = EADDRNOTAVAIL;
+			for (i = 0; i < MSK_RESVPORT_COUNT; i++) {
+				port = msk_resvport_get();
+				if (!port)
+					break;
+				*sa_port = htons(port);
+				ret = rdma_bind_addr(trans->cm_id, sa);
+				if (!ret) {
+					trans->resvport = port;
+					break;
+				}
+				ret = errno;
+				msk_resvport_put(port);
+				if (ret != EADDRNOTAVAIL && ret != EADDRINUSE)
+					break;
+			}
+			if (ret) {
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "no reserved port available: %s (%d)", strerror(ret), ret);
+				break;
+			}
 		}
 
-		ret = rdma_resolve_addr(trans->cm_id, res->ai_src_addr, res->ai_dst_addr, trans->timeout);
+		ret = rdma_resolve_addr(trans->cm_id, src_addr, dst_addr, trans->timeout);
 		if (ret) {
 			ret = errno;
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_resolve_addr failed: %s (%d)", strerror(ret), ret);
 			break;
 		}
+	} while (0);
+
+	if (res)
 		rdma_freeaddrinfo(res);
+	if (bind_res)
+		rdma_freeaddrinfo(bind_res);
+
+	return ret;
+}
+
+/**
+ * msk_bind_client: resolve addr and route for the client and waits till it's done
+ * (the route and pthread_cond_signal is done in the cm thread)
+ *
+ */
+static int msk_bind_client(struct msk_trans *trans) {
+	int ret;
 
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+
+	do {
+		if ((ret = msk_resolve_addr(trans)))
+			break;
 
 		while (trans->state == MSK_INIT) {
 			msk_cond_wait(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_cond, &trans->cm_lock);
@@ -2068,7 +5243,7 @@ static int msk_bind_client(struct msk_trans *trans) {
 			break;
 		}
 
-		ret = rdma_resolve_route(trans->cm_id, trans->timeout);
+		ret = msk_resolve_route(trans);
 		if (ret) {
 			trans->state = MSK_ERROR;
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_resolve_route failed: %s (%d)", strerror(ret), ret);
@@ -2092,6 +5267,14 @@ static int msk_bind_client(struct msk_trans *trans) {
 	return ret;
 }
 
+static void msk_fill_conn_param(struct rdma_conn_param *conn_param) {
+	memset(conn_param, 0, sizeof(struct rdma_conn_param));
+	conn_param->responder_resources = 1;
+	conn_param->initiator_depth = 1;
+	conn_param->rnr_retry_count = 10;
+	conn_param->retry_count = 10;
+}
+
 /**
  * msk_finalize_connect: tells the other side we're ready to receive stuff (does the actual rdma_connect) and waits for its ack
  *
@@ -2109,11 +5292,7 @@ int msk_finalize_connect(struct msk_trans *trans) {
 	}
 
 
-	memset(&conn_param, 0, sizeof(struct rdma_conn_param));
-	conn_param.responder_resources = 1;
-	conn_param.initiator_depth = 1;
-	conn_param.rnr_retry_count = 10;
-	conn_param.retry_count = 10;
+	msk_fill_conn_param(&conn_param);
 
 	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
 
@@ -2133,6 +5312,7 @@ int msk_finalize_connect(struct msk_trans *trans) {
 		if (trans->state == MSK_CONNECTED) {
 			msk_cq_addfd(trans);
 			msk_stats_add(trans);
+			msk_msg_connected(trans);
 		} else {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Connection failed");
 			ret = ECONNREFUSED;
@@ -2146,34 +5326,11 @@ int msk_finalize_connect(struct msk_trans *trans) {
 }
 
 /**
- * msk_connect: connects a client to a server
- *
- * @param trans [INOUT] trans must be init first
- *
- * @return 0 on success, the value of errno on error 
+ * msk_setup_client: pd, qp and buffers once the route is resolved
  */
-int msk_connect(struct msk_trans *trans) {
-	int ret;
+static int msk_setup_client(struct msk_trans *trans) {
 	struct msk_pd *pd;
-
-	if (!trans || trans->state != MSK_INIT) {
-		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans must be initialized first!");
-		return EINVAL;
-	}
-
-	if (trans->server) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Must be on client side to call this function");
-		return EINVAL;
-	}
-
-	if ((ret = msk_check_create_epoll_thread(&msk_global_state->cm_thread, msk_cm_thread, trans, &msk_global_state->cm_epollfd))) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread failed: %s (%d)", strerror(ret), ret);
-		return ret;
-	}
-	msk_cm_addfd(trans);
-
-	if ((ret = msk_bind_client(trans)))
-		return ret;
+	int ret;
 
 	/* pick the right pd if we already have one, allocate otherwise */
 	ret = msk_setup_pd(trans);
@@ -2185,56 +5342,298 @@ int msk_connect(struct msk_trans *trans) {
 	pd = msk_getpd(trans);
 	if (!pd) {
 		ret = ENOSPC;
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No space left in msk pd, multiple contexts per device?");
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "No pd slot for this device");
 		return ret;
 	}
-	if (!pd->pd) {
-		pd->pd = ibv_alloc_pd(trans->cm_id->verbs);
-		if (!pd->pd) {
-			ret = errno;
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_alloc_pd failed: %s (%d)", strerror(ret), ret);
-			return ret;
-		}
-	}
+	if ((ret = msk_alloc_pd(trans, pd)))
+		return ret;
 
 	if ((ret = msk_setup_qp(trans)))
 		return ret;
 	if ((ret = msk_setup_wctx(trans)) || (ret = msk_setup_rctx(trans)))
 		return ret;
+	if ((ret = msk_msg_setup(trans)))
+		return ret;
+	if ((ret = msk_mw_setup(trans)))
+		return ret;
 
 	return 0;
 }
 
+static int msk_connect_check(struct msk_trans *trans) {
+	int ret;
 
-/**
- * msk_post_n_recv: Post a receive buffer.
- *
- * Need to post recv buffers before the opposite side tries to send anything!
- * @param trans        [IN]
- * @param data         [OUT] the data buffer to be filled with received data
- * @param num_sge      [IN]  the number of elements in data to register
- * @param callback     [IN]  function that'll be called when done
- * @param err_callback [IN]  function that'll be called on error
- * @param callback_arg [IN]  argument to give to the callback
- *
- * @return 0 on success, the value of errno on error
- */
-int msk_post_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
-	struct msk_ctx *rctx;
-	int i, ret;
-
-	if (!trans || (trans->state != MSK_CONNECTED && trans->state != MSK_ROUTE_RESOLVED && trans->state != MSK_CONNECT_REQUEST)) {
-		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) state: %d", trans, trans->state);
+	if (!trans || trans->state != MSK_INIT) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans must be initialized first!");
 		return EINVAL;
 	}
 
-	INFO_LOG(trans->debug & MSK_DEBUG_RECV, "posting recv");
-
-	i = 0;
+	if (trans->server) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Must be on client side to call this function");
+		return EINVAL;
+	}
+
+	if ((ret = msk_check_create_epoll_thread(&msk_global_state->cm_thread, msk_cm_thread, trans, &msk_global_state->cm_epollfd))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * msk_connect: connects a client to a server
+ *
+ * @param trans [INOUT] trans must be init first
+ *
+ * @return 0 on success, the value of errno on error 
+ */
+int msk_connect(struct msk_trans *trans) {
+	int ret;
+
+	if ((ret = msk_connect_check(trans)))
+		return ret;
+	msk_cm_addfd(trans);
+
+	if ((ret = msk_bind_client(trans)))
+		return ret;
+
+	return msk_setup_client(trans);
+}
+
+static void msk_connect_async_del(struct msk_trans *trans) {
+	struct msk_trans **prev;
+
+	pthread_mutex_lock(&msk_global_state->connect_lock);
+	for (prev = &msk_global_state->connecting; *prev; prev = &(*prev)->connect_next) {
+		if (*prev == trans) {
+			*prev = trans->connect_next;
+			break;
+		}
+	}
+	trans->connect_next = NULL;
+	pthread_mutex_unlock(&msk_global_state->connect_lock);
+}
+
+/**
+ * msk_connect_async_done: end of a non-blocking connect, either way
+ */
+static void msk_connect_async_done(struct msk_trans *trans, int status) {
+	msk_connect_async_del(trans);
+	atomic_store(&trans->connect_status, status);
+	if (status)
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "asynchronous connect failed: %s (%d)", strerror(status), status);
+
+	trans->connect_done_cb(trans, status, trans->connect_arg);
+}
+
+/**
+ * msk_connect_async_event: state machine of msk_connect_async, runs on the cm thread
+ * after msk_cma_event_handler updated the trans state
+ */
+static void msk_connect_async_event(struct msk_trans *trans, struct rdma_cm_event *event) {
+	struct rdma_conn_param conn_param;
+	int ret = 0;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		if ((ret = msk_resolve_route(trans))) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_resolve_route failed: %s (%d)", strerror(ret), ret);
+			trans->state = MSK_ERROR;
+		}
+		break;
+
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		if ((ret = msk_setup_client(trans)))
+			break;
+
+		if (trans->connect_setup_cb)
+			trans->connect_setup_cb(trans, 0, trans->connect_arg);
+
+		msk_fill_conn_param(&conn_param);
+		if (rdma_connect(trans->cm_id, &conn_param)) {
+			ret = errno;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_connect failed: %s (%d)", strerror(ret), ret);
+		}
+		break;
+
+	case RDMA_CM_EVENT_ESTABLISHED:
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+		if (trans->state == MSK_CONNECTED) {
+			msk_cq_addfd(trans);
+			msk_stats_add(trans);
+			msk_msg_connected(trans);
+		} else {
+			ret = ECONNREFUSED;
+		}
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+
+		msk_connect_async_done(trans, ret);
+		return;
+
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		ret = (event->status < 0) ? -event->status : ECONNREFUSED;
+		if (event->event == RDMA_CM_EVENT_REJECTED)
+			ret = ECONNREFUSED;
+		break;
+
+	// the connection went away before it was established
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+		ret = ECONNRESET;
+		break;
+
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		ret = ENODEV;
+		break;
+
+	default:
+		break;
+	}
+
+	if (ret)
+		msk_connect_async_done(trans, ret);
+}
+
+/**
+ * msk_connect_async_expire: fails the asynchronous connects still in
+ * progress after the trans' timeout, runs on the cm thread like their events
+ */
+static void msk_connect_async_expire(void) {
+	struct msk_trans *trans;
+	uint64_t now = msk_now_nsec();
+
+	for (;;) {
+		pthread_mutex_lock(&msk_global_state->connect_lock);
+		for (trans = msk_global_state->connecting; trans; trans = trans->connect_next)
+			if (trans->connect_deadline <= now)
+				break;
+		pthread_mutex_unlock(&msk_global_state->connect_lock);
+		if (!trans)
+			break;
+
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+		if (trans->state != MSK_CONNECTED) {
+			trans->state = MSK_ERROR;
+			pthread_cond_broadcast(&trans->cm_cond);
+		}
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+
+		// removes it from the list
+		msk_connect_async_done(trans, ETIMEDOUT);
+	}
+}
+
+/**
+ * msk_connect_async: non-blocking msk_connect + msk_finalize_connect
+ *
+ * Address/route resolution and connection are driven by the cm thread, so
+ * any number of connections can be in progress at the same time.
+ * The callbacks run on the cm thread and must not block nor destroy the trans.
+ * done_cb gets ETIMEDOUT if still not connected after the trans' timeout, and
+ * ECONNRESET or ENODEV if the connection or device goes away before that.
+ *
+ * @param trans    [INOUT] trans must be init first
+ * @param setup_cb [IN] called with 0 once the qp is there and just before
+ *                      connecting, to post receive buffers. Can be NULL
+ * @param done_cb  [IN] called with 0 once connected, or an errno value
+ * @param arg      [IN] argument given to both callbacks
+ *
+ * @return 0 if the connection was started, the value of errno on error.
+ * msk_connect_poll gives the progress.
+ */
+int msk_connect_async(struct msk_trans *trans, connect_callback_t setup_cb, connect_callback_t done_cb, void *arg) {
+	int ret;
+
+	if ((ret = msk_connect_check(trans)))
+		return ret;
+
+	if (!done_cb) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "need a completion callback, use msk_connect otherwise");
+		return EINVAL;
+	}
+
+	trans->connect_setup_cb = setup_cb;
+	trans->connect_done_cb = done_cb;
+	trans->connect_arg = arg;
+	trans->connect_status = EINPROGRESS;
+	trans->connect_deadline = msk_now_nsec() + trans->timeout * 1000000ULL;
+
+	// before anything can complete it, done takes it off again
+	pthread_mutex_lock(&msk_global_state->connect_lock);
+	trans->connect_next = msk_global_state->connecting;
+	msk_global_state->connecting = trans;
+	pthread_mutex_unlock(&msk_global_state->connect_lock);
+
+	msk_cm_addfd(trans);
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+	ret = msk_resolve_addr(trans);
+	if (ret)
+		trans->connect_status = ret;
+	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &trans->cm_lock);
+
+	if (ret)
+		msk_connect_async_del(trans);
+
+	return ret;
+}
+
+/**
+ * msk_connect_poll: progress of msk_connect_async
+ *
+ * @return EINPROGRESS while connecting, 0 once connected, the errno value of the failure otherwise
+ */
+int msk_connect_poll(struct msk_trans *trans) {
+	if (!trans || !trans->connect_done_cb)
+		return EINVAL;
+
+	return trans->connect_status;
+}
+
+
+/**
+ * msk_post_n_recv: Post a receive buffer.
+ *
+ * Need to post recv buffers before the opposite side tries to send anything!
+ * @param trans        [IN]
+ * @param data         [OUT] the data buffer to be filled with received data
+ * @param num_sge      [IN]  the number of elements in data to register
+ * @param callback     [IN]  function that'll be called when done
+ * @param err_callback [IN]  function that'll be called on error
+ * @param callback_arg [IN]  argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	struct msk_ctx *rctx;
+	struct timespec ts_start, ts_end;
+	int i, ret, waited = 0;
+
+	if (!trans || (trans->state != MSK_CONNECTED && trans->state != MSK_ROUTE_RESOLVED && trans->state != MSK_CONNECT_REQUEST)) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) state: %d", trans, trans->state);
+		return EINVAL;
+	}
+
+	DATA_LOG(trans->debug & MSK_DEBUG_RECV, "posting recv");
+	MSK_PROBE(post_recv, trans, data, num_sge);
+
+	// the srq's context array can grow, it has its own lock
+	if (trans->srq)
+		return msk_srq_post(trans->srq->srq_context, data, num_sge, callback, err_callback, callback_arg, 1);
+
+	i = 0;
 	rctx = trans->rctx;
 	do {
 		if (i == trans->rq_depth) {
-			INFO_LOG(trans->debug & MSK_DEBUG_CTX, "Waiting for rctx");
+			DATA_LOG(trans->debug & MSK_DEBUG_CTX, "Waiting for rctx");
+			if (!waited++)
+				clock_gettime(CLOCK_MONOTONIC, &ts_start);
 			usleep(250);
 			i = 0;
 			rctx = trans->rctx;
@@ -2245,7 +5644,15 @@ int msk_post_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_
 			i++;
 		}
 	} while ( i == trans->rq_depth || !(atomic_bool_compare_and_swap(&rctx->used, MSK_CTX_FREE, MSK_CTX_PENDING)) );
-	INFO_LOG(trans->debug & MSK_DEBUG_RECV, "got a free context");
+	DATA_LOG(trans->debug & MSK_DEBUG_RECV, "got a free context");
+	msk_gauge_inc(&trans->rctx_used, &trans->rctx_peak);
+	if (trans->server >= 0)
+		atomic_inc(trans->outstanding);
+	if (waited) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		atomic_add(msk_stats_slot(trans)->rq_wait, waited);
+		msk_stats_time(&msk_stats_slot(trans)->nsec_rq_wait, &ts_start, &ts_end);
+	}
 
 	rctx->callback = callback;
 	rctx->err_callback = err_callback;
@@ -2255,10 +5662,11 @@ int msk_post_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_
 	for (i=0; i < num_sge; i++) {
 		if (!data || !data->mr) {
 			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "You said to recv %d elements (num_sge), but we only found %d! Not requesting.", num_sge, i);
+			msk_put_rctx(trans, rctx);
 			return EINVAL;
 		} 
 		rctx->sg_list[i].addr = (uintptr_t) data->data;
-		INFO_LOG(trans->debug & MSK_DEBUG_RECV, "addr: %"PRIu64"\n", rctx->sg_list->addr);
+		DATA_LOG(trans->debug & MSK_DEBUG_RECV, "addr: %"PRIu64"\n", rctx->sg_list->addr);
 		rctx->sg_list[i].length = data->max_size;
 		rctx->sg_list[i].lkey = data->mr->lkey;
 		if (i != num_sge-1)
@@ -2270,253 +5678,3899 @@ int msk_post_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_
 	rctx->wr.rwr.sg_list = rctx->sg_list;
 	rctx->wr.rwr.num_sge = num_sge;
 
-	if (trans->srq)
-		ret = ibv_post_srq_recv(trans->srq, &rctx->wr.rwr, &trans->bad_recv_wr);
-	else
-		ret = ibv_post_recv(trans->qp, &rctx->wr.rwr, &trans->bad_recv_wr);
+	// before posting, the completion can come in right away
+	msk_trace(trans, rctx, MSK_TRACE_POST_RECV, 0, 0, rctx->sg_list[0].length);
+	ret = ibv_post_recv(trans->qp, &rctx->wr.rwr, &trans->bad_recv_wr);
+
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_recv failed: %s (%d)", strerror(ret), ret);
+		msk_put_rctx(trans, rctx);
+		return ret; // FIXME np_uerror(ret)
+	}
+
+	return 0;
+}
+
+/**
+ * msk_try_get_wctx: reserves a free send context if there is one
+ *
+ * @param trans [IN]
+ *
+ * @return the reserved context, in MSK_CTX_PENDING state, or NULL
+ */
+static struct msk_ctx *msk_try_get_wctx(struct msk_trans *trans) {
+	struct msk_ctx *wctx;
+	int i;
+
+	for (i = 0, wctx = trans->wctx;
+	     i < trans->sq_depth;
+	     i++, wctx = msk_next_ctx(wctx, trans->max_send_sge))
+		if (wctx->used == MSK_CTX_FREE
+		    && atomic_bool_compare_and_swap(&wctx->used, MSK_CTX_FREE, MSK_CTX_PENDING)) {
+			msk_gauge_inc(&trans->wctx_used, &trans->wctx_peak);
+			atomic_inc(trans->outstanding);
+			if (trans->stuck_ms)
+				wctx->post_nsec = msk_coarse_nsec();
+			return wctx;
+		}
+
+	return NULL;
+}
+
+/**
+ * msk_get_wctx: waits for a free send context and reserves it
+ */
+static struct msk_ctx *msk_get_wctx(struct msk_trans *trans) {
+	struct msk_ctx *wctx;
+	struct timespec ts_start, ts_end;
+	int waited = 0;
+
+	while (!(wctx = msk_try_get_wctx(trans))) {
+		DATA_LOG(trans->debug & MSK_DEBUG_CTX, "waiting for wctx");
+		if (!waited++)
+			clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		usleep(250);
+	}
+	if (waited) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		atomic_add(msk_stats_slot(trans)->sq_wait, waited);
+		msk_stats_time(&msk_stats_slot(trans)->nsec_sq_wait, &ts_start, &ts_end);
+	}
+	DATA_LOG(trans->debug & MSK_DEBUG_SEND, "got a free context");
+
+	return wctx;
+}
+
+/**
+ * msk_post_send_ctx: fills a reserved send context and posts it
+ * The context is given back if anything goes wrong.
+ */
+static int msk_post_send_ctx(struct msk_trans *trans, struct msk_ctx *wctx, enum ibv_wr_opcode opcode, msk_data_t *data, int num_sge, msk_rloc_t *rloc, uint32_t timeout_ms, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	int i, ret;
+	uint32_t totalsize = 0;
+
+	wctx->callback = callback;
+	wctx->err_callback = err_callback;
+	wctx->callback_arg = callback_arg;
+	wctx->data = data;
+
+	for (i=0; i < num_sge; i++) {
+		if (!data || !data->mr) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "You said to send %d elements (num_sge), but we only found %d! Not sending.", num_sge, i);
+			// or send up to previous one? It's probably an error though...
+			msk_put_wctx(trans, wctx);
+			return EINVAL;
+		} 
+		if (data->size == 0) {
+			num_sge = i; // only send up to previous sg, do we want to warn about this?
+			break;
+		}
+
+		wctx->sg_list[i].addr = (uintptr_t)data->data;
+		DATA_LOG(trans->debug & MSK_DEBUG_SEND, "addr: %"PRIu64"\n", wctx->sg_list[i].addr);
+		wctx->sg_list[i].length = data->size;
+		wctx->sg_list[i].lkey = data->mr->lkey;
+		totalsize += data->size;
+
+		if (i != num_sge-1)
+			data = data->next;
+	}
+
+	if (rloc && totalsize > rloc->size) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "trying to send or read a buffer bigger than the remote buffer (shall we truncate?)");
+		msk_put_wctx(trans, wctx);
+		return EMSGSIZE;
+	}
+
+	wctx->wr.wwr.next = NULL;
+	wctx->wr.wwr.wr_id = (uintptr_t)wctx;
+	wctx->wr.wwr.opcode = opcode;
+//FIXME	wctx->wr.wwr.imm_data = htonl(data->imm_data);
+	wctx->wr.wwr.send_flags = IBV_SEND_SIGNALED;
+	wctx->wr.wwr.sg_list = wctx->sg_list;
+	wctx->wr.wwr.num_sge = num_sge;
+	if (rloc) {
+		wctx->wr.wwr.wr.rdma.rkey = rloc->rkey;
+		wctx->wr.wwr.wr.rdma.remote_addr = rloc->raddr;
+	}
+
+	if (timeout_ms && (ret = msk_deadline_arm(trans, wctx, timeout_ms))) {
+		msk_put_wctx(trans, wctx);
+		return ret;
+	}
+
+	// before posting, the completion can come in right away
+	msk_trace(trans, wctx, MSK_TRACE_POST_SEND, opcode, 0, totalsize);
+	ret = ibv_post_send(trans->qp, &wctx->wr.wwr, &trans->bad_send_wr);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_send failed: %s (%d)", strerror(ret), ret);
+		// too late if err_callback already got the deadline
+		if (!timeout_ms || !msk_deadline_complete(trans, wctx))
+			msk_put_wctx(trans, wctx);
+		return ret; // FIXME np_uerror(ret)
+	}
+
+	return 0;
+}
+
+static int msk_post_send_generic(struct msk_trans *trans, enum ibv_wr_opcode opcode, msk_data_t *data, int num_sge, msk_rloc_t *rloc, uint32_t timeout_ms, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	struct msk_ctx *wctx;
+
+	if (!trans || trans->state != MSK_CONNECTED) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) state: %d", trans, trans->state);
+		return EINVAL;
+	}
+
+	DATA_LOG(trans->debug & MSK_DEBUG_SEND, "posting a send with op %d", opcode);
+	MSK_PROBE(post_send, trans, data, opcode, num_sge);
+
+	// opcode-specific checks:
+	if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_READ) {
+		if (!rloc) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Cannot do rdma without a remote location!");
+			return EINVAL;
+		}
+	} else if (opcode == IBV_WR_SEND || opcode == IBV_WR_SEND_WITH_IMM) {
+	} else {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "unsupported op code: %d", opcode);
+		return EINVAL;
+	}
+
+	wctx = msk_get_wctx(trans);
+
+	return msk_post_send_ctx(trans, wctx, opcode, data, num_sge, rloc, timeout_ms, callback, err_callback, callback_arg);
+}
+
+/**
+ * Post a send buffer.
+ *
+ * @param trans        [IN]
+ * @param data         [IN] the data buffer to be sent
+ * @param num_sge      [IN] the number of elements in data to send
+ * @param callback     [IN] function that'll be called when done
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_n_send(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	return msk_post_send_generic(trans, IBV_WR_SEND, data, num_sge, NULL, trans ? trans->op_timeout_ms : 0, callback, err_callback, callback_arg);
+}
+
+/**
+ * msk_wait_callback: send/recv callback that just unlocks a mutex.
+ *
+ */
+static void msk_wait_callback(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	pthread_mutex_t *lock = arg;
+
+	msk_profile_skip();
+	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, lock);
+}
+
+/**
+ * Post a receive buffer and waits for _that one and not any other_ to be filled.
+ * Generally a bad idea to use that one unless only that one is used.
+ *
+ * @param trans   [IN]
+ * @param data    [OUT] the data buffer to be filled with the received data
+ * @param num_sge [IN]  the number of elements in data to register
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_wait_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_n_recv(trans, data, num_sge, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+	}
+
+	return ret;
+}
+
+/**
+ * Post a send buffer and waits for that one to be completely sent
+ * @param trans   [IN]
+ * @param data    [IN] the data to send
+ * @param num_sge [IN] the number of elements in data to send
+ *
+ * @return 0 on success, ETIMEDOUT if op_timeout_ms passed first, the value of errno on error
+ */
+int msk_wait_n_send(struct msk_trans *trans, msk_data_t *data, int num_sge) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_n_send(trans, data, num_sge, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+		if (data->status == MSK_WC_DEADLINE)
+			ret = ETIMEDOUT;
+	}
+
+	return ret;
+}
+
+// callbacks would all be run in a big send/recv_thread
+
+
+// server specific:
+
+
+int msk_post_n_read(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	return msk_post_send_generic(trans, IBV_WR_RDMA_READ, data, num_sge, rloc, trans ? trans->op_timeout_ms : 0, callback, err_callback, callback_arg);
+}
+
+int msk_post_n_write(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
+	return msk_post_send_generic(trans, IBV_WR_RDMA_WRITE, data, num_sge, rloc, trans ? trans->op_timeout_ms : 0, callback, err_callback, callback_arg);
+}
+
+/**
+ * msk_post_n_timed: send, read or write with its own deadline
+ *
+ * If the post hasn't completed timeout_ms after it was posted, err_callback
+ * is called from a worker with data->status MSK_WC_DEADLINE, and neither
+ * callback gets the completion when it comes. The hardware may still use
+ * the buffers until then: the usual reaction is to give up on the
+ * connection before reusing them. err_callback must not destroy the
+ * transport itself, teardown waits for the context it runs for: leave
+ * msk_destroy_trans to another thread.
+ *
+ * @param opcode     [IN] IBV_WR_SEND, IBV_WR_RDMA_READ or IBV_WR_RDMA_WRITE
+ * @param rloc       [IN] remote location for reads and writes, NULL for sends
+ * @param timeout_ms [IN] 0 for no deadline, regardless of op_timeout_ms
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_n_timed(struct msk_trans *trans, enum ibv_wr_opcode opcode, msk_data_t *data, int num_sge, msk_rloc_t *rloc, uint32_t timeout_ms, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	return msk_post_send_generic(trans, opcode, data, num_sge, rloc, timeout_ms, callback, err_callback, callback_arg);
+}
+
+int msk_wait_n_read(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_n_read(trans, data, num_sge, rloc, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+		if (data->status == MSK_WC_DEADLINE)
+			ret = ETIMEDOUT;
+	}
+
+	return ret;
+}
+
+
+int msk_wait_n_write(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_n_write(trans, data, num_sge, rloc, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+		if (data->status == MSK_WC_DEADLINE)
+			ret = ETIMEDOUT;
+	}
+
+	return ret;
+}
+
+
+/* MESSAGE LAYER */
+
+/*
+ * Messages up to msg_threshold bytes are copied into a header-prefixed
+ * bounce buffer and sent eagerly into one of the rq_depth-1 small receive
+ * buffers posted by the library.
+ * Bigger ones only send a header advertising where the data lives; the
+ * receiver pulls it with an RDMA READ straight into the buffer given to
+ * msk_post_msg_recv and sends a FIN back, which completes the send.
+ *
+ * Data messages carry a sequence number so they are matched with posted
+ * receives in order even when callbacks run concurrently on workers.
+ *
+ * Everything goes out through a queue drained under tx_lock. With
+ * flow_control, each message needs a credit, i.e. a receive buffer known
+ * to be posted on the other side. Every header gives back the buffers
+ * reposted since the last one, and an explicit CREDIT message is sent when
+ * half of them are waiting and nothing else goes out. The last credit is
+ * kept for messages that give credits back so both sides cannot end up
+ * waiting on each other.
+ */
+
+#define MSK_MSG_EAGER  1
+#define MSK_MSG_RNDV   2
+#define MSK_MSG_FIN    3
+#define MSK_MSG_CREDIT 4
+
+struct msk_msg_hdr {
+	uint8_t type;
+	uint8_t status;		/**< FIN only: work completion status of the READ */
+	uint16_t credits;	/**< receive buffers reposted since our last message */
+	uint32_t seq;		/**< EAGER/RNDV only */
+	uint32_t size;		/**< payload size */
+	uint32_t cookie;	/**< sender slot, echoed back in FIN */
+	uint64_t raddr;		/**< RNDV only */
+	uint32_t rkey;		/**< RNDV only */
+	uint32_t pad2;
+};
+
+/** queued message, the buffer starts with its header */
+struct msk_msg_tx {
+	struct msk_msg_tx *next;
+	msk_data_t *bdata;
+	ctx_callback_t callback;	/**< send completion, called on error too */
+	void *callback_arg;
+	int stalled;			/**< already counted as waiting for credits */
+};
+
+/** send side slot, one per message in flight */
+struct msk_msg_slot {
+	uint32_t used;
+	uint32_t refs;		/**< completion events left: send, and FIN for rendezvous */
+	enum ibv_wc_status status;
+	struct msk_msg_tx tx;
+	msk_data_t bdata;	/**< bounce buffer, header + eager payload */
+	msk_data_t *data;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+};
+
+/** receive side bounce buffer */
+struct msk_msg_rbuf {
+	msk_data_t bdata;
+};
+
+/** receive posted by the application, kept until its FIN is sent */
+struct msk_msg_urecv {
+	uint32_t used;
+	uint32_t cookie;	/**< peer slot to FIN once the READ is done */
+	msk_rloc_t rloc;
+	struct msk_msg_tx tx;
+	msk_data_t fdata;	/**< FIN buffer, header only */
+	msk_data_t *data;	/**< NULL once the application got its callback */
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+};
+
+struct msk_msg {
+	uint32_t buf_size;		/**< header + threshold */
+	uint8_t *buf;			/**< all bounce buffers, rcount then scount, then ucount FIN headers and the CREDIT one */
+	struct ibv_mr *mr;
+	int rcount;
+	struct msk_msg_rbuf *rbufs;
+	struct msk_msg_rbuf **arrived;	/**< arrived data messages, indexed by seq % rcount */
+	uint32_t rx_next;		/**< next seq to match */
+	int scount;
+	struct msk_msg_slot *slots;
+	uint32_t tx_seq;
+	int ucount;
+	struct msk_msg_urecv *urecvs;
+	int *ufifo;			/**< posted receives waiting for a message, ucount long ring */
+	int uhead;
+	int utail;
+	struct msk_msg_tx *txq_head;	/**< messages waiting for a send context or credits */
+	struct msk_msg_tx *txq_tail;
+	int flow_control;
+	uint32_t tx_credits;		/**< peer receive buffers we may still use */
+	uint32_t rx_grant;		/**< reposted buffers not advertised yet */
+	uint32_t credit_threshold;	/**< rx_grant that triggers an explicit CREDIT message */
+	uint32_t credit_busy;
+	struct msk_msg_tx ctx;		/**< CREDIT message */
+	msk_data_t cdata;
+	struct timespec stall_start;	/**< set while the head of the queue waits for credits */
+	pthread_mutex_t tx_lock;	/**< queue, credits and seq attribution */
+	pthread_mutex_t rx_lock;
+};
+
+static void msk_msg_recv_cb(struct msk_trans *trans, msk_data_t *data, void *arg);
+static void msk_msg_recv_err_cb(struct msk_trans *trans, msk_data_t *data, void *arg);
+
+static inline struct msk_msg_hdr *msk_msg_hdr(msk_data_t *bdata) {
+	return (struct msk_msg_hdr *)bdata->data;
+}
+
+static inline void msk_msg_complete(struct msk_trans *trans, msk_data_t *data, enum ibv_wc_status status,
+				    ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	data->status = status;
+	if (status) {
+		if (err_callback)
+			msk_profile_call(err_callback, trans, data, callback_arg);
+	} else if (callback) {
+		msk_profile_call(callback, trans, data, callback_arg);
+	}
+}
+
+static struct msk_msg_slot *msk_msg_get_slot(struct msk_msg *msg) {
+	int i;
+
+	while (1) {
+		for (i = 0; i < msg->scount; i++)
+			if (msg->slots[i].used == 0
+			    && atomic_bool_compare_and_swap(&msg->slots[i].used, 0, 1))
+				return &msg->slots[i];
+		usleep(250);
+	}
+}
+
+static void msk_msg_put_slot(struct msk_trans *trans, struct msk_msg_slot *slot, int refs) {
+	if (atomic_sub(slot->refs, refs) != 0)
+		return;
+
+	if (slot->data)
+		msk_msg_complete(trans, slot->data, slot->status, slot->callback,
+				 slot->err_callback, slot->callback_arg);
+
+	slot->data = NULL;
+	atomic_store(&slot->used, 0);
+}
+
+static void msk_msg_send_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	struct msk_msg_slot *slot = arg;
+
+	msk_profile_skip();
+
+	if (data->status) {
+		DATA_LOG(trans->debug & MSK_DEBUG_SEND, "msg send failed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+		slot->status = data->status;
+		/* no FIN will come for that one */
+		msk_msg_put_slot(trans, slot, slot->refs);
+	} else {
+		msk_msg_put_slot(trans, slot, 1);
+	}
+
+	/* we just gave back a send context */
+	msk_msg_flush(trans);
+}
+
+/**
+ * msk_msg_may_send: credit check for the queue head, called under tx_lock
+ */
+static inline int msk_msg_may_send(struct msk_msg *msg, struct msk_msg_hdr *hdr) {
+	if (!msg->flow_control)
+		return 1;
+	if (hdr->type == MSK_MSG_CREDIT)
+		return msg->tx_credits > 0;
+	return msg->tx_credits > 1 || (msg->tx_credits == 1 && msg->rx_grant > 0);
+}
+
+/**
+ * msk_msg_flush: posts as much of the send queue as credits and send contexts allow
+ * Called whenever one of them might have been given back.
+ */
+static void msk_msg_flush(struct msk_trans *trans) {
+	struct msk_msg *msg = trans->msg;
+	struct msk_msg_tx *tx, *failed = NULL;
+	struct msk_msg_hdr *hdr;
+	struct msk_ctx *wctx;
+	struct timespec ts;
+	uint64_t nsec;
+	uint32_t grants;
+	int ret;
+
+	/* racy peek, whoever queues flushes after */
+	if (!msg->txq_head)
+		return;
+
+	pthread_mutex_lock(&msg->tx_lock);
+	while ((tx = msg->txq_head) && trans->state == MSK_CONNECTED) {
+		hdr = msk_msg_hdr(tx->bdata);
+
+		if (hdr->type == MSK_MSG_CREDIT && msg->rx_grant == 0) {
+			/* someone else gave them back already */
+			msg->txq_head = tx->next;
+			atomic_store(&msg->credit_busy, 0);
+			continue;
+		}
+
+		if (!msk_msg_may_send(msg, hdr)) {
+			if (!tx->stalled) {
+				tx->stalled = 1;
+				trans->stats.credit_stall++;
+			}
+			if (msg->stall_start.tv_sec == 0)
+				clock_gettime(CLOCK_MONOTONIC, &msg->stall_start);
+			break;
+		}
+
+		wctx = msk_try_get_wctx(trans);
+		if (!wctx) {
+			DATA_LOG(trans->debug & MSK_DEBUG_CTX, "no wctx for queued message");
+			break;
+		}
+
+		if (msg->stall_start.tv_sec) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			sub_timespec(&nsec, &msg->stall_start, &ts);
+			trans->stats.nsec_credit_stall += nsec;
+			msg->stall_start.tv_sec = 0;
+		}
+
+		msg->txq_head = tx->next;
+		tx->next = NULL;
+
+		grants = atomic_postmask(msg->rx_grant, 0);
+		if (grants > UINT16_MAX) {
+			atomic_add(msg->rx_grant, grants - UINT16_MAX);
+			grants = UINT16_MAX;
+		}
+		hdr->credits = htons(grants);
+		if (hdr->type == MSK_MSG_EAGER || hdr->type == MSK_MSG_RNDV)
+			hdr->seq = htonl(msg->tx_seq);
+
+		ret = msk_post_send_ctx(trans, wctx, IBV_WR_SEND, tx->bdata, 1, NULL, 0,
+					tx->callback, tx->callback, tx->callback_arg);
+		if (ret) {
+			atomic_add(msg->rx_grant, grants);
+			tx->next = failed;
+			failed = tx;
+			continue;
+		}
+
+		if (hdr->type == MSK_MSG_EAGER || hdr->type == MSK_MSG_RNDV)
+			msg->tx_seq++;
+		if (msg->flow_control)
+			msg->tx_credits--;
+		if (hdr->type == MSK_MSG_CREDIT)
+			trans->stats.credit_update++;
+	}
+	if (!msg->txq_head)
+		msg->txq_tail = NULL;
+	pthread_mutex_unlock(&msg->tx_lock);
+
+	/* callbacks can post again, only call them without the lock */
+	while ((tx = failed)) {
+		failed = tx->next;
+		tx->bdata->status = IBV_WC_GENERAL_ERR;
+		tx->callback(trans, tx->bdata, tx->callback_arg);
+	}
+}
+
+/**
+ * msk_msg_queue: appends a message to the send queue, CREDIT ones go first
+ */
+static void msk_msg_queue(struct msk_trans *trans, struct msk_msg_tx *tx) {
+	struct msk_msg *msg = trans->msg;
+
+	tx->stalled = 0;
+	pthread_mutex_lock(&msg->tx_lock);
+	if (msk_msg_hdr(tx->bdata)->type == MSK_MSG_CREDIT) {
+		tx->next = msg->txq_head;
+		msg->txq_head = tx;
+		if (!msg->txq_tail)
+			msg->txq_tail = tx;
+	} else {
+		tx->next = NULL;
+		if (msg->txq_tail)
+			msg->txq_tail->next = tx;
+		else
+			msg->txq_head = tx;
+		msg->txq_tail = tx;
+	}
+	pthread_mutex_unlock(&msg->tx_lock);
+
+	msk_msg_flush(trans);
+}
+
+static void msk_msg_credit_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	if (data->status)
+		DATA_LOG(trans->debug & MSK_DEBUG_SEND, "CREDIT send failed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+
+	atomic_store(&trans->msg->credit_busy, 0);
+	msk_msg_flush(trans);
+}
+
+/**
+ * msk_msg_give_credits: sends an explicit CREDIT message if enough are waiting
+ */
+static void msk_msg_give_credits(struct msk_trans *trans, uint32_t threshold) {
+	struct msk_msg *msg = trans->msg;
+	struct msk_msg_hdr *hdr;
+
+	if (!msg->flow_control || msg->rx_grant < threshold
+	    || !atomic_bool_compare_and_swap(&msg->credit_busy, 0, 1))
+		return;
+
+	hdr = msk_msg_hdr(&msg->cdata);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->type = MSK_MSG_CREDIT;
+	msg->cdata.size = sizeof(*hdr);
+
+	msk_msg_queue(trans, &msg->ctx);
+}
+
+/**
+ * msk_msg_post_slot: posts a message right away, only without flow control,
+ * waiting for a send context if needed
+ */
+static int msk_msg_post_slot(struct msk_trans *trans, struct msk_msg_slot *slot) {
+	struct msk_msg *msg = trans->msg;
+	struct msk_msg_hdr *hdr = msk_msg_hdr(&slot->bdata);
+	struct msk_ctx *wctx;
+	int ret;
+
+	/* take the context first, we must not wait for it with tx_lock held */
+	wctx = msk_get_wctx(trans);
+
+	pthread_mutex_lock(&msg->tx_lock);
+	hdr->seq = htonl(msg->tx_seq);
+	ret = msk_post_send_ctx(trans, wctx, IBV_WR_SEND, &slot->bdata, 1, NULL, 0,
+				msk_msg_send_cb, msk_msg_send_cb, slot);
+	if (!ret)
+		msg->tx_seq++;
+	pthread_mutex_unlock(&msg->tx_lock);
+
+	return ret;
+}
+
+static inline int msk_msg_repost(struct msk_trans *trans, struct msk_msg_rbuf *rbuf) {
+	int ret;
+
+	rbuf->bdata.size = 0;
+	ret = msk_post_recv(trans, &rbuf->bdata, msk_msg_recv_cb, msk_msg_recv_err_cb, rbuf);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "could not repost msg buffer: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	if (trans->msg->flow_control) {
+		atomic_inc(trans->msg->rx_grant);
+		msk_msg_give_credits(trans, trans->msg->credit_threshold);
+	}
+
+	return 0;
+}
+
+static void msk_msg_put_urecv(struct msk_msg_urecv *urecv) {
+	urecv->data = NULL;
+	atomic_store(&urecv->used, 0);
+}
+
+static void msk_msg_fin_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	if (data->status)
+		DATA_LOG(trans->debug & MSK_DEBUG_SEND, "FIN send failed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+
+	msk_msg_put_urecv(arg);
+	msk_msg_flush(trans);
+}
+
+/**
+ * msk_msg_send_fin: tells the peer we are done with its rendezvous buffer
+ * The receive slot is only released once the FIN has been sent.
+ */
+static void msk_msg_send_fin(struct msk_trans *trans, struct msk_msg_urecv *urecv, enum ibv_wc_status status) {
+	struct msk_msg_hdr *hdr = msk_msg_hdr(&urecv->fdata);
+
+	if (trans->state != MSK_CONNECTED) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "not sending FIN on trans (%p) in state %d", trans, trans->state);
+		msk_msg_put_urecv(urecv);
+		return;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->type = MSK_MSG_FIN;
+	hdr->status = status;
+	hdr->cookie = htonl(urecv->cookie);
+	urecv->fdata.size = sizeof(*hdr);
+
+	urecv->tx.bdata = &urecv->fdata;
+	urecv->tx.callback = msk_msg_fin_cb;
+	urecv->tx.callback_arg = urecv;
+	msk_msg_queue(trans, &urecv->tx);
+}
+
+static void msk_msg_read_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	struct msk_msg_urecv *urecv = arg;
+	ctx_callback_t callback = urecv->callback;
+	ctx_callback_t err_callback = urecv->err_callback;
+	void *callback_arg = urecv->callback_arg;
+	enum ibv_wc_status status = data->status;
+
+	msk_profile_skip();
+
+	urecv->data = NULL;
+	msk_msg_send_fin(trans, urecv, status);
+
+	msk_msg_complete(trans, data, status, callback, err_callback, callback_arg);
+	msk_msg_flush(trans);
+}
+
+/**
+ * msk_msg_deliver: hands a data message to the receive it got matched with
+ * the bounce buffer is reposted as soon as we are done with its content.
+ */
+static void msk_msg_deliver(struct msk_trans *trans, struct msk_msg_urecv *urecv, struct msk_msg_rbuf *rbuf) {
+	struct msk_msg_hdr *hdr = msk_msg_hdr(&rbuf->bdata);
+	msk_data_t *data = urecv->data;
+	ctx_callback_t callback = urecv->callback;
+	ctx_callback_t err_callback = urecv->err_callback;
+	void *callback_arg = urecv->callback_arg;
+	uint32_t size = ntohl(hdr->size);
+	int ret;
+
+	if (size > data->max_size) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "message (%u) bigger than posted buffer (%u)", size, data->max_size);
+		urecv->data = NULL;
+		if (hdr->type == MSK_MSG_RNDV) {
+			urecv->cookie = ntohl(hdr->cookie);
+			msk_msg_send_fin(trans, urecv, IBV_WC_REM_INV_REQ_ERR);
+		} else {
+			msk_msg_put_urecv(urecv);
+		}
+		msk_msg_repost(trans, rbuf);
+		msk_msg_complete(trans, data, IBV_WC_LOC_LEN_ERR, callback, err_callback, callback_arg);
+		return;
+	}
+
+	if (hdr->type == MSK_MSG_EAGER) {
+		memcpy(data->data, rbuf->bdata.data + sizeof(*hdr), size);
+		data->size = size;
+		msk_msg_repost(trans, rbuf);
+		msk_msg_put_urecv(urecv);
+		msk_msg_complete(trans, data, IBV_WC_SUCCESS, callback, err_callback, callback_arg);
+		return;
+	}
+
+	urecv->cookie = ntohl(hdr->cookie);
+	urecv->rloc.raddr = be64toh(hdr->raddr);
+	urecv->rloc.rkey = ntohl(hdr->rkey);
+	urecv->rloc.size = size;
+	msk_msg_repost(trans, rbuf);
+
+	data->size = size;
+	ret = msk_post_send_generic(trans, IBV_WR_RDMA_READ, data, 1, &urecv->rloc, 0, msk_msg_read_cb, msk_msg_read_cb, urecv);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "could not post rendezvous read: %s (%d)", strerror(ret), ret);
+		urecv->data = NULL;
+		msk_msg_send_fin(trans, urecv, IBV_WC_GENERAL_ERR);
+		msk_msg_complete(trans, data, IBV_WC_GENERAL_ERR, callback, err_callback, callback_arg);
+	}
+}
+
+/**
+ * msk_msg_match: pairs arrived data messages with posted receives, in order
+ */
+static void msk_msg_match(struct msk_trans *trans) {
+	struct msk_msg *msg = trans->msg;
+	struct msk_msg_rbuf *rbuf;
+	struct msk_msg_urecv *urecv;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&msg->rx_lock);
+		i = msg->rx_next % msg->rcount;
+		rbuf = msg->arrived[i];
+		if (!rbuf || msg->uhead == msg->utail) {
+			pthread_mutex_unlock(&msg->rx_lock);
+			break;
+		}
+		msg->arrived[i] = NULL;
+		msg->rx_next++;
+		urecv = &msg->urecvs[msg->ufifo[msg->uhead]];
+		msg->uhead = (msg->uhead + 1) % (msg->ucount + 1);
+		pthread_mutex_unlock(&msg->rx_lock);
+
+		msk_msg_deliver(trans, urecv, rbuf);
+	}
+}
+
+static void msk_msg_recv_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	struct msk_msg *msg = trans->msg;
+	struct msk_msg_rbuf *rbuf = arg;
+	struct msk_msg_hdr *hdr = msk_msg_hdr(data);
+	uint32_t cookie;
+
+	msk_profile_skip();
+
+	if (data->size < sizeof(*hdr)) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "runt message (%u bytes), dropping", data->size);
+		msk_msg_repost(trans, rbuf);
+		return;
+	}
+
+	if (msg->flow_control && hdr->credits) {
+		pthread_mutex_lock(&msg->tx_lock);
+		msg->tx_credits += ntohs(hdr->credits);
+		pthread_mutex_unlock(&msg->tx_lock);
+		msk_msg_flush(trans);
+	}
+
+	switch (hdr->type) {
+	case MSK_MSG_FIN:
+		cookie = ntohl(hdr->cookie);
+		if (cookie >= msg->scount || !msg->slots[cookie].used) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "FIN for unknown slot %u", cookie);
+		} else {
+			if (hdr->status)
+				msg->slots[cookie].status = hdr->status;
+			msk_msg_put_slot(trans, &msg->slots[cookie], 1);
+		}
+		msk_msg_repost(trans, rbuf);
+		break;
+
+	case MSK_MSG_CREDIT:
+		msk_msg_repost(trans, rbuf);
+		break;
+
+	case MSK_MSG_EAGER:
+	case MSK_MSG_RNDV:
+		pthread_mutex_lock(&msg->rx_lock);
+		msg->arrived[ntohl(hdr->seq) % msg->rcount] = rbuf;
+		pthread_mutex_unlock(&msg->rx_lock);
+		msk_msg_match(trans);
+		break;
+
+	default:
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "unknown message type %d, dropping", hdr->type);
+		msk_msg_repost(trans, rbuf);
+	}
+}
+
+static void msk_msg_recv_err_cb(struct msk_trans *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	DATA_LOG(trans->debug & MSK_DEBUG_RECV, "msg buffer flushed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+}
+
+/**
+ * msk_msg_destroy: fails whatever the message layer still holds and frees it
+ * Must be called after the buffers have been flushed.
+ */
+static void msk_msg_destroy(struct msk_trans *trans) {
+	struct msk_msg *msg = trans->msg;
+	int i;
+
+	if (!msg)
+		return;
+
+	for (i = 0; i < msg->ucount; i++) {
+		if (!msg->urecvs[i].used)
+			continue;
+		if (msg->urecvs[i].data)
+			msk_msg_complete(trans, msg->urecvs[i].data, IBV_WC_WR_FLUSH_ERR,
+					 msg->urecvs[i].callback, msg->urecvs[i].err_callback,
+					 msg->urecvs[i].callback_arg);
+		msk_msg_put_urecv(&msg->urecvs[i]);
+	}
+
+	for (i = 0; i < msg->scount; i++)
+		if (msg->slots[i].used) {
+			msg->slots[i].status = IBV_WC_WR_FLUSH_ERR;
+			msk_msg_put_slot(trans, &msg->slots[i], msg->slots[i].refs);
+		}
+
+	if (msg->mr)
+		msk_dereg_mr(msg->mr);
+	pthread_mutex_destroy(&msg->tx_lock);
+	pthread_mutex_destroy(&msg->rx_lock);
+	free(msg->buf);
+	free(msg->rbufs);
+	free(msg->arrived);
+	free(msg->slots);
+	free(msg->urecvs);
+	free(msg->ufifo);
+	free(msg);
+	trans->msg = NULL;
+}
+
+/**
+ * msk_msg_setup: allocates and posts the message layer's buffers
+ * Called once the qp exists but before the connection is finalized.
+ *
+ * @return 0 on success, errno value on failure
+ */
+static int msk_msg_setup(struct msk_trans *trans) {
+	struct msk_msg *msg;
+	size_t len;
+	int i, ret;
+
+	if (!trans->msg_threshold)
+		return 0;
+
+	/* with flow control, fewer than 3 buffers would make the credit threshold 1:
+	 * the buffer a CREDIT came in would be enough to send one back, forever */
+	if (trans->srq || trans->rq_depth < (trans->flow_control ? 4 : 2)) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "message layer needs its own receive queue with rq_depth >= 2 (4 with flow control)");
+		return EINVAL;
+	}
+
+	msg = malloc(sizeof(*msg));
+	if (!msg) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc trans->msg");
+		return ENOMEM;
+	}
+	memset(msg, 0, sizeof(*msg));
+	trans->msg = msg;
+
+	/* keep one rctx free so buffers can be reposted from their own callback */
+	msg->rcount = trans->rq_depth - 1;
+	msg->scount = trans->sq_depth;
+	msg->ucount = trans->rq_depth;
+	msg->buf_size = sizeof(struct msk_msg_hdr) + trans->msg_threshold;
+
+	ret = ENOMEM;
+	do {
+		if (pthread_mutex_init(&msg->tx_lock, NULL) || pthread_mutex_init(&msg->rx_lock, NULL))
+			break;
+
+		len = (size_t)(msg->rcount + msg->scount) * msg->buf_size
+			+ (msg->ucount + 1) * sizeof(struct msk_msg_hdr);
+		msg->buf = malloc(len);
+		msg->rbufs = malloc(msg->rcount * sizeof(*msg->rbufs));
+		msg->arrived = malloc(msg->rcount * sizeof(*msg->arrived));
+		msg->slots = malloc(msg->scount * sizeof(*msg->slots));
+		msg->urecvs = malloc(msg->ucount * sizeof(*msg->urecvs));
+		msg->ufifo = malloc((msg->ucount + 1) * sizeof(*msg->ufifo));
+		if (!msg->buf || !msg->rbufs || !msg->arrived || !msg->slots || !msg->urecvs || !msg->ufifo) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc message layer buffers");
+			break;
+		}
+		memset(msg->arrived, 0, msg->rcount * sizeof(*msg->arrived));
+		memset(msg->slots, 0, msg->scount * sizeof(*msg->slots));
+		memset(msg->urecvs, 0, msg->ucount * sizeof(*msg->urecvs));
+
+		msg->mr = msk_reg_mr(trans, msg->buf, len, IBV_ACCESS_LOCAL_WRITE);
+		if (!msg->mr) {
+			ret = errno ? errno : EINVAL;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't register message layer buffers: %s (%d)", strerror(ret), ret);
+			break;
+		}
+
+		for (i = 0; i < msg->scount; i++) {
+			msg->slots[i].bdata.data = msg->buf + (size_t)(msg->rcount + i) * msg->buf_size;
+			msg->slots[i].bdata.max_size = msg->buf_size;
+			msg->slots[i].bdata.mr = msg->mr;
+		}
+		for (i = 0; i < msg->ucount; i++) {
+			msg->urecvs[i].fdata.data = msg->buf + (size_t)(msg->rcount + msg->scount) * msg->buf_size
+				+ i * sizeof(struct msk_msg_hdr);
+			msg->urecvs[i].fdata.max_size = sizeof(struct msk_msg_hdr);
+			msg->urecvs[i].fdata.mr = msg->mr;
+		}
+		msg->cdata.data = msg->buf + (size_t)(msg->rcount + msg->scount) * msg->buf_size
+			+ msg->ucount * sizeof(struct msk_msg_hdr);
+		msg->cdata.max_size = sizeof(struct msk_msg_hdr);
+		msg->cdata.mr = msg->mr;
+		msg->ctx.bdata = &msg->cdata;
+		msg->ctx.callback = msk_msg_credit_cb;
+
+		ret = 0;
+		for (i = 0; i < msg->rcount && !ret; i++) {
+			memset(&msg->rbufs[i], 0, sizeof(msg->rbufs[i]));
+			msg->rbufs[i].bdata.data = msg->buf + (size_t)i * msg->buf_size;
+			msg->rbufs[i].bdata.max_size = msg->buf_size;
+			msg->rbufs[i].bdata.mr = msg->mr;
+			ret = msk_msg_repost(trans, &msg->rbufs[i]);
+		}
+		if (ret)
+			break;
+
+		/* the peer has at least one buffer posted, it will tell us about the others */
+		msg->flow_control = trans->flow_control;
+		msg->tx_credits = 1;
+		msg->rx_grant = msg->rcount - 1;
+		msg->credit_threshold = (msg->rcount + 1) / 2;
+	} while (0);
+
+	if (ret)
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "message layer setup failed: %s (%d)", strerror(ret), ret);
+
+	/* on failure, msk_destroy_qp will clean up after flushing what got posted */
+	return ret;
+}
+
+/**
+ * msk_msg_connected: gives the peer the credits it does not know about yet
+ */
+static void msk_msg_connected(struct msk_trans *trans) {
+	if (!trans->msg)
+		return;
+
+	msk_msg_give_credits(trans, 1);
+	msk_msg_flush(trans);
+}
+
+/**
+ * msk_post_msg: sends a message of any size through the message layer
+ *
+ * Messages up to msg_threshold are copied and sent right away, bigger ones
+ * are read by the remote side directly from data, which must then have been
+ * registered with IBV_ACCESS_REMOTE_READ and be left untouched until callback.
+ * With flow_control the message is queued locally if the peer has no buffer
+ * left for it, errors posting it are then reported through err_callback and
+ * 0 is always returned. Without it, this waits for a send context and
+ * posting errors are returned right away.
+ *
+ * @param trans        [IN]
+ * @param data         [IN] the data to send, single element
+ * @param callback     [IN] function that'll be called when done
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_msg(struct msk_trans *trans, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_msg_slot *slot;
+	struct msk_msg_hdr *hdr;
+	int ret;
+
+	if (!trans || !trans->msg || trans->state != MSK_CONNECTED) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) not connected or without message layer", trans);
+		return EINVAL;
+	}
+	if (!data || !data->mr) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "data must be registered");
+		return EINVAL;
+	}
+
+	DATA_LOG(trans->debug & MSK_DEBUG_SEND, "posting a %u bytes message", data->size);
+
+	slot = msk_msg_get_slot(trans->msg);
+	hdr = msk_msg_hdr(&slot->bdata);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->size = htonl(data->size);
+	hdr->cookie = htonl(slot - trans->msg->slots);
+
+	slot->data = data;
+	slot->callback = callback;
+	slot->err_callback = err_callback;
+	slot->callback_arg = callback_arg;
+	slot->status = IBV_WC_SUCCESS;
+	slot->tx.bdata = &slot->bdata;
+	slot->tx.callback = msk_msg_send_cb;
+	slot->tx.callback_arg = slot;
+
+	if (data->size <= trans->msg_threshold) {
+		hdr->type = MSK_MSG_EAGER;
+		memcpy(slot->bdata.data + sizeof(*hdr), data->data, data->size);
+		slot->bdata.size = sizeof(*hdr) + data->size;
+		slot->refs = 1;
+	} else {
+		hdr->type = MSK_MSG_RNDV;
+		hdr->raddr = htobe64((uint64_t)(uintptr_t)data->data);
+		hdr->rkey = htonl(data->mr->rkey);
+		slot->bdata.size = sizeof(*hdr);
+		slot->refs = 2;
+	}
+
+	if (trans->msg->flow_control) {
+		msk_msg_queue(trans, &slot->tx);
+		return 0;
+	}
+
+	ret = msk_msg_post_slot(trans, slot);
+	if (ret) {
+		slot->data = NULL;
+		msk_msg_put_slot(trans, slot, slot->refs);
+	}
+
+	return ret;
+}
+
+/**
+ * msk_post_msg_recv: posts a buffer for the next message
+ *
+ * Receives are matched with messages in order, data->max_size must be big
+ * enough for the whole message or err_callback gets IBV_WC_LOC_LEN_ERR.
+ *
+ * @param trans        [IN]
+ * @param data         [OUT] the buffer to fill, single element
+ * @param callback     [IN]  function that'll be called when done
+ * @param err_callback [IN]  function that'll be called on error
+ * @param callback_arg [IN]  argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_msg_recv(struct msk_trans *trans, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_msg *msg;
+	struct msk_msg_urecv *urecv = NULL;
+	int i;
+
+	if (!trans || !trans->msg || (trans->state != MSK_CONNECTED && trans->state != MSK_ROUTE_RESOLVED && trans->state != MSK_CONNECT_REQUEST)) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) not usable or without message layer", trans);
+		return EINVAL;
+	}
+	if (!data || !data->mr) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "data must be registered");
+		return EINVAL;
+	}
+
+	msg = trans->msg;
+	while (!urecv) {
+		for (i = 0; i < msg->ucount; i++)
+			if (msg->urecvs[i].used == 0
+			    && atomic_bool_compare_and_swap(&msg->urecvs[i].used, 0, 1)) {
+				urecv = &msg->urecvs[i];
+				break;
+			}
+		if (!urecv) {
+			DATA_LOG(trans->debug & MSK_DEBUG_CTX, "Waiting for a msg recv slot");
+			usleep(250);
+		}
+	}
+
+	urecv->data = data;
+	urecv->callback = callback;
+	urecv->err_callback = err_callback;
+	urecv->callback_arg = callback_arg;
+
+	pthread_mutex_lock(&msg->rx_lock);
+	msg->ufifo[msg->utail] = urecv - msg->urecvs;
+	msg->utail = (msg->utail + 1) % (msg->ucount + 1);
+	pthread_mutex_unlock(&msg->rx_lock);
+
+	msk_msg_match(trans);
+
+	return 0;
+}
+
+int msk_wait_msg(struct msk_trans *trans, msk_data_t *data) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_msg(trans, data, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+	}
+
+	return ret;
+}
+
+int msk_wait_msg_recv(struct msk_trans *trans, msk_data_t *data) {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int ret;
+
+	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+	ret = msk_post_msg_recv(trans, data, msk_wait_callback, msk_wait_callback, &lock);
+
+	if (!ret) {
+		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
+		pthread_mutex_destroy(&lock);
+	}
+
+	return ret;
+}
+
+
+/* MEMORY WINDOWS */
+
+/**
+ * \struct msk_mw_entry
+ * one type 2 memory window of the per-trans pool
+ */
+struct msk_mw_entry {
+	enum {
+		MSK_MW_FREE = 0,
+		MSK_MW_BINDING,
+		MSK_MW_BOUND,
+		MSK_MW_INVALIDATING,
+	} used;
+	struct ibv_mw *mw;
+	msk_data_t *data;	/**< what the window covers */
+	msk_rloc_t rloc;	/**< what the peer gets, rkey is the current one */
+};
+
+struct msk_mw_pool {
+	uint32_t count;
+	struct msk_mw_entry entries[0];
+};
+
+/**
+ * msk_mw_find: pool entry from its current rkey
+ */
+static struct msk_mw_entry *msk_mw_find(struct msk_trans *trans, uint32_t rkey) {
+	uint32_t i;
+
+	if (!trans->mw)
+		return NULL;
+
+	for (i = 0; i < trans->mw->count; i++)
+		if (trans->mw->entries[i].used != MSK_MW_FREE
+		    && trans->mw->entries[i].rloc.rkey == rkey)
+			return &trans->mw->entries[i];
+
+	return NULL;
+}
+
+/**
+ * msk_mw_completion: updates the window of a completed bind or invalidate.
+ * Called from the cq handler before the callbacks, with any ctx.
+ * A successful bind keeps its window, anything else gives it back.
+ */
+static void msk_mw_completion(struct msk_trans *trans, struct msk_ctx *ctx, enum ibv_wc_status status) {
+	struct msk_mw_entry *entry;
+	size_t stride = sizeof(struct msk_ctx) + trans->max_send_sge * sizeof(struct ibv_sge);
+	uint32_t i;
+
+	/* only send contexts carry windows */
+	if (!trans->mw || (uint8_t*)ctx < (uint8_t*)trans->wctx
+	    || (uint8_t*)ctx >= (uint8_t*)trans->wctx + trans->sq_depth * stride)
+		return;
+
+	switch (ctx->wr.wwr.opcode) {
+	case IBV_WR_BIND_MW:
+		for (i = 0; i < trans->mw->count; i++) {
+			entry = &trans->mw->entries[i];
+			if (entry->mw == ctx->wr.wwr.bind_mw.mw) {
+				atomic_store(&entry->used, status == IBV_WC_SUCCESS ? MSK_MW_BOUND : MSK_MW_FREE);
+				break;
+			}
+		}
+		break;
+	case IBV_WR_LOCAL_INV:
+		entry = msk_mw_find(trans, ctx->wr.wwr.invalidate_rkey);
+		if (entry)
+			atomic_store(&entry->used, MSK_MW_FREE);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * msk_mw_remote_inv: the peer invalidated one of our windows (SEND_WITH_INV)
+ */
+static void msk_mw_remote_inv(struct msk_trans *trans, uint32_t rkey) {
+	struct msk_mw_entry *entry = msk_mw_find(trans, rkey);
+
+	if (!entry) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "remote invalidation of unknown rkey %x", rkey);
+		return;
+	}
+
+	DATA_LOG(trans->debug & MSK_DEBUG_RECV, "rkey %x invalidated by peer", rkey);
+	atomic_store(&entry->used, MSK_MW_FREE);
+}
+
+static int msk_mw_setup(struct msk_trans *trans) {
+	struct msk_pd *pd;
+	uint32_t i;
+	int ret;
+
+	if (!trans->mw_count)
+		return 0;
+
+	pd = msk_getpd(trans);
+	if (!pd || !pd->pd)
+		return EINVAL;
+
+	trans->mw = malloc(sizeof(*trans->mw) + trans->mw_count * sizeof(struct msk_mw_entry));
+	if (!trans->mw) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't malloc memory window pool");
+		return ENOMEM;
+	}
+	memset(trans->mw, 0, sizeof(*trans->mw) + trans->mw_count * sizeof(struct msk_mw_entry));
+
+	for (i = 0; i < trans->mw_count; i++) {
+		trans->mw->entries[i].mw = ibv_alloc_mw(pd->pd, IBV_MW_TYPE_2);
+		if (!trans->mw->entries[i].mw) {
+			ret = errno ? errno : ENOSYS;
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_alloc_mw failed (type 2 windows supported?): %s (%d)", strerror(ret), ret);
+			msk_mw_destroy(trans);
+			return ret;
+		}
+		trans->mw->entries[i].rloc.rkey = trans->mw->entries[i].mw->rkey;
+		trans->mw->count++;
+	}
+
+	return 0;
+}
+
+static void msk_mw_destroy(struct msk_trans *trans) {
+	uint32_t i;
+
+	if (!trans->mw)
+		return;
+
+	for (i = 0; i < trans->mw->count; i++)
+		ibv_dealloc_mw(trans->mw->entries[i].mw);
+
+	free(trans->mw);
+	trans->mw = NULL;
+}
+
+/**
+ * msk_post_bind: exposes a registered buffer for remote access through a
+ * memory window, posted on the send queue. The mr must have been registered
+ * with IBV_ACCESS_MW_BIND.
+ * The rloc can be sent to the peer right away on the same trans, sends are
+ * processed in order after the bind.
+ * The window covers data->max_size if remote write is allowed, data->size
+ * otherwise.
+ *
+ * @param trans        [IN]
+ * @param data         [IN] buffer to expose
+ * @param access       [IN] IBV_ACCESS_REMOTE_READ and/or IBV_ACCESS_REMOTE_WRITE
+ * @param callback     [IN] function that'll be called once bound
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callback
+ *
+ * @return the rloc to give to the peer, valid until invalidated, or NULL with errno set
+ */
+msk_rloc_t *msk_post_bind(struct msk_trans *trans, msk_data_t *data, int access, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_mw_entry *entry = NULL;
+	struct msk_ctx *wctx;
+	uint32_t i;
+	int ret;
+
+	if (!trans || trans->state != MSK_CONNECTED || !trans->mw) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans not connected or without memory windows");
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!data || !data->mr) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < trans->mw->count; i++)
+		if (trans->mw->entries[i].used == MSK_MW_FREE
+		    && atomic_bool_compare_and_swap(&trans->mw->entries[i].used, MSK_MW_FREE, MSK_MW_BINDING)) {
+			entry = &trans->mw->entries[i];
+			break;
+		}
+	if (!entry) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "no free memory window");
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	entry->data = data;
+	entry->rloc.raddr = (uintptr_t)data->data;
+	entry->rloc.size = (access & IBV_ACCESS_REMOTE_WRITE) ? data->max_size : data->size;
+	entry->rloc.rkey = ibv_inc_rkey(entry->rloc.rkey);
+
+	wctx = msk_get_wctx(trans);
+	wctx->callback = callback;
+	wctx->err_callback = err_callback;
+	wctx->callback_arg = callback_arg;
+	wctx->data = data;
+
+	memset(&wctx->wr.wwr, 0, sizeof(wctx->wr.wwr));
+	wctx->wr.wwr.wr_id = (uintptr_t)wctx;
+	wctx->wr.wwr.opcode = IBV_WR_BIND_MW;
+	wctx->wr.wwr.send_flags = IBV_SEND_SIGNALED;
+	wctx->wr.wwr.bind_mw.mw = entry->mw;
+	wctx->wr.wwr.bind_mw.rkey = entry->rloc.rkey;
+	wctx->wr.wwr.bind_mw.bind_info.mr = data->mr;
+	wctx->wr.wwr.bind_mw.bind_info.addr = entry->rloc.raddr;
+	wctx->wr.wwr.bind_mw.bind_info.length = entry->rloc.size;
+	wctx->wr.wwr.bind_mw.bind_info.mw_access_flags = access;
+
+	ret = ibv_post_send(trans->qp, &wctx->wr.wwr, &trans->bad_send_wr);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_send (bind) failed: %s (%d)", strerror(ret), ret);
+		msk_put_wctx(trans, wctx);
+		atomic_store(&entry->used, MSK_MW_FREE);
+		errno = ret;
+		return NULL;
+	}
+
+	return &entry->rloc;
+}
+
+/**
+ * msk_post_invalidate: takes remote access away from a window we bound,
+ * posted on the send queue. The window goes back to the pool on completion.
+ * Not needed if the peer replied with msk_post_send_inv.
+ *
+ * @param trans        [IN]
+ * @param rloc         [IN] rloc given by msk_post_bind
+ * @param callback     [IN] function that'll be called when done, with the bound data
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_invalidate(struct msk_trans *trans, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_mw_entry *entry;
+	struct msk_ctx *wctx;
+	int ret;
+
+	if (!trans || trans->state != MSK_CONNECTED || !rloc)
+		return EINVAL;
+
+	entry = msk_mw_find(trans, rloc->rkey);
+	if (!entry || !atomic_bool_compare_and_swap(&entry->used, MSK_MW_BOUND, MSK_MW_INVALIDATING)) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rkey %x isn't a bound window", rloc->rkey);
+		return EINVAL;
+	}
+
+	wctx = msk_get_wctx(trans);
+	wctx->callback = callback;
+	wctx->err_callback = err_callback;
+	wctx->callback_arg = callback_arg;
+	wctx->data = entry->data;
+
+	memset(&wctx->wr.wwr, 0, sizeof(wctx->wr.wwr));
+	wctx->wr.wwr.wr_id = (uintptr_t)wctx;
+	wctx->wr.wwr.opcode = IBV_WR_LOCAL_INV;
+	wctx->wr.wwr.send_flags = IBV_SEND_SIGNALED;
+	wctx->wr.wwr.invalidate_rkey = entry->rloc.rkey;
+
+	ret = ibv_post_send(trans->qp, &wctx->wr.wwr, &trans->bad_send_wr);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_send (local inv) failed: %s (%d)", strerror(ret), ret);
+		msk_put_wctx(trans, wctx);
+		atomic_store(&entry->used, MSK_MW_BOUND);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * msk_post_n_send_inv: send that also invalidates one of the peer's windows,
+ * typically the reply once we're done reading/writing it.
+ *
+ * @param rkey [IN] the peer's rkey, as given in its rloc
+ * other parameters as msk_post_n_send
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_post_n_send_inv(struct msk_trans *trans, msk_data_t *data, int num_sge, uint32_t rkey, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_ctx *wctx;
+
+	if (!trans || trans->state != MSK_CONNECTED) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) not connected", trans);
+		return EINVAL;
+	}
+
+	wctx = msk_get_wctx(trans);
+	/* msk_post_send_ctx leaves the imm_data/invalidate_rkey union alone */
+	wctx->wr.wwr.invalidate_rkey = rkey;
+
+	return msk_post_send_ctx(trans, wctx, IBV_WR_SEND_WITH_INV, data, num_sge, NULL, trans->op_timeout_ms, callback, err_callback, callback_arg);
+}
+
+
+struct sockaddr *msk_get_dst_addr(struct msk_trans *trans) {
+	return rdma_get_peer_addr(trans->cm_id);
+}
+
+struct sockaddr *msk_get_src_addr(struct msk_trans *trans) {
+	return rdma_get_local_addr(trans->cm_id);
+}
+
+uint16_t msk_get_src_port(struct msk_trans *trans) {
+	return rdma_get_src_port(trans->cm_id);
+}
+
+uint16_t msk_get_dst_port(struct msk_trans *trans) {
+	return rdma_get_dst_port(trans->cm_id);
+}
+
+const char *msk_wc_status_str(enum ibv_wc_status status) {
+	return ibv_wc_status_str(status);
+}
+
+
+
+
+/* CONNECTION POOL */
+
+/**
+ * \struct msk_pool_req
+ * one outstanding request of a pooled connection, matched to its reply by xid
+ */
+struct msk_pool_req {
+	enum {
+		MSK_REQ_FREE = 0,
+		MSK_REQ_PENDING,
+		MSK_REQ_DONE,
+	} used;
+	uint32_t xid;			/**< index in the lower 16 bits, generation above */
+	struct msk_pool_hdr *hdr;	/**< in the connection's registered buffer */
+	msk_data_t hdr_data;
+	msk_data_t *reply;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	struct msk_pool_conn *conn;
+};
+
+struct msk_pool_conn {
+	struct msk_pool *pool;
+	msk_trans_t *trans;
+	int dead;			/**< disconnected, no new requests */
+	int load;			/**< outstanding requests */
+	int nchan;			/**< channels bound here, under pool lock */
+	time_t idle_since;		/**< CLOCK_MONOTONIC seconds nchan dropped to 0 */
+	uint8_t *buf;
+	struct ibv_mr *mr;
+	int req_count;
+	uint32_t req_next;
+	struct msk_pool_req *reqs;
+	msk_data_t *rdata;
+};
+
+struct msk_pool {
+	pthread_mutex_t lock;
+	msk_trans_attr_t attr;
+	msk_pool_attr_t pattr;
+	int count;
+	int opening;			/**< connections being opened outside of the lock, count against max_conns */
+	struct msk_pool_conn **conns;	/**< max_conns entries, the first count are used */
+	uint32_t next_chan;
+	struct msk_pd *pd;		/**< our reference on the pd array all connections share */
+};
+
+struct msk_chan {
+	struct msk_pool *pool;
+	struct msk_pool_conn *conn;
+	uint32_t id;
+};
+
+/**
+ * msk_pool_req_done: claims a pending request for completion,
+ * reply, send error and disconnect can race for it
+ */
+static inline int msk_pool_req_done(struct msk_pool_conn *conn, struct msk_pool_req *req) {
+	if (!atomic_bool_compare_and_swap(&req->used, MSK_REQ_PENDING, MSK_REQ_DONE))
+		return 0;
+	atomic_dec(conn->load);
+	return 1;
+}
+
+static void msk_pool_req_fail(struct msk_pool_conn *conn, struct msk_pool_req *req, enum ibv_wc_status status) {
+	if (!msk_pool_req_done(conn, req))
+		return;
+
+	req->reply->status = status;
+	if (req->err_callback)
+		msk_profile_call(req->err_callback, conn->trans, req->reply, req->callback_arg);
+	atomic_store(&req->used, MSK_REQ_FREE);
+}
+
+static void msk_pool_send_err(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct msk_pool_req *req = arg;
+
+	msk_profile_skip();
+
+	msk_pool_req_fail(req->conn, req, data->status);
+}
+
+static void msk_pool_recv_err(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "pooled recv failed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+}
+
+static void msk_pool_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct msk_pool_conn *conn = arg;
+	struct msk_pool_hdr *hdr = (struct msk_pool_hdr *)data->data;
+	struct msk_pool_req *req;
+	uint32_t xid, len;
+
+	msk_profile_skip();
+
+	do {
+		if (data->size < MSK_POOL_HDR_SIZE) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "reply too short (%u)", data->size);
+			break;
+		}
+		xid = ntohl(hdr->xid);
+		if ((xid & 0xffff) >= conn->req_count) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "reply to unknown request %x", xid);
+			break;
+		}
+		req = &conn->reqs[xid & 0xffff];
+		if (req->xid != xid || !msk_pool_req_done(conn, req)) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "stale reply %x", xid);
+			break;
+		}
+
+		len = data->size - MSK_POOL_HDR_SIZE;
+		if (len > req->reply->max_size) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "reply of %u bytes truncated to %u", len, req->reply->max_size);
+			len = req->reply->max_size;
+		}
+		memcpy(req->reply->data, data->data + MSK_POOL_HDR_SIZE, len);
+		req->reply->size = len;
+		req->reply->status = IBV_WC_SUCCESS;
+		if (req->callback)
+			msk_profile_call(req->callback, trans, req->reply, req->callback_arg);
+		atomic_store(&req->used, MSK_REQ_FREE);
+	} while (0);
+
+	data->size = data->max_size;
+	if (!conn->dead)
+		msk_post_recv(trans, data, msk_pool_recv_cb, msk_pool_recv_err, conn);
+}
+
+static void msk_pool_disconnect_cb(msk_trans_t *trans) {
+	struct msk_pool_conn *conn = trans->owner;
+	int i;
+
+	if (!conn)
+		return;
+
+	conn->dead = 1;
+	for (i = 0; i < conn->req_count; i++)
+		msk_pool_req_fail(conn, &conn->reqs[i], IBV_WC_WR_FLUSH_ERR);
+}
+
+static void msk_pool_conn_free(struct msk_pool_conn *conn) {
+	int i;
+
+	if (conn->trans) {
+		// the disconnect event could come after we're gone, fail what's left here
+		conn->trans->disconnect_callback = NULL;
+		conn->dead = 1;
+		for (i = 0; conn->reqs && i < conn->req_count; i++)
+			msk_pool_req_fail(conn, &conn->reqs[i], IBV_WC_WR_FLUSH_ERR);
+		msk_destroy_trans(&conn->trans);
+	}
+	if (conn->mr)
+		msk_dereg_mr(conn->mr);
+	free(conn->buf);
+	free(conn->reqs);
+	free(conn->rdata);
+	free(conn);
+}
+
+/**
+ * msk_pool_conn_open: connects one more transport of the pool, with its
+ * receive buffers posted and request slots ready. Blocks in connect, so
+ * called without the pool lock on a copy of the pool attributes taken
+ * under it; msk_pool_conn_add publishes the result.
+ */
+static struct msk_pool_conn *msk_pool_conn_open(struct msk_pool *pool, msk_trans_attr_t *attr) {
+	struct msk_pool_conn *conn;
+	uint32_t rsize = MSK_POOL_HDR_SIZE + pool->pattr.max_reply_size;
+	int i, ret;
+
+	conn = malloc(sizeof(*conn));
+	if (!conn)
+		return NULL;
+	memset(conn, 0, sizeof(*conn));
+	conn->pool = pool;
+
+	do {
+		ret = msk_init(&conn->trans, attr);
+		if (ret || !conn->trans) {
+			INFO_LOG(attr->debug & MSK_DEBUG_EVENT, "msk_init failed: %d", ret);
+			break;
+		}
+		conn->trans->owner = conn;
+
+		// every reply needs a posted receive
+		conn->req_count = conn->trans->sq_depth < conn->trans->rq_depth ? conn->trans->sq_depth : conn->trans->rq_depth;
+		conn->reqs = malloc(conn->req_count * sizeof(struct msk_pool_req));
+		conn->rdata = malloc(conn->trans->rq_depth * sizeof(msk_data_t));
+		conn->buf = malloc(conn->req_count * MSK_POOL_HDR_SIZE + conn->trans->rq_depth * rsize);
+		if (!conn->reqs || !conn->rdata || !conn->buf) {
+			ret = ENOMEM;
+			break;
+		}
+		memset(conn->reqs, 0, conn->req_count * sizeof(struct msk_pool_req));
+		memset(conn->rdata, 0, conn->trans->rq_depth * sizeof(msk_data_t));
+
+		ret = msk_connect(conn->trans);
+		if (ret) {
+			INFO_LOG(attr->debug & MSK_DEBUG_EVENT, "msk_connect failed: %d", ret);
+			break;
+		}
+
+		conn->mr = msk_reg_mr(conn->trans, conn->buf, conn->req_count * MSK_POOL_HDR_SIZE + conn->trans->rq_depth * rsize, IBV_ACCESS_LOCAL_WRITE);
+		if (!conn->mr) {
+			ret = errno;
+			break;
+		}
+
+		for (i = 0; i < conn->req_count; i++) {
+			conn->reqs[i].xid = i;
+			conn->reqs[i].conn = conn;
+			conn->reqs[i].hdr = (struct msk_pool_hdr *)(conn->buf + i * MSK_POOL_HDR_SIZE);
+			conn->reqs[i].hdr_data.data = (uint8_t *)conn->reqs[i].hdr;
+			conn->reqs[i].hdr_data.max_size = MSK_POOL_HDR_SIZE;
+			conn->reqs[i].hdr_data.size = MSK_POOL_HDR_SIZE;
+			conn->reqs[i].hdr_data.mr = conn->mr;
+		}
+
+		for (i = 0; i < conn->trans->rq_depth; i++) {
+			conn->rdata[i].data = conn->buf + conn->req_count * MSK_POOL_HDR_SIZE + i * rsize;
+			conn->rdata[i].max_size = rsize;
+			conn->rdata[i].size = rsize;
+			conn->rdata[i].mr = conn->mr;
+			ret = msk_post_recv(conn->trans, &conn->rdata[i], msk_pool_recv_cb, msk_pool_recv_err, conn);
+			if (ret)
+				break;
+		}
+		if (ret)
+			break;
+
+		ret = msk_finalize_connect(conn->trans);
+		if (ret) {
+			INFO_LOG(attr->debug & MSK_DEBUG_EVENT, "msk_finalize_connect failed: %d", ret);
+			break;
+		}
+	} while (0);
+
+	if (ret) {
+		msk_pool_conn_free(conn);
+		errno = ret;
+		return NULL;
+	}
+
+	return conn;
+}
+
+/**
+ * msk_pool_conn_add: makes a connection from msk_pool_conn_open available
+ * to channels. Called with the pool lock held.
+ */
+static void msk_pool_conn_add(struct msk_pool *pool, struct msk_pool_conn *conn) {
+	conn->idle_since = msk_now_sec();
+	pool->conns[pool->count++] = conn;
+
+	// have the next connections share this one's pds, so user memory is registered once
+	if (!pool->attr.pd && conn->trans->pd) {
+		atomic_inc(conn->trans->pd->refcnt);
+		pool->pd = conn->trans->pd;
+		pool->attr.pd = pool->pd;
+	}
+}
+
+/**
+ * msk_pool_reap: closes connections left without channel for idle_timeout,
+ * as long as we stay above min_conns. Called with the pool lock held.
+ */
+static void msk_pool_reap(struct msk_pool *pool) {
+	struct msk_pool_conn *conn;
+	time_t now = msk_now_sec();
+	int i;
+
+	for (i = pool->count - 1; i >= 0; i--) {
+		conn = pool->conns[i];
+		if (conn->nchan || conn->load)
+			continue;
+		if (!conn->dead && (pool->count <= pool->pattr.min_conns || now - conn->idle_since < pool->pattr.idle_timeout))
+			continue;
+
+		pool->conns[i] = pool->conns[--pool->count];
+		msk_pool_conn_free(conn);
+	}
+}
+
+/**
+ * msk_pool_least_loaded: live connection with the fewest outstanding
+ * requests, ties going to the one with fewer channels. Pool lock held.
+ */
+static struct msk_pool_conn *msk_pool_least_loaded(struct msk_pool *pool) {
+	struct msk_pool_conn *conn, *best = NULL;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		conn = pool->conns[i];
+		if (conn->dead)
+			continue;
+		if (!best || conn->load < best->load
+		    || (conn->load == best->load && conn->nchan < best->nchan))
+			best = conn;
+	}
+
+	return best;
+}
+
+/**
+ * Create a client connection pool
+ *
+ * @param ppool [OUT] the new pool
+ * @param attr  [IN]  transport attributes used for every connection (client only),
+ *                    disconnect_callback is replaced by the pool's
+ * @param pattr [IN]  pool sizing
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_pool_init(msk_pool_t **ppool, msk_trans_attr_t *attr, msk_pool_attr_t *pattr) {
+	struct msk_pool *pool;
+	struct msk_pool_conn *conn;
+	int i, ret = 0;
+
+	if (!ppool || !attr || !pattr || attr->server || pattr->max_conns <= 0
+	    || pattr->min_conns > pattr->max_conns || pattr->chan_per_conn <= 0) {
+		INFO_LOG(attr ? attr->debug & MSK_DEBUG_EVENT : 0, "invalid pool attributes");
+		return EINVAL;
+	}
+
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		return ENOMEM;
+	memset(pool, 0, sizeof(*pool));
+
+	memcpy(&pool->attr, attr, sizeof(pool->attr));
+	memcpy(&pool->pattr, pattr, sizeof(pool->pattr));
+	pool->attr.disconnect_callback = msk_pool_disconnect_cb;
+	pool->attr.destroy_on_disconnect = 0;
+	if (pool->attr.max_send_sge < 2)
+		pool->attr.max_send_sge = 2;
+	if (pool->attr.sq_depth == 0)
+		pool->attr.sq_depth = 50;
+	if (pool->attr.rq_depth == 0)
+		pool->attr.rq_depth = 50;
+	if (pool->attr.sq_depth > 0x10000)
+		pool->attr.sq_depth = 0x10000; // xid only has 16 bits of index
+	pool->attr.msg_threshold = 0;
+
+	pool->conns = malloc(pattr->max_conns * sizeof(struct msk_pool_conn *));
+	if (!pool->conns) {
+		free(pool);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	// nobody else sees the pool yet, only the publishing needs the lock
+	for (i = 0; i < pattr->min_conns; i++) {
+		conn = msk_pool_conn_open(pool, &pool->attr);
+		if (!conn) {
+			ret = errno;
+			break;
+		}
+		pthread_mutex_lock(&pool->lock);
+		msk_pool_conn_add(pool, conn);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (ret) {
+		msk_pool_destroy(&pool);
+		return ret;
+	}
+
+	*ppool = pool;
+	return 0;
+}
+
+/**
+ * Closes all connections of the pool, failing their outstanding requests.
+ * Channels must have been closed first.
+ */
+void msk_pool_destroy(msk_pool_t **ppool) {
+	struct msk_pool *pool = *ppool;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count > 0)
+		msk_pool_conn_free(pool->conns[--pool->count]);
+	if (pool->pd)
+		msk_put_pd(pool->pd);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->conns);
+	free(pool);
+	*ppool = NULL;
+}
+
+/**
+ * Opens a logical channel on the least loaded connection, opening
+ * a new connection if every one already carries chan_per_conn channels.
+ * Blocks while connecting, do not call from a callback.
+ *
+ * @return the channel, NULL with errno set on failure
+ */
+msk_chan_t *msk_chan_open(msk_pool_t *pool) {
+	struct msk_chan *chan;
+	struct msk_pool_conn *conn, *new_conn;
+	msk_trans_attr_t attr;
+
+	chan = malloc(sizeof(*chan));
+	if (!chan) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	msk_pool_reap(pool);
+
+	conn = msk_pool_least_loaded(pool);
+	if ((!conn || conn->nchan >= pool->pattr.chan_per_conn) && pool->count + pool->opening < pool->pattr.max_conns) {
+		// reserve the slot and connect without the lock, other channels keep going
+		memcpy(&attr, &pool->attr, sizeof(attr));
+		pool->opening++;
+		pthread_mutex_unlock(&pool->lock);
+
+		new_conn = msk_pool_conn_open(pool, &attr);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->opening--;
+		if (new_conn) {
+			msk_pool_conn_add(pool, new_conn);
+			conn = new_conn;
+		} else {
+			// conn may have been reaped meanwhile
+			conn = msk_pool_least_loaded(pool);
+		}
+	}
+	if (!conn) {
+		pthread_mutex_unlock(&pool->lock);
+		free(chan);
+		errno = ENOTCONN;
+		return NULL;
+	}
+
+	conn->nchan++;
+	chan->pool = pool;
+	chan->conn = conn;
+	chan->id = pool->next_chan++;
+	pthread_mutex_unlock(&pool->lock);
+
+	return chan;
+}
+
+/**
+ * Closes a channel. Outstanding requests still complete.
+ * The connection is closed later if it stays unused.
+ */
+void msk_chan_close(msk_chan_t **pchan) {
+	struct msk_chan *chan = *pchan;
+
+	if (!chan)
+		return;
+
+	pthread_mutex_lock(&chan->pool->lock);
+	if (--chan->conn->nchan == 0)
+		chan->conn->idle_since = msk_now_sec();
+	pthread_mutex_unlock(&chan->pool->lock);
+
+	free(chan);
+	*pchan = NULL;
+}
+
+/**
+ * Post a request on a channel, the callback gets the reply
+ *
+ * The pool header goes in front of request in its own sge, the peer must
+ * send back the first MSK_POOL_HDR_SIZE bytes it received in front of its
+ * reply. The reply is copied into reply (truncated to its max_size).
+ * If the connection died, the channel moves to the least loaded live one.
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_chan_call(msk_chan_t *chan, msk_data_t *request, msk_data_t *reply, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_pool_conn *conn = chan->conn;
+	struct msk_pool_req *req = NULL;
+	uint32_t i, idx;
+	int ret;
+
+	if (conn->dead) {
+		pthread_mutex_lock(&chan->pool->lock);
+		conn = msk_pool_least_loaded(chan->pool);
+		if (conn) {
+			if (--chan->conn->nchan == 0)
+				chan->conn->idle_since = msk_now_sec();
+			conn->nchan++;
+			chan->conn = conn;
+		}
+		pthread_mutex_unlock(&chan->pool->lock);
+		if (!conn)
+			return ENOTCONN;
+	}
+
+	while (!req) {
+		for (i = 0; i < conn->req_count; i++) {
+			idx = (conn->req_next + i) % conn->req_count;
+			if (atomic_bool_compare_and_swap(&conn->reqs[idx].used, MSK_REQ_FREE, MSK_REQ_PENDING)) {
+				req = &conn->reqs[idx];
+				conn->req_next = idx + 1;
+				break;
+			}
+		}
+		if (!req) {
+			if (conn->dead)
+				return ENOTCONN;
+			DATA_LOG(conn->trans->debug & MSK_DEBUG_CTX, "waiting for a pool request slot");
+			usleep(250);
+		}
+	}
+
+	req->xid += 0x10000;
+	req->reply = reply;
+	req->callback = callback;
+	req->err_callback = err_callback;
+	req->callback_arg = callback_arg;
+	req->hdr->xid = htonl(req->xid);
+	req->hdr->chan = htonl(chan->id);
+	req->hdr_data.next = request;
+	atomic_inc(conn->load);
+
+	ret = msk_post_send_generic(conn->trans, IBV_WR_SEND, &req->hdr_data, 2, NULL, 0, NULL, msk_pool_send_err, req);
+	if (ret && msk_pool_req_done(conn, req))
+		atomic_store(&req->used, MSK_REQ_FREE);
+
+	return ret;
+}
+
+struct msk_wait_done {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+};
+
+static void msk_wait_done_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct msk_wait_done *wait = arg;
+
+	msk_profile_skip();
+
+	pthread_mutex_lock(&wait->lock);
+	wait->done = 1;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->lock);
+}
+
+/**
+ * Blocking msk_chan_call
+ *
+ * @return 0 on success, errno value on failure, EIO if the call's
+ *         completion failed (reply->status tells how)
+ */
+int msk_chan_wait_call(msk_chan_t *chan, msk_data_t *request, msk_data_t *reply) {
+	struct msk_wait_done wait;
+	int ret;
+
+	memset(&wait, 0, sizeof(wait));
+	pthread_mutex_init(&wait.lock, NULL);
+	pthread_cond_init(&wait.cond, NULL);
+
+	pthread_mutex_lock(&wait.lock);
+	ret = msk_chan_call(chan, request, reply, msk_wait_done_cb, msk_wait_done_cb, &wait);
+	if (!ret) {
+		while (!wait.done)
+			pthread_cond_wait(&wait.cond, &wait.lock);
+		ret = reply->status ? EIO : 0;
+	}
+	pthread_mutex_unlock(&wait.lock);
+
+	pthread_cond_destroy(&wait.cond);
+	pthread_mutex_destroy(&wait.lock);
+
+	return ret;
+}
+
+/**
+ * msk_chan_trans: the transport a channel currently uses, for rdma
+ * read/write on the side
+ */
+msk_trans_t *msk_chan_trans(msk_chan_t *chan) {
+	return chan->conn->trans;
+}
+
+
+/* STRIPED TRANSPORT */
+
+#define MSK_STRIPE_MAGIC 0x6d736b73
+#define MSK_STRIPE_SEG_PER_LANE 16	/**< segments are made bigger past this many per lane */
+
+enum msk_stripe_ctrl_type {
+	MSK_STRIPE_HELLO = 1,
+	MSK_STRIPE_DESC,
+	MSK_STRIPE_FIN,
+};
+
+/**
+ * \struct msk_stripe_ctrl
+ * control messages, all go over lane 0 except hellos. Network order.
+ */
+struct msk_stripe_ctrl {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t seq;
+	uint32_t status;		/**< FIN: 0 or errno */
+	uint32_t lane;			/**< HELLO */
+	uint32_t nlanes;		/**< HELLO */
+	uint64_t id;			/**< HELLO */
+	uint64_t addr;			/**< DESC */
+	uint64_t size;			/**< DESC */
+	uint32_t rkey[MSK_STRIPE_MAX_LANES];	/**< DESC */
+};
+
+struct msk_stripe_lane {
+	msk_trans_t *trans;
+	int outstanding;		/**< segments in flight */
+	uint64_t queued_bytes;		/**< bytes in flight, picks the lane of the next segment */
+	uint64_t bytes;
+	uint64_t segments;
+	uint64_t nsec_busy;
+	struct timespec ts_busy;	/**< last time outstanding went from 0 to 1 */
+};
+
+struct msk_stripe_op;
+
+struct msk_stripe_seg {
+	struct msk_stripe_op *op;
+	int lane;
+	msk_data_t data;
+	msk_rloc_t rloc;
+};
+
+struct msk_stripe_op {
+	struct msk_stripe *stripe;
+	int remaining;
+	enum ibv_wc_status status;
+	void (*done)(struct msk_stripe_op *op);
+	void *done_arg;
+	msk_data_t *data;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	int nseg;
+	struct msk_stripe_seg segs[0];
+};
+
+struct msk_stripe_tx {
+	int used;
+	uint32_t seq;
+	struct msk_stripe_ctrl *ctrl;
+	msk_data_t ctrl_data;
+	msk_data_t *data;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+};
+
+struct msk_stripe_rx {
+	enum {
+		MSK_STRIPE_RX_FREE = 0,
+		MSK_STRIPE_RX_POSTED,		/**< user buffer, waiting for the DESC */
+		MSK_STRIPE_RX_DESC,		/**< DESC came first, waiting for msk_stripe_recv */
+		MSK_STRIPE_RX_ACTIVE,		/**< reading */
+	} state;
+	uint32_t seq;
+	struct msk_stripe_ctrl desc;	/**< host order copy */
+	msk_data_t *data;
+	struct msk_mr_set *set;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	struct msk_stripe_ctrl *fin;
+	msk_data_t fin_data;
+};
+
+struct msk_stripe {
+	struct msk_stripe *next;	/**< server side, stripes waiting for lanes */
+	msk_trans_t *listener;
+	uint64_t id;
+	int nlanes;
+	int nconnected;
+	struct msk_stripe_lane lanes[MSK_STRIPE_MAX_LANES];
+	uint32_t stripe_size;
+	struct timespec ts_start;
+	pthread_mutex_t lock;
+	uint8_t *ctrl_buf;
+	struct msk_mr_set *ctrl_set;	/**< registered on every device, lanes can be on any of them */
+	int depth;			/**< tx/rx ring size */
+	int rcount;			/**< control receive buffers on lane 0 */
+	msk_data_t *ctrl_rdata;
+	struct msk_stripe_tx *tx;
+	struct msk_stripe_rx *rx;
+	uint32_t tx_seq;
+	uint32_t rx_post;
+	int dead;			/**< a lane is gone, see msk_stripe_fail */
+	disconnect_callback_t disconnect_callback;	/**< the user's, lanes call msk_stripe_disconnect_cb */
+};
+
+static pthread_mutex_t msk_stripe_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct msk_stripe *msk_stripe_pending = NULL;
+
+static inline msk_trans_t *msk_stripe_lane0(struct msk_stripe *stripe) {
+	return stripe->lanes[0].trans;
+}
+
+static void msk_stripe_seg_done(struct msk_stripe_seg *seg, enum ibv_wc_status status) {
+	struct msk_stripe_op *op = seg->op;
+	struct msk_stripe_lane *lane = &op->stripe->lanes[seg->lane];
+	struct timespec ts_now;
+	uint64_t nsec;
+
+	atomic_sub(lane->queued_bytes, seg->data.size);
+	if (status) {
+		op->status = status;
+	} else {
+		atomic_add(lane->bytes, seg->data.size);
+		atomic_inc(lane->segments);
+	}
+	if (atomic_dec(lane->outstanding) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		sub_timespec(&nsec, &lane->ts_busy, &ts_now);
+		atomic_add(lane->nsec_busy, nsec);
+	}
+
+	if (atomic_dec(op->remaining) == 0)
+		op->done(op);
+}
+
+static void msk_stripe_seg_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	msk_stripe_seg_done(arg, IBV_WC_SUCCESS);
+}
+
+static void msk_stripe_seg_err(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	msk_stripe_seg_done(arg, data->status ? data->status : IBV_WC_GENERAL_ERR);
+}
+
+/**
+ * msk_stripe_rdma: splits a read or write in segments, each going to the
+ * lane with the fewest bytes in flight. op->done runs once all completed.
+ */
+static int msk_stripe_rdma(struct msk_stripe *stripe, enum ibv_wr_opcode opcode, uint8_t *addr, uint64_t size, struct msk_mr_set *set,
+			   uint64_t raddr, const uint32_t *rkey, void (*done)(struct msk_stripe_op *op), void *done_arg,
+			   msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_stripe_op *op;
+	struct msk_stripe_seg *seg;
+	struct msk_stripe_lane *lane;
+	struct ibv_mr *mr;
+	uint64_t seg_size, off;
+	int i, l, nseg, ret = 0;
+
+	seg_size = stripe->stripe_size;
+	if (size > seg_size * stripe->nlanes * MSK_STRIPE_SEG_PER_LANE)
+		seg_size = (size + stripe->nlanes * MSK_STRIPE_SEG_PER_LANE - 1) / (stripe->nlanes * MSK_STRIPE_SEG_PER_LANE);
+	if (seg_size > UINT32_MAX)
+		return EMSGSIZE;
+	nseg = (size + seg_size - 1) / seg_size;
+
+	op = malloc(sizeof(*op) + nseg * sizeof(struct msk_stripe_seg));
+	if (!op)
+		return ENOMEM;
+	memset(op, 0, sizeof(*op) + nseg * sizeof(struct msk_stripe_seg));
+	op->stripe = stripe;
+	op->done = done;
+	op->done_arg = done_arg;
+	op->data = data;
+	op->callback = callback;
+	op->err_callback = err_callback;
+	op->callback_arg = callback_arg;
+	op->nseg = nseg;
+	// one extra so op->done can't run before everything is posted
+	op->remaining = nseg + 1;
+
+	for (i = 0, off = 0; i < nseg; i++, off += seg_size) {
+		seg = &op->segs[i];
+		seg->op = op;
+
+		seg->lane = 0;
+		for (l = 1; l < stripe->nlanes; l++)
+			if (stripe->lanes[l].queued_bytes < stripe->lanes[seg->lane].queued_bytes)
+				seg->lane = l;
+		lane = &stripe->lanes[seg->lane];
+
+		mr = msk_mr_set_get(set, lane->trans);
+		seg->data.data = addr + off;
+		seg->data.size = (size - off < seg_size) ? size - off : seg_size;
+		seg->data.max_size = seg->data.size;
+		seg->data.mr = mr;
+		seg->rloc.raddr = raddr + off;
+		seg->rloc.rkey = rkey[seg->lane];
+		seg->rloc.size = seg->data.size;
+
+		atomic_add(lane->queued_bytes, seg->data.size);
+		if (atomic_postinc(lane->outstanding) == 0)
+			clock_gettime(CLOCK_MONOTONIC, &lane->ts_busy);
+
+		if (!mr) {
+			ret = ENODEV;
+		} else if (opcode == IBV_WR_RDMA_READ) {
+			ret = msk_post_send_generic(lane->trans, IBV_WR_RDMA_READ, &seg->data, 1, &seg->rloc, 0, msk_stripe_seg_cb, msk_stripe_seg_err, seg);
+		} else {
+			ret = msk_post_send_generic(lane->trans, IBV_WR_RDMA_WRITE, &seg->data, 1, &seg->rloc, 0, msk_stripe_seg_cb, msk_stripe_seg_err, seg);
+		}
+		if (ret) {
+			INFO_LOG(lane->trans->debug & MSK_DEBUG_EVENT, "posting segment %d on lane %d failed: %s (%d)", i, seg->lane, strerror(ret), ret);
+			msk_stripe_seg_done(seg, IBV_WC_GENERAL_ERR);
+		}
+	}
+
+	if (atomic_dec(op->remaining) == 0)
+		op->done(op);
+
+	return 0;
+}
+
+static void msk_stripe_user_done(struct msk_stripe_op *op) {
+	msk_trans_t *trans = msk_stripe_lane0(op->stripe);
+
+	op->data->status = op->status;
+	if (op->status) {
+		if (op->err_callback)
+			msk_profile_call(op->err_callback, trans, op->data, op->callback_arg);
+	} else if (op->callback) {
+		msk_profile_call(op->callback, trans, op->data, op->callback_arg);
+	}
+	free(op);
+}
+
+/**
+ * Striped RDMA write of data (registered with msk_stripe_reg_mr) to rloc
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_write(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, msk_stripe_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	if (data->size > rloc->size)
+		return EMSGSIZE;
+	return msk_stripe_rdma(stripe, IBV_WR_RDMA_WRITE, data->data, data->size, set, rloc->raddr, rloc->rkey,
+			       msk_stripe_user_done, NULL, data, callback, err_callback, callback_arg);
+}
+
+/**
+ * Striped RDMA read of rloc into data (registered with msk_stripe_reg_mr)
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_read(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, msk_stripe_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	if (data->size > rloc->size)
+		return EMSGSIZE;
+	return msk_stripe_rdma(stripe, IBV_WR_RDMA_READ, data->data, data->size, set, rloc->raddr, rloc->rkey,
+			       msk_stripe_user_done, NULL, data, callback, err_callback, callback_arg);
+}
+
+static void msk_stripe_tx_done(struct msk_stripe *stripe, struct msk_stripe_tx *tx, int status) {
+	msk_trans_t *trans = msk_stripe_lane0(stripe);
+
+	if (!atomic_bool_compare_and_swap(&tx->used, 1, 2))
+		return;
+
+	tx->data->status = status ? IBV_WC_REM_ABORT_ERR : IBV_WC_SUCCESS;
+	if (status) {
+		if (tx->err_callback)
+			msk_profile_call(tx->err_callback, trans, tx->data, tx->callback_arg);
+	} else if (tx->callback) {
+		msk_profile_call(tx->callback, trans, tx->data, tx->callback_arg);
+	}
+	atomic_store(&tx->used, 0);
+}
+
+static void msk_stripe_tx_err(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct msk_stripe_tx *tx = arg;
+
+	msk_profile_skip();
+
+	msk_stripe_tx_done(trans->owner, tx, EIO);
+}
+
+/**
+ * msk_stripe_fail: a lane is gone, no DESC or FIN is coming anymore.
+ * Fails the messages waiting for one and frees the slots msk_stripe_recv
+ * would wait on; reads already going complete as their lanes flush.
+ */
+static void msk_stripe_fail(struct msk_stripe *stripe, enum ibv_wc_status status) {
+	msk_trans_t *trans = msk_stripe_lane0(stripe);
+	struct msk_stripe_tx *tx;
+	struct msk_stripe_rx *rx;
+	msk_data_t *data;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	int i, posted;
+
+	atomic_store(&stripe->dead, 1);
+
+	for (i = 0; stripe->tx && i < stripe->depth; i++) {
+		tx = &stripe->tx[i];
+		if (!atomic_bool_compare_and_swap(&tx->used, 1, 2))
+			continue;
+		tx->data->status = status;
+		if (tx->err_callback)
+			msk_profile_call(tx->err_callback, trans, tx->data, tx->callback_arg);
+		atomic_store(&tx->used, 0);
+	}
+
+	for (i = 0; stripe->rx && i < stripe->depth; i++) {
+		rx = &stripe->rx[i];
+		pthread_mutex_lock(&stripe->lock);
+		posted = rx->state == MSK_STRIPE_RX_POSTED;
+		data = rx->data;
+		err_callback = rx->err_callback;
+		callback_arg = rx->callback_arg;
+		if (posted || rx->state == MSK_STRIPE_RX_DESC)
+			rx->state = MSK_STRIPE_RX_FREE;
+		pthread_mutex_unlock(&stripe->lock);
+
+		if (!posted)
+			continue;
+		data->status = status;
+		if (err_callback)
+			msk_profile_call(err_callback, trans, data, callback_arg);
+	}
+}
+
+static void msk_stripe_disconnect_cb(msk_trans_t *trans) {
+	struct msk_stripe *stripe = trans->owner;
+
+	INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "stripe lane disconnected");
+	msk_stripe_fail(stripe, IBV_WC_WR_FLUSH_ERR);
+	if (stripe->disconnect_callback)
+		stripe->disconnect_callback(trans);
+}
+
+/**
+ * msk_stripe_rx_finish: frees the slot and sends its FIN. The FIN lets the
+ * peer send the DESC depth messages later into that same slot, so it must
+ * be free first. The caller copied whatever else it needs from it.
+ */
+static void msk_stripe_rx_finish(struct msk_stripe *stripe, struct msk_stripe_rx *rx, int status) {
+	uint32_t seq = rx->seq;
+	int ret;
+
+	rx->fin->magic = htonl(MSK_STRIPE_MAGIC);
+	rx->fin->type = htonl(MSK_STRIPE_FIN);
+	rx->fin->seq = htonl(seq);
+	rx->fin->status = htonl(status);
+
+	pthread_mutex_lock(&stripe->lock);
+	rx->state = MSK_STRIPE_RX_FREE;
+	pthread_mutex_unlock(&stripe->lock);
+
+	ret = msk_post_send_generic(msk_stripe_lane0(stripe), IBV_WR_SEND, &rx->fin_data, 1, NULL, 0, NULL, NULL, NULL);
+	if (ret)
+		INFO_LOG(msk_stripe_lane0(stripe)->debug & MSK_DEBUG_EVENT, "sending FIN %u failed: %d", seq, ret);
+}
+
+static void msk_stripe_rx_done(struct msk_stripe_op *op) {
+	struct msk_stripe *stripe = op->stripe;
+	struct msk_stripe_rx *rx = op->done_arg;
+	msk_trans_t *trans = msk_stripe_lane0(stripe);
+	msk_data_t *data = rx->data;
+	ctx_callback_t callback = rx->callback, err_callback = rx->err_callback;
+	void *callback_arg = rx->callback_arg;
+	enum ibv_wc_status status = op->status;
+
+	free(op);
+
+	data->size = rx->desc.size;
+	data->status = status;
+	msk_stripe_rx_finish(stripe, rx, status ? EIO : 0);
+
+	if (status) {
+		if (err_callback)
+			msk_profile_call(err_callback, trans, data, callback_arg);
+	} else if (callback) {
+		msk_profile_call(callback, trans, data, callback_arg);
+	}
+}
+
+/**
+ * msk_stripe_rx_start: both the DESC and the user buffer are there, pull the data.
+ * The caller marked the slot active under the stripe lock, callbacks can
+ * run from here so it must not hold it anymore.
+ */
+static void msk_stripe_rx_start(struct msk_stripe *stripe, struct msk_stripe_rx *rx) {
+	msk_trans_t *trans = msk_stripe_lane0(stripe);
+	msk_data_t *data = rx->data;
+	ctx_callback_t err_callback = rx->err_callback;
+	void *callback_arg = rx->callback_arg;
+	int ret = EMSGSIZE;
+
+	if (rx->desc.size <= data->max_size)
+		ret = msk_stripe_rdma(stripe, IBV_WR_RDMA_READ, data->data, rx->desc.size, rx->set,
+				      rx->desc.addr, rx->desc.rkey, msk_stripe_rx_done, rx, NULL, NULL, NULL, NULL);
+	if (ret) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "striped message %u (%"PRIu64" bytes) not received: %s (%d)",
+			 rx->seq, rx->desc.size, strerror(ret), ret);
+		data->status = IBV_WC_LOC_LEN_ERR;
+		msk_stripe_rx_finish(stripe, rx, ret);
+		if (err_callback)
+			msk_profile_call(err_callback, trans, data, callback_arg);
+	}
+}
+
+static void msk_stripe_ctrl_recv(msk_trans_t *trans, msk_data_t *data, void *arg);
+
+static void msk_stripe_ctrl_err(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	msk_profile_skip();
+
+	INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "stripe control recv failed: %s (%d)", ibv_wc_status_str(data->status), data->status);
+	// lane 0 is in error, the control messages are lost with it
+	msk_stripe_fail(arg, data->status);
+}
+
+static void msk_stripe_ctrl_recv(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct msk_stripe *stripe = arg;
+	struct msk_stripe_ctrl *ctrl = (struct msk_stripe_ctrl *)data->data;
+	struct msk_stripe_ctrl desc;
+	struct msk_stripe_rx *rx;
+	struct msk_stripe_tx *tx;
+	uint32_t seq;
+	int i, start;
+
+	msk_profile_skip();
+
+	do {
+		if (data->size < sizeof(*ctrl) || ntohl(ctrl->magic) != MSK_STRIPE_MAGIC) {
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "not a stripe control message");
+			break;
+		}
+		seq = ntohl(ctrl->seq);
+
+		switch (ntohl(ctrl->type)) {
+		case MSK_STRIPE_DESC:
+			rx = &stripe->rx[seq % stripe->depth];
+			desc.addr = be64toh(ctrl->addr);
+			desc.size = be64toh(ctrl->size);
+			for (i = 0; i < stripe->nlanes; i++)
+				desc.rkey[i] = ntohl(ctrl->rkey[i]);
+			start = 0;
+			pthread_mutex_lock(&stripe->lock);
+			if (stripe->dead) {
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "DESC %u on a failed stripe", seq);
+			} else if (rx->state == MSK_STRIPE_RX_POSTED && rx->seq == seq) {
+				rx->desc = desc;
+				rx->state = MSK_STRIPE_RX_ACTIVE;
+				start = 1;
+			} else if (rx->state == MSK_STRIPE_RX_FREE) {
+				rx->desc = desc;
+				rx->seq = seq;
+				rx->state = MSK_STRIPE_RX_DESC;
+			} else {
+				// still reading with its own desc, leave it alone
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "DESC %u on a busy slot (state %d, seq %u)", seq, rx->state, rx->seq);
+			}
+			pthread_mutex_unlock(&stripe->lock);
+			if (start)
+				msk_stripe_rx_start(stripe, rx);
+			break;
+
+		case MSK_STRIPE_FIN:
+			tx = &stripe->tx[seq % stripe->depth];
+			if (tx->used != 1 || tx->seq != seq) {
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "stale FIN %u", seq);
+				break;
+			}
+			msk_stripe_tx_done(stripe, tx, ntohl(ctrl->status));
+			break;
+
+		default:
+			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "unexpected stripe control message %u", ntohl(ctrl->type));
+		}
+	} while (0);
+
+	data->size = data->max_size;
+	msk_post_recv(trans, data, msk_stripe_ctrl_recv, msk_stripe_ctrl_err, stripe);
+}
+
+/**
+ * Send a message striped over all lanes: lane 0 carries its address and
+ * rkeys, the peer reads it in with striped RDMA READs into the buffer
+ * given to msk_stripe_recv and answers with a FIN that calls the callback.
+ * data must be registered with msk_stripe_reg_mr with IBV_ACCESS_REMOTE_READ.
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_send(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_stripe_tx *tx;
+	struct ibv_mr *mr;
+	uint32_t seq;
+	int i, ret;
+
+	if (stripe->dead)
+		return ENOTCONN;
+	for (i = 0; i < stripe->nlanes; i++)
+		if (!msk_mr_set_get(set, stripe->lanes[i].trans))
+			return EINVAL;
+
+	pthread_mutex_lock(&stripe->lock);
+	seq = stripe->tx_seq++;
+	pthread_mutex_unlock(&stripe->lock);
+
+	tx = &stripe->tx[seq % stripe->depth];
+	while (!atomic_bool_compare_and_swap(&tx->used, 0, 1)) {
+		if (stripe->dead)
+			return ENOTCONN;
+		DATA_LOG(msk_stripe_lane0(stripe)->debug & MSK_DEBUG_CTX, "waiting for FIN of message %u", seq - stripe->depth);
+		usleep(250);
+	}
+
+	tx->seq = seq;
+	tx->data = data;
+	tx->callback = callback;
+	tx->err_callback = err_callback;
+	tx->callback_arg = callback_arg;
+
+	tx->ctrl->magic = htonl(MSK_STRIPE_MAGIC);
+	tx->ctrl->type = htonl(MSK_STRIPE_DESC);
+	tx->ctrl->seq = htonl(seq);
+	tx->ctrl->addr = htobe64((uintptr_t)data->data);
+	tx->ctrl->size = htobe64(data->size);
+	for (i = 0; i < stripe->nlanes; i++) {
+		mr = msk_mr_set_get(set, stripe->lanes[i].trans);
+		tx->ctrl->rkey[i] = htonl(mr->rkey);
+	}
+
+	ret = msk_post_send_generic(msk_stripe_lane0(stripe), IBV_WR_SEND, &tx->ctrl_data, 1, NULL, 0, NULL, msk_stripe_tx_err, tx);
+	if (ret)
+		atomic_store(&tx->used, 0);
+
+	return ret;
+}
+
+/**
+ * Post a buffer for the next striped message, in order.
+ * data must be registered with msk_stripe_reg_mr with IBV_ACCESS_LOCAL_WRITE,
+ * data->size is set to the message size before the callback.
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_recv(msk_stripe_t *stripe, msk_data_t *data, struct msk_mr_set *set, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_stripe_rx *rx;
+	uint32_t seq;
+	int start = 0;
+
+	pthread_mutex_lock(&stripe->lock);
+	seq = stripe->rx_post;
+	rx = &stripe->rx[seq % stripe->depth];
+	// still reading the message depth before us
+	while (!stripe->dead && !(rx->state == MSK_STRIPE_RX_FREE || (rx->state == MSK_STRIPE_RX_DESC && rx->seq == seq))) {
+		pthread_mutex_unlock(&stripe->lock);
+		usleep(250);
+		pthread_mutex_lock(&stripe->lock);
+	}
+	if (stripe->dead) {
+		pthread_mutex_unlock(&stripe->lock);
+		return ENOTCONN;
+	}
+	stripe->rx_post++;
+
+	rx->data = data;
+	rx->set = set;
+	rx->callback = callback;
+	rx->err_callback = err_callback;
+	rx->callback_arg = callback_arg;
+	if (rx->state == MSK_STRIPE_RX_DESC) {
+		rx->state = MSK_STRIPE_RX_ACTIVE;
+		start = 1;
+	} else {
+		rx->seq = seq;
+		rx->state = MSK_STRIPE_RX_POSTED;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (start)
+		msk_stripe_rx_start(stripe, rx);
+
+	return 0;
+}
+
+/**
+ * msk_stripe_setup_ctrl: control buffers and lane 0 receives, once all lanes are there
+ */
+static int msk_stripe_setup_ctrl(struct msk_stripe *stripe) {
+	msk_trans_t *trans = msk_stripe_lane0(stripe);
+	struct ibv_mr *mr;
+	size_t size;
+	uint8_t *buf;
+	int i, ret;
+
+	// peer DESCs and FINs of our own messages share the receive buffers
+	stripe->rcount = trans->rq_depth;
+	stripe->depth = trans->rq_depth / 2 > 0 ? trans->rq_depth / 2 : 1;
+
+	size = (stripe->rcount + 2 * stripe->depth) * sizeof(struct msk_stripe_ctrl);
+	stripe->ctrl_buf = malloc(size);
+	stripe->ctrl_rdata = malloc(stripe->rcount * sizeof(msk_data_t));
+	stripe->tx = malloc(stripe->depth * sizeof(struct msk_stripe_tx));
+	stripe->rx = malloc(stripe->depth * sizeof(struct msk_stripe_rx));
+	if (!stripe->ctrl_buf || !stripe->ctrl_rdata || !stripe->tx || !stripe->rx)
+		return ENOMEM;
+	memset(stripe->ctrl_buf, 0, size);
+	memset(stripe->tx, 0, stripe->depth * sizeof(struct msk_stripe_tx));
+	memset(stripe->rx, 0, stripe->depth * sizeof(struct msk_stripe_rx));
+
+	stripe->ctrl_set = msk_reg_mr_all(trans, stripe->ctrl_buf, size, IBV_ACCESS_LOCAL_WRITE);
+	if (!stripe->ctrl_set)
+		return errno;
+	mr = msk_mr_set_get(stripe->ctrl_set, trans);
+
+	buf = stripe->ctrl_buf;
+	for (i = 0; i < stripe->depth; i++, buf += sizeof(struct msk_stripe_ctrl)) {
+		stripe->tx[i].ctrl = (struct msk_stripe_ctrl *)buf;
+		stripe->tx[i].ctrl_data.data = buf;
+		stripe->tx[i].ctrl_data.size = stripe->tx[i].ctrl_data.max_size = sizeof(struct msk_stripe_ctrl);
+		stripe->tx[i].ctrl_data.mr = mr;
+	}
+	for (i = 0; i < stripe->depth; i++, buf += sizeof(struct msk_stripe_ctrl)) {
+		stripe->rx[i].fin = (struct msk_stripe_ctrl *)buf;
+		stripe->rx[i].fin_data.data = buf;
+		stripe->rx[i].fin_data.size = stripe->rx[i].fin_data.max_size = sizeof(struct msk_stripe_ctrl);
+		stripe->rx[i].fin_data.mr = mr;
+	}
+	for (i = 0; i < stripe->rcount; i++, buf += sizeof(struct msk_stripe_ctrl)) {
+		memset(&stripe->ctrl_rdata[i], 0, sizeof(msk_data_t));
+		stripe->ctrl_rdata[i].data = buf;
+		stripe->ctrl_rdata[i].size = stripe->ctrl_rdata[i].max_size = sizeof(struct msk_stripe_ctrl);
+		stripe->ctrl_rdata[i].mr = mr;
+		ret = msk_post_recv(trans, &stripe->ctrl_rdata[i], msk_stripe_ctrl_recv, msk_stripe_ctrl_err, stripe);
+		if (ret)
+			return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stripe->ts_start);
+
+	return 0;
+}
+
+static struct msk_stripe *msk_stripe_alloc(int nlanes, uint32_t stripe_size) {
+	struct msk_stripe *stripe;
+
+	stripe = malloc(sizeof(*stripe));
+	if (!stripe)
+		return NULL;
+	memset(stripe, 0, sizeof(*stripe));
+	stripe->nlanes = nlanes;
+	stripe->stripe_size = stripe_size ? stripe_size : MSK_STRIPE_DEFAULT_SIZE;
+	pthread_mutex_init(&stripe->lock, NULL);
+
+	return stripe;
+}
+
+/**
+ * Tear a striped transport down, outstanding operations fail.
+ * Their err_callbacks get lane 0 as trans like any stripe callback;
+ * it is disconnecting by then, don't post on it.
+ */
+void msk_stripe_destroy(msk_stripe_t **pstripe) {
+	struct msk_stripe *stripe = *pstripe;
+	int i;
+
+	if (!stripe)
+		return;
+
+	// while lane 0 is still there to pass along
+	msk_stripe_fail(stripe, IBV_WC_WR_FLUSH_ERR);
+
+	// lane 0 last, so reads flushed on the others still complete with it
+	for (i = stripe->nlanes - 1; i >= 0; i--)
+		if (stripe->lanes[i].trans) {
+			stripe->lanes[i].trans->disconnect_callback = stripe->disconnect_callback;
+			msk_destroy_trans(&stripe->lanes[i].trans);
+		}
+
+	if (stripe->ctrl_set)
+		msk_dereg_mr_all(stripe->ctrl_set);
+	free(stripe->ctrl_buf);
+	free(stripe->ctrl_rdata);
+	free(stripe->tx);
+	free(stripe->rx);
+	pthread_mutex_destroy(&stripe->lock);
+	free(stripe);
+	*pstripe = NULL;
+}
+
+/**
+ * Connect a striped transport of sattr->lanes connections
+ *
+ * @param pstripe [OUT]
+ * @param attr    [IN] client attributes shared by all lanes
+ * @param sattr   [IN] lane count, optional per-lane destination and local
+ *                     addresses to spread lanes over devices and ports
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_connect(msk_stripe_t **pstripe, msk_trans_attr_t *attr, msk_stripe_attr_t *sattr) {
+	struct msk_stripe *stripe;
+	struct msk_stripe_ctrl *hello;
+	msk_trans_attr_t lattr;
+	msk_data_t hello_data;
+	struct timespec ts;
+	msk_trans_t *trans;
+	int i, ret = 0;
+
+	if (!attr || attr->server || !sattr || sattr->lanes <= 0 || sattr->lanes > MSK_STRIPE_MAX_LANES)
+		return EINVAL;
+
+	stripe = msk_stripe_alloc(sattr->lanes, sattr->stripe_size);
+	if (!stripe)
+		return ENOMEM;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	stripe->id = ((uint64_t)getpid() << 32) ^ ((uint64_t)ts.tv_sec << 20) ^ ts.tv_nsec ^ (uintptr_t)stripe;
+
+	memcpy(&lattr, attr, sizeof(lattr));
+	lattr.destroy_on_disconnect = 0;
+	lattr.disconnect_callback = msk_stripe_disconnect_cb;
+	stripe->disconnect_callback = attr->disconnect_callback;
+
+	for (i = 0; i < stripe->nlanes; i++) {
+		if (sattr->nodes && sattr->nodes[i])
+			lattr.node = sattr->nodes[i];
+		if (sattr->bind_nodes)
+			lattr.bind_node = sattr->bind_nodes[i];
+
+		ret = msk_init(&stripe->lanes[i].trans, &lattr);
+		if (ret)
+			break;
+		trans = stripe->lanes[i].trans;
+		trans->owner = stripe;
+		ret = msk_connect(trans);
+		if (ret)
+			break;
+		if (i == 0) {
+			// one pd array for all lanes, so memory is registered once per device
+			lattr.pd = trans->pd;
+			ret = msk_stripe_setup_ctrl(stripe);
+			if (ret)
+				break;
+		}
+		ret = msk_finalize_connect(trans);
+		if (ret)
+			break;
+		stripe->nconnected++;
+
+		hello = stripe->tx[0].ctrl;
+		memset(hello, 0, sizeof(*hello));
+		hello->magic = htonl(MSK_STRIPE_MAGIC);
+		hello->type = htonl(MSK_STRIPE_HELLO);
+		hello->lane = htonl(i);
+		hello->nlanes = htonl(stripe->nlanes);
+		hello->id = htobe64(stripe->id);
+		memcpy(&hello_data, &stripe->tx[0].ctrl_data, sizeof(hello_data));
+		hello_data.mr = msk_mr_set_get(stripe->ctrl_set, trans);
+		ret = msk_wait_send(trans, &hello_data);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		INFO_LOG(attr->debug & MSK_DEBUG_EVENT, "lane %d failed: %s (%d)", i, strerror(ret), ret);
+		msk_stripe_destroy(&stripe);
+		return ret;
+	}
+
+	*pstripe = stripe;
+	return 0;
+}
+
+static void msk_stripe_pending_del(struct msk_stripe *stripe) {
+	struct msk_stripe **pprev;
+
+	for (pprev = &msk_stripe_pending; *pprev; pprev = &(*pprev)->next) {
+		if (*pprev == stripe) {
+			*pprev = stripe->next;
+			break;
+		}
+	}
+}
+
+/**
+ * msk_stripe_pending_drop: destroys the incomplete stripes of a listener
+ * that failed or is being destroyed, nothing will accept their other lanes
+ */
+static void msk_stripe_pending_drop(struct msk_trans *listener) {
+	struct msk_stripe **pprev, *stripe, *dropped = NULL;
+
+	pthread_mutex_lock(&msk_stripe_pending_lock);
+	pprev = &msk_stripe_pending;
+	while ((stripe = *pprev)) {
+		if (stripe->listener != listener) {
+			pprev = &stripe->next;
+			continue;
+		}
+		*pprev = stripe->next;
+		stripe->next = dropped;
+		dropped = stripe;
+	}
+	pthread_mutex_unlock(&msk_stripe_pending_lock);
+
+	while ((stripe = dropped)) {
+		dropped = stripe->next;
+		INFO_LOG(listener->debug & MSK_DEBUG_EVENT, "dropping stripe %"PRIx64" with %d/%d lanes", stripe->id, stripe->nconnected, stripe->nlanes);
+		msk_stripe_destroy(&stripe);
+	}
+}
+
+/**
+ * Accept connections on listener until one striped transport has all its
+ * lanes. Lanes of other clients are kept aside for the next calls, until
+ * accepting fails or the listener is destroyed.
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_stripe_accept(msk_trans_t *listener, msk_stripe_t **pstripe) {
+	struct msk_stripe *stripe = NULL;
+	struct msk_stripe_ctrl hello;
+	struct msk_wait_done wait;
+	struct ibv_mr *mr = NULL;
+	msk_data_t hello_data;
+	msk_trans_t *child;
+	uint32_t lane, nlanes;
+	uint64_t id;
+	int ret = 0;
+
+	pthread_mutex_init(&wait.lock, NULL);
+	pthread_cond_init(&wait.cond, NULL);
+
+	while (!stripe || stripe->nconnected < stripe->nlanes) {
+		child = msk_accept_one(listener);
+		if (!child) {
+			ret = errno ? errno : ECONNABORTED;
+			msk_stripe_pending_drop(listener);
+			break;
+		}
+
+		memset(&hello_data, 0, sizeof(hello_data));
+		hello_data.data = (uint8_t *)&hello;
+		hello_data.size = hello_data.max_size = sizeof(hello);
+		mr = msk_reg_mr(child, &hello, sizeof(hello), IBV_ACCESS_LOCAL_WRITE);
+		hello_data.mr = mr;
+		wait.done = 0;
+		if (!mr
+		    || (ret = msk_post_recv(child, &hello_data, msk_wait_done_cb, msk_wait_done_cb, &wait))
+		    || (ret = msk_finalize_accept(child))) {
+			ret = mr ? ret : errno;
+			INFO_LOG(listener->debug & MSK_DEBUG_EVENT, "lane setup failed: %s (%d)", strerror(ret), ret);
+			if (mr)
+				msk_dereg_mr(mr);
+			msk_destroy_trans(&child);
+			stripe = NULL;
+			continue;
+		}
+		pthread_mutex_lock(&wait.lock);
+		while (!wait.done)
+			pthread_cond_wait(&wait.cond, &wait.lock);
+		pthread_mutex_unlock(&wait.lock);
+		msk_dereg_mr(mr);
+
+		lane = ntohl(hello.lane);
+		nlanes = ntohl(hello.nlanes);
+		id = be64toh(hello.id);
+		if (hello_data.status || ntohl(hello.magic) != MSK_STRIPE_MAGIC || ntohl(hello.type) != MSK_STRIPE_HELLO
+		    || nlanes == 0 || nlanes > MSK_STRIPE_MAX_LANES || lane >= nlanes) {
+			INFO_LOG(listener->debug & MSK_DEBUG_EVENT, "bad stripe hello, dropping connection");
+			msk_destroy_trans(&child);
+			stripe = NULL;
+			continue;
+		}
+
+		pthread_mutex_lock(&msk_stripe_pending_lock);
+		for (stripe = msk_stripe_pending; stripe; stripe = stripe->next)
+			if (stripe->listener == listener && stripe->id == id)
+				break;
+		if (!stripe && (stripe = msk_stripe_alloc(nlanes, 0))) {
+			stripe->listener = listener;
+			stripe->id = id;
+			stripe->next = msk_stripe_pending;
+			msk_stripe_pending = stripe;
+		}
+		if (!stripe || stripe->nlanes != nlanes || stripe->lanes[lane].trans) {
+			pthread_mutex_unlock(&msk_stripe_pending_lock);
+			INFO_LOG(listener->debug & MSK_DEBUG_EVENT, "can't place lane %u of stripe %"PRIx64, lane, id);
+			msk_destroy_trans(&child);
+			stripe = NULL;
+			continue;
+		}
+		// children all got the listener's disconnect_callback
+		stripe->disconnect_callback = child->disconnect_callback;
+		child->disconnect_callback = msk_stripe_disconnect_cb;
+		child->owner = stripe;
+		stripe->lanes[lane].trans = child;
+		stripe->nconnected++;
+		if (stripe->nconnected == stripe->nlanes)
+			msk_stripe_pending_del(stripe);
+		else
+			stripe = NULL;
+		pthread_mutex_unlock(&msk_stripe_pending_lock);
+	}
+
+	pthread_cond_destroy(&wait.cond);
+	pthread_mutex_destroy(&wait.lock);
+
+	if (!stripe)
+		return ret;
+
+	ret = msk_stripe_setup_ctrl(stripe);
+	if (ret) {
+		msk_stripe_destroy(&stripe);
+		return ret;
+	}
+
+	*pstripe = stripe;
+	return 0;
+}
+
+/**
+ * Register memory for striped operations, on every device lanes can use
+ */
+struct msk_mr_set *msk_stripe_reg_mr(msk_stripe_t *stripe, void *memaddr, size_t size, int access) {
+	return msk_reg_mr_all(msk_stripe_lane0(stripe), memaddr, size, access);
+}
+
+/**
+ * Fill rloc with what the peer needs to read or write memaddr over every lane
+ */
+void msk_stripe_make_rloc(msk_stripe_t *stripe, struct msk_mr_set *set, void *memaddr, uint64_t size, msk_stripe_rloc_t *rloc) {
+	struct ibv_mr *mr;
+	int i;
+
+	memset(rloc, 0, sizeof(*rloc));
+	rloc->raddr = (uintptr_t)memaddr;
+	rloc->size = size;
+	for (i = 0; i < stripe->nlanes; i++) {
+		mr = msk_mr_set_get(set, stripe->lanes[i].trans);
+		rloc->rkey[i] = mr ? mr->rkey : 0;
+	}
+}
+
+int msk_stripe_lanes(msk_stripe_t *stripe) {
+	return stripe->nlanes;
+}
+
+msk_trans_t *msk_stripe_lane(msk_stripe_t *stripe, int lane) {
+	if (lane < 0 || lane >= stripe->nlanes)
+		return NULL;
+	return stripe->lanes[lane].trans;
+}
+
+/**
+ * Per-lane counters, nsec_busy over nsec_up is the lane utilization
+ *
+ * @return number of lanes filled in
+ */
+int msk_stripe_stats(msk_stripe_t *stripe, struct msk_stripe_lane_stats *stats, int max) {
+	struct timespec ts_now;
+	uint64_t nsec_up = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	sub_timespec(&nsec_up, &stripe->ts_start, &ts_now);
+
+	for (i = 0; i < stripe->nlanes && i < max; i++) {
+		stats[i].bytes = stripe->lanes[i].bytes;
+		stats[i].segments = stripe->lanes[i].segments;
+		stats[i].nsec_busy = stripe->lanes[i].nsec_busy;
+		stats[i].nsec_up = nsec_up;
+		stats[i].outstanding = stripe->lanes[i].outstanding;
+	}
+
+	return i;
+}
+
+
+/* DATAGRAM TRANSPORT */
+
+#define MSK_UD_HASH_SIZE 256
+#define MSK_UD_BACKLOG 64	/**< pending address lookups from peers */
+
+/** a peer's address handle and qp, looked up by node/port */
+struct msk_ud_dest {
+	struct msk_ud_dest *next;	/**< hash chain */
+	char *node;
+	char *port;
+	struct ibv_ah *ah;
+	uint32_t qpn;
+	uint32_t qkey;
+};
+
+struct msk_ud {
+	pthread_mutex_t lock;
+	struct msk_ud_dest *hash[MSK_UD_HASH_SIZE];
+	uint32_t dest_count;
+	uint32_t max_msg;		/**< path mtu, the biggest message a send can carry */
+};
+
+static unsigned int msk_ud_hash(const char *node, const char *port) {
+	unsigned int h = 5381;
+
+	while (*node)
+		h = h * 33 + (unsigned char)*node++;
+	while (*port)
+		h = h * 33 + (unsigned char)*port++;
+
+	return h & (MSK_UD_HASH_SIZE-1);
+}
+
+/**
+ * msk_ud_sidr_reply: answers a peer's msk_ud_resolve with our qp number
+ */
+static int msk_ud_sidr_reply(struct msk_trans *trans, struct rdma_cm_id *cm_id) {
+	struct rdma_conn_param conn_param;
+	int ret;
+
+	memset(&conn_param, 0, sizeof(conn_param));
+	conn_param.qp_num = trans->qp->qp_num;
+
+	if (rdma_accept(cm_id, &conn_param)) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_accept (sidr) failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void msk_ud_destroy(struct msk_trans *trans) {
+	struct msk_ud_dest *dest;
+	int i;
+
+	for (i = 0; i < MSK_UD_HASH_SIZE; i++) {
+		while ((dest = trans->ud->hash[i])) {
+			trans->ud->hash[i] = dest->next;
+			ibv_destroy_ah(dest->ah);
+			free(dest->node);
+			free(dest->port);
+			free(dest);
+		}
+	}
+	pthread_mutex_destroy(&trans->ud->lock);
+	free(trans->ud);
+	trans->ud = NULL;
+}
+
+/**
+ * msk_ud_bind: sets a RDMA_PS_UDP transport up as a datagram endpoint.
+ * One qp is used for all peers, found with msk_ud_resolve. Peers resolve
+ * us through the same node/port, so node has to be an address of a rdma
+ * device, not a wildcard.
+ *
+ * Receives are posted with msk_post_recv as usual, buffers need
+ * MSK_UD_GRH_SIZE bytes more than the biggest message, see msk_ud_payload.
+ *
+ * @param trans [INOUT] initialized with conn_type RDMA_PS_UDP
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_ud_bind(struct msk_trans *trans) {
+	struct rdma_addrinfo hints, *res;
+	struct ibv_port_attr port_attr;
+	struct msk_pd *pd;
+	int ret;
+
+	if (!trans || trans->state != MSK_INIT || trans->conn_type != RDMA_PS_UDP) {
+		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans must be initialized first with conn_type RDMA_PS_UDP");
+		return EINVAL;
+	}
+
+	memset(&hints, 0, sizeof(struct rdma_addrinfo));
+	hints.ai_flags = RAI_PASSIVE;
+	hints.ai_port_space = RDMA_PS_UDP;
+
+	ret = rdma_getaddrinfo(trans->node, trans->port, &hints, &res);
+	if (ret) {
+		ret = errno ? errno : EADDRNOTAVAIL;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_getaddrinfo: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+	ret = rdma_bind_addr(trans->cm_id, res->ai_src_addr);
+	rdma_freeaddrinfo(res);
+	if (ret) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_bind_addr: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+	if (!trans->cm_id->verbs) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "%s isn't the address of a rdma device", trans->node);
+		return EADDRNOTAVAIL;
+	}
+
+	if ((ret = ibv_query_port(trans->cm_id->verbs, trans->cm_id->port_num, &port_attr))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_query_port: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	trans->ud = malloc(sizeof(*trans->ud));
+	if (!trans->ud)
+		return ENOMEM;
+	memset(trans->ud, 0, sizeof(*trans->ud));
+	pthread_mutex_init(&trans->ud->lock, NULL);
+	// IBV_MTU_256 is 1
+	trans->ud->max_msg = 128 << port_attr.active_mtu;
+
+	if ((ret = msk_setup_pd(trans)))
+		return ret;
+	pd = msk_getpd(trans);
+	if (!pd)
+		return ENOSPC;
+	if ((ret = msk_alloc_pd(trans, pd)))
+		return ret;
+
+	if ((ret = msk_setup_qp(trans)))
+		return ret;
+	if ((ret = msk_setup_wctx(trans)) || (ret = msk_setup_rctx(trans)))
+		return ret;
+
+	if (rdma_listen(trans->cm_id, trans->server > 0 ? trans->server : MSK_UD_BACKLOG)) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_listen failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	if ((ret = msk_check_create_epoll_thread(&msk_global_state->cm_thread, msk_cm_thread, trans, &msk_global_state->cm_epollfd))
+	    || (ret = msk_check_create_epoll_thread(&msk_global_state->cq_thread, msk_cq_thread, trans, &msk_global_state->cq_epollfd))
+	    || ((trans->stats_prefix || trans->stats_shm || trans->stuck_ms) && (ret = msk_check_create_epoll_thread(&msk_global_state->stats_thread, msk_stats_thread, trans, &msk_global_state->stats_epollfd)))) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "msk_check_create_epoll_thread failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	msk_cm_addfd(trans);
+	msk_cq_addfd(trans);
+	msk_stats_add(trans);
+
+	// posts check for that
+	trans->state = MSK_CONNECTED;
+
+	INFO_LOG(trans->debug & MSK_DEBUG_SETUP, "datagram endpoint on qp %u, %u bytes per message", trans->qp->qp_num, trans->ud->max_msg);
+
+	return 0;
+}
+
+/**
+ * msk_ud_wait_event: next event of a private channel, which has to be of the given type
+ *
+ * @return 0 with *pevent to ack, errno value otherwise
+ */
+static int msk_ud_wait_event(struct msk_trans *trans, struct rdma_event_channel *channel, enum rdma_cm_event_type type, struct rdma_cm_event **pevent) {
+	int ret;
+
+	if (rdma_get_cm_event(channel, pevent)) {
+		ret = errno;
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "rdma_get_cm_event failed: %s (%d)", strerror(ret), ret);
+		return ret;
+	}
+
+	if ((*pevent)->event != type) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "expected %s, got %s (status %d)",
+			 rdma_event_str(type), rdma_event_str((*pevent)->event), (*pevent)->status);
+		ret = (*pevent)->event == RDMA_CM_EVENT_UNREACHABLE ? EHOSTUNREACH : ECONNREFUSED;
+		rdma_ack_cm_event(*pevent);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * msk_ud_lookup: resolves a peer's address, route and qp number (service id resolution)
+ * on a throw-away cm_id, then makes an address handle for it.
+ */
+static struct msk_ud_dest *msk_ud_lookup(struct msk_trans *trans, const char *node, const char *port) {
+	struct rdma_event_channel *channel;
+	struct rdma_cm_id *cm_id = NULL;
+	struct rdma_cm_event *event;
+	struct rdma_conn_param conn_param;
+	struct rdma_addrinfo hints, *res = NULL;
+	struct msk_ud_dest *dest = NULL;
+	struct msk_pd *pd;
+	int ret;
+
+	channel = rdma_create_event_channel();
+	if (!channel)
+		return NULL;
+
+	do {
+		if (rdma_create_id(channel, &cm_id, NULL, RDMA_PS_UDP)) {
+			ret = errno;
+			cm_id = NULL;
+			break;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_port_space = RDMA_PS_UDP;
+		if ((ret = rdma_getaddrinfo(node, port, &hints, &res))) {
+			ret = errno ? errno : EHOSTUNREACH;
+			res = NULL;
+			break;
+		}
+
+		// from our own address, so the route is on our device
+		if (rdma_resolve_addr(cm_id, rdma_get_local_addr(trans->cm_id), res->ai_dst_addr, trans->timeout)) {
+			ret = errno;
+			break;
+		}
+		if ((ret = msk_ud_wait_event(trans, channel, RDMA_CM_EVENT_ADDR_RESOLVED, &event)))
+			break;
+		rdma_ack_cm_event(event);
+
+		if (rdma_resolve_route(cm_id, trans->timeout)) {
+			ret = errno;
+			break;
+		}
+		if ((ret = msk_ud_wait_event(trans, channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &event)))
+			break;
+		rdma_ack_cm_event(event);
+
+		memset(&conn_param, 0, sizeof(conn_param));
+		if (rdma_connect(cm_id, &conn_param)) {
+			ret = errno;
+			break;
+		}
+		if ((ret = msk_ud_wait_event(trans, channel, RDMA_CM_EVENT_ESTABLISHED, &event)))
+			break;
+
+		do {
+			dest = malloc(sizeof(*dest));
+			if (!dest) {
+				ret = ENOMEM;
+				break;
+			}
+			memset(dest, 0, sizeof(*dest));
+			dest->qpn = event->param.ud.qp_num;
+			dest->qkey = event->param.ud.qkey;
+
+			pd = msk_getpd(trans);
+			dest->ah = ibv_create_ah(pd->pd, &event->param.ud.ah_attr);
+			if (!dest->ah) {
+				ret = errno;
+				INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_create_ah failed: %s (%d)", strerror(ret), ret);
+				break;
+			}
+			dest->node = strdup(node);
+			dest->port = strdup(port);
+			if (!dest->node || !dest->port)
+				ret = ENOMEM;
+		} while (0);
+		rdma_ack_cm_event(event);
+	} while (0);
+
+	if (ret && dest) {
+		if (dest->ah)
+			ibv_destroy_ah(dest->ah);
+		free(dest->node);
+		free(dest->port);
+		free(dest);
+		dest = NULL;
+	}
+
+	if (res)
+		rdma_freeaddrinfo(res);
+	if (cm_id)
+		rdma_destroy_id(cm_id);
+	rdma_destroy_event_channel(channel);
 
 	if (ret) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_recv failed: %s (%d)", strerror(ret), ret);
-		return ret; // FIXME np_uerror(ret)
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "couldn't resolve %s:%s: %s (%d)", node, port, strerror(ret), ret);
+		errno = ret;
 	}
 
-	return 0;
+	return dest;
 }
 
-static int msk_post_send_generic(struct msk_trans *trans, enum ibv_wr_opcode opcode, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
-	struct msk_ctx *wctx;
-	int i, ret;
-	uint32_t totalsize = 0;
+/**
+ * msk_ud_resolve: finds a peer datagram endpoint. Destinations are cached
+ * for the life of the transport, only the first call for a node/port goes
+ * on the wire.
+ *
+ * @param trans [IN] bound with msk_ud_bind
+ * @param node  [IN] peer's address, as given to its msk_ud_bind
+ * @param port  [IN]
+ *
+ * @return the destination, or NULL with errno set
+ */
+struct msk_ud_dest *msk_ud_resolve(struct msk_trans *trans, const char *node, const char *port) {
+	struct msk_ud_dest *dest, *other;
+	unsigned int h;
 
-	if (!trans || trans->state != MSK_CONNECTED) {
-		INFO_LOG((trans ? trans->debug : 0) & MSK_DEBUG_EVENT, "trans (%p) state: %d", trans, trans->state);
-		return EINVAL;
+	if (!trans || !trans->ud || !node || !port) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	INFO_LOG(trans->debug & MSK_DEBUG_SEND, "posting a send with op %d", opcode);
+	h = msk_ud_hash(node, port);
 
-	// opcode-specific checks:
-	if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_READ) {
-		if (!rloc) {
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "Cannot do rdma without a remote location!");
-			return EINVAL;
-		}
-	} else if (opcode == IBV_WR_SEND || opcode == IBV_WR_SEND_WITH_IMM) {
-	} else {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "unsupported op code: %d", opcode);
-		return EINVAL;
-	}
-
-	i = 0;
-	wctx = trans->wctx;
-	do {
-		if (i == trans->sq_depth) {
-			INFO_LOG(trans->debug & MSK_DEBUG_CTX, "waiting for wctx");
-			usleep(250);
-			i = 0;
-			wctx = trans->wctx;
-		}
+	pthread_mutex_lock(&trans->ud->lock);
+	for (dest = trans->ud->hash[h]; dest; dest = dest->next)
+		if (!strcmp(dest->node, node) && !strcmp(dest->port, port))
+			break;
+	pthread_mutex_unlock(&trans->ud->lock);
 
-		while (i < trans->sq_depth && wctx->used != MSK_CTX_FREE) {
-			wctx = msk_next_ctx(wctx, trans->max_send_sge);
-			i++;
-		}
-	} while ( i == trans->sq_depth || !(atomic_bool_compare_and_swap(&wctx->used, MSK_CTX_FREE, MSK_CTX_PENDING)) );
-	INFO_LOG(trans->debug & MSK_DEBUG_SEND, "got a free context");
+	if (dest)
+		return dest;
 
-	wctx->callback = callback;
-	wctx->err_callback = err_callback;
-	wctx->callback_arg = callback_arg;
-	wctx->data = data;
+	// not under the lock, this is a round trip
+	dest = msk_ud_lookup(trans, node, port);
+	if (!dest)
+		return NULL;
 
-	for (i=0; i < num_sge; i++) {
-		if (!data || !data->mr) {
-			INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "You said to send %d elements (num_sge), but we only found %d! Not sending.", num_sge, i);
-			// or send up to previous one? It's probably an error though...
-			return EINVAL;
-		} 
-		if (data->size == 0) {
-			num_sge = i; // only send up to previous sg, do we want to warn about this?
+	pthread_mutex_lock(&trans->ud->lock);
+	for (other = trans->ud->hash[h]; other; other = other->next)
+		if (!strcmp(other->node, node) && !strcmp(other->port, port))
 			break;
-		}
+	if (!other) {
+		dest->next = trans->ud->hash[h];
+		trans->ud->hash[h] = dest;
+		trans->ud->dest_count++;
+	}
+	pthread_mutex_unlock(&trans->ud->lock);
+
+	// someone else resolved it in the meantime
+	if (other) {
+		ibv_destroy_ah(dest->ah);
+		free(dest->node);
+		free(dest->port);
+		free(dest);
+		dest = other;
+	}
 
-		wctx->sg_list[i].addr = (uintptr_t)data->data;
-		INFO_LOG(trans->debug & MSK_DEBUG_SEND, "addr: %"PRIu64"\n", wctx->sg_list[i].addr);
-		wctx->sg_list[i].length = data->size;
-		wctx->sg_list[i].lkey = data->mr->lkey;
-		totalsize += data->size;
+	return dest;
+}
 
-		if (i != num_sge-1)
-			data = data->next;
-	}
+/**
+ * msk_ud_max_msg: biggest message msk_ud_post_send takes, the path mtu
+ */
+uint32_t msk_ud_max_msg(struct msk_trans *trans) {
+	return (trans && trans->ud) ? trans->ud->max_msg : 0;
+}
 
-	if (rloc && totalsize > rloc->size) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "trying to send or read a buffer bigger than the remote buffer (shall we truncate?)");
+/**
+ * msk_ud_post_send: sends a datagram to a destination from msk_ud_resolve.
+ * Delivery isn't guaranteed, a peer without a posted receive drops it.
+ *
+ * @param trans        [IN]
+ * @param dest         [IN]
+ * @param data         [IN] up to msk_ud_max_msg bytes
+ * @param callback     [IN] function that'll be called when done
+ * @param err_callback [IN] function that'll be called on error
+ * @param callback_arg [IN] argument to give to the callback
+ *
+ * @return 0 on success, the value of errno on error
+ */
+int msk_ud_post_send(struct msk_trans *trans, struct msk_ud_dest *dest, msk_data_t *data, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_ctx *wctx;
+	int ret;
+
+	if (!trans || !trans->ud || trans->state != MSK_CONNECTED || !dest || !data || !data->mr)
+		return EINVAL;
+
+	if (data->size > trans->ud->max_msg) {
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "datagram of %u bytes, mtu is %u", data->size, trans->ud->max_msg);
 		return EMSGSIZE;
 	}
+	MSK_PROBE(post_send, trans, data, IBV_WR_SEND, 1);
 
-	wctx->wr.wwr.next = NULL;
+	wctx = msk_get_wctx(trans);
+	wctx->callback = callback;
+	wctx->err_callback = err_callback;
+	wctx->callback_arg = callback_arg;
+	wctx->data = data;
+
+	wctx->sg_list[0].addr = (uintptr_t)data->data;
+	wctx->sg_list[0].length = data->size;
+	wctx->sg_list[0].lkey = data->mr->lkey;
+
+	memset(&wctx->wr.wwr, 0, sizeof(wctx->wr.wwr));
 	wctx->wr.wwr.wr_id = (uintptr_t)wctx;
-	wctx->wr.wwr.opcode = opcode;
-//FIXME	wctx->wr.wwr.imm_data = htonl(data->imm_data);
+	wctx->wr.wwr.opcode = IBV_WR_SEND;
 	wctx->wr.wwr.send_flags = IBV_SEND_SIGNALED;
 	wctx->wr.wwr.sg_list = wctx->sg_list;
-	wctx->wr.wwr.num_sge = num_sge;
-	if (rloc) {
-		wctx->wr.wwr.wr.rdma.rkey = rloc->rkey;
-		wctx->wr.wwr.wr.rdma.remote_addr = rloc->raddr;
-	}
+	wctx->wr.wwr.num_sge = 1;
+	wctx->wr.wwr.wr.ud.ah = dest->ah;
+	wctx->wr.wwr.wr.ud.remote_qpn = dest->qpn;
+	wctx->wr.wwr.wr.ud.remote_qkey = dest->qkey;
 
+	msk_trace(trans, wctx, MSK_TRACE_POST_SEND, IBV_WR_SEND, 0, data->size);
 	ret = ibv_post_send(trans->qp, &wctx->wr.wwr, &trans->bad_send_wr);
 	if (ret) {
-		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_send failed: %s (%d)", strerror(ret), ret);
-		return ret; // FIXME np_uerror(ret)
+		INFO_LOG(trans->debug & MSK_DEBUG_EVENT, "ibv_post_send (ud) failed: %s (%d)", strerror(ret), ret);
+		msk_put_wctx(trans, wctx);
+		return ret;
 	}
 
 	return 0;
 }
 
+
+/* TRACING */
+
 /**
- * Post a send buffer.
+ * msk_trace_start: record data path events in per-thread rings
  *
- * @param trans        [IN]
- * @param data         [IN] the data buffer to be sent
- * @param num_sge      [IN] the number of elements in data to send
- * @param callback     [IN] function that'll be called when done
- * @param err_callback [IN] function that'll be called on error
- * @param callback_arg [IN] argument to give to the callback
+ * Posts, completions and callbacks each write a struct msk_trace_rec
+ * in the ring of the thread doing them, oldest records get overwritten.
  *
- * @return 0 on success, the value of errno on error
+ * @param records [IN] ring size of threads that start tracing from now on,
+ *                     rounded up to a power of two, 0 for the default,
+ *                     at most MSK_TRACE_MAX_RECORDS
+ *
+ * @return 0
  */
-int msk_post_n_send(struct msk_trans *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
-	return msk_post_send_generic(trans, IBV_WR_SEND, data, num_sge, NULL, callback, err_callback, callback_arg);
+int msk_trace_start(uint32_t records) {
+	uint32_t size = 1;
+
+	if (!records)
+		records = MSK_TRACE_DEFAULT_RECORDS;
+	// size would wrap doubling past that
+	if (records > MSK_TRACE_MAX_RECORDS)
+		records = MSK_TRACE_MAX_RECORDS;
+	while (size < records)
+		size *= 2;
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	msk_global_state->trace_size = size;
+	atomic_store(&msk_global_state->trace_on, 1);
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	return 0;
+}
+
+void msk_trace_stop(void) {
+	atomic_store(&msk_global_state->trace_on, 0);
 }
 
 /**
- * msk_wait_callback: send/recv callback that just unlocks a mutex.
+ * msk_trace_dump: write all rings to a file for src/tools/msktrace
+ *
+ * Rings are copied as they are, stop tracing first if records being
+ * overwritten during the dump matter.
  *
+ * @return 0 on success, errno value on failure
  */
-static void msk_wait_callback(struct msk_trans *trans, msk_data_t *data, void *arg) {
-	pthread_mutex_t *lock = arg;
-	msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, lock);
+int msk_trace_dump(const char *path) {
+	struct msk_trace_file_hdr hdr;
+	struct msk_trace_ring_hdr rhdr;
+	struct msk_trace_ring *ring;
+	uint64_t head, start;
+	uint32_t first, tail;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "w");
+	if (!f)
+		return errno;
+
+	pthread_mutex_lock(&msk_global_state->lock);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MSK_TRACE_MAGIC;
+	hdr.version = MSK_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct msk_trace_rec);
+	for (ring = msk_global_state->trace_rings; ring; ring = ring->next)
+		hdr.nrings++;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		ret = EIO;
+
+	for (ring = msk_global_state->trace_rings; ring && !ret; ring = ring->next) {
+		head = atomic_load(&ring->head);
+		start = head > ring->size ? head - ring->size : 0;
+		memset(&rhdr, 0, sizeof(rhdr));
+		rhdr.tid = ring->tid;
+		rhdr.count = head - start;
+		rhdr.lost = start;
+		first = start & (ring->size - 1);
+
+		// oldest first: from the slot head will overwrite next, then from 0
+		tail = rhdr.count > ring->size - first ? ring->size - first : rhdr.count;
+		if (fwrite(&rhdr, sizeof(rhdr), 1, f) != 1
+		    || fwrite(&ring->recs[first], sizeof(struct msk_trace_rec), tail, f) != tail
+		    || fwrite(ring->recs, sizeof(struct msk_trace_rec), rhdr.count - tail, f) != rhdr.count - tail)
+			ret = EIO;
+	}
+	pthread_mutex_unlock(&msk_global_state->lock);
+
+	if (fclose(f) && !ret)
+		ret = errno;
+
+	return ret;
 }
 
+
+/* PROFILING */
+
 /**
- * Post a receive buffer and waits for _that one and not any other_ to be filled.
- * Generally a bad idea to use that one unless only that one is used.
+ * msk_profile_start: time every callback and sum it up per callback function
  *
- * @param trans   [IN]
- * @param data    [OUT] the data buffer to be filled with the received data
- * @param num_sge [IN]  the number of elements in data to register
+ * Counts go on from where a previous msk_profile_stop left them.
+ * Up to MSK_PROFILE_SLOTS distinct functions are told apart.
  *
- * @return 0 on success, the value of errno on error
+ * @return 0
  */
-int msk_wait_n_recv(struct msk_trans *trans, msk_data_t *data, int num_sge) {
-	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-	int ret;
+int msk_profile_start(void) {
+	atomic_store(&msk_global_state->profile_on, 1);
+	return 0;
+}
 
-	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-	ret = msk_post_n_recv(trans, data, num_sge, msk_wait_callback, msk_wait_callback, &lock);
+void msk_profile_stop(void) {
+	atomic_store(&msk_global_state->profile_on, 0);
+}
 
-	if (!ret) {
-		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		pthread_mutex_destroy(&lock);
+/* function+offset, object+offset or the bare address */
+static void msk_symbol(void *addr, char *buf, size_t size) {
+	Dl_info info;
+	const char *name;
+
+	if (!dladdr(addr, &info)) {
+		snprintf(buf, size, "%p", addr);
+	} else if (info.dli_sname && info.dli_saddr == addr) {
+		snprintf(buf, size, "%s", info.dli_sname);
+	} else if (info.dli_sname) {
+		snprintf(buf, size, "%s+0x%tx", info.dli_sname, (char *)addr - (char *)info.dli_saddr);
+	} else {
+		// static functions and executables not linked with -rdynamic, addr2line -e can take it from here
+		name = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+		name = name ? name + 1 : info.dli_fname ? info.dli_fname : "?";
+		snprintf(buf, size, "%s+0x%tx", name, (char *)addr - (char *)info.dli_fbase);
 	}
+}
 
-	return ret;
+static int msk_callback_cmp(const void *a, const void *b) {
+	const struct msk_callback_stats *ca = a, *cb = b;
+
+	if (ca->nsec_total != cb->nsec_total)
+		return ca->nsec_total < cb->nsec_total ? 1 : -1;
+	return 0;
 }
 
 /**
- * Post a send buffer and waits for that one to be completely sent
- * @param trans   [IN]
- * @param data    [IN] the data to send
- * @param num_sge [IN] the number of elements in data to send
+ * msk_get_callback_stats: profiler counts, the most time consuming callback first
  *
- * @return 0 on success, the value of errno on error
+ * Symbols are only resolved here, callbacks are keyed by address.
+ *
+ * @param stats [OUT] array of max entries
+ * @param max [IN]
+ *
+ * @return the number of distinct callbacks seen, can be more than max
  */
-int msk_wait_n_send(struct msk_trans *trans, msk_data_t *data, int num_sge) {
-	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-	int ret;
+int msk_get_callback_stats(struct msk_callback_stats *stats, int max) {
+	struct msk_callback_stats all[MSK_PROFILE_SLOTS];
+	struct msk_profile_slot *slot;
+	int i, n = 0;
+
+	for (i = 0; i < MSK_PROFILE_SLOTS; i++) {
+		slot = &msk_global_state->profile[i];
+		if (!slot->callback)
+			continue;
+		all[n].callback = slot->callback;
+		all[n].calls = atomic_load(&slot->calls);
+		all[n].nsec_total = atomic_load(&slot->nsec_total);
+		all[n].nsec_max = atomic_load(&slot->nsec_max);
+		n++;
+	}
 
-	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-	ret = msk_post_n_send(trans, data, num_sge, msk_wait_callback, msk_wait_callback, &lock);
+	qsort(all, n, sizeof(struct msk_callback_stats), msk_callback_cmp);
 
-	if (!ret) {
-		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		pthread_mutex_destroy(&lock);
+	for (i = 0; i < n && i < max; i++) {
+		msk_symbol(all[i].callback, all[i].symbol, MSK_SYMBOL_LEN);
+		memcpy(&stats[i], &all[i], sizeof(struct msk_callback_stats));
 	}
 
-	return ret;
+	return n;
 }
 
-// callbacks would all be run in a big send/recv_thread
 
+/* RECORDING */
 
-// server specific:
+static inline struct msk_record_sample *msk_record_slot(struct msk_record_hdr *hdr, uint64_t n) {
+	return (struct msk_record_sample *)((uint8_t *)hdr + hdr->hdr_size) + n % hdr->capacity;
+}
 
+/* one sample per transport seen at the previous tick too, needs record_lock */
+static void msk_record_sample(void) {
+	struct msk_record_hdr *hdr = msk_global_state->record;
+	struct msk_record_sample *sample;
+	struct msk_record_prev *prev;
+	struct msk_trans *trans;
+	struct msk_stats stats;
+	struct timespec ts;
+	uint64_t now, real, errors;
+	double period;
 
-int msk_post_n_read(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
-	return msk_post_send_generic(trans, IBV_WR_RDMA_READ, data, num_sge, rloc, callback, err_callback, callback_arg);
-}
+	now = msk_now_nsec();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	real = ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+
+	for (trans = msk_global_state->record_trans; trans; trans = trans->record_next) {
+		msk_get_stats(trans, &stats);
+		prev = trans->record_prev;
+		errors = stats.tx_err + stats.rx_err;
+
+		if (prev->nsec && now > prev->nsec) {
+			period = now - prev->nsec;
+			sample = msk_record_slot(hdr, hdr->head);
+			sample->nsec = real;
+			sample->trans = (uintptr_t)trans;
+			// through doubles, bytes times NSEC_IN_SEC can overflow
+			sample->tx_bytes = (stats.tx_bytes - prev->tx_bytes) * (NSEC_IN_SEC / period);
+			sample->rx_bytes = (stats.rx_bytes - prev->rx_bytes) * (NSEC_IN_SEC / period);
+			sample->tx_pkt = (stats.tx_pkt - prev->tx_pkt) * (NSEC_IN_SEC / period);
+			sample->rx_pkt = (stats.rx_pkt - prev->rx_pkt) * (NSEC_IN_SEC / period);
+			sample->errors = (errors - prev->errors) * (NSEC_IN_SEC / period);
+			sample->period_us = period / 1000;
+			sample->wctx_pending = stats.wctx_pending;
+			sample->rctx_pending = stats.rctx_pending;
+			sample->worker_queue_depth = stats.worker_queue_depth;
+			sample->state = trans->state;
+			atomic_store(&hdr->head, hdr->head + 1);
+		}
 
-int msk_post_n_write(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc, ctx_callback_t callback, ctx_callback_t err_callback, void* callback_arg) {
-	return msk_post_send_generic(trans, IBV_WR_RDMA_WRITE, data, num_sge, rloc, callback, err_callback, callback_arg);
+		prev->nsec = now;
+		prev->tx_bytes = stats.tx_bytes;
+		prev->rx_bytes = stats.rx_bytes;
+		prev->tx_pkt = stats.tx_pkt;
+		prev->rx_pkt = stats.rx_pkt;
+		prev->errors = errors;
+	}
 }
 
-int msk_wait_n_read(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc) {
-	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static void *msk_record_thread(void *arg) {
+	struct timespec next, now;
+	uint64_t period = msk_global_state->record_period_ms * 1000000ULL;
 	int ret;
 
-	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-	ret = msk_post_n_read(trans, data, num_sge, rloc, msk_wait_callback, msk_wait_callback, &lock);
+	msk_thread_start("record");
 
-	if (!ret) {
-		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		pthread_mutex_destroy(&lock);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	while (msk_global_state->record_run) {
+		next.tv_sec += (next.tv_nsec + period) / NSEC_IN_SEC;
+		next.tv_nsec = (next.tv_nsec + period) % NSEC_IN_SEC;
+
+		// fixed ticks, woken up early only to stop
+		do {
+			msk_thread_switch(MSK_THREAD_IDLE);
+			ret = pthread_cond_timedwait(&msk_global_state->record_cond, &msk_global_state->record_lock, &next);
+			msk_thread_switch(MSK_THREAD_POLL);
+		} while (ret != ETIMEDOUT && msk_global_state->record_run);
+		if (!msk_global_state->record_run)
+			break;
+
+		msk_record_sample();
+
+		// don't make up for missed ticks with a burst
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+			next = now;
 	}
+	pthread_mutex_unlock(&msk_global_state->record_lock);
 
-	return ret;
+	msk_thread_stop();
+	pthread_exit(NULL);
 }
 
+/**
+ * msk_record_start: sample every connected transport's rates to a file
+ *
+ * Each period, a struct msk_record_sample per transport goes in a ring
+ * of fixed size mapped from path, overwriting the oldest ones. Readers
+ * (src/tools/mskrecord) can follow it live or after the process is gone.
+ *
+ * @param path [IN] file to create, truncated if it exists
+ * @param period_ms [IN] 0 for MSK_RECORD_DEFAULT_PERIOD_MS
+ * @param size [IN] file size, which bounds memory and disk use, 0 for MSK_RECORD_DEFAULT_SIZE
+ *
+ * @return 0 on success, errno value on failure
+ */
+int msk_record_start(const char *path, uint32_t period_ms, size_t size) {
+	struct msk_record_hdr *hdr;
+	struct msk_trans *trans;
+	uint64_t capacity;
+	size_t len;
+	int fd, ret = 0;
 
-int msk_wait_n_write(struct msk_trans *trans, msk_data_t *data, int num_sge, msk_rloc_t *rloc) {
-	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-	int ret;
+	if (!path)
+		return EINVAL;
+	if (!period_ms)
+		period_ms = MSK_RECORD_DEFAULT_PERIOD_MS;
+	if (!size)
+		size = MSK_RECORD_DEFAULT_SIZE;
+	if (size < sizeof(struct msk_record_hdr) + sizeof(struct msk_record_sample))
+		return EINVAL;
 
-	msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-	ret = msk_post_n_write(trans, data, num_sge, rloc, msk_wait_callback, msk_wait_callback, &lock);
+	capacity = (size - sizeof(struct msk_record_hdr)) / sizeof(struct msk_record_sample);
+	if (capacity > UINT32_MAX)
+		capacity = UINT32_MAX;
+	len = sizeof(struct msk_record_hdr) + capacity * sizeof(struct msk_record_sample);
 
-	if (!ret) {
-		msk_mutex_lock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		msk_mutex_unlock(trans->debug & MSK_DEBUG_CM_LOCKS, &lock);
-		pthread_mutex_destroy(&lock);
-	}
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	do {
+		if (msk_global_state->record) {
+			ret = EALREADY;
+			break;
+		}
 
-	return ret;
-}
+		fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (fd == -1) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "open %s failed: %s (%d)", path, strerror(ret), ret);
+			break;
+		}
+		if (ftruncate(fd, len)) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "ftruncate %s failed: %s (%d)", path, strerror(ret), ret);
+			close(fd);
+			break;
+		}
+		hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (hdr == MAP_FAILED) {
+			ret = errno;
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "mmap %s failed: %s (%d)", path, strerror(ret), ret);
+			break;
+		}
 
+		hdr->version = MSK_RECORD_VERSION;
+		hdr->hdr_size = sizeof(struct msk_record_hdr);
+		hdr->sample_size = sizeof(struct msk_record_sample);
+		hdr->capacity = capacity;
+		hdr->period_ms = period_ms;
+		hdr->pid = getpid();
+		// readers check magic last
+		atomic_store(&hdr->magic, MSK_RECORD_MAGIC);
+
+		// rates of a previous recording would span the gap
+		for (trans = msk_global_state->record_trans; trans; trans = trans->record_next)
+			trans->record_prev->nsec = 0;
+
+		msk_global_state->record = hdr;
+		msk_global_state->record_len = len;
+		msk_global_state->record_period_ms = period_ms;
+		msk_global_state->record_run = 1;
+		ret = msk_create_thread(&msk_global_state->record_thread, msk_record_thread, NULL);
+		if (ret) {
+			INFO_LOG(msk_global_state->debug & MSK_DEBUG_EVENT, "Could not create thread: %s (%d)", strerror(ret), ret);
+			munmap(hdr, len);
+			msk_global_state->record = NULL;
+			msk_global_state->record_run = 0;
+		}
+	} while (0);
+	pthread_mutex_unlock(&msk_global_state->record_lock);
 
-struct sockaddr *msk_get_dst_addr(struct msk_trans *trans) {
-	return rdma_get_peer_addr(trans->cm_id);
+	return ret;
 }
 
-struct sockaddr *msk_get_src_addr(struct msk_trans *trans) {
-	return rdma_get_local_addr(trans->cm_id);
-}
+void msk_record_stop(void) {
+	pthread_t thread;
 
-uint16_t msk_get_src_port(struct msk_trans *trans) {
-	return rdma_get_src_port(trans->cm_id);
-}
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	if (!msk_global_state->record_run) {
+		pthread_mutex_unlock(&msk_global_state->record_lock);
+		return;
+	}
+	msk_global_state->record_run = 0;
+	thread = msk_global_state->record_thread;
+	pthread_cond_signal(&msk_global_state->record_cond);
+	pthread_mutex_unlock(&msk_global_state->record_lock);
 
-uint16_t msk_get_dst_port(struct msk_trans *trans) {
-	return rdma_get_dst_port(trans->cm_id);
-}
+	pthread_join(thread, NULL);
 
-const char *msk_wc_status_str(enum ibv_wc_status status) {
-	return ibv_wc_status_str(status);
+	pthread_mutex_lock(&msk_global_state->record_lock);
+	munmap(msk_global_state->record, msk_global_state->record_len);
+	msk_global_state->record = NULL;
+	pthread_mutex_unlock(&msk_global_state->record_lock);
 }
-
-
@@ -2,6 +2,12 @@
 //#define ERROR_LOG(fmt, args...)
 #define INFO_LOG(debug, fmt, args...) 	if (debug) fprintf(stderr, "INFO:  %s (%d), %s: " fmt "\n", __FILE__, __LINE__, __func__, ##args)
 //#define INFO_LOG(fmt, args...)
+/* data path messages (MSK_DEBUG_SEND, RECV, CTX, WORKERS), configure --disable-data-debug drops them and their checks */
+#ifdef NO_DATA_DEBUG
+#define DATA_LOG(debug, fmt, args...)	if (0) fprintf(stderr, fmt, ##args)
+#else
+#define DATA_LOG(debug, fmt, args...)	INFO_LOG(debug, fmt, ##args)
+#endif
 
 #define TEST_Z(x)  do { int retval; if ( (retval=x)) { ERROR_LOG("error: " #x " failed (returned %d, errno %d).", retval, errno ); exit(retval); } } while (0)
 #define TEST_NZ(x) do { if (!(x)) { ERROR_LOG("error: " #x " failed (returned zero/null. errno=%d).", errno); exit(-1); }} while (0)